@@ -0,0 +1,216 @@
+/*
+ * bitmap.c - $Bitmap validation for the NTFS Punch Driver
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Before attaching, make sure every cluster the runlist points at is
+ * still marked in use in the volume's $Bitmap.  If Windows freed the
+ * clusters and gave them to another file, writes through the device
+ * would corrupt that file instead.
+ *
+ * Only the parts of $Bitmap covering the image's runs are read, through
+ * its page cache with a large readahead window, and each page is scanned
+ * a word at a time for a clear bit.  Big images are split by cluster
+ * count over several unbound work items, so a multi-terabyte image
+ * doesn't scan on one CPU.  The time taken is logged and shown as
+ * bitmap_check_us.
+ */
+
+#include "ntfspunch.h"
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/bitops.h>
+#include <linux/ktime.h>
+#include <linux/cpumask.h>
+#include <linux/workqueue.h>
+#include <linux/math64.h>
+
+#define NP_BITS_PER_PAGE_SHIFT	(PAGE_SHIFT + 3)
+#define NP_BITS_PER_PAGE	(1UL << NP_BITS_PER_PAGE_SHIFT)
+/* Readahead window for $Bitmap, 2M covers 64G of 4K clusters */
+#define NP_BITMAP_RA_PAGES	(2 * 1024 * 1024 / PAGE_SIZE)
+/* Each worker gets at least this many pages of $Bitmap to scan */
+#define NP_BITMAP_WORKER_PAGES	256
+
+struct np_bitmap_check {
+	struct np_member *m;
+	struct address_space *mapping;
+	atomic_t failed;
+};
+
+struct np_bitmap_work {
+	struct work_struct work;
+	struct np_bitmap_check *check;
+	s64 start;	/* in clusters, counting data runs only */
+	s64 end;
+	LCN bad;	/* the first free cluster found, or -1 */
+	int ret;
+};
+
+/*
+ * Scan one LCN range of $Bitmap, returns the first clear bit or -1
+ */
+static LCN
+bitmap_scan(struct np_bitmap_work *w, struct file_ra_state *ra, LCN lcn,
+	    s64 len)
+{
+	struct address_space *mapping = w->check->mapping;
+	LCN end = lcn + len, base;
+	unsigned long first, last, bit;
+	pgoff_t index, last_index;
+	struct page *page;
+	void *addr;
+
+	last_index = (end - 1) >> NP_BITS_PER_PAGE_SHIFT;
+	for (index = lcn >> NP_BITS_PER_PAGE_SHIFT; index <= last_index;
+	     index++) {
+		if (atomic_read(&w->check->failed))
+			return -1;
+		page = find_get_page(mapping, index);
+		if (page == NULL)
+			page_cache_sync_readahead(mapping, ra, NULL, index,
+						  last_index - index + 1);
+		else
+			page_cache_release(page);
+		page = read_mapping_page(mapping, index, NULL);
+		if (IS_ERR(page)) {
+			w->ret = PTR_ERR(page);
+			return -1;
+		}
+		base = (LCN)index << NP_BITS_PER_PAGE_SHIFT;
+		first = max(lcn, base) - base;
+		last = min_t(LCN, end - base, NP_BITS_PER_PAGE);
+		addr = kmap(page);
+		bit = find_next_zero_bit_le(addr, last, first);
+		kunmap(page);
+		page_cache_release(page);
+		if (bit < last)
+			return base + bit;
+		cond_resched();
+	}
+	return -1;
+}
+
+static void
+bitmap_work(struct work_struct *work)
+{
+	struct np_bitmap_work *w = container_of(work, struct np_bitmap_work,
+						work);
+	struct np_member *m = w->check->m;
+	struct file_ra_state ra;
+	runlist_element *rl;
+	s64 pos = 0, skip, len;
+
+	file_ra_state_init(&ra, w->check->mapping);
+	ra.ra_pages = max_t(unsigned int, ra.ra_pages, NP_BITMAP_RA_PAGES);
+	w->bad = -1;
+	for (rl = m->rl; rl->length && pos < w->end; rl++) {
+		if (rl->lcn < 0)
+			continue;
+		if (pos + rl->length > w->start) {
+			skip = max(w->start - pos, 0LL);
+			len = min(w->end, pos + rl->length) - (pos + skip);
+			w->bad = bitmap_scan(w, &ra, rl->lcn + skip, len);
+			if (w->bad >= 0 || w->ret)
+				break;
+		}
+		pos += rl->length;
+	}
+	if (w->bad >= 0 || w->ret)
+		atomic_set(&w->check->failed, 1);
+}
+
+/*
+ * Check a member's data runs against $Bitmap, returns -ESTALE if any of
+ * its clusters is free
+ */
+int
+np_bitmap_check(struct np_member *m)
+{
+	ntfs_volume *vol = m->ni->vol;
+	struct np_bitmap_check check;
+	struct np_bitmap_work *works;
+	runlist_element *rl;
+	s64 total = 0, pages;
+	ktime_t start = ktime_get();
+	int i, n, ret = 0;
+
+	for (rl = m->rl; rl->length; rl++) {
+		if (rl->lcn < 0)
+			continue;
+		if (rl->lcn + rl->length > vol->nr_clusters) {
+			printk(KERN_WARNING "ntfspunch: %s: run at cluster %lld is past the end of the volume\n",
+			       m->filename, rl->lcn);
+			return -ESTALE;
+		}
+		total += rl->length;
+	}
+	if (total == 0)
+		return 0;
+
+	check.m = m;
+	check.mapping = vol->lcnbmp_ino->i_mapping;
+	atomic_set(&check.failed, 0);
+	/* Not so many workers that each has less than a readahead's worth */
+	pages = (total + NP_BITS_PER_PAGE - 1) >> NP_BITS_PER_PAGE_SHIFT;
+	n = clamp_t(s64, div_s64(pages, NP_BITMAP_WORKER_PAGES), 1,
+		    num_online_cpus());
+	works = kcalloc(n, sizeof(*works), GFP_KERNEL);
+	if (works == NULL)
+		return -ENOMEM;
+
+	down_read(&vol->lcnbmp_lock);
+	for (i = 0; i < n; i++) {
+		works[i].check = &check;
+		works[i].start = div_s64(total * i, n);
+		works[i].end = div_s64(total * (i + 1), n);
+		INIT_WORK(&works[i].work, bitmap_work);
+		if (i > 0)
+			queue_work(system_unbound_wq, &works[i].work);
+	}
+	/* The first share is ours */
+	bitmap_work(&works[0].work);
+	for (i = 1; i < n; i++)
+		flush_work(&works[i].work);
+	up_read(&vol->lcnbmp_lock);
+
+	for (i = 0; i < n; i++) {
+		if (works[i].ret) {
+			printk(KERN_WARNING "ntfspunch: %s: reading $Bitmap failed %d\n",
+			       m->filename, works[i].ret);
+			ret = works[i].ret;
+			break;
+		}
+		if (works[i].bad >= 0) {
+			printk(KERN_WARNING "ntfspunch: %s: cluster %lld is free in $Bitmap, the runlist is stale\n",
+			       m->filename, works[i].bad);
+			ret = -ESTALE;
+			break;
+		}
+	}
+	kfree(works);
+	m->bitmap_check_us = ktime_us_delta(ktime_get(), start);
+	printk(KERN_DEBUG "ntfspunch: %s: checked %lld clusters against $Bitmap in %llu us (%d workers)\n",
+	       m->filename, total, m->bitmap_check_us, n);
+	return ret;
+}
@@ -0,0 +1,1105 @@
+/*
+ * cache.c - SSD cache tier for NTFS Punch devices
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * An SSD (any spare block device) can sit in front of a device as a
+ * cache of its hot 64K blocks, for images on spinning disks:
+ *
+ *   echo "cache_attach /dev/sdb2" > /proc/ntfspunch/a
+ *   echo "cache_mode writeback" > /proc/ntfspunch/a
+ *
+ * Only I/O that fits in one cache block is served from the cache, bigger
+ * or straddling I/O goes to the image.  Reads that miss count towards a
+ * small frequency sketch, and a block is only promoted (copied in by the
+ * worker, replacing the least recently used clean block) after
+ * NP_CACHE_ADMIT misses, so one-off reads don't churn the cache.
+ *
+ * Write-through writes cached blocks in both places.  Write-back writes
+ * them to the cache only and marks them dirty.  The worker writes dirty
+ * blocks back every few seconds and on detach.  Writes that miss go to
+ * the image and drop any clean copy.  Anything that has to wait for a
+ * dirty block (a write that partly overlaps it, a straddling read) is
+ * handed to the worker, which writes the block back first.
+ *
+ * On disk: a superblock, an array of struct np_cache_entry, then the
+ * data blocks.  Only dirty entries are kept up to date as the cache
+ * runs, and always before the data they cover is acknowledged.  Detach
+ * writes out every entry and marks the cache clean.  Attaching a clean
+ * cache picks up where it left off.  After a crash only the dirty blocks
+ * are kept, and the worker writes them back.
+ */
+
+#include "ntfspunch.h"
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/list.h>
+#include <linux/seq_file.h>
+#include <linux/blkdev.h>
+#include <linux/completion.h>
+#include <linux/jiffies.h>
+
+#define NP_CACHE_MAGIC		0x4e504348	/* "NPCH" */
+#define NP_CACHE_VERSION	1
+
+/* 64K blocks, in sectors */
+#define NP_CACHE_BLOCK_SHIFT	7
+#define NP_CACHE_BLOCK_SECTORS	(1 << NP_CACHE_BLOCK_SHIFT)
+#define NP_CACHE_BLOCK_PAGES	\
+	DIV_ROUND_UP(NP_CACHE_BLOCK_SECTORS << NP_SECTOR_SHIFT, PAGE_SIZE)
+
+/* Misses before a block is worth promoting */
+#define NP_CACHE_ADMIT		2
+#define NP_CACHE_SKETCH_BITS	12
+/* How far from the cold end to look for a block to replace */
+#define NP_CACHE_VICTIM_SCAN	64
+#define NP_CACHE_WB_DELAY	(5 * HZ)
+
+enum {
+	NP_CACHE_WT,
+	NP_CACHE_WB,
+};
+
+enum {
+	NP_CB_INVALID,
+	NP_CB_CLEAN,
+	NP_CB_DIRTY,
+	NP_CB_PROMOTING,	/* in memory only */
+};
+
+/*
+ * On disk, little endian
+ */
+struct np_cache_sb {
+	__le32 magic;
+	__le32 version;
+	__le32 clean;
+	__le32 block_sectors;
+	__le64 nr_blocks;
+	__le64 meta_start;	/* in sectors */
+	__le64 data_start;
+	__le64 origin_size;	/* in bytes */
+	char origin[256];
+};
+
+struct np_cache_entry {
+	__le64 oblock;
+	__le32 state;
+	__le32 reserved;
+};
+
+struct np_cblock {
+	struct hlist_node hash;
+	struct list_head lru;
+	struct list_head promote;
+	u64 oblock;
+	int state;
+	int users;	/* I/O in flight to it */
+	int writers;	/* of which writes */
+	int busy;	/* being written back */
+	int redirty;	/* written since writeback started */
+	int stale;	/* written while being promoted */
+};
+
+struct np_cache {
+	struct mapping_dev *dev;
+	spinlock_t lock;
+	struct block_device *bdev;
+	char path[256];
+	int mode;
+	u64 nr_blocks;
+	sector_t meta_start;
+	sector_t data_start;
+	struct np_cache_entry *meta;	/* as last written */
+	size_t meta_size;		/* in bytes, whole pages */
+	struct np_cblock *blocks;
+	struct hlist_head *hash;
+	unsigned int hash_bits;
+	struct list_head lru;		/* coldest first */
+	struct list_head promote;	/* waiting on the worker */
+	struct bio_list deferred;	/* waiting on the worker */
+	u8 sketch[1 << NP_CACHE_SKETCH_BITS];
+	unsigned int sketch_ops;
+	struct page *buf[NP_CACHE_BLOCK_PAGES];
+	mempool_t *io_pool;
+	struct delayed_work work;
+	unsigned long last_wb;
+	u64 nr_valid;
+	u64 nr_dirty;
+	u64 read_hits;		/* stats */
+	u64 read_misses;
+	u64 write_hits;
+	u64 write_misses;
+	u64 promotions;
+	u64 writebacks;
+};
+
+/*
+ * A bio the cache has taken, and the cache block it went to if any
+ */
+struct np_cache_io {
+	struct np_cache *cache;
+	struct np_cblock *cb;
+	struct bio *parent;
+	sector_t start;
+	sector_t end;
+	int write;
+	atomic_t remaining;
+	int error;
+	int copy_error;	/* of the cached copy of a write-through hit */
+};
+
+static int cache_map(struct np_cache *cache, struct bio *bio, int can_sleep);
+
+static inline sector_t
+cache_data_sector(struct np_cache *cache, struct np_cblock *cb)
+{
+	return cache->data_start +
+		((sector_t)(cb - cache->blocks) << NP_CACHE_BLOCK_SHIFT);
+}
+
+static struct np_cblock *
+cache_lookup(struct np_cache *cache, u64 oblock)
+{
+	struct np_cblock *cb;
+
+	hlist_for_each_entry(cb, &cache->hash[hash_64(oblock, cache->hash_bits)],
+			     hash)
+		if (cb->oblock == oblock)
+			return cb;
+	return NULL;
+}
+
+static void
+cache_insert(struct np_cache *cache, struct np_cblock *cb, u64 oblock)
+{
+	cb->oblock = oblock;
+	hlist_add_head(&cb->hash,
+		       &cache->hash[hash_64(oblock, cache->hash_bits)]);
+}
+
+/*
+ * Drop a clean or promoting block, cache lock held
+ */
+static void
+cache_invalidate(struct np_cache *cache, struct np_cblock *cb)
+{
+	if (cb->state == NP_CB_CLEAN)
+		cache->nr_valid--;
+	cb->state = NP_CB_INVALID;
+	hlist_del_init(&cb->hash);
+	list_move(&cb->lru, &cache->lru);
+}
+
+/*
+ * Blocks [first, last] of the device have been (or are about to be)
+ * written without going through the cache: drop clean copies and spoil
+ * promotions.  Returns a dirty block in the way, if there is one.
+ *
+ * cache lock held
+ */
+static struct np_cblock *
+cache_overlap(struct np_cache *cache, u64 first, u64 last, int write)
+{
+	struct np_cblock *cb, *dirty = NULL;
+	u64 ob, i;
+
+	if (last - first >= cache->nr_blocks) {
+		/* Huge (discard), quicker to go through the cache */
+		for (i = 0; i < cache->nr_blocks; i++) {
+			cb = &cache->blocks[i];
+			if (cb->state == NP_CB_INVALID ||
+			    cb->oblock < first || cb->oblock > last)
+				continue;
+			if (cb->state == NP_CB_DIRTY)
+				dirty = cb;
+			else if (!write)
+				continue;
+			else if (cb->state == NP_CB_PROMOTING)
+				cb->stale = 1;
+			else
+				cache_invalidate(cache, cb);
+		}
+		return dirty;
+	}
+	for (ob = first; ob <= last; ob++) {
+		cb = cache_lookup(cache, ob);
+		if (cb == NULL)
+			continue;
+		if (cb->state == NP_CB_DIRTY)
+			dirty = cb;
+		else if (!write)
+			continue;
+		else if (cb->state == NP_CB_PROMOTING)
+			cb->stale = 1;
+		else
+			cache_invalidate(cache, cb);
+	}
+	return dirty;
+}
+
+/*
+ * Count a read miss, and once a block has missed often enough pick a
+ * slot for it and queue the promotion.  cache lock held.
+ */
+static void
+cache_admit(struct np_cache *cache, u64 oblock)
+{
+	struct mapping_dev *dev = cache->dev;
+	u8 *count = &cache->sketch[hash_64(oblock, NP_CACHE_SKETCH_BITS)];
+	struct np_cblock *cb, *victim = NULL;
+	int i = 0;
+
+	if (*count < 255)
+		(*count)++;
+	/* Age the counts so yesterday's hot blocks don't stay hot */
+	if (++cache->sketch_ops >= 8 * ARRAY_SIZE(cache->sketch)) {
+		for (i = 0; i < ARRAY_SIZE(cache->sketch); i++)
+			cache->sketch[i] >>= 1;
+		cache->sketch_ops = 0;
+	}
+	if (*count < NP_CACHE_ADMIT)
+		return;
+	/* Only whole blocks */
+	if (np_sectors_to_bytes((oblock + 1) << NP_CACHE_BLOCK_SHIFT) >
+	    dev->size)
+		return;
+	/* Holes are free to read, and a write-back could never land */
+	if (ntfspunch_has_hole(dev, oblock << NP_CACHE_BLOCK_SHIFT,
+			       NP_CACHE_BLOCK_SECTORS))
+		return;
+
+	i = 0;
+	list_for_each_entry(cb, &cache->lru, lru) {
+		if (i++ == NP_CACHE_VICTIM_SCAN)
+			break;
+		if (cb->state == NP_CB_INVALID ||
+		    (cb->state == NP_CB_CLEAN && cb->users == 0)) {
+			victim = cb;
+			break;
+		}
+	}
+	if (victim == NULL)
+		return;
+	if (victim->state == NP_CB_CLEAN)
+		cache_invalidate(cache, victim);
+	victim->state = NP_CB_PROMOTING;
+	victim->stale = 0;
+	cache_insert(cache, victim, oblock);
+	list_move_tail(&victim->lru, &cache->lru);
+	list_add_tail(&victim->promote, &cache->promote);
+	*count = 0;
+	mod_delayed_work(np_wq, &cache->work, 0);
+}
+
+/*
+ * Synchronous I/O of whole pages, to the cache device or (bdev NULL)
+ * through the device's own remapping to the image
+ */
+struct cache_sync {
+	struct completion done;
+	int error;
+};
+
+static void
+cache_sync_end_io(struct bio *bio, int err)
+{
+	struct cache_sync *sync = bio->bi_private;
+
+	sync->error = err;
+	complete(&sync->done);
+}
+
+static int
+cache_sync_io(struct np_cache *cache, struct block_device *bdev, int rw,
+	      sector_t sector, struct page **pages, int nr_pages)
+{
+	struct cache_sync sync;
+	struct bio *bio;
+	int i;
+
+	init_completion(&sync.done);
+	bio = bio_alloc(GFP_NOIO, nr_pages);
+	bio->bi_sector = sector;
+	bio->bi_end_io = cache_sync_end_io;
+	bio->bi_private = &sync;
+	for (i = 0; i < nr_pages; i++)
+		bio_add_page(bio, pages[i], PAGE_SIZE, 0);
+	if (bdev) {
+		bio->bi_bdev = bdev;
+		submit_bio(rw, bio);
+	} else {
+		bio->bi_rw = rw;
+		ntfspunch_remap_origin(cache->dev, bio);
+	}
+	wait_for_completion(&sync.done);
+	bio_put(bio);
+	return sync.error;
+}
+
+/*
+ * Write the page of metadata holding a slot's entry
+ */
+static int
+cache_persist(struct np_cache *cache, struct np_cblock *cb, int state)
+{
+	u64 slot = cb - cache->blocks;
+	size_t off = (slot * sizeof(*cache->meta)) & PAGE_MASK;
+	struct page *page;
+
+	cache->meta[slot].oblock = cpu_to_le64(cb->oblock);
+	cache->meta[slot].state = cpu_to_le32(state);
+	page = vmalloc_to_page((char *)cache->meta + off);
+	return cache_sync_io(cache, cache->bdev, WRITE_FUA,
+			     cache->meta_start + np_bytes_to_sectors(off),
+			     &page, 1);
+}
+
+/*
+ * Make a clean block dirty, on disk before in memory.  cb is pinned by
+ * the caller's users reference, which this drops.
+ */
+static int
+cache_make_dirty(struct np_cache *cache, struct np_cblock *cb)
+{
+	unsigned long flags;
+	int ret, undo = 0;
+
+	ret = cache_persist(cache, cb, NP_CB_DIRTY);
+	spin_lock_irqsave(&cache->lock, flags);
+	cb->users--;
+	if (ret == 0 && cb->state == NP_CB_CLEAN) {
+		cb->state = NP_CB_DIRTY;
+		cache->nr_dirty++;
+	} else if (ret == 0) {
+		/* Dropped while we slept, don't leave it dirty on disk */
+		undo = 1;
+	}
+	spin_unlock_irqrestore(&cache->lock, flags);
+	if (undo)
+		cache_persist(cache, cb, NP_CB_INVALID);
+	return ret;
+}
+
+/*
+ * Copy a dirty block back to the image.  cb is pinned by the caller's
+ * users reference, which this drops.
+ */
+static int
+cache_writeback(struct np_cache *cache, struct np_cblock *cb)
+{
+	unsigned long flags;
+	int ret, clean;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	if (cb->state != NP_CB_DIRTY) {
+		cb->users--;
+		spin_unlock_irqrestore(&cache->lock, flags);
+		return 0;
+	}
+	cb->busy = 1;
+	cb->redirty = cb->writers > 0;
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	ret = cache_sync_io(cache, cache->bdev, READ,
+			    cache_data_sector(cache, cb),
+			    cache->buf, NP_CACHE_BLOCK_PAGES);
+	/* FUA, it mustn't be lost once the entry says clean */
+	if (ret == 0)
+		ret = cache_sync_io(cache, NULL, WRITE_FUA,
+				    cb->oblock << NP_CACHE_BLOCK_SHIFT,
+				    cache->buf, NP_CACHE_BLOCK_PAGES);
+
+	spin_lock_irqsave(&cache->lock, flags);
+	cb->busy = 0;
+	clean = ret == 0 && !cb->redirty && cb->writers == 0;
+	if (clean) {
+		cb->state = NP_CB_CLEAN;
+		cache->nr_dirty--;
+		cache->writebacks++;
+	}
+	spin_unlock_irqrestore(&cache->lock, flags);
+	if (clean)
+		cache_persist(cache, cb, NP_CB_CLEAN);
+	else if (ret && printk_ratelimit())
+		printk(KERN_WARNING "ntfspunch: %s: cache writeback of %llu failed\n",
+		       cache->dev->filename,
+		       np_sectors_to_bytes(cb->oblock << NP_CACHE_BLOCK_SHIFT));
+
+	spin_lock_irqsave(&cache->lock, flags);
+	cb->users--;
+	spin_unlock_irqrestore(&cache->lock, flags);
+	return ret;
+}
+
+static void
+cache_promote(struct np_cache *cache, struct np_cblock *cb)
+{
+	unsigned long flags;
+	int ret;
+
+	ret = cache_sync_io(cache, NULL, READ,
+			    cb->oblock << NP_CACHE_BLOCK_SHIFT,
+			    cache->buf, NP_CACHE_BLOCK_PAGES);
+	if (ret == 0)
+		ret = cache_sync_io(cache, cache->bdev, WRITE,
+				    cache_data_sector(cache, cb),
+				    cache->buf, NP_CACHE_BLOCK_PAGES);
+
+	spin_lock_irqsave(&cache->lock, flags);
+	if (ret || cb->stale) {
+		cache_invalidate(cache, cb);
+	} else {
+		cb->state = NP_CB_CLEAN;
+		cache->nr_valid++;
+		cache->promotions++;
+	}
+	spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+static void
+cache_end_io(struct bio *clone, int err)
+{
+	struct np_cache_io *io = clone->bi_private;
+	struct np_cache *cache = io->cache;
+	struct np_cblock *cb = io->cb;
+	unsigned long flags;
+	int retry = 0;
+
+	if (err)
+		io->error = err;
+	bio_put(clone);
+	if (!atomic_dec_and_test(&io->remaining))
+		return;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	if (cb) {
+		cb->users--;
+		if (io->write)
+			cb->writers--;
+		/* The image has the write, so drop the cached copy instead */
+		if (io->copy_error) {
+			if (cb->state == NP_CB_CLEAN)
+				cache_invalidate(cache, cb);
+			else
+				io->error = io->copy_error;
+		}
+		/* A clean block can just be read from the image instead */
+		if (io->error && !io->write && cb->state == NP_CB_CLEAN) {
+			cache_invalidate(cache, cb);
+			bio_list_add(&cache->deferred, io->parent);
+			retry = 1;
+		}
+	} else if (io->write) {
+		/* Catch promotions that read the image before this landed */
+		cache_overlap(cache, io->start >> NP_CACHE_BLOCK_SHIFT,
+			      (io->end - 1) >> NP_CACHE_BLOCK_SHIFT, 1);
+	}
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	if (retry)
+		mod_delayed_work(np_wq, &cache->work, 0);
+	else
+		bio_endio(io->parent, io->error);
+	mempool_free(io, cache->io_pool);
+}
+
+static struct np_cache_io *
+cache_io_alloc(struct np_cache *cache, struct bio *bio, struct np_cblock *cb,
+	       int pieces)
+{
+	struct np_cache_io *io = mempool_alloc(cache->io_pool, GFP_NOIO);
+
+	io->cache = cache;
+	io->cb = cb;
+	io->parent = bio;
+	io->start = bio->bi_sector;
+	io->end = bio_end_sector(bio);
+	io->write = bio_data_dir(bio) == WRITE;
+	io->error = 0;
+	io->copy_error = 0;
+	atomic_set(&io->remaining, pieces);
+	return io;
+}
+
+static struct bio *
+cache_clone(struct np_cache *cache, struct np_cache_io *io, struct bio *bio)
+{
+	struct bio *clone = bio_clone_bioset(bio, GFP_NOIO, cache->dev->bs);
+
+	clone->bi_end_io = cache_end_io;
+	clone->bi_private = io;
+	return clone;
+}
+
+/*
+ * The cached copy of a write hit that also goes to the image.  If it
+ * fails the block no longer matches the image, cache_end_io() sorts that
+ * out rather than failing the write.
+ */
+static void
+cache_copy_end_io(struct bio *clone, int err)
+{
+	struct np_cache_io *io = clone->bi_private;
+
+	if (err)
+		io->copy_error = err;
+	cache_end_io(clone, 0);
+}
+
+/*
+ * Send a bio to the image, plus a flush of the cache device when it
+ * carries a flush and the cache may hold written data
+ */
+static void
+cache_submit_origin(struct np_cache *cache, struct bio *bio,
+		    struct np_cblock *cb, int pieces)
+{
+	int flush = cache->mode == NP_CACHE_WB && (bio->bi_rw & REQ_FLUSH);
+	struct np_cache_io *io = cache_io_alloc(cache, bio, cb, pieces + flush);
+	struct bio *clone;
+
+	if (flush) {
+		clone = bio_alloc_bioset(GFP_NOIO, 0, cache->dev->bs);
+		clone->bi_bdev = cache->bdev;
+		clone->bi_end_io = cache_end_io;
+		clone->bi_private = io;
+		submit_bio(WRITE_FLUSH, clone);
+	}
+	if (pieces == 2) {
+		/* Write-through hit, the cached copy too */
+		clone = cache_clone(cache, io, bio);
+		clone->bi_end_io = cache_copy_end_io;
+		clone->bi_bdev = cache->bdev;
+		clone->bi_sector = cache_data_sector(cache, cb) +
+			(bio->bi_sector & (NP_CACHE_BLOCK_SECTORS - 1));
+		generic_make_request(clone);
+	}
+	ntfspunch_remap_origin(cache->dev, cache_clone(cache, io, bio));
+}
+
+static void
+cache_submit_hit(struct np_cache *cache, struct bio *bio, struct np_cblock *cb)
+{
+	struct np_cache_io *io = cache_io_alloc(cache, bio, cb, 1);
+	struct bio *clone = cache_clone(cache, io, bio);
+
+	clone->bi_bdev = cache->bdev;
+	clone->bi_sector = cache_data_sector(cache, cb) +
+		(bio->bi_sector & (NP_CACHE_BLOCK_SECTORS - 1));
+	generic_make_request(clone);
+}
+
+/*
+ * Route a bio.  Returns 0 if the caller should send it to the image
+ * as usual, 1 if the cache has taken it.
+ *
+ * Anything that would have to sleep is handed to the worker, which
+ * calls back in with can_sleep set.
+ */
+static int
+cache_map(struct np_cache *cache, struct bio *bio, int can_sleep)
+{
+	sector_t start = bio->bi_sector, end = bio_end_sector(bio);
+	u64 first = start >> NP_CACHE_BLOCK_SHIFT;
+	u64 last = (end - 1) >> NP_CACHE_BLOCK_SHIFT;
+	int write = bio_data_dir(bio) == WRITE;
+	struct np_cblock *cb, *dirty;
+	unsigned long flags;
+	int ret;
+
+again:
+	cb = NULL;
+	spin_lock_irqsave(&cache->lock, flags);
+	if (first == last && !(bio->bi_rw & REQ_DISCARD))
+		cb = cache_lookup(cache, first);
+	if (cb && (cb->state == NP_CB_CLEAN || cb->state == NP_CB_DIRTY)) {
+		if (write && cache->mode == NP_CACHE_WB &&
+		    cb->state == NP_CB_CLEAN) {
+			if (!can_sleep)
+				goto defer;
+			cb->users++;
+			spin_unlock_irqrestore(&cache->lock, flags);
+			if ((ret = cache_make_dirty(cache, cb))) {
+				bio_endio(bio, ret);
+				return 1;
+			}
+			goto again;
+		}
+		cb->users++;
+		list_move_tail(&cb->lru, &cache->lru);
+		if (write) {
+			cb->writers++;
+			cb->redirty = 1;
+			cache->write_hits++;
+		} else {
+			cache->read_hits++;
+		}
+		spin_unlock_irqrestore(&cache->lock, flags);
+		if (!write)
+			cache_submit_hit(cache, bio, cb);
+		else if (cache->mode == NP_CACHE_WT ||
+			 (bio->bi_rw & (REQ_FLUSH | REQ_FUA)))
+			cache_submit_origin(cache, bio, cb, 2);
+		else
+			cache_submit_hit(cache, bio, cb);
+		return 1;
+	}
+
+	/* Miss, the image has the data unless a dirty block is in the way */
+	dirty = cache_overlap(cache, first, last, write);
+	if (dirty) {
+		if (!can_sleep)
+			goto defer;
+		dirty->users++;
+		spin_unlock_irqrestore(&cache->lock, flags);
+		if ((ret = cache_writeback(cache, dirty))) {
+			bio_endio(bio, ret);
+			return 1;
+		}
+		goto again;
+	}
+	if (!write) {
+		cache->read_misses++;
+		if (first == last)
+			cache_admit(cache, first);
+		spin_unlock_irqrestore(&cache->lock, flags);
+		return 0;
+	}
+	cache->write_misses++;
+	spin_unlock_irqrestore(&cache->lock, flags);
+	cache_submit_origin(cache, bio, NULL, 1);
+	return 1;
+
+defer:
+	bio_list_add(&cache->deferred, bio);
+	spin_unlock_irqrestore(&cache->lock, flags);
+	mod_delayed_work(np_wq, &cache->work, 0);
+	return 1;
+}
+
+int
+np_cache_map(struct mapping_dev *dev, struct bio *bio)
+{
+	if (bio_sectors(bio) == 0)
+		return 0;
+	return cache_map(dev->cache, bio, 0);
+}
+
+/*
+ * Write back every dirty block (or stop at the first failure)
+ */
+static int
+cache_writeback_all(struct np_cache *cache)
+{
+	struct np_cblock *cb;
+	unsigned long flags;
+	u64 i;
+	int ret;
+
+	for (i = 0; i < cache->nr_blocks; i++) {
+		cb = &cache->blocks[i];
+		spin_lock_irqsave(&cache->lock, flags);
+		if (cb->state != NP_CB_DIRTY) {
+			spin_unlock_irqrestore(&cache->lock, flags);
+			continue;
+		}
+		cb->users++;
+		spin_unlock_irqrestore(&cache->lock, flags);
+		if ((ret = cache_writeback(cache, cb)))
+			return ret;
+	}
+	return 0;
+}
+
+static void
+cache_work(struct work_struct *work)
+{
+	struct np_cache *cache = container_of(to_delayed_work(work),
+					      struct np_cache, work);
+	struct bio_list deferred;
+	struct np_cblock *cb;
+	struct bio *bio;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	deferred = cache->deferred;
+	bio_list_init(&cache->deferred);
+	spin_unlock_irqrestore(&cache->lock, flags);
+	while ((bio = bio_list_pop(&deferred)))
+		if (!cache_map(cache, bio, 1))
+			ntfspunch_remap_origin(cache->dev, bio);
+
+	for (;;) {
+		spin_lock_irqsave(&cache->lock, flags);
+		cb = list_first_entry_or_null(&cache->promote,
+					      struct np_cblock, promote);
+		if (cb)
+			list_del_init(&cb->promote);
+		spin_unlock_irqrestore(&cache->lock, flags);
+		if (cb == NULL)
+			break;
+		cache_promote(cache, cb);
+	}
+
+	if (cache->nr_dirty &&
+	    (cache->mode == NP_CACHE_WT ||
+	     time_after_eq(jiffies, cache->last_wb + NP_CACHE_WB_DELAY))) {
+		cache_writeback_all(cache);
+		cache->last_wb = jiffies;
+	}
+	if (cache->nr_dirty)
+		queue_delayed_work(np_wq, &cache->work, NP_CACHE_WB_DELAY);
+}
+
+/*
+ * Write the superblock, and all the entries first if it's going clean
+ */
+static int
+cache_write_sb(struct np_cache *cache, int clean)
+{
+	struct np_cache_sb *sb;
+	struct page *page;
+	u64 i;
+	int ret;
+
+	if (clean) {
+		for (i = 0; i < cache->nr_blocks; i++) {
+			struct np_cblock *cb = &cache->blocks[i];
+			int state = cb->state == NP_CB_PROMOTING ?
+				NP_CB_INVALID : cb->state;
+			cache->meta[i].oblock = cpu_to_le64(cb->oblock);
+			cache->meta[i].state = cpu_to_le32(state);
+		}
+		for (i = 0; i < cache->meta_size; i += PAGE_SIZE) {
+			page = vmalloc_to_page((char *)cache->meta + i);
+			ret = cache_sync_io(cache, cache->bdev, WRITE,
+					    cache->meta_start +
+					    np_bytes_to_sectors(i), &page, 1);
+			if (ret)
+				return ret;
+		}
+	}
+
+	page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	if (page == NULL)
+		return -ENOMEM;
+	sb = page_address(page);
+	sb->magic = cpu_to_le32(NP_CACHE_MAGIC);
+	sb->version = cpu_to_le32(NP_CACHE_VERSION);
+	sb->clean = cpu_to_le32(clean);
+	sb->block_sectors = cpu_to_le32(NP_CACHE_BLOCK_SECTORS);
+	sb->nr_blocks = cpu_to_le64(cache->nr_blocks);
+	sb->meta_start = cpu_to_le64(cache->meta_start);
+	sb->data_start = cpu_to_le64(cache->data_start);
+	sb->origin_size = cpu_to_le64(cache->dev->size);
+	strncpy(sb->origin, cache->dev->filename, sizeof(sb->origin) - 1);
+	/* Flush so the entries (or data) it vouches for are there first */
+	ret = cache_sync_io(cache, cache->bdev, WRITE_FLUSH_FUA, 0, &page, 1);
+	__free_page(page);
+	return ret;
+}
+
+/*
+ * Read an existing cache's superblock and entries, or lay out a new one
+ */
+static int
+cache_load(struct np_cache *cache)
+{
+	struct mapping_dev *dev = cache->dev;
+	sector_t total = np_bytes_to_sectors(i_size_read(cache->bdev->bd_inode));
+	struct np_cache_sb *sb;
+	struct np_cblock *cb;
+	struct page *page;
+	int ret, clean = 0, fresh = 0, state;
+	u64 i, oblock, dev_blocks;
+
+	page = alloc_page(GFP_KERNEL);
+	if (page == NULL)
+		return -ENOMEM;
+	ret = cache_sync_io(cache, cache->bdev, READ, 0, &page, 1);
+	if (ret)
+		goto out;
+	sb = page_address(page);
+	if (le32_to_cpu(sb->magic) == NP_CACHE_MAGIC) {
+		sb->origin[sizeof(sb->origin) - 1] = '\0';
+		if (le32_to_cpu(sb->version) != NP_CACHE_VERSION ||
+		    le32_to_cpu(sb->block_sectors) != NP_CACHE_BLOCK_SECTORS ||
+		    le64_to_cpu(sb->origin_size) != dev->size ||
+		    strncmp(sb->origin, dev->filename, sizeof(sb->origin) - 1)) {
+			printk(KERN_WARNING "ntfspunch: %s is a cache for %s, wipe it to reuse it\n",
+			       cache->path, sb->origin);
+			ret = -EINVAL;
+			goto out;
+		}
+		clean = le32_to_cpu(sb->clean);
+		cache->nr_blocks = le64_to_cpu(sb->nr_blocks);
+		cache->meta_start = le64_to_cpu(sb->meta_start);
+		cache->data_start = le64_to_cpu(sb->data_start);
+	} else {
+		/* Metadata in the first pages, then whole 64K blocks */
+		fresh = 1;
+		cache->meta_start = np_bytes_to_sectors(PAGE_SIZE);
+		cache->nr_blocks = total >> NP_CACHE_BLOCK_SHIFT;
+		do {
+			cache->data_start = round_up(cache->meta_start +
+				np_bytes_to_sectors(PAGE_ALIGN(cache->nr_blocks *
+					sizeof(struct np_cache_entry))),
+				NP_CACHE_BLOCK_SECTORS);
+		} while (cache->data_start +
+			 (cache->nr_blocks << NP_CACHE_BLOCK_SHIFT) > total &&
+			 --cache->nr_blocks);
+	}
+	if (cache->nr_blocks == 0 ||
+	    cache->data_start + (cache->nr_blocks << NP_CACHE_BLOCK_SHIFT) > total) {
+		printk(KERN_WARNING "ntfspunch: %s is too small for a cache\n",
+		       cache->path);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	cache->meta_size = PAGE_ALIGN(cache->nr_blocks *
+				      sizeof(struct np_cache_entry));
+	cache->meta = vzalloc(cache->meta_size);
+	cache->blocks = vzalloc(cache->nr_blocks * sizeof(*cache->blocks));
+	cache->hash_bits = max(ilog2(cache->nr_blocks), 4);
+	cache->hash = vzalloc(sizeof(*cache->hash) << cache->hash_bits);
+	if (cache->meta == NULL || cache->blocks == NULL || cache->hash == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < cache->nr_blocks; i++) {
+		cb = &cache->blocks[i];
+		INIT_HLIST_NODE(&cb->hash);
+		INIT_LIST_HEAD(&cb->promote);
+		list_add_tail(&cb->lru, &cache->lru);
+	}
+	if (fresh) {
+		ret = cache_write_sb(cache, 1);
+		goto out;
+	}
+
+	for (i = 0; i < cache->meta_size; i += PAGE_SIZE) {
+		struct page *mp = vmalloc_to_page((char *)cache->meta + i);
+		ret = cache_sync_io(cache, cache->bdev, READ,
+				    cache->meta_start + np_bytes_to_sectors(i),
+				    &mp, 1);
+		if (ret)
+			goto out;
+	}
+	dev_blocks = np_bytes_to_sectors(dev->size) >> NP_CACHE_BLOCK_SHIFT;
+	for (i = 0; i < cache->nr_blocks; i++) {
+		cb = &cache->blocks[i];
+		oblock = le64_to_cpu(cache->meta[i].oblock);
+		state = le32_to_cpu(cache->meta[i].state);
+		/* After a crash only the dirty entries can be trusted */
+		if (state != NP_CB_DIRTY && !(clean && state == NP_CB_CLEAN))
+			continue;
+		if (oblock >= dev_blocks || cache_lookup(cache, oblock)) {
+			printk(KERN_WARNING "ntfspunch: %s: bad cache entry %llu\n",
+			       cache->path, i);
+			continue;
+		}
+		cb->state = state;
+		cache_insert(cache, cb, oblock);
+		list_move_tail(&cb->lru, &cache->lru);
+		cache->nr_valid += state == NP_CB_CLEAN;
+		cache->nr_dirty += state == NP_CB_DIRTY;
+	}
+	printk(KERN_INFO "ntfspunch: %s: cache %s has %llu clean and %llu dirty blocks%s\n",
+	       dev->filename, cache->path, cache->nr_valid, cache->nr_dirty,
+	       clean ? "" : " (recovered)");
+	ret = 0;
+out:
+	__free_page(page);
+	return ret;
+}
+
+static void
+cache_free(struct np_cache *cache)
+{
+	int i;
+
+	for (i = 0; i < NP_CACHE_BLOCK_PAGES; i++)
+		if (cache->buf[i])
+			__free_page(cache->buf[i]);
+	if (cache->io_pool)
+		mempool_destroy(cache->io_pool);
+	vfree(cache->meta);
+	vfree(cache->blocks);
+	vfree(cache->hash);
+	if (cache->bdev)
+		blkdev_put(cache->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	kfree(cache);
+}
+
+static int
+cache_attach(struct mapping_dev *dev, const char *path)
+{
+	struct np_cache *cache;
+	struct block_device *bdev;
+	int i, ret;
+
+	if (dev->cache || dev->overlay)
+		return -EBUSY;
+	/* Keeps the remap path from ever seeing it half set up */
+	if (dev->users > 0)
+		return -EBUSY;
+
+	cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+	if (cache == NULL)
+		return -ENOMEM;
+	cache->dev = dev;
+	spin_lock_init(&cache->lock);
+	strncpy(cache->path, path, sizeof(cache->path) - 1);
+	cache->mode = NP_CACHE_WT;
+	INIT_LIST_HEAD(&cache->lru);
+	INIT_LIST_HEAD(&cache->promote);
+	bio_list_init(&cache->deferred);
+	INIT_DELAYED_WORK(&cache->work, cache_work);
+	cache->last_wb = jiffies;
+
+	bdev = blkdev_get_by_path(path, FMODE_READ | FMODE_WRITE | FMODE_EXCL,
+				  cache);
+	if (IS_ERR(bdev)) {
+		printk(KERN_WARNING "ntfspunch: Failed to open cache %s\n",
+		       path);
+		kfree(cache);
+		return PTR_ERR(bdev);
+	}
+	cache->bdev = bdev;
+	if (bdev_logical_block_size(bdev) > dev->sector_size) {
+		printk(KERN_WARNING "ntfspunch: cache %s needs %u byte I/O, the device does %u\n",
+		       path, bdev_logical_block_size(bdev), dev->sector_size);
+		ret = -EINVAL;
+		goto fail;
+	}
+	ret = -ENOMEM;
+	for (i = 0; i < NP_CACHE_BLOCK_PAGES; i++)
+		if ((cache->buf[i] = alloc_page(GFP_KERNEL)) == NULL)
+			goto fail;
+	cache->io_pool = mempool_create_kmalloc_pool(BIO_POOL_SIZE,
+						     sizeof(struct np_cache_io));
+	if (cache->io_pool == NULL)
+		goto fail;
+	if ((ret = cache_load(cache)))
+		goto fail;
+	/* From here on the entries on disk may be behind */
+	if ((ret = cache_write_sb(cache, 0)))
+		goto fail;
+
+	prefetch_ctl(dev, "", "off");
+	dev->cache = cache;
+	if (cache->nr_dirty)
+		queue_delayed_work(np_wq, &cache->work, 0);
+	return 0;
+
+fail:
+	cache_free(cache);
+	return ret;
+}
+
+/*
+ * Write everything back and leave the cache clean on disk
+ */
+void
+np_cache_detach(struct mapping_dev *dev)
+{
+	struct np_cache *cache = dev->cache;
+
+	if (cache == NULL)
+		return;
+	cancel_delayed_work_sync(&cache->work);
+	/* Nothing new is coming in, so run the worker one last time */
+	cache_work(&cache->work.work);
+	cancel_delayed_work_sync(&cache->work);
+	if (cache_writeback_all(cache) || cache_write_sb(cache, 1))
+		printk(KERN_WARNING "ntfspunch: %s: cache %s not cleanly detached, %llu dirty blocks\n",
+		       dev->filename, cache->path, cache->nr_dirty);
+	dev->cache = NULL;
+	cache_free(cache);
+}
+
+struct block_device *
+np_cache_flush_bdev(struct mapping_dev *dev)
+{
+	if (dev->cache == NULL || dev->cache->mode != NP_CACHE_WB)
+		return NULL;
+	return dev->cache->bdev;
+}
+
+int
+np_cache_ctl(struct mapping_dev *dev, char *key, char *value)
+{
+	struct np_cache *cache = dev->cache;
+
+	if (strcmp(key, "attach") == 0)
+		return cache_attach(dev, value);
+	if (cache == NULL)
+		return -ENODEV;
+	if (strcmp(key, "detach") == 0 && strcmp(value, "now") == 0) {
+		if (dev->users > 0)
+			return -EBUSY;
+		np_cache_detach(dev);
+		return 0;
+	}
+	if (strcmp(key, "mode") == 0) {
+		if (strcmp(value, "writethrough") == 0) {
+			/* The worker writes back whatever is still dirty */
+			cache->mode = NP_CACHE_WT;
+			mod_delayed_work(np_wq, &cache->work, 0);
+		} else if (strcmp(value, "writeback") == 0) {
+			cache->mode = NP_CACHE_WB;
+		} else {
+			return -EINVAL;
+		}
+		return 0;
+	}
+	return -EINVAL;
+}
+
+void
+np_cache_show(struct seq_file *m, struct mapping_dev *dev)
+{
+	struct np_cache *cache = dev->cache;
+
+	if (cache == NULL) {
+		seq_printf(m, "cache: none\n");
+		return;
+	}
+	seq_printf(m, "cache: %s\n", cache->path);
+	seq_printf(m, "cache_mode: %s\n", cache->mode == NP_CACHE_WB ?
+		   "writeback" : "writethrough");
+	seq_printf(m, "cache_block_size: %llu\n",
+		   np_sectors_to_bytes(NP_CACHE_BLOCK_SECTORS));
+	seq_printf(m, "cache_blocks: %llu/%llu\n",
+		   cache->nr_valid + cache->nr_dirty, cache->nr_blocks);
+	seq_printf(m, "cache_dirty: %llu\n", cache->nr_dirty);
+	seq_printf(m, "cache_read_hits: %llu\n", cache->read_hits);
+	seq_printf(m, "cache_read_misses: %llu\n", cache->read_misses);
+	seq_printf(m, "cache_write_hits: %llu\n", cache->write_hits);
+	seq_printf(m, "cache_write_misses: %llu\n", cache->write_misses);
+	seq_printf(m, "cache_promotions: %llu\n", cache->promotions);
+	seq_printf(m, "cache_writebacks: %llu\n", cache->writebacks);
+}
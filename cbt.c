@@ -0,0 +1,393 @@
+/*
+ * cbt.c - Changed block tracking for the NTFS Punch Driver
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Changed block tracking keeps a bitmap of which regions of a device
+ * have been written, so a backup only needs to copy those:
+ *
+ *   echo "cbt_granularity 65536" > /proc/ntfspunch/a
+ *   echo "cbt_start /var/lib/ntfspunch/a.cbt" > /proc/ntfspunch/a
+ *
+ * Writes set their bits on the way into the remap path, which is all
+ * tracking costs them.  The NTFSPUNCH_CBT_GET ioctl (ntfspunch_ioctl.h)
+ * hands the changed ranges out in bulk and can reset them as it goes,
+ * a word at a time with xchg(), so writes racing with it keep their
+ * bits.  A write still in flight when its bit is reset may not have
+ * reached the disk by the time the backup reads it, so writers should
+ * be quiesced (fsfreeze in the guest) around the fetch.
+ *
+ * The bitmap is saved to the state file when tracking stops or the
+ * device goes away, and the file is marked dirty while tracking runs.
+ * Starting from a clean file picks up where it left off.  Anything
+ * else (no file, a crash, a different size or granularity) can't say
+ * what changed meanwhile, so everything is reported as changed.
+ */
+
+#include "ntfspunch.h"
+#include "ntfspunch_ioctl.h"
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include <linux/fs.h>
+#include <linux/bitops.h>
+#include <linux/bitmap.h>
+#include <linux/capability.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+
+#define NP_CBT_MAGIC		0x4e504342	/* "NPCB" */
+#define NP_CBT_VERSION		1
+#define NP_CBT_GRANULARITY	(64 * 1024)
+/* The bitmap follows the header in the state file */
+#define NP_CBT_MAP_OFFSET	4096
+/* Most ranges handed out per ioctl, callers loop on next */
+#define NP_CBT_MAX_RANGES	4096
+
+/*
+ * State file header, little endian.  The bitmap after it is in the
+ * host's own long layout.
+ */
+struct np_cbt_header {
+	__le32 magic;
+	__le32 version;
+	__le32 clean;
+	__le32 granularity;	/* in bytes */
+	__le64 size;		/* of the device, in bytes */
+	__le64 nr_bits;
+};
+
+struct np_cbt {
+	struct file *fp;
+	char path[256];
+	unsigned int shift;	/* log2 of sectors per bit */
+	unsigned long nr_bits;
+	unsigned long *map;
+	size_t map_size;	/* in bytes */
+	u64 fetches;		/* stats */
+	u64 resets;
+};
+
+void
+np_cbt_mark(struct mapping_dev *dev, struct bio *bio)
+{
+	struct np_cbt *cbt = dev->cbt;
+	unsigned long bit, last;
+
+	if (bio->bi_size == 0)
+		return;
+	bit = bio->bi_sector >> cbt->shift;
+	last = (bio->bi_sector + bio_sectors(bio) - 1) >> cbt->shift;
+	/* Rewrites of a changed region don't need the cache line */
+	for (; bit <= last; bit++)
+		if (!test_bit(bit, cbt->map))
+			set_bit(bit, cbt->map);
+}
+
+static int
+cbt_write_header(struct np_cbt *cbt, struct mapping_dev *dev, int clean)
+{
+	struct np_cbt_header hdr;
+	ssize_t ret;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = cpu_to_le32(NP_CBT_MAGIC);
+	hdr.version = cpu_to_le32(NP_CBT_VERSION);
+	hdr.clean = cpu_to_le32(clean);
+	hdr.granularity = cpu_to_le32(np_sectors_to_bytes(1 << cbt->shift));
+	hdr.size = cpu_to_le64(dev->size);
+	hdr.nr_bits = cpu_to_le64(cbt->nr_bits);
+	ret = kernel_write(cbt->fp, (char *)&hdr, sizeof(hdr), 0);
+	if (ret != sizeof(hdr))
+		return ret < 0 ? ret : -EIO;
+	return vfs_fsync(cbt->fp, 0);
+}
+
+/*
+ * Returns 0 if the state file had a usable clean bitmap, which is now in
+ * cbt->map
+ */
+static int
+cbt_load(struct np_cbt *cbt, struct mapping_dev *dev)
+{
+	struct np_cbt_header hdr;
+	int ret;
+
+	ret = kernel_read(cbt->fp, 0, (char *)&hdr, sizeof(hdr));
+	if (ret != sizeof(hdr))
+		return -ENODATA;
+	if (le32_to_cpu(hdr.magic) != NP_CBT_MAGIC ||
+	    le32_to_cpu(hdr.version) != NP_CBT_VERSION ||
+	    le32_to_cpu(hdr.granularity) !=
+	    np_sectors_to_bytes(1 << cbt->shift) ||
+	    le64_to_cpu(hdr.size) != dev->size ||
+	    le64_to_cpu(hdr.nr_bits) != cbt->nr_bits)
+		return -EINVAL;
+	if (!le32_to_cpu(hdr.clean))
+		return -EUCLEAN;
+	ret = kernel_read(cbt->fp, NP_CBT_MAP_OFFSET, (char *)cbt->map,
+			  cbt->map_size);
+	if (ret != cbt->map_size)
+		return -ENODATA;
+	return 0;
+}
+
+static int
+cbt_save(struct np_cbt *cbt, struct mapping_dev *dev)
+{
+	ssize_t ret;
+
+	ret = kernel_write(cbt->fp, (char *)cbt->map, cbt->map_size,
+			   NP_CBT_MAP_OFFSET);
+	if (ret != cbt->map_size)
+		return ret < 0 ? ret : -EIO;
+	/* The bitmap has to be down before the header says it's good */
+	ret = vfs_fsync(cbt->fp, 0);
+	if (ret)
+		return ret;
+	return cbt_write_header(cbt, dev, 1);
+}
+
+static void
+cbt_free(struct np_cbt *cbt)
+{
+	if (cbt->fp && !IS_ERR(cbt->fp))
+		filp_close(cbt->fp, NULL);
+	vfree(cbt->map);
+	kfree(cbt);
+}
+
+static int
+cbt_start(struct mapping_dev *dev, const char *path)
+{
+	u32 gran = dev->cbt_granularity ? : NP_CBT_GRANULARITY;
+	struct np_cbt *cbt;
+	int ret;
+
+	if (dev->cbt)
+		return -EBUSY;
+	if (dev->users > 0)
+		return -EBUSY;
+
+	cbt = kzalloc(sizeof(*cbt), GFP_KERNEL);
+	if (cbt == NULL)
+		return -ENOMEM;
+	strncpy(cbt->path, path, sizeof(cbt->path) - 1);
+	cbt->shift = ilog2(gran) - NP_SECTOR_SHIFT;
+	cbt->nr_bits = DIV_ROUND_UP_ULL(np_bytes_to_sectors(dev->size),
+					1 << cbt->shift);
+	cbt->map_size = BITS_TO_LONGS(cbt->nr_bits) * sizeof(long);
+	cbt->map = vzalloc(cbt->map_size);
+	if (cbt->map == NULL) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	cbt->fp = filp_open(path, O_RDWR|O_CREAT|O_LARGEFILE, 0600);
+	if (IS_ERR(cbt->fp)) {
+		printk(KERN_WARNING "ntfspunch: Failed to open CBT state file %s\n",
+		       path);
+		ret = PTR_ERR(cbt->fp);
+		goto fail;
+	}
+	ret = cbt_load(cbt, dev);
+	if (ret) {
+		printk(KERN_WARNING "ntfspunch: no clean CBT state in %s (%d), reporting all of %s as changed\n",
+		       path, ret, dev->filename);
+		bitmap_fill(cbt->map, cbt->nr_bits);
+	}
+	/* From here on the file can't be trusted until it's saved again */
+	ret = cbt_write_header(cbt, dev, 0);
+	if (ret) {
+		printk(KERN_WARNING "ntfspunch: Failed to write CBT state file %s (%d)\n",
+		       path, ret);
+		goto fail;
+	}
+	dev->cbt = cbt;
+	return 0;
+
+fail:
+	cbt_free(cbt);
+	return ret;
+}
+
+void
+np_cbt_stop(struct mapping_dev *dev)
+{
+	struct np_cbt *cbt = dev->cbt;
+	int ret;
+
+	if (cbt == NULL)
+		return;
+	dev->cbt = NULL;
+	ret = cbt_save(cbt, dev);
+	if (ret)
+		printk(KERN_WARNING "ntfspunch: Failed to save CBT state to %s (%d), the next start will report everything as changed\n",
+		       cbt->path, ret);
+	cbt_free(cbt);
+}
+
+/*
+ * Put back bits taken by xchg() that aren't being handed out
+ */
+static void
+cbt_restore(struct np_cbt *cbt, unsigned long w, unsigned long word)
+{
+	while (word) {
+		set_bit(w * BITS_PER_LONG + __ffs(word), cbt->map);
+		word &= word - 1;
+	}
+}
+
+int
+np_cbt_get(struct mapping_dev *dev, void __user *argp)
+{
+	struct np_cbt *cbt = dev->cbt;
+	struct np_cbt_get req;
+	struct np_cbt_range *r;
+	unsigned long bit, w, word, keep, pos, end;
+	unsigned int gshift;
+	u32 i, n = 0, max;
+	int reset, ret = 0;
+
+	if (cbt == NULL)
+		return -ENODEV;
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+	if (req.flags & ~NP_CBT_RESET || req.nr_ranges == 0)
+		return -EINVAL;
+	reset = req.flags & NP_CBT_RESET;
+	if (reset && !capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	max = min_t(u32, req.nr_ranges, NP_CBT_MAX_RANGES);
+	r = kmalloc(max * sizeof(*r), GFP_KERNEL);
+	if (r == NULL)
+		return -ENOMEM;
+
+	gshift = cbt->shift + NP_SECTOR_SHIFT;
+	bit = req.start < dev->size ? req.start >> gshift : cbt->nr_bits;
+	while (bit < cbt->nr_bits) {
+		w = BIT_WORD(bit);
+		word = reset ? xchg(&cbt->map[w], 0) : ACCESS_ONCE(cbt->map[w]);
+		/* Bits before start aren't ours to hand out */
+		keep = word & (BIT_MASK(bit) - 1);
+		word &= ~(BIT_MASK(bit) - 1);
+		while (word) {
+			pos = w * BITS_PER_LONG + __ffs(word);
+			if (n && r[n - 1].offset + r[n - 1].length ==
+			    (u64)pos << gshift) {
+				r[n - 1].length += 1ULL << gshift;
+			} else if (n < max) {
+				r[n].offset = (u64)pos << gshift;
+				r[n].length = 1ULL << gshift;
+				n++;
+			} else {
+				break;
+			}
+			word &= word - 1;
+		}
+		if (reset)
+			cbt_restore(cbt, w, keep | word);
+		if (word) {
+			/* Out of room, carry on from here next time */
+			bit = w * BITS_PER_LONG + __ffs(word);
+			break;
+		}
+		bit = (w + 1) * BITS_PER_LONG;
+	}
+
+	/* The last region can run past the end of the device */
+	if (n && r[n - 1].offset + r[n - 1].length > dev->size)
+		r[n - 1].length = dev->size - r[n - 1].offset;
+	req.next = min_t(u64, (u64)bit << gshift, dev->size);
+	req.nr_ranges = n;
+	req.granularity = 1ULL << gshift;
+	if (copy_to_user((void __user *)(unsigned long)req.ranges, r,
+			 n * sizeof(*r)) ||
+	    copy_to_user(argp, &req, sizeof(req))) {
+		/* Nobody got them, so they're still changed */
+		for (i = 0; reset && i < n; i++) {
+			pos = r[i].offset >> gshift;
+			end = DIV_ROUND_UP_ULL(r[i].offset + r[i].length,
+					       1ULL << gshift);
+			for (; pos < end; pos++)
+				set_bit(pos, cbt->map);
+		}
+		ret = -EFAULT;
+	}
+	if (ret == 0) {
+		cbt->fetches++;
+		if (reset)
+			cbt->resets++;
+	}
+	kfree(r);
+	return ret;
+}
+
+int
+np_cbt_ctl(struct mapping_dev *dev, char *key, char *value)
+{
+	unsigned long gran;
+
+	if (strcmp(key, "start") == 0)
+		return cbt_start(dev, value);
+	if (strcmp(key, "granularity") == 0) {
+		if (kstrtoul(value, 0, &gran) || !is_power_of_2(gran) ||
+		    gran < dev->sector_size || gran > (1UL << 30))
+			return -EINVAL;
+		/* Only takes effect on the next start */
+		if (dev->cbt)
+			return -EBUSY;
+		dev->cbt_granularity = gran;
+		return 0;
+	}
+	if (strcmp(key, "stop") == 0) {
+		if (dev->cbt == NULL)
+			return -ENODEV;
+		if (strcmp(value, "now") != 0)
+			return -EINVAL;
+		if (dev->users > 0)
+			return -EBUSY;
+		np_cbt_stop(dev);
+		return 0;
+	}
+	return -EINVAL;
+}
+
+void
+np_cbt_show(struct seq_file *m, struct mapping_dev *dev)
+{
+	struct np_cbt *cbt = dev->cbt;
+
+	if (cbt == NULL) {
+		seq_printf(m, "cbt: none\n");
+		seq_printf(m, "cbt_granularity: %u\n",
+			   dev->cbt_granularity ? : NP_CBT_GRANULARITY);
+		return;
+	}
+	seq_printf(m, "cbt: %s\n", cbt->path);
+	seq_printf(m, "cbt_granularity: %llu\n",
+		   np_sectors_to_bytes(1 << cbt->shift));
+	seq_printf(m, "cbt_changed: %d/%lu\n",
+		   bitmap_weight(cbt->map, cbt->nr_bits), cbt->nr_bits);
+	seq_printf(m, "cbt_fetches: %llu\n", cbt->fetches);
+	seq_printf(m, "cbt_resets: %llu\n", cbt->resets);
+}
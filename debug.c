@@ -30,6 +30,8 @@ dump_unlocked_device(int device_num)
 {
 	runlist_element *rl;
 	struct mapping_dev *dev = NULL;
+	struct np_member *m;
+	int i;
 	printk(KERN_DEBUG "ntfspunch: Dump for device_num [%d]\n", device_num);
 	spin_lock(&dev_list_lock);
 	printk(KERN_DEBUG "num_devices: %d\n", num_devices);
@@ -46,7 +48,6 @@ dump_unlocked_device(int device_num)
 	printk(KERN_DEBUG "   stored at %p\n", dev);
 	printk(KERN_DEBUG "   filename %s\n", dev->filename);
 	printk(KERN_DEBUG "   lock %p\n", &dev->lock);
-	printk(KERN_DEBUG "   img_fp %p\n", dev->img_fp);
 	printk(KERN_DEBUG "   users %d\n", dev->users);
 	printk(KERN_DEBUG "   gd %p\n", dev->gd);
 	printk(KERN_DEBUG "   gd->slave_dir %p\n", dev->gd->slave_dir);
@@ -60,15 +61,23 @@ dump_unlocked_device(int device_num)
 	printk(KERN_DEBUG "   (kobj) queue.kobj.state_initialized %d\n",
 	       dev->queue->kobj.state_initialized);
 	printk(KERN_DEBUG "   size %lld\n", dev->size);
-	printk(KERN_DEBUG "   cluster_size %u\n", dev->cluster_size);
-	printk(KERN_DEBUG "   block_dev %p\n", dev->block_dev);
-	printk(KERN_DEBUG "   ni %p\n", dev->ni);
-	printk(KERN_DEBUG "   rl %p\n", dev->rl);
-	for (rl = dev->rl; rl->length; rl++) {
-		printk(KERN_DEBUG "   file_offset:%lld disk_offset:%lld length:%lld\n",
-		       rl->vcn * dev->cluster_size,
-		       rl->lcn * dev->cluster_size,
-		       rl->length * dev->cluster_size);
+	printk(KERN_DEBUG "   sector_size %u\n", dev->sector_size);
+	printk(KERN_DEBUG "   layout %d chunk_sectors %llu\n", dev->layout,
+	       (unsigned long long)dev->chunk_sectors);
+	for (i = 0; i < dev->nr_members; i++) {
+		m = &dev->members[i];
+		printk(KERN_DEBUG "   member %d %s\n", i, m->filename);
+		printk(KERN_DEBUG "   img_fp %p\n", m->img_fp);
+		printk(KERN_DEBUG "   cluster_size %u\n", m->cluster_size);
+		printk(KERN_DEBUG "   block_dev %p\n", m->block_dev);
+		printk(KERN_DEBUG "   ni %p\n", m->ni);
+		printk(KERN_DEBUG "   rl %p\n", m->rl);
+		for (rl = m->rl; rl->length; rl++) {
+			printk(KERN_DEBUG "   file_offset:%lld disk_offset:%lld length:%lld\n",
+			       rl->vcn * m->cluster_size,
+			       rl->lcn * m->cluster_size,
+			       rl->length * m->cluster_size);
+		}
 	}
 
 	printk(KERN_DEBUG " Queue Limits: %p\n", dev->queue);
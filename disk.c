@@ -0,0 +1,500 @@
+/*
+ * disk.c - Per underlying disk state shared by NTFS Punch devices
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Every punched device on a volume sits on the same block device
+ * (i_sb->s_bdev), so anything that really belongs to the disk rather than
+ * to one image lives here, shared and refcounted.
+ *
+ * Flushes: a cache flush is whole-disk, so concurrent flushes from any of
+ * the devices are merged group-commit style.  Waiters that arrive while a
+ * flush is in flight can't ride on it (their writes may have completed
+ * after it started), so they gather on "next" and all go together in the
+ * following flush.
+ *
+ * Reverse map: every attached data run is also kept in a tree on its disk
+ * sorted by physical sector, so a sector from a disk error (or anyone
+ * else) can be traced back to the device and file offset using it.  The
+ * volume's $MFT and $MFTMirr are in there too, and nothing in the tree
+ * may overlap, which is what keeps two attaches (or a stale runlist) from
+ * sharing clusters.  Each run is one O(log n) check.
+ */
+
+#include "ntfspunch.h"
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/seq_file.h>
+#include <linux/blkdev.h>
+#include <linux/workqueue.h>
+
+static LIST_HEAD(np_disks);
+static DEFINE_SPINLOCK(np_disks_lock);
+
+/* For work that I/O completion kicks off, usable under memory pressure */
+struct workqueue_struct *np_wq;
+
+static void np_disk_flush_work(struct work_struct *work);
+static int np_disk_meta_alloc(struct np_disk *disk, ntfs_volume *vol);
+static void np_disk_meta_free(struct np_disk *disk);
+
+struct np_rmap {
+	struct rb_node node;
+	sector_t phys;		/* on the disk */
+	sector_t len;
+	sector_t msector;	/* within the member */
+	struct mapping_dev *dev;	/* NULL for a device-mapper target */
+	struct np_member *m;	/* NULL for volume metadata */
+	const char *what;	/* which metadata */
+};
+
+/*
+ * The disk's entry, with a reference taken, or NULL
+ *
+ * np_disks_lock must be held
+ */
+static struct np_disk *
+np_disk_find(struct block_device *bdev)
+{
+	struct np_disk *disk;
+
+	list_for_each_entry(disk, &np_disks, list) {
+		if (disk->bdev == bdev) {
+			disk->refs++;
+			return disk;
+		}
+	}
+	return NULL;
+}
+
+struct np_disk *
+np_disk_get(struct block_device *bdev, ntfs_volume *vol)
+{
+	struct np_disk *disk, *new;
+
+	spin_lock(&np_disks_lock);
+	disk = np_disk_find(bdev);
+	spin_unlock(&np_disks_lock);
+	if (disk)
+		return disk;
+
+	/* The metadata is only reserved once, by whoever creates the disk */
+	new = kzalloc(sizeof(*new), GFP_KERNEL);
+	if (new == NULL)
+		return NULL;
+	new->rmap = RB_ROOT;
+	if (np_disk_meta_alloc(new, vol)) {
+		kfree(new);
+		return NULL;
+	}
+
+	spin_lock(&np_disks_lock);
+	/* Someone else may have got there while we were allocating */
+	disk = np_disk_find(bdev);
+	if (disk) {
+		spin_unlock(&np_disks_lock);
+		np_disk_meta_free(new);
+		kfree(new);
+		return disk;
+	}
+	new->bdev = bdev;
+	new->refs = 1;
+	spin_lock_init(&new->lock);
+	spin_lock_init(&new->rmap_lock);
+	bio_list_init(&new->flush_running);
+	bio_list_init(&new->flush_next);
+	INIT_WORK(&new->flush_work, np_disk_flush_work);
+	list_add(&new->list, &np_disks);
+	spin_unlock(&np_disks_lock);
+	return new;
+}
+
+void
+np_disk_put(struct np_disk *disk)
+{
+	if (disk == NULL)
+		return;
+	spin_lock(&np_disks_lock);
+	if (--disk->refs) {
+		spin_unlock(&np_disks_lock);
+		return;
+	}
+	list_del(&disk->list);
+	spin_unlock(&np_disks_lock);
+	WARN_ON(disk->flushing);
+	np_disk_meta_free(disk);
+	WARN_ON(!RB_EMPTY_ROOT(&disk->rmap));
+	kfree(disk);
+}
+
+static void
+np_disk_flush_end_io(struct bio *bio, int err)
+{
+	struct np_disk *disk = bio->bi_private;
+	struct bio_list done;
+	struct bio *waiter;
+	unsigned long flags;
+
+	spin_lock_irqsave(&disk->lock, flags);
+	done = disk->flush_running;
+	bio_list_init(&disk->flush_running);
+	if (bio_list_empty(&disk->flush_next))
+		disk->flushing = 0;
+	else
+		queue_work(np_wq, &disk->flush_work);
+	spin_unlock_irqrestore(&disk->lock, flags);
+
+	while ((waiter = bio_list_pop(&done)))
+		bio_endio(waiter, err);
+}
+
+/*
+ * Start a flush for everyone on flush_next
+ *
+ * Only one flush is ever in flight per disk, so the embedded bio is free
+ */
+static void
+np_disk_issue_flush(struct np_disk *disk)
+{
+	struct bio *bio = &disk->flush_bio;
+	unsigned long flags;
+
+	spin_lock_irqsave(&disk->lock, flags);
+	bio_list_merge(&disk->flush_running, &disk->flush_next);
+	bio_list_init(&disk->flush_next);
+	disk->flushes_issued++;
+	spin_unlock_irqrestore(&disk->lock, flags);
+
+	bio_init(bio);
+	bio->bi_bdev = disk->bdev;
+	bio->bi_rw = WRITE_FLUSH;
+	bio->bi_end_io = np_disk_flush_end_io;
+	bio->bi_private = disk;
+	generic_make_request(bio);
+}
+
+static void
+np_disk_flush_work(struct work_struct *work)
+{
+	np_disk_issue_flush(container_of(work, struct np_disk, flush_work));
+}
+
+/*
+ * Queue an empty flush bio from one of the devices on its disk's next
+ * group flush, the bio completes when that does
+ */
+void
+np_disk_flush(struct np_disk *disk, struct bio *bio)
+{
+	unsigned long flags;
+	int issue = 0;
+
+	spin_lock_irqsave(&disk->lock, flags);
+	disk->flushes_requested++;
+	bio_list_add(&disk->flush_next, bio);
+	if (!disk->flushing) {
+		disk->flushing = 1;
+		issue = 1;
+	}
+	spin_unlock_irqrestore(&disk->lock, flags);
+
+	if (issue)
+		np_disk_issue_flush(disk);
+}
+
+void
+np_disk_show(struct seq_file *m, struct np_disk *disk)
+{
+	seq_printf(m, "disk_flushes_requested: %llu\n",
+		   disk->flushes_requested);
+	seq_printf(m, "disk_flushes_issued: %llu\n", disk->flushes_issued);
+}
+
+/*
+ * The run starting closest at or below sector, the only one that can
+ * hold it since nothing in the tree overlaps
+ */
+static struct np_rmap *
+rmap_floor(struct rb_root *root, sector_t sector)
+{
+	struct rb_node *n = root->rb_node;
+	struct np_rmap *r, *best = NULL;
+
+	while (n) {
+		r = rb_entry(n, struct np_rmap, node);
+		if (sector < r->phys) {
+			n = n->rb_left;
+		} else {
+			best = r;
+			n = n->rb_right;
+		}
+	}
+	return best;
+}
+
+/*
+ * Insert a run, unless it overlaps one already there, which is returned
+ * instead.  The only candidate is the last run starting before the new
+ * one ends.
+ */
+static struct np_rmap *
+rmap_insert(struct rb_root *root, struct np_rmap *r)
+{
+	struct rb_node **p = &root->rb_node, *parent = NULL;
+	struct np_rmap *prev;
+
+	prev = rmap_floor(root, r->phys + r->len - 1);
+	if (prev && prev->phys + prev->len > r->phys)
+		return prev;
+	while (*p) {
+		parent = *p;
+		if (r->phys < rb_entry(parent, struct np_rmap, node)->phys)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&r->node, parent, p);
+	rb_insert_color(&r->node, root);
+	return NULL;
+}
+
+static void
+rmap_erase(struct rb_root *root, struct np_rmap *r, int n)
+{
+	for (; n > 0; n--, r++) {
+		if (RB_EMPTY_NODE(&r->node))
+			continue;
+		rb_erase(&r->node, root);
+		RB_CLEAR_NODE(&r->node);
+	}
+}
+
+/*
+ * Reserve the volume's $MFT (every mapped run, it can be fragmented) and
+ * $MFTMirr, before the disk is visible to anyone else
+ */
+static int
+np_disk_meta_alloc(struct np_disk *disk, ntfs_volume *vol)
+{
+	ntfs_inode *mft = NTFS_I(vol->mft_ino);
+	int shift = vol->cluster_size_bits - NP_SECTOR_SHIFT;
+	runlist_element *rl;
+	struct np_rmap *r;
+	int i, n = 1;
+
+	down_read(&mft->runlist.lock);
+	for (rl = mft->runlist.rl; rl && rl->length; rl++)
+		n += rl->lcn >= 0;
+	disk->meta = kcalloc(n, sizeof(*r), GFP_KERNEL);
+	if (disk->meta == NULL) {
+		up_read(&mft->runlist.lock);
+		return -ENOMEM;
+	}
+	r = disk->meta;
+	for (rl = mft->runlist.rl; rl && rl->length; rl++) {
+		if (rl->lcn < 0)
+			continue;
+		r->phys = (sector_t)rl->lcn << shift;
+		r->len = (sector_t)rl->length << shift;
+		r->what = "$MFT";
+		r++;
+	}
+	up_read(&mft->runlist.lock);
+	r->phys = (sector_t)vol->mftmirr_lcn << shift;
+	r->len = np_bytes_to_sectors(round_up((u64)vol->mftmirr_size <<
+					      vol->mft_record_size_bits,
+					      vol->cluster_size));
+	r->what = "$MFTMirr";
+	disk->nr_meta = n;
+
+	for (i = 0; i < n; i++) {
+		RB_CLEAR_NODE(&disk->meta[i].node);
+		/* The mirror can't overlap $MFT, but skip it if it does */
+		if (disk->meta[i].len)
+			rmap_insert(&disk->rmap, &disk->meta[i]);
+	}
+	return 0;
+}
+
+static void
+np_disk_meta_free(struct np_disk *disk)
+{
+	rmap_erase(&disk->rmap, disk->meta, disk->nr_meta);
+	kfree(disk->meta);
+}
+
+/*
+ * Build the reverse map entries for the data runs of a member
+ */
+int
+np_rmap_alloc(struct mapping_dev *dev, struct np_member *m)
+{
+	runlist_element *rl;
+	struct np_rmap *r;
+	int n = 0;
+
+	for (rl = m->rl; rl->length; rl++)
+		n += rl->lcn >= 0;
+	m->rmap = kcalloc(max(n, 1), sizeof(*r), GFP_KERNEL);
+	if (m->rmap == NULL)
+		return -ENOMEM;
+	m->nr_rmap = n;
+	for (r = m->rmap, rl = m->rl; rl->length; rl++) {
+		if (rl->lcn < 0)
+			continue;
+		r->phys = np_clusters_to_sectors(m, rl->lcn);
+		r->len = np_clusters_to_sectors(m, rl->length);
+		r->msector = np_clusters_to_sectors(m, rl->vcn);
+		r->dev = dev;
+		r->m = m;
+		RB_CLEAR_NODE(&r->node);
+		r++;
+	}
+	return 0;
+}
+
+/*
+ * Claim a member's runs on its disk, or fail with -EBUSY (claiming none
+ * of them) if any overlaps something already attached or the metadata
+ */
+int
+np_disk_rmap_add(struct np_disk *disk, struct np_member *m)
+{
+	struct np_rmap *other = NULL;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&disk->rmap_lock, flags);
+	for (i = 0; i < m->nr_rmap; i++) {
+		other = rmap_insert(&disk->rmap, &m->rmap[i]);
+		if (other)
+			break;
+	}
+	if (other) {
+		printk(KERN_WARNING "ntfspunch: %s overlaps %s at disk offset %llu\n",
+		       m->filename, other->m ? other->m->filename : other->what,
+		       np_sectors_to_bytes(max(m->rmap[i].phys, other->phys)));
+		rmap_erase(&disk->rmap, m->rmap, i);
+	}
+	spin_unlock_irqrestore(&disk->rmap_lock, flags);
+	return other ? -EBUSY : 0;
+}
+
+/*
+ * Take a member's runs back out of the tree, if they were ever added
+ */
+void
+np_disk_rmap_del(struct np_disk *disk, struct np_member *m)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&disk->rmap_lock, flags);
+	rmap_erase(&disk->rmap, m->rmap, m->nr_rmap);
+	spin_unlock_irqrestore(&disk->rmap_lock, flags);
+}
+
+static int
+rmap_describe(struct np_disk *disk, sector_t sector, char *buf, size_t len)
+{
+	struct np_rmap *r;
+	struct gendisk *gd;
+	sector_t msector;
+	unsigned long flags;
+	int ret = -ENOENT;
+
+	spin_lock_irqsave(&disk->rmap_lock, flags);
+	r = rmap_floor(&disk->rmap, sector);
+	if (r && sector < r->phys + r->len && r->m == NULL) {
+		snprintf(buf, len, "metadata: %s\n", r->what);
+		ret = 0;
+	} else if (r && sector < r->phys + r->len && r->dev == NULL) {
+		/* A device-mapper target, which maps the file one to one */
+		msector = r->msector + (sector - r->phys);
+		snprintf(buf, len, "device: (device-mapper)\n"
+			 "offset: %llu\nfile: %s\nfile_offset: %llu\n",
+			 np_sectors_to_bytes(msector), r->m->filename,
+			 np_sectors_to_bytes(msector));
+		ret = 0;
+	} else if (r && sector < r->phys + r->len) {
+		/* Runs are claimed before the gendisk is up */
+		gd = ACCESS_ONCE(r->dev->gd);
+		msector = r->msector + (sector - r->phys);
+		snprintf(buf, len, "device: /dev/%s\n"
+			 "offset: %llu\nfile: %s\nfile_offset: %llu\n",
+			 gd && (gd->flags & GENHD_FL_UP) ? gd->disk_name :
+			 "(being added)",
+			 np_sectors_to_bytes(np_member_to_dev(r->dev, r->m,
+							      msector)),
+			 r->m->filename, np_sectors_to_bytes(msector));
+		ret = 0;
+	}
+	spin_unlock_irqrestore(&disk->rmap_lock, flags);
+	return ret;
+}
+
+/*
+ * Describe which device and file a disk sector belongs to
+ *
+ * devt is either the partition the volume is on, with a sector relative
+ * to it, or the whole disk.  Returns -ENOENT if nothing attached has it.
+ */
+int
+np_disk_lookup(dev_t devt, sector_t sector, char *buf, size_t len)
+{
+	struct block_device *bdev;
+	struct np_disk *disk;
+	sector_t s;
+	int ret = -ENOENT;
+
+	spin_lock(&np_disks_lock);
+	list_for_each_entry(disk, &np_disks, list) {
+		bdev = disk->bdev;
+		s = sector;
+		if (bdev->bd_dev != devt) {
+			if (bdev->bd_contains == bdev ||
+			    bdev->bd_contains->bd_dev != devt ||
+			    bdev->bd_part == NULL ||
+			    sector < bdev->bd_part->start_sect)
+				continue;
+			s -= bdev->bd_part->start_sect;
+		}
+		ret = rmap_describe(disk, s, buf, len);
+		if (ret == 0)
+			break;
+	}
+	spin_unlock(&np_disks_lock);
+	return ret;
+}
+
+int
+np_disk_init(void)
+{
+	np_wq = alloc_workqueue("ntfspunch", WQ_MEM_RECLAIM, 0);
+	if (np_wq == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+void
+np_disk_exit(void)
+{
+	destroy_workqueue(np_wq);
+}
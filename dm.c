@@ -0,0 +1,529 @@
+/*
+ * dm.c - Device-mapper target variant of the NTFS Punch Driver
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * The same remapping as the standalone driver, but as a device-mapper
+ * target so DM takes care of limit stacking, flushes and runlist reloads
+ * (suspend/reload/resume), and we get dm-stats for free.  Bios are only
+ * split where they cross from one run to the next, by the target itself.
+ *
+ * Table line, either from a file on a read-only mounted NTFS:
+ *
+ *   0 <sectors> ntfspunch file <path>
+ *
+ * or from an explicit runlist (bytes, same format as /proc/ntfspunch/?):
+ *
+ *   0 <sectors> ntfspunch runlist <dev> <file_offset:disk_offset:length>...
+ *
+ * A file goes through the same checks as attaching it to /dev/ntfspunchX
+ * ($Bitmap, the MFT record on disk, and no overlap with other images or
+ * the volume's metadata), again on every resume.  An explicit runlist has
+ * no file to check against, and is taken as given.
+ */
+
+#include "ntfspunch.h"
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/device-mapper.h>
+
+#define DM_MSG_PREFIX "ntfspunch"
+
+struct np_extent {
+	sector_t start;		/* within the target */
+	sector_t len;
+	sector_t phys;		/* on the underlying device, or NP_PHYS_HOLE */
+};
+
+struct np_target {
+	struct dm_dev *dev;
+	struct np_member *m;	/* NULL for an explicit runlist */
+	char *path;
+	struct np_extent *ext;
+	unsigned int nr_ext;
+	struct bio_set *bs;	/* for the pieces of bios crossing runs */
+	mempool_t *split_pool;
+	atomic64_t splits;
+};
+
+/*
+ * A bio crossing runs, sent as one clone per run
+ */
+struct np_dm_split {
+	struct np_target *nt;
+	struct bio *parent;
+	atomic_t remaining;
+	int error;
+};
+
+/*
+ * Build the extent table from a member's runlist
+ */
+static int
+np_dm_extents_from_member(struct np_target *nt, struct np_member *m)
+{
+	struct np_extent *ext;
+	runlist_element *rl;
+	int i;
+
+	ext = kcalloc(m->nr_runs, sizeof(*ext), GFP_KERNEL);
+	if (ext == NULL)
+		return -ENOMEM;
+	for (i = 0, rl = m->rl; i < m->nr_runs; i++, rl++) {
+		ext[i].start = np_clusters_to_sectors(m, rl->vcn);
+		ext[i].len = np_clusters_to_sectors(m, rl->length);
+		ext[i].phys = rl->lcn < 0 ? NP_PHYS_HOLE :
+			np_clusters_to_sectors(m, rl->lcn);
+	}
+
+	nt->ext = ext;
+	nt->nr_ext = m->nr_runs;
+	return 0;
+}
+
+static int
+np_dm_extents_from_args(struct np_target *nt, unsigned int argc, char **argv)
+{
+	unsigned long long f, d, l;
+	sector_t next = 0;
+	unsigned int i;
+	char dummy;
+
+	nt->ext = kcalloc(argc, sizeof(*nt->ext), GFP_KERNEL);
+	if (nt->ext == NULL)
+		return -ENOMEM;
+	for (i = 0; i < argc; i++) {
+		if (sscanf(argv[i], "%llu:%llu:%llu%c", &f, &d, &l,
+			   &dummy) != 3 ||
+		    (f | d | l) & ((1 << NP_SECTOR_SHIFT) - 1) || l == 0 ||
+		    np_bytes_to_sectors(f) != next)
+			return -EINVAL;
+		nt->ext[i].start = np_bytes_to_sectors(f);
+		nt->ext[i].phys = np_bytes_to_sectors(d);
+		nt->ext[i].len = np_bytes_to_sectors(l);
+		next += nt->ext[i].len;
+	}
+	nt->nr_ext = argc;
+	return 0;
+}
+
+static sector_t
+np_dm_size(struct np_target *nt)
+{
+	struct np_extent *last = &nt->ext[nt->nr_ext - 1];
+	return last->start + last->len;
+}
+
+static struct np_extent *
+np_dm_find(struct np_target *nt, sector_t sector)
+{
+	unsigned int lo = 0, hi = nt->nr_ext, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (sector < nt->ext[mid].start)
+			hi = mid;
+		else if (sector >= nt->ext[mid].start + nt->ext[mid].len)
+			lo = mid + 1;
+		else
+			return &nt->ext[mid];
+	}
+	return NULL;
+}
+
+static void
+np_dm_free(struct np_target *nt)
+{
+	if (nt->split_pool)
+		mempool_destroy(nt->split_pool);
+	if (nt->bs)
+		bioset_free(nt->bs);
+	if (nt->m) {
+		if (nt->m->rmap)
+			np_disk_rmap_del(nt->m->disk, nt->m);
+		np_member_close(nt->m);
+		kfree(nt->m);
+	}
+	kfree(nt->path);
+	kfree(nt->ext);
+	kfree(nt);
+}
+
+static int
+np_dm_ctr(struct dm_target *ti, unsigned int argc, char **argv)
+{
+	struct np_target *nt;
+	char devname[BDEVNAME_SIZE];
+	const char *dev_path;
+	int ret;
+
+	if (argc < 2) {
+		ti->error = "Expected \"file <path>\" or \"runlist <dev> <runs>\"";
+		return -EINVAL;
+	}
+	nt = kzalloc(sizeof(*nt), GFP_KERNEL);
+	if (nt == NULL) {
+		ti->error = "Cannot allocate context";
+		return -ENOMEM;
+	}
+
+	if (strcmp(argv[0], "file") == 0 && argc == 2) {
+		nt->path = kstrdup(argv[1], GFP_KERNEL);
+		nt->m = kzalloc(sizeof(*nt->m), GFP_KERNEL);
+		if (nt->m == NULL) {
+			ti->error = "Cannot allocate context";
+			ret = -ENOMEM;
+			goto bad;
+		}
+		if ((ret = np_member_open(NULL, nt->m, argv[1]))) {
+			ti->error = "File failed validation";
+			goto bad;
+		}
+		if (np_mft_check_member(nt->m) == -ESTALE) {
+			ti->error = "File has moved since the NTFS was mounted";
+			ret = -ESTALE;
+			goto bad;
+		}
+		if ((ret = np_disk_rmap_add(nt->m->disk, nt->m))) {
+			ti->error = "File overlaps another image or NTFS metadata";
+			goto bad;
+		}
+		if ((ret = np_dm_extents_from_member(nt, nt->m))) {
+			ti->error = "Unable to copy runlist";
+			goto bad;
+		}
+		format_dev_t(devname, nt->m->block_dev->bd_dev);
+		dev_path = devname;
+	} else if (strcmp(argv[0], "runlist") == 0 && argc > 2) {
+		if ((ret = np_dm_extents_from_args(nt, argc - 2, argv + 2))) {
+			ti->error = "Invalid runlist";
+			goto bad;
+		}
+		nt->path = kstrdup(argv[1], GFP_KERNEL);
+		dev_path = argv[1];
+	} else {
+		ti->error = "Unknown mapping type";
+		ret = -EINVAL;
+		goto bad;
+	}
+
+	if (ti->len > np_dm_size(nt)) {
+		ti->error = "Target is larger than the image";
+		ret = -EINVAL;
+		goto bad;
+	}
+	ret = dm_get_device(ti, dev_path, dm_table_get_mode(ti->table),
+			    &nt->dev);
+	if (ret) {
+		ti->error = "Device lookup failed";
+		goto bad;
+	}
+
+	nt->bs = bioset_create(BIO_POOL_SIZE, 0);
+	nt->split_pool = mempool_create_kmalloc_pool(BIO_POOL_SIZE,
+					sizeof(struct np_dm_split));
+	if (nt->bs == NULL || nt->split_pool == NULL) {
+		ti->error = "Cannot allocate bio pools";
+		dm_put_device(ti, nt->dev);
+		ret = -ENOMEM;
+		goto bad;
+	}
+	atomic64_set(&nt->splits, 0);
+	ti->num_flush_bios = 1;
+	ti->private = nt;
+	return 0;
+
+bad:
+	np_dm_free(nt);
+	return ret;
+}
+
+static void
+np_dm_dtr(struct dm_target *ti)
+{
+	struct np_target *nt = ti->private;
+
+	dm_put_device(ti, nt->dev);
+	np_dm_free(nt);
+}
+
+/*
+ * The extent holding sector, if a bio there can go ahead.  Holes read as
+ * zeroes, but can't be written without allocating on a read-only NTFS.
+ */
+static struct np_extent *
+np_dm_check(struct np_target *nt, struct bio *bio, sector_t sector)
+{
+	struct np_extent *ext = np_dm_find(nt, sector);
+
+	if (ext == NULL) {
+		DMERR_LIMIT("Couldn't map I/O at sector %llu (%u sectors)",
+			    (unsigned long long)sector, bio_sectors(bio));
+		return NULL;
+	}
+	if (ext->phys == NP_PHYS_HOLE && bio_data_dir(bio) == WRITE &&
+	    !(bio->bi_rw & REQ_DISCARD)) {
+		DMERR_LIMIT("Write to a hole at sector %llu refused",
+			    (unsigned long long)sector);
+		return NULL;
+	}
+	return ext;
+}
+
+static void
+np_dm_end_hole(struct bio *bio)
+{
+	if (bio_data_dir(bio) == READ)
+		np_zero_fill_bio(bio);
+	bio_endio(bio, 0);
+}
+
+static void
+np_dm_split_end_io(struct bio *clone, int err)
+{
+	struct np_dm_split *split = clone->bi_private;
+	struct np_target *nt = split->nt;
+
+	if (err)
+		split->error = err;
+	bio_put(clone);
+	if (atomic_dec_and_test(&split->remaining)) {
+		bio_endio(split->parent, split->error);
+		mempool_free(split, nt->split_pool);
+	}
+}
+
+/*
+ * Send a bio crossing runs as one clone per run, from the target's own
+ * pools so it keeps going under memory pressure.  Only real run edges
+ * split a bio, however small the runs elsewhere in the file.
+ */
+static int
+np_dm_split(struct np_target *nt, struct bio *bio, sector_t start)
+{
+	sector_t end = start + bio_sectors(bio), pos, len;
+	struct np_dm_split *split;
+	struct np_extent *ext;
+	struct bio *clone;
+	int pieces = 0;
+
+	/* All or nothing, rather than a half done write */
+	for (pos = start; pos < end; pos += len, pieces++) {
+		if ((ext = np_dm_check(nt, bio, pos)) == NULL)
+			return -EIO;
+		len = min(end, ext->start + ext->len) - pos;
+	}
+
+	split = mempool_alloc(nt->split_pool, GFP_NOIO);
+	split->nt = nt;
+	split->parent = bio;
+	split->error = 0;
+	atomic_set(&split->remaining, pieces);
+	atomic64_inc(&nt->splits);
+
+	/* The extents only change while suspended, so these are as checked */
+	for (pos = start; pos < end; pos += len) {
+		ext = np_dm_find(nt, pos);
+		len = min(end, ext->start + ext->len) - pos;
+		clone = bio_clone_bioset(bio, GFP_NOIO, nt->bs);
+		clone->bi_end_io = np_dm_split_end_io;
+		clone->bi_private = split;
+		bio_trim(clone, pos - start, len);
+		if (ext->phys == NP_PHYS_HOLE) {
+			np_dm_end_hole(clone);
+			continue;
+		}
+		clone->bi_bdev = nt->dev->bdev;
+		clone->bi_sector = ext->phys + (pos - ext->start);
+		generic_make_request(clone);
+	}
+	return DM_MAPIO_SUBMITTED;
+}
+
+static int
+np_dm_map(struct dm_target *ti, struct bio *bio)
+{
+	struct np_target *nt = ti->private;
+	struct np_extent *ext;
+	sector_t sector = dm_target_offset(ti, bio->bi_sector);
+
+	bio->bi_bdev = nt->dev->bdev;
+	if (bio_sectors(bio) == 0)
+		return DM_MAPIO_REMAPPED;	/* flush */
+
+	if ((ext = np_dm_check(nt, bio, sector)) == NULL)
+		return -EIO;
+	if (sector + bio_sectors(bio) > ext->start + ext->len)
+		return np_dm_split(nt, bio, sector);
+	if (ext->phys == NP_PHYS_HOLE) {
+		np_dm_end_hole(bio);
+		return DM_MAPIO_SUBMITTED;
+	}
+	bio->bi_sector = ext->phys + (sector - ext->start);
+	return DM_MAPIO_REMAPPED;
+}
+
+/*
+ * For file tables a plain suspend/resume re-reads the NTFS runlist, so a
+ * moved file can be picked up without building a new table.  The new
+ * runlist has to pass the same checks as the first.
+ */
+static int
+np_dm_preresume(struct dm_target *ti)
+{
+	struct np_target *nt = ti->private;
+	struct np_target fresh = { };
+	struct np_member *old = nt->m, *m;
+	int ret;
+
+	if (old == NULL)
+		return 0;
+	/* The file and disk references move over with the copy */
+	m = kmemdup(old, sizeof(*m), GFP_KERNEL);
+	if (m == NULL)
+		return -ENOMEM;
+	m->rmap = NULL;
+	down_read(&m->ni->runlist.lock);
+	m->rl = np_copy_runlist(m->ni);
+	up_read(&m->ni->runlist.lock);
+	if (m->rl == NULL) {
+		kfree(m);
+		return -ENOMEM;
+	}
+	for (m->nr_runs = 0; m->rl[m->nr_runs].length; m->nr_runs++);
+
+	ret = np_bitmap_check(m);
+	if (ret == 0 && np_mft_check_member(m) == -ESTALE)
+		ret = -ESTALE;
+	if (ret == 0)
+		ret = np_rmap_alloc(NULL, m);
+	if (ret == 0)
+		ret = np_dm_extents_from_member(&fresh, m);
+	if (ret == 0 && np_dm_size(&fresh) < ti->len) {
+		DMERR("%s shrank below the target length", nt->path);
+		ret = -EINVAL;
+	}
+	if (ret == 0) {
+		/* Where the file hasn't moved, the new runs overlap the old */
+		np_disk_rmap_del(old->disk, old);
+		ret = np_disk_rmap_add(m->disk, m);
+		if (ret)
+			np_disk_rmap_add(old->disk, old);
+	}
+	if (ret) {
+		kfree(fresh.ext);
+		kfree(m->rmap);
+		kfree(m->rl);
+		kfree(m);
+		return ret;
+	}
+
+	/* Suspended, so nothing is looking at the old extents */
+	kfree(nt->ext);
+	nt->ext = fresh.ext;
+	nt->nr_ext = fresh.nr_ext;
+	nt->m = m;
+	kfree(old->rmap);
+	kfree(old->rl);
+	kfree(old);
+	return 0;
+}
+
+static void
+np_dm_status(struct dm_target *ti, status_type_t type,
+	     unsigned status_flags, char *result, unsigned maxlen)
+{
+	struct np_target *nt = ti->private;
+	unsigned int sz = 0, i;
+
+	switch (type) {
+	case STATUSTYPE_INFO:
+		DMEMIT("%u %llu", nt->nr_ext,
+		       (unsigned long long)atomic64_read(&nt->splits));
+		break;
+	case STATUSTYPE_TABLE:
+		if (nt->m) {
+			DMEMIT("file %s", nt->path);
+			break;
+		}
+		DMEMIT("runlist %s", nt->path);
+		for (i = 0; i < nt->nr_ext; i++)
+			DMEMIT(" %llu:%llu:%llu",
+			       np_sectors_to_bytes(nt->ext[i].start),
+			       np_sectors_to_bytes(nt->ext[i].phys),
+			       np_sectors_to_bytes(nt->ext[i].len));
+		break;
+	}
+}
+
+/*
+ * Report every extent so DM stacks the limits (alignment in particular)
+ * of all of them, not just the first
+ */
+static int
+np_dm_iterate_devices(struct dm_target *ti, iterate_devices_callout_fn fn,
+		      void *data)
+{
+	struct np_target *nt = ti->private;
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < nt->nr_ext && !ret; i++) {
+		if (nt->ext[i].start >= ti->len)
+			break;
+		if (nt->ext[i].phys == NP_PHYS_HOLE)
+			continue;
+		ret = fn(ti, nt->dev, nt->ext[i].phys,
+			 min(nt->ext[i].len, ti->len - nt->ext[i].start),
+			 data);
+	}
+	return ret;
+}
+
+static struct target_type np_dm_target = {
+	.name = "ntfspunch",
+	.version = {1, 0, 0},
+	.module = THIS_MODULE,
+	.ctr = np_dm_ctr,
+	.dtr = np_dm_dtr,
+	.map = np_dm_map,
+	.preresume = np_dm_preresume,
+	.status = np_dm_status,
+	.iterate_devices = np_dm_iterate_devices,
+};
+
+int
+dm_target_init(void)
+{
+	int ret = dm_register_target(&np_dm_target);
+	if (ret < 0)
+		printk(KERN_WARNING "ntfspunch: dm target register failed %d\n",
+		       ret);
+	return ret;
+}
+
+void
+dm_target_exit(void)
+{
+	dm_unregister_target(&np_dm_target);
+}
@@ -21,12 +21,17 @@
  */
 
 #include "ntfspunch.h"
+#include "ntfspunch_ioctl.h"
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/fs.h>
 #include <linux/blkdev.h>
+#include <linux/log2.h>
+#include <linux/highmem.h>
+#include <linux/string.h>
+#include <linux/mutex.h>
 
 int ntfspunch_major = 0;
 module_param(ntfspunch_major, int, 0);
@@ -34,81 +39,368 @@ module_param(ntfspunch_major, int, 0);
 struct mapping_dev **dev_list = NULL;
 spinlock_t dev_list_lock;
 int num_devices = 0;
+/* Serializes add_device(), which sleeps, around dev_list_lock */
+static DEFINE_MUTEX(add_mutex);
 
-static void ntfspunch_make_request(struct request_queue *q, struct bio *bio);
-static runlist_element *copy_runlist(runlist *runlist);
+static void remap_bio(struct mapping_dev *dev, struct bio *bio);
 
 /*
- * Returns the calculated physical sector of the start if it
- * fits within one chunk
- *
- * If the IO stradles a chunk, then it will automatically be
- * split and re-submitted
+ * Ties the pieces of a split bio back to the original
+ */
+struct np_split {
+	struct mapping_dev *dev;
+	struct bio *parent;
+	atomic_t remaining;
+	int error;
+};
+
+/*
+ * Every bio from dev->bs has room in front for where it was on the
+ * device, since bi_sector is a disk sector by the time it fails
+ */
+struct np_clone {
+	sector_t sector;
+	unsigned int size;
+	struct bio bio;
+};
+
+#define np_clone(bio)	container_of(bio, struct np_clone, bio)
+
+/*
+ * A bio sent on whole, with its own completion put aside so a failure
+ * can be reported first
+ */
+struct np_remap {
+	struct mapping_dev *dev;
+	bio_end_io_t *end_io;
+	void *private;
+	sector_t sector;
+	unsigned int size;
+};
+
+/*
+ * The disk only knows the physical sector, say which I/O failed
+ */
+static void
+log_io_error(struct mapping_dev *dev, int err, sector_t sector,
+	     unsigned int size)
+{
+	if (printk_ratelimit())
+		printk(KERN_WARNING "ntfspunch: %s: error %d on %u bytes at offset %llu\n",
+		       dev->gd->disk_name, err, size,
+		       np_sectors_to_bytes(sector));
+}
+
+static void
+split_end_io(struct bio *clone, int err)
+{
+	struct np_split *split = clone->bi_private;
+	struct mapping_dev *dev = split->dev;
+
+	if (err) {
+		log_io_error(dev, err, np_clone(clone)->sector,
+			     np_clone(clone)->size);
+		split->error = err;
+	}
+	bio_put(clone);
+	if (atomic_dec_and_test(&split->remaining)) {
+		bio_endio(split->parent, split->error);
+		mempool_free(split, dev->split_pool);
+	}
+}
+
+static struct np_split *
+split_alloc(struct mapping_dev *dev, struct bio *bio, int pieces)
+{
+	struct np_split *split = mempool_alloc(dev->split_pool, GFP_NOIO);
+
+	split->dev = dev;
+	split->parent = bio;
+	split->error = 0;
+	atomic_set(&split->remaining, pieces);
+	return split;
+}
+
+static struct bio *
+split_clone(struct mapping_dev *dev, struct np_split *split, struct bio *bio)
+{
+	struct bio *clone = bio_clone_bioset(bio, GFP_NOIO, dev->bs);
+
+	clone->bi_end_io = split_end_io;
+	clone->bi_private = split;
+	np_clone(clone)->sector = bio->bi_sector;
+	np_clone(clone)->size = bio->bi_size;
+	return clone;
+}
+
+static void
+remap_end_io(struct bio *bio, int err)
+{
+	struct np_remap *rm = bio->bi_private;
+	struct mapping_dev *dev = rm->dev;
+
+	if (err)
+		log_io_error(dev, err, rm->sector, rm->size);
+	bio->bi_end_io = rm->end_io;
+	bio->bi_private = rm->private;
+	mempool_free(rm, dev->remap_pool);
+	bio_endio(bio, err);
+}
+
+/*
+ * Take over a bio's completion until it's back from the disk
+ */
+static void
+remap_hook(struct mapping_dev *dev, struct bio *bio)
+{
+	struct np_remap *rm = mempool_alloc(dev->remap_pool, GFP_NOIO);
+
+	rm->dev = dev;
+	rm->end_io = bio->bi_end_io;
+	rm->private = bio->bi_private;
+	rm->sector = bio->bi_sector;
+	rm->size = bio->bi_size;
+	bio->bi_end_io = remap_end_io;
+	bio->bi_private = rm;
+}
+
+/*
+ * Where a device sector ends up: the member, the sector on its disk (or
+ * NP_PHYS_HOLE), and how many sectors from there on are physically
+ * contiguous.  Returns NULL if it's past the end of the member.
  *
- * dev lock should NOT be held
+ * Mirrors pick the member themselves and pass it in as m, every other
+ * layout passes NULL and gets it from np_map_sector().
  */
-static unsigned long long
-split_or_get_offset(struct request_queue *q,
-		    struct mapping_dev *dev, struct bio *bio)
+static struct np_member *
+resolve(struct mapping_dev *dev, struct np_member *m, sector_t sector,
+	sector_t *phys, sector_t *len)
 {
 	runlist_element *rl;
-	unsigned long long blocks_per_cluster, ret;
+	sector_t msector, max, run_start, run_end;
+
+	if (m == NULL) {
+		m = np_map_sector(dev, sector, &msector, &max);
+	} else {
+		msector = sector;
+		max = np_bytes_to_sectors(dev->size) - sector;
+	}
+	rl = find_run(m, msector);
+	if (rl == NULL)
+		return NULL;
+	run_start = np_clusters_to_sectors(m, rl->vcn);
+	run_end = np_clusters_to_sectors(m, rl->vcn + rl->length);
+	/*
+	 * This should never be zero,
+	 * since NTFS has metadata up front
+	 */
+	if (rl->lcn < 0)
+		*phys = NP_PHYS_HOLE;
+	else
+		*phys = msector - run_start +
+			np_clusters_to_sectors(m, rl->lcn);
+	*len = min(max, run_end - msector);
+	return m;
+}
+
+/*
+ * Zero the pages of a bio, stopping at bi_size (a trimmed clone still
+ * has its parent's whole vector)
+ */
+void
+np_zero_fill_bio(struct bio *bio)
+{
+	unsigned int left = bio->bi_size, len;
+	unsigned long flags;
+	struct bio_vec *bv;
+	char *data;
+	int i;
+
+	bio_for_each_segment(bv, bio, i) {
+		len = min(bv->bv_len, left);
+		data = bvec_kmap_irq(bv, &flags);
+		memset(data, 0, len);
+		flush_dcache_page(bv->bv_page);
+		bvec_kunmap_irq(data, &flags);
+		left -= len;
+		if (left == 0)
+			break;
+	}
+}
+
+/*
+ * Whether any of a range of device sectors is a hole (or unmapped)
+ */
+int
+ntfspunch_has_hole(struct mapping_dev *dev, sector_t sector, sector_t nr)
+{
+	sector_t end = sector + nr, phys, len;
+
+	for (; sector < end; sector += len)
+		if (resolve(dev, NULL, sector, &phys, &len) == NULL ||
+		    phys == NP_PHYS_HOLE)
+			return 1;
+	return 0;
+}
+
+/*
+ * Writes with data can't go to a hole, there's no allocating clusters on
+ * a read-only NTFS
+ */
+static int
+hole_write(struct bio *bio)
+{
+	return bio_data_dir(bio) == WRITE && !(bio->bi_rw & REQ_DISCARD);
+}
+
+static void
+refuse_hole_write(struct bio *bio, sector_t sector)
+{
+	if (printk_ratelimit())
+		printk(KERN_WARNING "ntfspunch: write to a hole at %lld refused\n",
+		       np_sectors_to_bytes(sector));
+	bio_io_error(bio);
+}
+
+/*
+ * Complete a bio (or a piece of one) that lies entirely in a hole
+ * without going near the disk: reads get zeroes, discards have nothing
+ * to do
+ */
+static void
+end_hole_bio(struct mapping_dev *dev, struct bio *bio)
+{
+	if (bio_data_dir(bio) == READ) {
+		np_zero_fill_bio(bio);
+		atomic64_add(bio->bi_size, &dev->hole_bytes);
+	}
+	bio_endio(bio, 0);
+}
+
+/*
+ * Send a bio that crosses runs (or stripe chunks) as one clone per
+ * contiguous piece
+ *
+ * Everything comes out of the device's reserved pools with GFP_NOIO, so
+ * this keeps going under memory pressure (swap).  If a pool runs dry
+ * while clones are still parked on current->bio_list, the bio_set's
+ * rescuer submits them for us.
+ */
+static void
+split_bio(struct mapping_dev *dev, struct np_member *fixed, struct bio *bio)
+{
+	sector_t start = bio->bi_sector, end = bio_end_sector(bio);
+	sector_t pos, phys, len;
+	struct np_split *split;
+	struct np_member *m;
+	struct bio *clone;
+	int pieces = 0;
+
+	/* The caller has checked the whole range resolves */
+	for (pos = start; pos < end; pos += len, pieces++) {
+		resolve(dev, fixed, pos, &phys, &len);
+		/* All or nothing, rather than a half done write */
+		if (phys == NP_PHYS_HOLE && hole_write(bio)) {
+			refuse_hole_write(bio, pos);
+			return;
+		}
+	}
+
+	split = split_alloc(dev, bio, pieces);
+	atomic64_inc(&dev->splits);
+
+	for (pos = start; pos < end; pos += len) {
+		m = resolve(dev, fixed, pos, &phys, &len);
+		len = min(len, end - pos);
+		clone = split_clone(dev, split, bio);
+		bio_trim(clone, pos - start, len);
+		np_clone(clone)->sector = clone->bi_sector;
+		np_clone(clone)->size = clone->bi_size;
+		if (phys == NP_PHYS_HOLE) {
+			end_hole_bio(dev, clone);
+			continue;
+		}
+		clone->bi_bdev = m->block_dev;
+		clone->bi_sector = phys;
+		generic_make_request(clone);
+	}
+}
+
+/*
+ * Returns the member holding the whole bio and the physical sector it
+ * starts at, if it fits within one chunk
+ *
+ * If the IO stradles a chunk, then it will automatically be
+ * split and submitted.  The lookup itself takes no locks, so only a
+ * split can block.
+ */
+static struct np_member *
+split_or_get_offset(struct mapping_dev *dev, struct np_member *fixed,
+		    struct bio *bio, sector_t *disk_start)
+{
+	struct np_member *m;
 	sector_t start = bio->bi_sector;
 	sector_t end = bio_end_sector(bio);
+	sector_t len;
 
-	spin_lock(&dev->lock);
-	blocks_per_cluster = dev->cluster_size >> 9;
-	for (rl = dev->rl; rl->length; rl++) {
-		if (start >= rl->vcn * blocks_per_cluster &&
-		    end <= rl->vcn * blocks_per_cluster +
-		    rl->length * blocks_per_cluster) {
-			/*
-			 * This should never be zero,
-			 * since NTFS has metadata up front
-			 */
-			ret = (start - rl->vcn * blocks_per_cluster +
-			       rl->lcn * blocks_per_cluster);
-			spin_unlock(&dev->lock);
-			return ret;
-		} else if (start < rl->vcn * blocks_per_cluster &&
-			   end <= rl->vcn * blocks_per_cluster +
-			   rl->length * blocks_per_cluster) {
-			struct bio_pair *bp;
-			printk(KERN_WARNING "ntfspunch: Split I/Os\n");
-			printk(KERN_WARNING "ntfspunch: segments %d\n",
-			       bio_segments(bio));
-			printk(KERN_WARNING "ntfspunch: splitting on %lld\n",
-			       (rl->vcn * blocks_per_cluster) - start);
-			bp = bio_split(bio,
-				       (rl->vcn * blocks_per_cluster) - start);
-			printk(KERN_WARNING "ntfspunch: resubmitting requests\n");
-			/* Release all locks to re-enter */
-			spin_unlock(&dev->lock);
-			ntfspunch_make_request(q, &bp->bio1);
-			ntfspunch_make_request(q, &bp->bio2);
-			bio_pair_release(bp);
-			printk(KERN_WARNING "ntfspunch: all done with split I/O\n");
-			return 0;
-		}
+	m = resolve(dev, fixed, start, disk_start, &len);
+	if (m == NULL || end > np_bytes_to_sectors(dev->size)) {
+		if (printk_ratelimit())
+			printk(KERN_WARNING "ntfspunch: Couldn't map I/O %lld-%lld\n",
+			       np_sectors_to_bytes(start),
+			       np_sectors_to_bytes(end));
+		bio_io_error(bio);
+		return NULL;
+	}
+	if (end - start <= len) {
+		if (*disk_start != NP_PHYS_HOLE)
+			return m;
+		if (hole_write(bio))
+			refuse_hole_write(bio, start);
+		else
+			end_hole_bio(dev, bio);
+		return NULL;
 	}
-	spin_unlock(&dev->lock);
 
-	printk(KERN_WARNING "ntfspunch: Couldn't map I/O\n");
-	printk(KERN_WARNING "ntfspunch: bio start sec:%ld  bytes: %ld\n",
-	       bio->bi_sector, bio->bi_sector * 512);
-	printk(KERN_WARNING "ntfspunch: bio end	sec:%ld bytes: %ld\n",
-	       bio->bi_sector + bio_sectors(bio),
-	       (bio->bi_sector + bio_sectors(bio)) * 512);
-	bio_io_error(bio);
-	return 0;
+	split_bio(dev, fixed, bio);
+	return NULL;
+}
+
+/*
+ * Flush every member's disk (and a write-back cache's or an overlay's),
+ * completing the bio once they all have
+ */
+static void
+flush_members(struct mapping_dev *dev, struct bio *bio)
+{
+	struct block_device *cache_bdev = np_cache_flush_bdev(dev);
+	struct np_split *split;
+	struct bio *clone;
+	int i;
+
+	/* A cache and an overlay never go together */
+	if (cache_bdev == NULL)
+		cache_bdev = np_overlay_flush_bdev(dev);
+	if (dev->nr_members == 1 && cache_bdev == NULL) {
+		np_disk_flush(dev->members[0].disk, bio);
+		return;
+	}
+	split = split_alloc(dev, bio, dev->nr_members + !!cache_bdev);
+	for (i = 0; i < dev->nr_members; i++)
+		np_disk_flush(dev->members[i].disk,
+			      split_clone(dev, split, bio));
+	if (cache_bdev) {
+		clone = split_clone(dev, split, bio);
+		clone->bi_bdev = cache_bdev;
+		generic_make_request(clone);
+	}
 }
 
 static void
 ntfspunch_make_request(struct request_queue *q, struct bio *bio)
 {
 	struct mapping_dev *dev = q->queuedata;
-	unsigned long long disk_start;
-	spin_lock(&dev->lock);
+
 	bio_get(bio);
 #if NP_DEBUG_IO
 	printk(KERN_WARNING "ntfspunch: make_request called\n\n");
@@ -122,9 +414,10 @@ ntfspunch_make_request(struct request_queue *q, struct bio *bio)
 	printk(KERN_WARNING "bi_flags: %lx\n", bio->bi_flags);
 	printk(KERN_WARNING "bi_rw: %lx\n", bio->bi_rw);
 	printk(KERN_WARNING "bi_sector: %ld\n", bio->bi_sector);
-	printk(KERN_WARNING "bi_sector (*512): %ld\n", bio->bi_sector * 512);
+	printk(KERN_WARNING "bi_sector (bytes): %lld\n",
+	       np_sectors_to_bytes(bio->bi_sector));
 	printk(KERN_WARNING "length: %u\n", bio_sectors(bio));
-	printk(KERN_WARNING "length (*512): %u\n", bio_sectors(bio) * 512);
+	printk(KERN_WARNING "length (bytes): %u\n", bio->bi_size);
 	printk(KERN_WARNING "bi_seg_front_size: %x\n", bio->bi_seg_front_size);
 	printk(KERN_WARNING "bi_seg_back_size: %x\n", bio->bi_seg_back_size);
 	printk(KERN_WARNING "bi_end_io: %p\n", bio->bi_end_io);
@@ -134,23 +427,254 @@ ntfspunch_make_request(struct request_queue *q, struct bio *bio)
 	printk(KERN_WARNING "bi_io_vec: %p\n", bio->bi_io_vec);
 	printk(KERN_WARNING "bi_pool: %p\n", bio->bi_pool);
 #endif
-	spin_unlock(&dev->lock);
-	disk_start = split_or_get_offset(q, dev, bio);
-	if (disk_start > 0) {
-		bio->bi_bdev = dev->block_dev;
+	/* Empty flushes are whole-disk, merge them with everyone else's */
+	if ((bio->bi_rw & REQ_FLUSH) && bio->bi_size == 0) {
+		flush_members(dev, bio);
+		bio_put(bio);
+		return;
+	}
+	/* The queue limits should make this impossible, but be sure */
+	if ((bio->bi_sector | bio_sectors(bio)) &
+	    (np_bytes_to_sectors(dev->sector_size) - 1)) {
+		if (printk_ratelimit())
+			printk(KERN_WARNING "ntfspunch: I/O not aligned to %u bytes\n",
+			       dev->sector_size);
+		bio_io_error(bio);
+		bio_put(bio);
+		return;
+	}
+	/* Anything over its QoS limits waits its turn in qos.c */
+	if (np_qos_throttle(dev, bio) == 0)
+		remap_bio(dev, bio);
+	bio_put(bio);
+}
+
+/*
+ * Send a bio to the image itself, through the layout and runlists
+ */
+static void
+remap_origin(struct mapping_dev *dev, struct bio *bio)
+{
+	struct np_member *m;
+	sector_t disk_start;
+
+	bio_get(bio);
+	if (dev->layout == NP_LAYOUT_MIRROR) {
+		/* Fans out to the members, which come back through below */
+		np_mirror_submit(dev, bio);
+		bio_put(bio);
+		return;
+	}
+	m = split_or_get_offset(dev, NULL, bio, &disk_start);
+	if (m) {
+		remap_hook(dev, bio);
+		bio->bi_bdev = m->block_dev;
 		bio->bi_sector = disk_start;
 		generic_make_request(bio);
 #if NP_DEBUG_IO
-		printk(KERN_WARNING "new sector %llu\n\n", disk_start);
+		printk(KERN_WARNING "new sector %llu\n\n",
+		       (unsigned long long)disk_start);
 #endif
 	}
 	bio_put(bio);
 }
 
+/*
+ * Whether a write's payload is all zeroes
+ *
+ * memchr_inv() goes a word at a time, and gives up at the first non-zero
+ * word, which for real data is almost always in the first few bytes.
+ */
+static int
+bio_is_zero(struct bio *bio)
+{
+	struct bio_vec *bv;
+	void *data;
+	int i, zero = 1;
+
+	bio_for_each_segment(bv, bio, i) {
+		data = kmap_atomic(bv->bv_page);
+		zero = memchr_inv(data + bv->bv_offset, 0, bv->bv_len) == NULL;
+		kunmap_atomic(data);
+		if (!zero)
+			break;
+	}
+	return zero;
+}
+
+/*
+ * How a member's disk can zero len sectors at phys without being sent
+ * the zeroes: REQ_WRITE_SAME of the zero page, or a discard if discarded
+ * blocks read back as zeroes.  0 if it can't.
+ */
+static unsigned long
+zero_op(struct np_member *m, sector_t phys, sector_t len)
+{
+	struct request_queue *q = bdev_get_queue(m->block_dev);
+	unsigned int gran;
+
+	if (len <= q->limits.max_write_same_sectors)
+		return REQ_WRITE | REQ_WRITE_SAME;
+	if (!blk_queue_discard(q) || !q->limits.discard_zeroes_data ||
+	    len > q->limits.max_discard_sectors)
+		return 0;
+	/* Only whole discard granules are sure to be zeroed */
+	gran = np_bytes_to_sectors(max(q->limits.discard_granularity,
+				       bdev_logical_block_size(m->block_dev)));
+	if ((phys | len) & (gran - 1))
+		return 0;
+	return REQ_WRITE | REQ_DISCARD;
+}
+
+/*
+ * Zero detection: send an all-zero write down as WRITE SAME or discard,
+ * one per contiguous piece, so the data never crosses the bus.  Zeroes
+ * written to a hole have nothing to do at all.  Returns 0 to leave the
+ * bio to the normal path.
+ */
+static int
+zero_write(struct mapping_dev *dev, struct bio *bio)
+{
+	sector_t start = bio->bi_sector, end = bio_end_sector(bio);
+	sector_t pos, phys, len;
+	struct np_split *split;
+	struct np_member *m;
+	struct bio *zbio;
+	unsigned long rw;
+	int pieces = 0;
+
+	if (bio_data_dir(bio) != WRITE || !bio_has_data(bio) ||
+	    bio->bi_rw & (REQ_FLUSH | REQ_FUA | REQ_DISCARD | REQ_WRITE_SAME) ||
+	    bio->bi_size < PAGE_SIZE ||
+	    dev->layout == NP_LAYOUT_MIRROR || dev->overlay || dev->cache ||
+	    end > np_bytes_to_sectors(dev->size))
+		return 0;
+	/* Every piece has to be able to, before any goes */
+	for (pos = start; pos < end; pos += len, pieces++) {
+		m = resolve(dev, NULL, pos, &phys, &len);
+		if (m == NULL)
+			return 0;
+		len = min(len, end - pos);
+		if (phys != NP_PHYS_HOLE && !zero_op(m, phys, len))
+			return 0;
+	}
+	if (!bio_is_zero(bio))
+		return 0;
+
+	atomic64_inc(&dev->zero_writes);
+	atomic64_add(bio->bi_size, &dev->zero_bytes);
+	split = split_alloc(dev, bio, pieces);
+	for (pos = start; pos < end; pos += len) {
+		m = resolve(dev, NULL, pos, &phys, &len);
+		len = min(len, end - pos);
+		zbio = bio_alloc_bioset(GFP_NOIO, 1, dev->bs);
+		zbio->bi_end_io = split_end_io;
+		zbio->bi_private = split;
+		np_clone(zbio)->sector = pos;
+		np_clone(zbio)->size = np_sectors_to_bytes(len);
+		if (phys == NP_PHYS_HOLE) {
+			bio_endio(zbio, 0);
+			continue;
+		}
+		zbio->bi_bdev = m->block_dev;
+		zbio->bi_sector = phys;
+		rw = zero_op(m, phys, len);
+		if (rw & REQ_WRITE_SAME) {
+			zbio->bi_vcnt = 1;
+			zbio->bi_io_vec[0].bv_page = ZERO_PAGE(0);
+			zbio->bi_io_vec[0].bv_offset = 0;
+			zbio->bi_io_vec[0].bv_len =
+				bdev_logical_block_size(m->block_dev);
+		}
+		zbio->bi_size = np_sectors_to_bytes(len);
+		zbio->bi_rw = rw;
+		generic_make_request(zbio);
+	}
+	return 1;
+}
+
+int
+ntfspunch_zero_ctl(struct mapping_dev *dev, char *key, char *value)
+{
+	if (strcmp(value, "on") == 0)
+		dev->zero_detect = 1;
+	else if (strcmp(value, "off") == 0)
+		dev->zero_detect = 0;
+	else
+		return -EINVAL;
+	return 0;
+}
+
+/*
+ * Everything past admission: prefetch, overlay or cache, then the image
+ */
+static void
+remap_bio(struct mapping_dev *dev, struct bio *bio)
+{
+	bio_get(bio);
+	if (bio_data_dir(bio) == WRITE) {
+		if (dev->cbt)
+			np_cbt_mark(dev, bio);
+		prefetch_write(dev, bio);
+	} else if (prefetch_read(dev, bio)) {
+		bio_put(bio);
+		return;
+	}
+	if (dev->zero_detect && zero_write(dev, bio)) {
+		bio_put(bio);
+		return;
+	}
+	if (dev->overlay)
+		np_overlay_map(dev, bio);
+	else if (dev->cache == NULL || !np_cache_map(dev, bio))
+		remap_origin(dev, bio);
+	bio_put(bio);
+}
+
+/*
+ * Submit a bio that has already been through admission (throttled bios
+ * being released by qos.c)
+ */
+void
+ntfspunch_dispatch(struct mapping_dev *dev, struct bio *bio)
+{
+	remap_bio(dev, bio);
+}
+
+/*
+ * Submit a bio straight to the image, skipping the cache (cache.c's own
+ * I/O, and bios it has finished with)
+ */
+void
+ntfspunch_remap_origin(struct mapping_dev *dev, struct bio *bio)
+{
+	remap_origin(dev, bio);
+}
+
+/*
+ * Remap and submit a bio to one particular member (mirror.c's clones)
+ */
+void
+ntfspunch_remap_member(struct mapping_dev *dev, struct np_member *m,
+		       struct bio *bio)
+{
+	sector_t disk_start;
+
+	if (split_or_get_offset(dev, m, bio, &disk_start)) {
+		bio->bi_bdev = m->block_dev;
+		bio->bi_sector = disk_start;
+		generic_make_request(bio);
+	}
+}
+
 static int
 ntfspunch_open(struct block_device *bdev, fmode_t mode)
 {
 	struct mapping_dev *dev = bdev->bd_disk->private_data;
+
+	/* Catch the file having moved before anything is written */
+	if (dev->mft_check_open && np_mft_check(dev) == -ESTALE)
+		return -ESTALE;
 	spin_lock(&dev->lock);
 	dev->users++;
 	spin_unlock(&dev->lock);
@@ -182,8 +706,12 @@ int
 ntfspunch_ioctl(struct block_device *bdev, fmode_t mode,
 		unsigned int cmd, unsigned long arg)
 {
-	printk(KERN_WARNING "ntfspunch: TODO ioctl called with cmd 0x%x\n",
-	       cmd);
+	struct mapping_dev *dev = bdev->bd_disk->private_data;
+
+	switch (cmd) {
+	case NTFSPUNCH_CBT_GET:
+		return np_cbt_get(dev, (void __user *)arg);
+	}
 	return -ENOTTY;
 }
 
@@ -197,27 +725,43 @@ static struct block_device_operations ntfspunch_ops = {
 };
 
 /*
- * Free an already locked device
+ * Free a device that isn't (or is no longer) on dev_list
+ *
+ * Detaching a cache or saving CBT state does I/O, so no spinlocks may be
+ * held here.
  */
 static void
 ntfspunch_free_dev(struct mapping_dev *dev)
 {
+	np_members_rmap_del(dev);
 	if (dev->users > 0) {
 		printk(KERN_DEBUG "ntfspunch: %s still in use %d\n",
 		       dev->filename, dev->users);
 		/* TODO - block freeing if it's inuse */
 	}
-	if (dev->img_fp) {
-		filp_close(dev->img_fp, 0);
-	}
 	if (dev->gd) {
-		del_gendisk(dev->gd);
+		/* A failed add never got as far as add_disk() */
+		if (dev->gd->flags & GENHD_FL_UP)
+			del_gendisk(dev->gd);
 		put_disk(dev->gd);
 	}
+	np_cache_detach(dev);
+	np_overlay_detach(dev);
+	np_qos_free(dev);
+	np_mirror_free(dev);
 	if (dev->queue) {
 		blk_cleanup_queue(dev->queue);
 	}
-	kfree(dev->rl);
+	/* Nothing can be marked any more, so the saved map is complete */
+	np_cbt_stop(dev);
+	if (dev->bs)
+		bioset_free(dev->bs);
+	if (dev->split_pool)
+		mempool_destroy(dev->split_pool);
+	if (dev->remap_pool)
+		mempool_destroy(dev->remap_pool);
+	prefetch_free(dev);
+	np_members_free(dev);
 	kfree(dev);
 }
 
@@ -252,8 +796,17 @@ validate(struct file *img_fp)
 		ret = -EFAULT;
 	}
 
-	if (ni->allocated_size != ni->initialized_size) {
-		printk(KERN_WARNING "ntfspunch: File must be fully allocated! (not sparse)\n");
+	if (ni->vol && (ni->vol->cluster_size % ni->vol->sector_size ||
+	    ni->vol->cluster_size %
+	    bdev_logical_block_size(img_fp->f_inode->i_sb->s_bdev))) {
+		printk(KERN_WARNING "ntfspunch: cluster size %u not a multiple of the sector size\n",
+		       ni->vol->cluster_size);
+		ret = -EFAULT;
+	}
+
+	/* Sparse is fine, but compressed "holes" are really data */
+	if (NInoCompressed(ni) || NInoEncrypted(ni)) {
+		printk(KERN_WARNING "ntfspunch: File must not be compressed or encrypted\n");
 		ret = -EFAULT;
 	}
 
@@ -263,6 +816,11 @@ validate(struct file *img_fp)
 		ret = -EFAULT;
 	}
 	for (rl = ni->runlist.rl; rl->length; rl++) {
+		if (rl->lcn < LCN_HOLE) {
+			printk(KERN_WARNING "ntfspunch: runlist not fully mapped!\n");
+			ret = -EFAULT;
+			break;
+		}
 		if ((rl->vcn + rl->length) * ni->vol->cluster_size < size) {
 			printk(KERN_WARNING "ntfspunch: runlist out of order!\n");
 			ret = -EFAULT;
@@ -299,94 +857,225 @@ done:
 }
 
 /*
- * Allocate and copy over a runlist
+ * Largest io_opt hint we'll derive from the extent sizes
+ */
+#define NP_IO_OPT_MAX	(4 << 20)
+
+/*
+ * Typical extent size, as the power of two at or below the median
  *
- * This fundamentally assumes the runlist isn't
- * changing out from under us
+ * Bucketing by log2 finds that without having to sort the runlists.
  */
-static runlist_element *
-copy_runlist(runlist *runlist)
+static u32
+typical_extent_size(struct mapping_dev *dev)
 {
+	unsigned int buckets[32] = { 0 };
+	unsigned int seen = 0, total = 0;
+	struct np_member *m;
 	runlist_element *rl;
-	int i = 1;
-	for (rl = runlist->rl; rl->length; rl++, i++);
-	rl = kcalloc(i, sizeof(*rl), GFP_KERNEL);
-	memcpy(rl, runlist->rl, (i-1) * sizeof(*rl));
-	return rl;
+	int i;
+
+	for (m = dev->members; m < dev->members + dev->nr_members; m++) {
+		for (rl = m->rl; rl->length; rl++) {
+			u64 bytes = rl->length * m->cluster_size;
+
+			if (rl->lcn < 0)
+				continue;
+			buckets[ilog2(min_t(u64, bytes, NP_IO_OPT_MAX))]++;
+			total++;
+		}
+	}
+	/* All holes */
+	if (total == 0)
+		return dev->members[0].cluster_size;
+	for (i = 0; i < ARRAY_SIZE(buckets); i++) {
+		seen += buckets[i];
+		if (seen * 2 >= total)
+			return 1U << i;
+	}
+	return dev->members[0].cluster_size;
 }
 
-int
-add_device(char *in_filename)
+/*
+ * Make the queue look like the disks underneath as far as the block
+ * layer, I/O schedulers, readahead and mkfs are concerned
+ */
+static void
+stack_topology(struct mapping_dev *dev)
 {
-	struct mapping_dev *dev = NULL, **tmp = NULL;
-	struct file *img_fp = NULL;
-	int ret, device_num;
-	char *filename = strim(in_filename);
+	struct request_queue *q = dev->queue, *bq;
+	unsigned int ra_pages = 0, flush = 0;
+	int nonrot = 1;
+	struct np_member *m;
+	runlist_element *rl;
+	u32 io_opt;
 
-	/* Before doing anything else, attempt to open the file */
-	img_fp = filp_open(filename, O_RDONLY|O_LARGEFILE, 0600);
-	if (IS_ERR(img_fp)) {
-		printk(KERN_WARNING "ntfspunch: Failed to open file %s\n",
-		       filename);
-		return PTR_ERR(img_fp);
+	for (m = dev->members; m < dev->members + dev->nr_members; m++) {
+		bq = bdev_get_queue(m->block_dev);
+		/*
+		 * Every run sits at its own offset on the disk, so stack
+		 * each one.  The offset handed down is where the device
+		 * would start if the whole thing were laid out like this
+		 * run.  Alignment is sorted out separately by
+		 * analyze_alignment().
+		 */
+		for (rl = m->rl; rl->length; rl++)
+			if (rl->lcn >= 0)
+				bdev_stack_limits(&q->limits, m->block_dev,
+						  np_clusters_to_sectors(m, rl->lcn - rl->vcn));
+		nonrot &= blk_queue_nonrot(bq);
+		flush |= bq->flush_flags & (REQ_FLUSH | REQ_FUA);
+		ra_pages = max(ra_pages, bq->backing_dev_info.ra_pages);
 	}
-	if ((ret = validate(img_fp))) {
-		printk(KERN_WARNING "ntfspunch: file failed validation%s\n",
-		       filename);
-		filp_close(img_fp, 0);
-		return ret;
+
+	if (nonrot) {
+		queue_flag_set_unlocked(QUEUE_FLAG_NONROT, q);
+		queue_flag_clear_unlocked(QUEUE_FLAG_ADD_RANDOM, q);
 	}
 
-	spin_lock(&dev_list_lock);
-	if (dev_list == NULL) {
-		dev_list = kmalloc((num_devices+1) * sizeof(dev),
-				   GFP_KERNEL);
-		if (dev_list == NULL) {
-			printk(KERN_WARNING "ntfspunch: unable to allocate device %s\n",
-			       filename);
-			filp_close(img_fp, 0);
-			spin_unlock(&dev_list_lock);
-			return -ENOMEM;
-		}
+	/* Only pass flushes on if a disk has a volatile cache to flush */
+	blk_queue_flush(q, flush);
+
+	if (dev->layout == NP_LAYOUT_STRIPE) {
+		/* Like md raid0, a chunk per member per go */
+		blk_queue_io_min(q, np_sectors_to_bytes(dev->chunk_sectors));
+		io_opt = np_sectors_to_bytes(dev->chunk_sectors) *
+			dev->nr_members;
 	} else {
-		tmp = krealloc(dev_list, (num_devices+1) *
-			       sizeof(dev), GFP_KERNEL);
-		if (tmp == NULL) {
-			printk(KERN_WARNING "ntfspunch: unable to allocate device %s\n",
-			       filename);
-			spin_unlock(&dev_list_lock);
-			filp_close(img_fp, 0);
-			return -ENOMEM;
+		io_opt = typical_extent_size(dev);
+	}
+	if (q->limits.io_opt < io_opt)
+		blk_queue_io_opt(q, io_opt);
+
+	ra_pages = max_t(unsigned int, ra_pages,
+			 q->limits.io_opt >> PAGE_CACHE_SHIFT);
+	q->backing_dev_info.ra_pages = ra_pages;
+}
+
+/*
+ * Work out how each run lines up with the disk's physical blocks
+ *
+ * A run is aligned if a physically aligned write to the punched device
+ * stays physically aligned on the disk.  If every run is off by the same
+ * amount we can say so with alignment_offset, otherwise the only honest
+ * answer is "misaligned".  Stripe chunks are whole pages, so they don't
+ * move anything relative to the physical blocks.
+ */
+static void
+analyze_alignment(struct mapping_dev *dev)
+{
+	struct queue_limits *lim = &dev->queue->limits;
+	u32 pbs = lim->physical_block_size;
+	int first = 1, uniform = 1;
+	struct np_member *m;
+	runlist_element *rl;
+	u32 off, common = 0, disk_align;
+
+	for (m = dev->members; m < dev->members + dev->nr_members; m++)
+		pbs = max_t(u32, pbs, bdev_physical_block_size(m->block_dev));
+	dev->phys_block_size = pbs;
+	dev->misaligned_runs = 0;
+	dev->misaligned_bytes = 0;
+	/* Stacking each run in stack_topology() may have set these */
+	lim->misaligned = 0;
+	lim->alignment_offset = 0;
+	for (m = dev->members; m < dev->members + dev->nr_members; m++) {
+		disk_align = bdev_alignment_offset(m->block_dev);
+		m->misaligned_runs = 0;
+		for (rl = m->rl; rl->length; rl++) {
+			if (rl->lcn < 0)
+				continue;
+			/* Unsigned wrap is fine, pbs is a power of two */
+			off = ((u64)(rl->lcn - rl->vcn) * m->cluster_size -
+			       disk_align) & (pbs - 1);
+			if (off) {
+				m->misaligned_runs++;
+				dev->misaligned_bytes +=
+					rl->length * m->cluster_size;
+			}
+			if (first)
+				common = off;
+			else if (off != common)
+				uniform = 0;
+			first = 0;
 		}
-		printk(KERN_WARNING "ntfspunch: realloc of dev_list - old:%p new %p\n",
-		       dev_list, tmp);
-		dev_list = tmp;
+		dev->misaligned_runs += m->misaligned_runs;
+		if (m->misaligned_runs)
+			printk(KERN_WARNING "ntfspunch: %s: %d of %d runs not aligned to %u byte physical blocks\n",
+			       m->filename, m->misaligned_runs, m->nr_runs, pbs);
+	}
 
+	if (uniform) {
+		blk_queue_alignment_offset(dev->queue, (pbs - common) & (pbs - 1));
+	} else {
+		lim->misaligned = 1;
 	}
-	device_num = num_devices;
-	dev = dev_list[device_num] = kmalloc(sizeof(*dev), GFP_KERNEL);
+}
+
+int
+add_device(char *in_filename)
+{
+	struct mapping_dev *dev = NULL, **list, **old;
+	int ret, device_num, i;
+	char *filename = strim(in_filename);
+	u32 pbs;
+
+	/* Before doing anything else, attempt to open the file(s) */
+	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
 	if (dev == NULL) {
-		printk(KERN_WARNING "ntfspunch: unable to allocate queue\n");
-		spin_unlock(&dev_list_lock);
+		printk(KERN_WARNING "ntfspunch: unable to allocate device %s\n",
+		       filename);
 		return -ENOMEM;
 	}
+	if ((ret = np_members_setup(dev, filename))) {
+		kfree(dev);
+		return ret;
+	}
+	if ((ret = np_mirror_init(dev))) {
+		np_members_free(dev);
+		kfree(dev);
+		return ret;
+	}
+	/* No cluster may be reachable through two devices, or be metadata */
+	if ((ret = np_members_rmap_add(dev))) {
+		np_mirror_free(dev);
+		np_members_free(dev);
+		kfree(dev);
+		return ret;
+	}
 
+	/*
+	 * Everything that can sleep happens before the device is published,
+	 * nothing else can see it until it's on dev_list
+	 */
 	spin_lock_init(&dev->lock);
-	spin_lock(&dev->lock);
-	dev->img_fp = img_fp;
 	dev->users = 0;
 	dev->gd = NULL;
 	dev->queue = NULL;
-	dev->rl = NULL;
-	strncpy(dev->filename, filename, PATH_MAX);
-	dev->ni = NTFS_I(img_fp->f_inode);
-	dev->rl = copy_runlist(&dev->ni->runlist);
-	if (dev->rl == NULL) {
-		printk(KERN_WARNING "ntfspunch: unable to copy runlist\n");
+	dev->pf.pages = NULL;
+	dev->bs = NULL;
+	dev->split_pool = NULL;
+	dev->remap_pool = NULL;
+	dev->cache = NULL;
+	dev->overlay = NULL;
+	atomic64_set(&dev->splits, 0);
+	dev->mft_check_open = 1;
+	np_qos_init(dev);
+	/* Reserved so splits always make progress, even for swap */
+	dev->bs = bioset_create(BIO_POOL_SIZE, offsetof(struct np_clone, bio));
+	dev->split_pool = mempool_create_kmalloc_pool(BIO_POOL_SIZE,
+						      sizeof(struct np_split));
+	dev->remap_pool = mempool_create_kmalloc_pool(BIO_POOL_SIZE,
+						      sizeof(struct np_remap));
+	if (dev->bs == NULL || dev->split_pool == NULL ||
+	    dev->remap_pool == NULL) {
+		printk(KERN_WARNING "ntfspunch: unable to allocate split pools\n");
+		goto devfree;
+	}
+	if (prefetch_init(dev)) {
+		printk(KERN_WARNING "ntfspunch: unable to allocate prefetch window\n");
 		goto devfree;
 	}
-	dev->cluster_size = dev->ni->vol->cluster_size;
-	dev->size = dev->ni->allocated_size;
 
 	/* Queue setup */
 	dev->queue = blk_alloc_queue(GFP_KERNEL);
@@ -395,7 +1084,14 @@ add_device(char *in_filename)
 		goto devfree;
 	}
 	blk_queue_make_request(dev->queue, ntfspunch_make_request);
-	blk_limits_max_hw_sectors(&dev->queue->limits, dev->cluster_size >> 9);
+	/* Splitting is cheap, so take whatever the disks can do */
+	blk_set_stacking_limits(&dev->queue->limits);
+	blk_queue_logical_block_size(dev->queue, dev->sector_size);
+	pbs = dev->sector_size;
+	for (i = 0; i < dev->nr_members; i++)
+		pbs = max_t(u32, pbs,
+			    bdev_physical_block_size(dev->members[i].block_dev));
+	blk_queue_physical_block_size(dev->queue, pbs);
 	dev->queue->queuedata = dev;
 
 	/* Gendisk setup */
@@ -406,22 +1102,38 @@ add_device(char *in_filename)
 	}
 
 	dev->gd->major = ntfspunch_major;
-	dev->gd->first_minor = device_num;
 	dev->gd->fops = &ntfspunch_ops;
 	dev->gd->queue = dev->queue;
 	dev->gd->private_data = dev;
-	snprintf(dev->gd->disk_name, 32, "ntfspunch%c", device_num + 'a');
-	set_capacity(dev->gd, dev->size / 512);
-	dev->block_dev = img_fp->f_inode->i_sb->s_bdev;
+	set_capacity(dev->gd, np_bytes_to_sectors(dev->size));
 
-	disk_stack_limits(dev->gd, dev->block_dev,
-			  dev->rl[0].lcn * (dev->cluster_size >> 9));
+	stack_topology(dev);
+	analyze_alignment(dev);
 
-	blk_queue_flush(dev->queue, REQ_FLUSH | REQ_FUA);
+	/* Only adds grow dev_list, so num_devices holds still under this */
+	mutex_lock(&add_mutex);
+	device_num = num_devices;
+	list = kmalloc((device_num + 1) * sizeof(dev), GFP_KERNEL);
+	if (list == NULL) {
+		mutex_unlock(&add_mutex);
+		printk(KERN_WARNING "ntfspunch: unable to allocate device %s\n",
+		       filename);
+		goto devfree;
+	}
+	dev->gd->first_minor = device_num;
+	snprintf(dev->gd->disk_name, 32, "ntfspunch%c", device_num + 'a');
 
+	spin_lock(&dev_list_lock);
+	old = dev_list;
+	if (old)
+		memcpy(list, old, device_num * sizeof(dev));
+	list[device_num] = dev;
+	dev_list = list;
 	num_devices++;
 	spin_unlock(&dev_list_lock);
-	spin_unlock(&dev->lock);
+	mutex_unlock(&add_mutex);
+	/* Lookups only use the list under the lock, so it's done with */
+	kfree(old);
 
 	add_disk(dev->gd);
 	proc_add_node(device_num);
@@ -435,7 +1147,6 @@ add_device(char *in_filename)
 
 devfree:
 	ntfspunch_free_dev(dev);
-	spin_unlock(&dev_list_lock);
 	return -ENOMEM;
 
 }
@@ -452,12 +1163,29 @@ ntfspunch_init(void)
 		return -EBUSY;
 	}
 
+	ret = np_disk_init();
+	if (ret != 0) {
+		unregister_blkdev(ntfspunch_major, "ntfspunch");
+		return ret;
+	}
+
 	ret = proc_init();
 	if (ret != 0) {
 		printk(KERN_WARNING "ntfspunch: unable to setup proc: %d\n",
 		       ret);
+		np_disk_exit();
+		return ret;
+	}
+
+#ifdef NTFSPUNCH_DM
+	ret = dm_target_init();
+	if (ret != 0) {
+		proc_exit();
+		np_disk_exit();
+		unregister_blkdev(ntfspunch_major, "ntfspunch");
 		return ret;
 	}
+#endif
 
 	printk(KERN_DEBUG "ntfspunch: initialized (lock %p)\n", &dev_list_lock);
 	return 0;
@@ -466,22 +1194,28 @@ ntfspunch_init(void)
 static void
 ntfspunch_exit(void)
 {
-	struct mapping_dev *dev;
-	int i;
+	struct mapping_dev **list;
+	int i, nr;
 	printk(KERN_DEBUG "ntfspunch: Exiting...\n");
 
-	spin_lock(&dev_list_lock);
-	for (i = 0; i < num_devices; i++) {
+	for (i = 0; i < num_devices; i++)
 		proc_remove_node(i);
-		dev = dev_list[i];
-		spin_lock(&dev->lock);
-		ntfspunch_free_dev(dev);
-	}
-	if (dev_list != NULL) {
-		kfree(dev_list);
-	}
+	/* Take the devices off the list, then tear them down unlocked */
+	spin_lock(&dev_list_lock);
+	list = dev_list;
+	nr = num_devices;
+	dev_list = NULL;
+	num_devices = 0;
+	spin_unlock(&dev_list_lock);
+	for (i = 0; i < nr; i++)
+		ntfspunch_free_dev(list[i]);
+	kfree(list);
 	unregister_blkdev(ntfspunch_major, "ntfspunch");
 	proc_exit();
+#ifdef NTFSPUNCH_DM
+	dm_target_exit();
+#endif
+	np_disk_exit();
 	printk(KERN_DEBUG "ntfspunch: exited.\n");
 }
 
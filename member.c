@@ -0,0 +1,345 @@
+/*
+ * member.c - Backing files of an NTFS Punch device and how they are laid out
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * A device is made of one or more members, each a pre-allocated file on
+ * a (read-only) NTFS volume with its own runlist and underlying disk:
+ *
+ *   <path>                          one file, mapped straight through
+ *   stripe <chunk> <path> <path>... RAID0 across the files, chunk in
+ *                                   bytes (K/M/G suffixes allowed)
+ *   mirror <path> <path>...         RAID1, identical copies (mirror.c)
+ *
+ * Device sectors are first mapped to a member and a sector within it,
+ * then through that member's runlist to its disk.
+ */
+
+#include "ntfspunch.h"
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/blkdev.h>
+#include <linux/math64.h>
+
+/*
+ * Allocate and copy over a runlist, with everything past the initialized
+ * size turned into a hole
+ *
+ * NTFS reads that part as zeroes whatever is on the disk.  The cut is
+ * rounded up to a cluster, so the rest of the last initialized cluster
+ * comes from the disk as is.
+ *
+ * This fundamentally assumes the runlist isn't
+ * changing out from under us
+ */
+runlist_element *
+np_copy_runlist(ntfs_inode *ni)
+{
+	s64 init = (ni->initialized_size + ni->vol->cluster_size - 1) >>
+		ni->vol->cluster_size_bits;
+	runlist_element *rl, *src;
+	int i = 0;
+
+	for (src = ni->runlist.rl; src->length; src++, i++);
+	/* Room for the terminator and splitting the run init falls in */
+	rl = kcalloc(i + 2, sizeof(*rl), GFP_KERNEL);
+	if (rl == NULL)
+		return NULL;
+	for (i = 0, src = ni->runlist.rl; src->length; src++, i++) {
+		rl[i] = *src;
+		if (src->lcn < 0 || src->vcn + src->length <= init)
+			continue;
+		if (src->vcn < init) {
+			rl[i].length = init - src->vcn;
+			i++;
+			rl[i].vcn = init;
+			rl[i].length = src->vcn + src->length - init;
+		}
+		rl[i].lcn = LCN_HOLE;
+	}
+	rl[i] = *src;
+	return rl;
+}
+
+/*
+ * Binary search a member's runlist for the element holding sector
+ *
+ * The runlist is private to the device and never changes once
+ * added, so no lock is needed.  Returns NULL if unmapped.  Holes are
+ * returned like any other run, with lcn LCN_HOLE.
+ */
+runlist_element *
+find_run(struct np_member *m, sector_t sector)
+{
+	int lo = 0, hi = m->nr_runs, mid;
+	runlist_element *rl;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		rl = &m->rl[mid];
+		if (sector < np_clusters_to_sectors(m, rl->vcn))
+			hi = mid;
+		else if (sector >= np_clusters_to_sectors(m,
+							  rl->vcn + rl->length))
+			lo = mid + 1;
+		else
+			return rl;
+	}
+	return NULL;
+}
+
+/*
+ * Map a device sector to its member and the sector within that member
+ *
+ * *max is how many sectors from there stay on the same member.
+ */
+struct np_member *
+np_map_sector(struct mapping_dev *dev, sector_t sector, sector_t *msector,
+	      sector_t *max)
+{
+	sector_t chunk_no = sector;
+	u32 off, idx;
+
+	if (dev->layout != NP_LAYOUT_STRIPE) {
+		*msector = sector;
+		*max = np_bytes_to_sectors(dev->size) - sector;
+		return &dev->members[0];
+	}
+	off = sector_div(chunk_no, dev->chunk_sectors);
+	idx = sector_div(chunk_no, dev->nr_members);
+	*msector = chunk_no * dev->chunk_sectors + off;
+	*max = dev->chunk_sectors - off;
+	return &dev->members[idx];
+}
+
+/*
+ * The inverse of np_map_sector(), the device sector for a member sector
+ */
+sector_t
+np_member_to_dev(struct mapping_dev *dev, struct np_member *m,
+		 sector_t msector)
+{
+	sector_t chunk_no = msector;
+	u32 off;
+
+	if (dev->layout != NP_LAYOUT_STRIPE)
+		return msector;
+	off = sector_div(chunk_no, dev->chunk_sectors);
+	return (chunk_no * dev->nr_members + (m - dev->members)) *
+		dev->chunk_sectors + off;
+}
+
+/*
+ * Open a member and run the attach checks on it, short of claiming its
+ * runs in the disk's reverse map
+ *
+ * dev is NULL for the device-mapper target, which has no mapping_dev.
+ */
+int
+np_member_open(struct mapping_dev *dev, struct np_member *m,
+	       const char *filename)
+{
+	int ret;
+
+	strncpy(m->filename, filename, PATH_MAX);
+	m->img_fp = filp_open(filename, O_RDONLY|O_LARGEFILE, 0600);
+	if (IS_ERR(m->img_fp)) {
+		printk(KERN_WARNING "ntfspunch: Failed to open file %s\n",
+		       filename);
+		ret = PTR_ERR(m->img_fp);
+		m->img_fp = NULL;
+		return ret;
+	}
+	if ((ret = validate(m->img_fp))) {
+		printk(KERN_WARNING "ntfspunch: file failed validation%s\n",
+		       filename);
+		return ret;
+	}
+
+	m->ni = NTFS_I(m->img_fp->f_inode);
+	m->rl = np_copy_runlist(m->ni);
+	if (m->rl == NULL) {
+		printk(KERN_WARNING "ntfspunch: unable to copy runlist\n");
+		return -ENOMEM;
+	}
+	for (m->nr_runs = 0; m->rl[m->nr_runs].length; m->nr_runs++);
+	m->cluster_size = m->ni->vol->cluster_size;
+	m->cluster_shift = m->ni->vol->cluster_size_bits - NP_SECTOR_SHIFT;
+	if ((ret = np_bitmap_check(m)))
+		return ret;
+	m->size = m->ni->allocated_size;
+	m->block_dev = m->img_fp->f_inode->i_sb->s_bdev;
+	/* validate() made sure the cluster size is a multiple of both */
+	m->sector_size = max_t(u32, m->ni->vol->sector_size,
+			       bdev_logical_block_size(m->block_dev));
+	m->disk = np_disk_get(m->block_dev, m->ni->vol);
+	if (m->disk == NULL) {
+		printk(KERN_WARNING "ntfspunch: unable to allocate disk state\n");
+		return -ENOMEM;
+	}
+	return np_rmap_alloc(dev, m);
+}
+
+void
+np_member_close(struct np_member *m)
+{
+	if (m->img_fp)
+		filp_close(m->img_fp, 0);
+	np_disk_put(m->disk);
+	kfree(m->rmap);
+	kfree(m->rl);
+}
+
+/*
+ * Claim (and release) the device's runs in the disk reverse maps, which
+ * refuse any overlap, including between the members themselves
+ */
+int
+np_members_rmap_add(struct mapping_dev *dev)
+{
+	int i, ret;
+
+	for (i = 0; i < dev->nr_members; i++) {
+		ret = np_disk_rmap_add(dev->members[i].disk, &dev->members[i]);
+		if (ret) {
+			np_members_rmap_del(dev);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+void
+np_members_rmap_del(struct mapping_dev *dev)
+{
+	int i;
+
+	for (i = 0; i < dev->nr_members; i++)
+		if (dev->members[i].rmap)
+			np_disk_rmap_del(dev->members[i].disk,
+					 &dev->members[i]);
+}
+
+void
+np_members_free(struct mapping_dev *dev)
+{
+	int i;
+
+	np_members_rmap_del(dev);
+	for (i = 0; i < dev->nr_members; i++)
+		np_member_close(&dev->members[i]);
+	kfree(dev->members);
+	dev->members = NULL;
+	dev->nr_members = 0;
+}
+
+/*
+ * Open every member named in spec and work out the device's size and
+ * logical block size
+ */
+int
+np_members_setup(struct mapping_dev *dev, char *spec)
+{
+	char *names[NP_MAX_MEMBERS], *p, *word;
+	unsigned long long chunk = 0;
+	s64 min_size = 0;
+	int i, n = 0, ret;
+
+	strncpy(dev->filename, spec, PATH_MAX);
+	dev->layout = NP_LAYOUT_LINEAR;
+	if (strncmp(spec, "stripe ", 7) == 0)
+		dev->layout = NP_LAYOUT_STRIPE;
+	else if (strncmp(spec, "mirror ", 7) == 0)
+		dev->layout = NP_LAYOUT_MIRROR;
+
+	if (dev->layout == NP_LAYOUT_LINEAR) {
+		names[n++] = spec;
+	} else {
+		p = spec + 7;
+		while ((word = strsep(&p, " \t")) != NULL) {
+			if (*word == '\0')
+				continue;
+			if (dev->layout == NP_LAYOUT_STRIPE && chunk == 0) {
+				chunk = memparse(word, NULL);
+				continue;
+			}
+			if (n == NP_MAX_MEMBERS)
+				return -E2BIG;
+			names[n++] = word;
+		}
+	}
+	if (dev->layout == NP_LAYOUT_STRIPE &&
+	    (n < 2 || chunk < PAGE_SIZE || chunk % PAGE_SIZE)) {
+		printk(KERN_WARNING "ntfspunch: usage: stripe <chunk> <file> <file>...\n");
+		return -EINVAL;
+	}
+	if (dev->layout == NP_LAYOUT_MIRROR && n < 2) {
+		printk(KERN_WARNING "ntfspunch: usage: mirror <file> <file>...\n");
+		return -EINVAL;
+	}
+
+	dev->members = kcalloc(n, sizeof(*dev->members), GFP_KERNEL);
+	if (dev->members == NULL)
+		return -ENOMEM;
+	dev->nr_members = n;
+	dev->sector_size = 0;
+	for (i = 0; i < n; i++) {
+		ret = np_member_open(dev, &dev->members[i], names[i]);
+		if (ret)
+			goto fail;
+		dev->sector_size = max(dev->sector_size,
+				       dev->members[i].sector_size);
+		if (dev->layout == NP_LAYOUT_MIRROR && i > 0 &&
+		    dev->members[i].size != min_size) {
+			printk(KERN_WARNING "ntfspunch: mirror files must all be the same size, %s isn't\n",
+			       names[i]);
+			ret = -EINVAL;
+			goto fail;
+		}
+		if (i == 0 || dev->members[i].size < min_size)
+			min_size = dev->members[i].size;
+	}
+
+	if (dev->layout == NP_LAYOUT_STRIPE) {
+		if (chunk % dev->sector_size) {
+			printk(KERN_WARNING "ntfspunch: chunk size must be a multiple of %u\n",
+			       dev->sector_size);
+			ret = -EINVAL;
+			goto fail;
+		}
+		dev->chunk_sectors = np_bytes_to_sectors(chunk);
+		/* Whole chunks only, the same number from every member */
+		dev->size = div64_u64(min_size, chunk) * chunk * n;
+	} else {
+		dev->chunk_sectors = 0;
+		dev->size = min_size;
+	}
+	if (dev->size == 0) {
+		ret = -EINVAL;
+		goto fail;
+	}
+	return 0;
+
+fail:
+	np_members_free(dev);
+	return ret;
+}
@@ -0,0 +1,522 @@
+/*
+ * mft.c - On-disk runlist re-validation for the NTFS Punch Driver
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The runlist a device was attached with is the one the kernel ntfs
+ * driver had cached at the time.  If Windows moved the file since (say
+ * after resuming from hibernation), writes would land on clusters that
+ * now belong to something else.  So on every open, and on demand:
+ *
+ *   echo "mft_check now" > /proc/ntfspunch/a
+ *
+ * the file's MFT record is read straight from the disk (bypassing every
+ * cache) with its update sequence fixups applied.  So are the extent
+ * records and the attribute list, if it has one.  The $DATA mapping
+ * pairs are decoded and compared with the attached runlist.  Anything
+ * past the initialized size is a hole to the device whatever is on disk,
+ * so only the allocation is compared there.  A typical file is a single
+ * 1K read, so the check costs about one disk access.
+ */
+
+#include "ntfspunch.h"
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/blkdev.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+#include "ntfs/layout.h"
+
+/* Update sequence numbers protect the end of every 512 bytes */
+#define NP_USA_STRIDE	512
+
+#define np_sle64(x)	((s64)le64_to_cpu((__force le64)(x)))
+
+struct np_mft {
+	struct np_member *m;
+	ntfs_volume *vol;
+	struct page *page;	/* bounce buffer for the reads */
+	u8 *rec;		/* the base record */
+	u8 *ext;		/* an extent record */
+	runlist_element *rl;	/* decoded $DATA, sorted by vcn */
+	int nr;
+	int alloced;
+};
+
+struct np_mft_sync {
+	struct completion done;
+	int error;
+};
+
+static void
+mft_end_io(struct bio *bio, int err)
+{
+	struct np_mft_sync *sync = bio->bi_private;
+
+	sync->error = err;
+	complete(&sync->done);
+}
+
+/*
+ * Read len bytes (a multiple of the logical block size) at sector into
+ * the bounce page
+ */
+static int
+mft_read_sectors(struct np_mft *mft, sector_t sector, unsigned int len)
+{
+	struct np_mft_sync sync;
+	struct bio *bio;
+
+	init_completion(&sync.done);
+	bio = bio_alloc(GFP_NOIO, 1);
+	bio->bi_bdev = mft->m->block_dev;
+	bio->bi_sector = sector;
+	bio->bi_end_io = mft_end_io;
+	bio->bi_private = &sync;
+	bio_add_page(bio, mft->page, len, 0);
+	submit_bio(READ_SYNC, bio);
+	wait_for_completion(&sync.done);
+	bio_put(bio);
+	return sync.error;
+}
+
+/*
+ * Read bytes [off, off + len) of a stream whose runs are rl into dst,
+ * in pieces of at most a page aligned to the disk's logical blocks
+ */
+static int
+mft_read_stream(struct np_mft *mft, runlist_element *rl, s64 off, u32 len,
+		u8 *dst)
+{
+	u32 lbs = bdev_logical_block_size(mft->m->block_dev);
+	u8 cbits = mft->vol->cluster_size_bits;
+	runlist_element *e;
+	s64 vcn, phys, astart, run_left;
+	u32 skew, chunk;
+	int ret;
+
+	while (len) {
+		vcn = off >> cbits;
+		for (e = rl; e->length; e++)
+			if (vcn >= e->vcn && vcn < e->vcn + e->length)
+				break;
+		if (e->length == 0 || e->lcn < 0)
+			return -EIO;
+		phys = ((e->lcn + vcn - e->vcn) << cbits) +
+			(off & (mft->vol->cluster_size - 1));
+		run_left = ((e->vcn + e->length) << cbits) - off;
+		astart = round_down(phys, lbs);
+		skew = phys - astart;
+		chunk = min_t(s64, min_t(u32, len, PAGE_SIZE - skew),
+			      run_left);
+		ret = mft_read_sectors(mft, np_bytes_to_sectors(astart),
+				       round_up(skew + chunk, lbs));
+		if (ret)
+			return ret;
+		memcpy(dst, page_address(mft->page) + skew, chunk);
+		dst += chunk;
+		off += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+/*
+ * Read MFT record mft_no into rec and undo the update sequence fixups
+ */
+static int
+mft_read_record(struct np_mft *mft, unsigned long mft_no, u8 *rec)
+{
+	ntfs_volume *vol = mft->vol;
+	ntfs_inode *mft_ni = NTFS_I(vol->mft_ino);
+	MFT_RECORD *mrec = (MFT_RECORD *)rec;
+	u16 usa_ofs, usa_count, usn, *usa, *end;
+	int i, ret;
+
+	down_read(&mft_ni->runlist.lock);
+	ret = mft_read_stream(mft, mft_ni->runlist.rl,
+			      (s64)mft_no << vol->mft_record_size_bits,
+			      vol->mft_record_size, rec);
+	up_read(&mft_ni->runlist.lock);
+	if (ret)
+		return ret;
+
+	usa_ofs = le16_to_cpu(mrec->usa_ofs);
+	usa_count = le16_to_cpu(mrec->usa_count);
+	if (mrec->magic != magic_FILE || usa_ofs & 1 ||
+	    usa_count != vol->mft_record_size / NP_USA_STRIDE + 1 ||
+	    usa_ofs + usa_count * 2 > NP_USA_STRIDE - 2)
+		return -EIO;
+	usa = (u16 *)(rec + usa_ofs);
+	usn = *usa;
+	for (i = 1; i < usa_count; i++) {
+		end = (u16 *)(rec + i * NP_USA_STRIDE - 2);
+		/* A torn write, the record can't be trusted */
+		if (*end != usn)
+			return -EIO;
+		*end = usa[i];
+	}
+	if (!(mrec->flags & MFT_RECORD_IN_USE) ||
+	    le16_to_cpu(mrec->attrs_offset) >= vol->mft_record_size ||
+	    le32_to_cpu(mrec->bytes_in_use) > vol->mft_record_size)
+		return -EIO;
+	return 0;
+}
+
+/*
+ * Find an unnamed attribute of a type in a record, for $DATA the extent
+ * starting at lowest_vcn
+ */
+static ATTR_RECORD *
+mft_find_attr(struct np_mft *mft, u8 *rec, ATTR_TYPE type, s64 lowest_vcn)
+{
+	MFT_RECORD *mrec = (MFT_RECORD *)rec;
+	u8 *end = rec + le32_to_cpu(mrec->bytes_in_use);
+	ATTR_RECORD *a = (ATTR_RECORD *)(rec + le16_to_cpu(mrec->attrs_offset));
+	u32 len;
+
+	while ((u8 *)a + sizeof(a->type) <= end && a->type != AT_END) {
+		len = le32_to_cpu(a->length);
+		if (len < offsetof(ATTR_RECORD, data) || (u8 *)a + len > end)
+			return NULL;
+		if (a->type == type && a->name_length == 0 &&
+		    (type != AT_DATA || (a->non_resident &&
+		     np_sle64(a->data.non_resident.lowest_vcn) == lowest_vcn)))
+			return a;
+		a = (ATTR_RECORD *)((u8 *)a + len);
+	}
+	return NULL;
+}
+
+static int
+mft_add_run(struct np_mft *mft, VCN vcn, LCN lcn, s64 length)
+{
+	runlist_element *tmp;
+
+	if (mft->nr + 1 >= mft->alloced) {
+		mft->alloced = mft->alloced ? mft->alloced * 2 : 64;
+		tmp = krealloc(mft->rl, mft->alloced * sizeof(*tmp),
+			       GFP_KERNEL);
+		if (tmp == NULL)
+			return -ENOMEM;
+		mft->rl = tmp;
+	}
+	mft->rl[mft->nr].vcn = vcn;
+	mft->rl[mft->nr].lcn = lcn;
+	mft->rl[mft->nr].length = length;
+	mft->nr++;
+	/* Keep it terminated for mft_read_stream() */
+	mft->rl[mft->nr].length = 0;
+	return 0;
+}
+
+/* A little endian signed value of n bytes */
+static s64
+mft_get_bytes(const u8 *p, int n)
+{
+	s64 v = (s8)p[n - 1];
+
+	while (--n > 0)
+		v = (v << 8) | p[n - 1];
+	return v;
+}
+
+/*
+ * Decode the mapping pairs of a non-resident attribute extent and
+ * append its runs, see ntfs_mapping_pairs_decompress() in the ntfs
+ * driver for the format
+ */
+static int
+mft_decode(struct np_mft *mft, ATTR_RECORD *a)
+{
+	u8 *p = (u8 *)a + le16_to_cpu(a->data.non_resident.mapping_pairs_offset);
+	u8 *end = (u8 *)a + le32_to_cpu(a->length);
+	VCN vcn = np_sle64(a->data.non_resident.lowest_vcn);
+	LCN lcn = 0;
+	s64 len;
+	int lb, ob, ret;
+
+	if (p < (u8 *)a || p > end)
+		return -EIO;
+	while (p < end && *p) {
+		lb = *p & 0xf;
+		ob = *p >> 4;
+		if (lb == 0 || lb > 8 || ob > 8 || p + 1 + lb + ob > end)
+			return -EIO;
+		len = mft_get_bytes(p + 1, lb);
+		if (len <= 0)
+			return -EIO;
+		if (ob) {
+			lcn += mft_get_bytes(p + 1 + lb, ob);
+			if (lcn < 0)
+				return -EIO;
+			ret = mft_add_run(mft, vcn, lcn, len);
+		} else {
+			/* Sparse, and it doesn't move the lcn */
+			ret = mft_add_run(mft, vcn, LCN_HOLE, len);
+		}
+		if (ret)
+			return ret;
+		vcn += len;
+		p += 1 + lb + ob;
+	}
+	if (vcn - 1 != np_sle64(a->data.non_resident.highest_vcn))
+		return -EIO;
+	return 0;
+}
+
+/*
+ * Decode $DATA through the attribute list, one extent per $DATA entry,
+ * reading the extent records it points at
+ */
+static int
+mft_decode_list(struct np_mft *mft, ATTR_RECORD *list)
+{
+	unsigned long mft_no = mft->m->ni->mft_no;
+	ATTR_LIST_ENTRY *ale;
+	ATTR_RECORD *a;
+	u8 *buf, *p, *end, *rec;
+	unsigned long ref;
+	s64 size;
+	u16 len;
+	int ret = 0;
+
+	if (list->non_resident) {
+		size = np_sle64(list->data.non_resident.data_size);
+		/* The list's own runs go first, then get dropped */
+		if (size <= 0 || size > 256 * 1024 || mft_decode(mft, list))
+			return -EIO;
+		buf = kmalloc(size, GFP_KERNEL);
+		if (buf == NULL)
+			return -ENOMEM;
+		ret = mft_read_stream(mft, mft->rl, 0, size, buf);
+		mft->nr = 0;
+		mft->rl[0].length = 0;
+		if (ret)
+			goto out;
+	} else {
+		size = le32_to_cpu(list->data.resident.value_length);
+		p = (u8 *)list + le16_to_cpu(list->data.resident.value_offset);
+		if (p + size > (u8 *)list + le32_to_cpu(list->length))
+			return -EIO;
+		buf = kmemdup(p, size, GFP_KERNEL);
+		if (buf == NULL)
+			return -ENOMEM;
+	}
+
+	end = buf + size;
+	for (p = buf; p + offsetof(ATTR_LIST_ENTRY, name) <= end; p += len) {
+		ale = (ATTR_LIST_ENTRY *)p;
+		len = le16_to_cpu(ale->length);
+		if (len < offsetof(ATTR_LIST_ENTRY, name) || p + len > end) {
+			ret = -EIO;
+			break;
+		}
+		if (ale->type != AT_DATA || ale->name_length)
+			continue;
+		ref = MREF_LE(ale->mft_reference);
+		rec = mft->rec;
+		if (ref != mft_no) {
+			ret = mft_read_record(mft, ref, mft->ext);
+			if (ret)
+				break;
+			/* Reused for some other file's extent */
+			if (MREF_LE(((MFT_RECORD *)mft->ext)->base_mft_record) !=
+			    mft_no) {
+				ret = -ESTALE;
+				break;
+			}
+			rec = mft->ext;
+		}
+		a = mft_find_attr(mft, rec, AT_DATA,
+				  np_sle64(ale->lowest_vcn));
+		if (a == NULL) {
+			ret = -EIO;
+			break;
+		}
+		ret = mft_decode(mft, a);
+		if (ret)
+			break;
+	}
+out:
+	kfree(buf);
+	return ret;
+}
+
+/*
+ * Compare the decoded runlist with the attached one, returning the
+ * first vcn they disagree at or -1.  Both are contiguous from vcn 0, but
+ * may be split up differently.
+ */
+static VCN
+mft_compare(struct np_mft *mft)
+{
+	struct np_member *m = mft->m;
+	VCN init = (m->ni->initialized_size + m->cluster_size - 1) >>
+		mft->vol->cluster_size_bits;
+	runlist_element *a = m->rl, *d = mft->rl;
+	VCN vcn = 0;
+
+	while (a->length && d->length) {
+		if (a->lcn >= 0) {
+			if (d->lcn < 0 || d->lcn - d->vcn != a->lcn - a->vcn)
+				return vcn;
+		} else if (vcn < init && d->lcn >= 0) {
+			/* A hole to the device, but allocated on the disk */
+			return vcn;
+		}
+		vcn = min(a->vcn + a->length, d->vcn + d->length);
+		if (vcn == a->vcn + a->length)
+			a++;
+		if (vcn == d->vcn + d->length)
+			d++;
+	}
+	/* Both have to end at the same place */
+	if (a->length || d->length)
+		return vcn;
+	return -1;
+}
+
+/*
+ * Re-read a member's runlist from its MFT record(s) on the disk and
+ * check it still matches, returns -ESTALE if it doesn't
+ */
+int
+np_mft_check_member(struct np_member *m)
+{
+	struct np_mft mft = { .m = m, .vol = m->ni->vol };
+	MFT_RECORD *mrec;
+	ATTR_RECORD *a;
+	VCN bad = 0;
+	int i, ret = -ENOMEM;
+
+	if (mft.vol->mft_record_size > PAGE_SIZE)
+		return -EOPNOTSUPP;
+	mft.page = alloc_page(GFP_KERNEL);
+	mft.rec = kmalloc(mft.vol->mft_record_size, GFP_KERNEL);
+	mft.ext = kmalloc(mft.vol->mft_record_size, GFP_KERNEL);
+	if (mft.page == NULL || mft.rec == NULL || mft.ext == NULL)
+		goto out;
+
+	ret = mft_read_record(&mft, m->ni->mft_no, mft.rec);
+	if (ret)
+		goto out;
+	mrec = (MFT_RECORD *)mft.rec;
+	if (le16_to_cpu(mrec->sequence_number) != m->ni->seq_no ||
+	    mrec->base_mft_record) {
+		/* The record was freed, and maybe reused for another file */
+		printk(KERN_WARNING "ntfspunch: %s: MFT record %lu no longer holds the file\n",
+		       m->filename, m->ni->mft_no);
+		ret = -ESTALE;
+		goto free;
+	}
+	a = mft_find_attr(&mft, mft.rec, AT_ATTRIBUTE_LIST, 0);
+	if (a) {
+		ret = mft_decode_list(&mft, a);
+	} else {
+		a = mft_find_attr(&mft, mft.rec, AT_DATA, 0);
+		ret = a ? mft_decode(&mft, a) : -ESTALE;
+	}
+	if (ret)
+		goto out;
+
+	/* The extents have to join up */
+	for (i = 0; i < mft.nr; i++) {
+		if (mft.rl[i].vcn != (i ? mft.rl[i - 1].vcn +
+				      mft.rl[i - 1].length : 0)) {
+			ret = -EIO;
+			goto out;
+		}
+	}
+	if (mft.nr == 0)
+		ret = -ESTALE;
+	else if ((bad = mft_compare(&mft)) >= 0)
+		ret = -ESTALE;
+out:
+	if (ret == -ESTALE)
+		printk(KERN_WARNING "ntfspunch: %s: runlist on disk differs at cluster %lld, the file has moved\n",
+		       m->filename, bad);
+	else if (ret)
+		printk(KERN_WARNING "ntfspunch: %s: unable to check the MFT record: %d\n",
+		       m->filename, ret);
+free:
+	kfree(mft.rl);
+	kfree(mft.ext);
+	kfree(mft.rec);
+	if (mft.page)
+		__free_page(mft.page);
+	return ret;
+}
+
+/*
+ * Check every member, returns -ESTALE if any has moved
+ */
+int
+np_mft_check(struct mapping_dev *dev)
+{
+	ktime_t start = ktime_get();
+	int i, ret, stale = 0;
+	u64 us;
+
+	for (i = 0; i < dev->nr_members; i++) {
+		ret = np_mft_check_member(&dev->members[i]);
+		if (ret == -ESTALE)
+			stale = 1;
+	}
+	us = ktime_us_delta(ktime_get(), start);
+
+	spin_lock(&dev->lock);
+	dev->mft_checks++;
+	dev->mft_stale += stale;
+	dev->mft_check_us = us;
+	spin_unlock(&dev->lock);
+	return stale ? -ESTALE : 0;
+}
+
+/*
+ * "mft_check on|off" for the check on every open, "mft_check now" to
+ * run it
+ */
+int
+np_mft_ctl(struct mapping_dev *dev, char *key, char *value)
+{
+	if (strcmp(key, "check") != 0)
+		return -EINVAL;
+	if (strcmp(value, "now") == 0)
+		return np_mft_check(dev);
+	else if (strcmp(value, "on") == 0)
+		dev->mft_check_open = 1;
+	else if (strcmp(value, "off") == 0)
+		dev->mft_check_open = 0;
+	else
+		return -EINVAL;
+	return 0;
+}
+
+void
+np_mft_show(struct seq_file *m, struct mapping_dev *dev)
+{
+	seq_printf(m, "mft_check: %s\n", dev->mft_check_open ? "on" : "off");
+	seq_printf(m, "mft_checks: %llu\n", dev->mft_checks);
+	seq_printf(m, "mft_stale: %llu\n", dev->mft_stale);
+	seq_printf(m, "mft_check_us: %llu\n", dev->mft_check_us);
+}
@@ -0,0 +1,696 @@
+/*
+ * mirror.c - Mirrored (RAID1) NTFS Punch devices
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Every member holds a full copy.  Writes go to all of them and complete
+ * once they've all finished; the bio only fails if every copy did.  A copy
+ * that failed has the regions it missed marked stale, and reads stay off
+ * stale regions until a resync has copied them over from a good member.
+ * Reads that fail are retried on another copy.
+ *
+ * Reads go to the member whose last read ended where this one starts, so
+ * a sequential stream stays on one disk, otherwise to the one with the
+ * fewest reads outstanding (nearest head position breaking ties), so
+ * random reads spread out.
+ *
+ * Resync walks the stale regions one at a time.  While it copies one,
+ * new writes to that region are held back on a list and in-flight ones
+ * to it are drained, so nothing can land in the middle of the copy.
+ * Writes anywhere else carry on.  The held writes are resubmitted from
+ * the resync work once the region is done, so the submitter never
+ * sleeps.
+ *
+ * The stale bitmaps are in memory only, so after a crash resync with
+ * "mirror_stale <member>" to be sure the copies match.
+ */
+
+#include "ntfspunch.h"
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include <linux/bitops.h>
+#include <linux/highmem.h>
+#include <linux/seq_file.h>
+#include <linux/blkdev.h>
+#include <linux/completion.h>
+
+/* 512K, small enough that a region always fits one bio */
+#define NP_MIRROR_REGION_SHIFT	10
+#define NP_MIRROR_REGION_PAGES	\
+	(1 << (NP_MIRROR_REGION_SHIFT - (PAGE_SHIFT - NP_SECTOR_SHIFT)))
+
+/*
+ * One bio sent to the mirror, and which member each of its clones went to
+ */
+struct np_mirror_io {
+	struct mapping_dev *dev;
+	struct bio *parent;
+	sector_t start;
+	sector_t end;
+	atomic_t remaining;
+	int error;
+	struct list_head list;  /* writes: on the mirror's writing list */
+	unsigned long tried;  /* reads: members already tried */
+	unsigned long failed;  /* writes: members that failed */
+	struct work_struct work;  /* reads: retry elsewhere */
+	struct np_mirror_clone {
+		struct np_mirror_io *io;
+		int member;
+	} clones[NP_MAX_MEMBERS];
+};
+
+static void mirror_retry_work(struct work_struct *work);
+static void mirror_resync_work(struct work_struct *work);
+
+int
+np_mirror_init(struct mapping_dev *dev)
+{
+	struct np_mirror *mi = &dev->mirror;
+	unsigned long bytes;
+	int i, j;
+
+	memset(mi, 0, sizeof(*mi));
+	spin_lock_init(&mi->lock);
+	mi->dev = dev;
+	INIT_LIST_HEAD(&mi->writing);
+	init_waitqueue_head(&mi->wait);
+	bio_list_init(&mi->held);
+	INIT_WORK(&mi->resync_work, mirror_resync_work);
+	if (dev->layout != NP_LAYOUT_MIRROR)
+		return 0;
+
+	mi->region_shift = NP_MIRROR_REGION_SHIFT;
+	mi->nr_regions = DIV_ROUND_UP_ULL(np_bytes_to_sectors(dev->size),
+					  1 << mi->region_shift);
+	bytes = BITS_TO_LONGS(mi->nr_regions) * sizeof(long);
+	for (i = 0; i < dev->nr_members; i++) {
+		atomic_set(&dev->members[i].inflight, 0);
+		dev->members[i].stale = vzalloc(bytes);
+		if (dev->members[i].stale == NULL)
+			goto fail;
+		for (j = 0; j < i; j++)
+			if (dev->members[j].disk == dev->members[i].disk)
+				printk(KERN_WARNING "ntfspunch: %s and %s are on the same disk\n",
+				       dev->members[j].filename,
+				       dev->members[i].filename);
+	}
+	mi->io_pool = mempool_create_kmalloc_pool(BIO_POOL_SIZE,
+						  sizeof(struct np_mirror_io));
+	if (mi->io_pool == NULL)
+		goto fail;
+	return 0;
+
+fail:
+	printk(KERN_WARNING "ntfspunch: unable to allocate mirror state\n");
+	np_mirror_free(dev);
+	return -ENOMEM;
+}
+
+void
+np_mirror_free(struct mapping_dev *dev)
+{
+	struct np_mirror *mi = &dev->mirror;
+	int i;
+
+	if (dev->layout != NP_LAYOUT_MIRROR)
+		return;
+	mi->resync_stop = 1;
+	flush_work(&mi->resync_work);
+	if (mi->io_pool)
+		mempool_destroy(mi->io_pool);
+	mi->io_pool = NULL;
+	for (i = 0; i < dev->nr_members; i++) {
+		vfree(dev->members[i].stale);
+		dev->members[i].stale = NULL;
+	}
+}
+
+static int
+mirror_stale(struct np_mirror *mi, struct np_member *m, sector_t start,
+	     sector_t end)
+{
+	unsigned long first = start >> mi->region_shift;
+	unsigned long last = (end - 1) >> mi->region_shift;
+
+	return find_next_bit(m->stale, last + 1, first) <= last;
+}
+
+static void
+mirror_mark_stale(struct np_mirror *mi, struct np_member *m, sector_t start,
+		  sector_t end)
+{
+	unsigned long r;
+
+	for (r = start >> mi->region_shift;
+	     r <= (end - 1) >> mi->region_shift; r++)
+		set_bit(r, m->stale);
+}
+
+/*
+ * Pick the member to read from, skipping those already tried and, if
+ * check_stale, those without an up to date copy of the range
+ */
+static struct np_member *
+mirror_pick(struct mapping_dev *dev, struct np_mirror_io *io, int check_stale)
+{
+	struct np_member *m, *best = NULL;
+	int i, load, best_load = 0;
+	sector_t dist, best_dist = 0;
+
+	for (i = 0; i < dev->nr_members; i++) {
+		m = &dev->members[i];
+		if (io->tried & (1UL << i))
+			continue;
+		if (check_stale && mirror_stale(&dev->mirror, m, io->start,
+						io->end))
+			continue;
+		/* A sequential stream stays where it is */
+		if (m->head == io->start)
+			return m;
+		load = atomic_read(&m->inflight);
+		dist = m->head > io->start ? m->head - io->start :
+			io->start - m->head;
+		if (best == NULL || load < best_load ||
+		    (load == best_load && dist < best_dist)) {
+			best = m;
+			best_load = load;
+			best_dist = dist;
+		}
+	}
+	return best;
+}
+
+static void
+mirror_read_end_io(struct bio *clone, int err)
+{
+	struct np_mirror_clone *c = clone->bi_private;
+	struct np_mirror_io *io = c->io;
+	struct mapping_dev *dev = io->dev;
+	struct np_member *m = &dev->members[c->member];
+
+	atomic_dec(&m->inflight);
+	bio_put(clone);
+	if (err && !(io->parent->bi_rw & REQ_RAHEAD)) {
+		/* Have resync rewrite it from a good copy */
+		mirror_mark_stale(&dev->mirror, m, io->start, io->end);
+		dev->mirror.read_errors++;
+		io->error = err;
+		queue_work(np_wq, &io->work);
+		return;
+	}
+	bio_endio(io->parent, err);
+	mempool_free(io, dev->mirror.io_pool);
+}
+
+static void
+mirror_read(struct mapping_dev *dev, struct np_mirror_io *io,
+	    struct np_member *m)
+{
+	struct bio *clone = bio_clone_bioset(io->parent, GFP_NOIO, dev->bs);
+
+	io->clones[0].member = m - dev->members;
+	io->tried |= 1UL << io->clones[0].member;
+	clone->bi_end_io = mirror_read_end_io;
+	clone->bi_private = &io->clones[0];
+	m->head = io->end;
+	m->reads++;
+	atomic_inc(&m->inflight);
+	ntfspunch_remap_member(dev, m, clone);
+}
+
+static void
+mirror_retry_work(struct work_struct *work)
+{
+	struct np_mirror_io *io = container_of(work, struct np_mirror_io, work);
+	struct mapping_dev *dev = io->dev;
+	struct np_member *m;
+
+	m = mirror_pick(dev, io, 1);
+	if (m == NULL)
+		m = mirror_pick(dev, io, 0);
+	if (m == NULL) {
+		bio_endio(io->parent, io->error);
+		mempool_free(io, dev->mirror.io_pool);
+		return;
+	}
+	if (printk_ratelimit())
+		printk(KERN_WARNING "ntfspunch: read error at %llu, retrying on %s\n",
+		       np_sectors_to_bytes(io->start), m->filename);
+	mirror_read(dev, io, m);
+}
+
+static void
+mirror_write_end_io(struct bio *clone, int err)
+{
+	struct np_mirror_clone *c = clone->bi_private;
+	struct np_mirror_io *io = c->io;
+	struct mapping_dev *dev = io->dev;
+	struct np_mirror *mi = &dev->mirror;
+	unsigned long flags;
+	int i;
+
+	if (err) {
+		set_bit(c->member, &io->failed);
+		io->error = err;
+	}
+	bio_put(clone);
+	if (!atomic_dec_and_test(&io->remaining))
+		return;
+
+	/* Good as long as one copy made it, the rest need a resync */
+	if (io->failed && hweight_long(io->failed) < dev->nr_members) {
+		for (i = 0; i < dev->nr_members; i++)
+			if (test_bit(i, &io->failed))
+				mirror_mark_stale(mi, &dev->members[i],
+						  io->start, io->end);
+		mi->write_errors++;
+		io->error = 0;
+	}
+	spin_lock_irqsave(&mi->lock, flags);
+	list_del(&io->list);
+	if (mi->barrier_end > mi->barrier_start)
+		wake_up(&mi->wait);
+	spin_unlock_irqrestore(&mi->lock, flags);
+	bio_endio(io->parent, io->error);
+	mempool_free(io, mi->io_pool);
+}
+
+void
+np_mirror_submit(struct mapping_dev *dev, struct bio *bio)
+{
+	struct np_mirror *mi = &dev->mirror;
+	struct np_mirror_io *io;
+	struct np_member *m;
+	struct bio *clone;
+	unsigned long flags;
+	int i;
+
+	io = mempool_alloc(mi->io_pool, GFP_NOIO);
+	io->start = bio->bi_sector;
+	io->end = bio_end_sector(bio);
+	if (bio_data_dir(bio) == WRITE) {
+		spin_lock_irqsave(&mi->lock, flags);
+		if (io->start < mi->barrier_end &&
+		    io->end > mi->barrier_start) {
+			bio_list_add(&mi->held, bio);
+			spin_unlock_irqrestore(&mi->lock, flags);
+			mempool_free(io, mi->io_pool);
+			return;
+		}
+		list_add_tail(&io->list, &mi->writing);
+		spin_unlock_irqrestore(&mi->lock, flags);
+	}
+
+	io->dev = dev;
+	io->parent = bio;
+	io->error = 0;
+	io->tried = 0;
+	io->failed = 0;
+	INIT_WORK(&io->work, mirror_retry_work);
+
+	if (bio_data_dir(bio) != WRITE) {
+		io->clones[0].io = io;
+		m = mirror_pick(dev, io, 1);
+		if (m == NULL)
+			m = mirror_pick(dev, io, 0);
+		mirror_read(dev, io, m);
+		return;
+	}
+
+	atomic_set(&io->remaining, dev->nr_members);
+	for (i = 0; i < dev->nr_members; i++) {
+		io->clones[i].io = io;
+		io->clones[i].member = i;
+		clone = bio_clone_bioset(bio, GFP_NOIO, dev->bs);
+		clone->bi_end_io = mirror_write_end_io;
+		clone->bi_private = &io->clones[i];
+		ntfspunch_remap_member(dev, &dev->members[i], clone);
+	}
+}
+
+/*
+ * Synchronous I/O of part of a region to or from one member, going
+ * through its runlist like any other bio
+ */
+struct mirror_sync {
+	struct completion done;
+	atomic_t remaining;
+	int error;
+};
+
+static void
+mirror_sync_end_io(struct bio *bio, int err)
+{
+	struct mirror_sync *sync = bio->bi_private;
+
+	if (err)
+		sync->error = err;
+	bio_put(bio);
+	if (atomic_dec_and_test(&sync->remaining))
+		complete(&sync->done);
+}
+
+static void
+mirror_zero_pages(struct page **pages, u64 bytes, u64 len)
+{
+	unsigned int off, seg;
+
+	for (; len; bytes += seg, len -= seg) {
+		off = bytes & ~PAGE_MASK;
+		seg = min_t(u64, PAGE_SIZE - off, len);
+		zero_user(pages[bytes >> PAGE_SHIFT], off, seg);
+	}
+}
+
+static int
+mirror_region_io(struct mapping_dev *dev, struct np_member *m, int rw,
+		 sector_t start, sector_t len)
+{
+	struct page **pages = dev->mirror.pages;
+	struct mirror_sync sync;
+	runlist_element *rl;
+	sector_t pos, n, run_end;
+	unsigned int off, seg;
+	struct bio *bio;
+	u64 bytes;
+
+	init_completion(&sync.done);
+	atomic_set(&sync.remaining, 1);
+	sync.error = 0;
+	for (pos = start; pos < start + len; pos += n) {
+		rl = find_run(m, pos);
+		if (rl == NULL) {
+			sync.error = -EIO;
+			break;
+		}
+		run_end = np_clusters_to_sectors(m, rl->vcn + rl->length);
+		n = min(run_end, start + len) - pos;
+		if (rl->lcn < 0) {
+			/* Nothing to write to a hole, and it reads as zeroes */
+			if (rw == READ)
+				mirror_zero_pages(pages,
+						  np_sectors_to_bytes(pos - start),
+						  np_sectors_to_bytes(n));
+			continue;
+		}
+		bio = bio_alloc(GFP_NOIO, NP_MIRROR_REGION_PAGES + 1);
+		bio->bi_bdev = m->block_dev;
+		bio->bi_sector = pos - np_clusters_to_sectors(m, rl->vcn) +
+			np_clusters_to_sectors(m, rl->lcn);
+		bio->bi_end_io = mirror_sync_end_io;
+		bio->bi_private = &sync;
+		for (bytes = np_sectors_to_bytes(pos - start);
+		     bytes < np_sectors_to_bytes(pos - start + n); bytes += seg) {
+			off = bytes & ~PAGE_MASK;
+			seg = min_t(u64, PAGE_SIZE - off,
+				    np_sectors_to_bytes(pos - start + n) - bytes);
+			bio_add_page(bio, pages[bytes >> PAGE_SHIFT], seg, off);
+		}
+		atomic_inc(&sync.remaining);
+		submit_bio(rw, bio);
+	}
+	if (!atomic_dec_and_test(&sync.remaining))
+		wait_for_completion(&sync.done);
+	return sync.error;
+}
+
+/*
+ * Whether any write in flight overlaps the barrier
+ */
+static int
+mirror_writing(struct np_mirror *mi)
+{
+	struct np_mirror_io *io;
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&mi->lock, flags);
+	list_for_each_entry(io, &mi->writing, list) {
+		if (io->start < mi->barrier_end &&
+		    io->end > mi->barrier_start) {
+			ret = 1;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&mi->lock, flags);
+	return ret;
+}
+
+static void
+mirror_barrier_raise(struct np_mirror *mi, unsigned long r)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&mi->lock, flags);
+	mi->barrier_start = (sector_t)r << mi->region_shift;
+	mi->barrier_end = (sector_t)(r + 1) << mi->region_shift;
+	spin_unlock_irqrestore(&mi->lock, flags);
+	wait_event(mi->wait, !mirror_writing(mi));
+}
+
+static void
+mirror_barrier_lower(struct np_mirror *mi)
+{
+	struct bio_list held;
+	struct bio *bio;
+	unsigned long flags;
+
+	spin_lock_irqsave(&mi->lock, flags);
+	mi->barrier_start = mi->barrier_end = 0;
+	held = mi->held;
+	bio_list_init(&mi->held);
+	spin_unlock_irqrestore(&mi->lock, flags);
+	while ((bio = bio_list_pop(&held)))
+		ntfspunch_remap_origin(mi->dev, bio);
+}
+
+/*
+ * Copy one region from a good member over the stale ones
+ */
+static void
+mirror_resync_region(struct mapping_dev *dev, unsigned long r)
+{
+	struct np_mirror *mi = &dev->mirror;
+	struct np_member *m, *src = NULL;
+	sector_t start = (sector_t)r << mi->region_shift;
+	sector_t len = min_t(sector_t, 1 << mi->region_shift,
+			     np_bytes_to_sectors(dev->size) - start);
+	int i;
+
+	for (i = 0; i < dev->nr_members; i++) {
+		if (!test_bit(r, dev->members[i].stale)) {
+			src = &dev->members[i];
+			break;
+		}
+	}
+	if (src == NULL) {
+		printk(KERN_WARNING "ntfspunch: %s: no good copy of %llu-%llu\n",
+		       dev->filename, np_sectors_to_bytes(start),
+		       np_sectors_to_bytes(start + len));
+		return;
+	}
+	if (mirror_region_io(dev, src, READ, start, len)) {
+		printk(KERN_WARNING "ntfspunch: %s: resync read of %llu failed\n",
+		       src->filename, np_sectors_to_bytes(start));
+		return;
+	}
+	for (i = 0; i < dev->nr_members; i++) {
+		m = &dev->members[i];
+		if (!test_bit(r, m->stale))
+			continue;
+		if (mirror_region_io(dev, m, WRITE, start, len)) {
+			printk(KERN_WARNING "ntfspunch: %s: resync write of %llu failed\n",
+			       m->filename, np_sectors_to_bytes(start));
+			continue;
+		}
+		clear_bit(r, m->stale);
+		mi->resynced += np_sectors_to_bytes(len);
+	}
+}
+
+static int
+mirror_region_dirty(struct mapping_dev *dev, unsigned long r)
+{
+	int i;
+
+	for (i = 0; i < dev->nr_members; i++)
+		if (test_bit(r, dev->members[i].stale))
+			return 1;
+	return 0;
+}
+
+static void
+mirror_resync_work(struct work_struct *work)
+{
+	struct np_mirror *mi = container_of(work, struct np_mirror,
+					    resync_work);
+	struct mapping_dev *dev = mi->dev;
+	unsigned long r, flags;
+	int i;
+
+	for (r = 0; r < mi->nr_regions && !ACCESS_ONCE(mi->resync_stop); r++) {
+		mi->resync_pos = r;
+		if (!mirror_region_dirty(dev, r))
+			continue;
+		/* Nothing may write to the region while it's copied */
+		mirror_barrier_raise(mi, r);
+		mirror_resync_region(dev, r);
+		mirror_barrier_lower(mi);
+		cond_resched();
+	}
+
+	spin_lock_irqsave(&mi->lock, flags);
+	mi->resyncing = 0;
+	spin_unlock_irqrestore(&mi->lock, flags);
+	for (i = 0; i < NP_MIRROR_REGION_PAGES; i++)
+		__free_page(mi->pages[i]);
+	kfree(mi->pages);
+	mi->pages = NULL;
+	printk(KERN_INFO "ntfspunch: %s: resync %s\n", dev->filename,
+	       r < mi->nr_regions ? "stopped" : "done");
+}
+
+static int
+mirror_resync_start(struct np_mirror *mi)
+{
+	struct page **pages;
+	unsigned long flags;
+	int i, ret = -ENOMEM;
+
+	pages = kcalloc(NP_MIRROR_REGION_PAGES, sizeof(*pages), GFP_KERNEL);
+	if (pages == NULL)
+		return -ENOMEM;
+	for (i = 0; i < NP_MIRROR_REGION_PAGES; i++) {
+		pages[i] = alloc_page(GFP_KERNEL);
+		if (pages[i] == NULL)
+			goto fail;
+	}
+
+	spin_lock_irqsave(&mi->lock, flags);
+	if (mi->resyncing) {
+		spin_unlock_irqrestore(&mi->lock, flags);
+		i = NP_MIRROR_REGION_PAGES;
+		ret = -EBUSY;
+		goto fail;
+	}
+	mi->resyncing = 1;
+	mi->resync_stop = 0;
+	mi->resync_pos = 0;
+	mi->pages = pages;
+	spin_unlock_irqrestore(&mi->lock, flags);
+	queue_work(np_wq, &mi->resync_work);
+	return 0;
+
+fail:
+	while (--i >= 0)
+		__free_page(pages[i]);
+	kfree(pages);
+	return ret;
+}
+
+/*
+ * Mark a whole member out of date, for when its copy can't be trusted
+ * (e.g. it was replaced, or after a crash).  Refused if that would leave
+ * some region without a good copy.
+ */
+static int
+mirror_mark_member(struct mapping_dev *dev, int idx)
+{
+	struct np_mirror *mi = &dev->mirror;
+	unsigned long r;
+	int i;
+
+	for (r = 0; r < mi->nr_regions; r++) {
+		for (i = 0; i < dev->nr_members; i++)
+			if (i != idx && !test_bit(r, dev->members[i].stale))
+				break;
+		if (i == dev->nr_members)
+			return -EINVAL;
+	}
+	for (r = 0; r < mi->nr_regions; r++)
+		set_bit(r, dev->members[idx].stale);
+	return 0;
+}
+
+int
+np_mirror_ctl(struct mapping_dev *dev, char *key, char *value)
+{
+	struct np_mirror *mi = &dev->mirror;
+	unsigned int idx;
+	int ret;
+
+	if (dev->layout != NP_LAYOUT_MIRROR)
+		return -EOPNOTSUPP;
+	if (strcmp(key, "resync") == 0) {
+		if (strcmp(value, "start") == 0)
+			return mirror_resync_start(mi);
+		if (strcmp(value, "stop") == 0) {
+			mi->resync_stop = 1;
+			return 0;
+		}
+		return -EINVAL;
+	} else if (strcmp(key, "stale") == 0) {
+		ret = kstrtouint(value, 0, &idx);
+		if (ret)
+			return ret;
+		if (idx >= dev->nr_members)
+			return -EINVAL;
+		return mirror_mark_member(dev, idx);
+	}
+	return -EINVAL;
+}
+
+void
+np_mirror_show(struct seq_file *m, struct mapping_dev *dev)
+{
+	struct np_mirror *mi = &dev->mirror;
+	unsigned long r, dirty = 0;
+
+	if (dev->layout != NP_LAYOUT_MIRROR)
+		return;
+	for (r = 0; r < mi->nr_regions; r++)
+		dirty += mirror_region_dirty(dev, r);
+	seq_printf(m, "mirror_region_size: %llu\n",
+		   np_sectors_to_bytes(1 << mi->region_shift));
+	seq_printf(m, "mirror_dirty_regions: %lu/%lu\n", dirty,
+		   mi->nr_regions);
+	if (mi->resyncing)
+		seq_printf(m, "mirror_resync: %lu/%lu\n", mi->resync_pos,
+			   mi->nr_regions);
+	else
+		seq_printf(m, "mirror_resync: idle\n");
+	seq_printf(m, "mirror_resynced: %llu\n", mi->resynced);
+	seq_printf(m, "mirror_read_errors: %llu\n", mi->read_errors);
+	seq_printf(m, "mirror_write_errors: %llu\n", mi->write_errors);
+}
+
+void
+np_mirror_show_member(struct seq_file *m, struct mapping_dev *dev,
+		      struct np_member *mb)
+{
+	if (dev->layout != NP_LAYOUT_MIRROR)
+		return;
+	seq_printf(m, "reads: %llu\n", mb->reads);
+	seq_printf(m, "inflight: %d\n", atomic_read(&mb->inflight));
+	seq_printf(m, "stale_regions: %d\n",
+		   bitmap_weight(mb->stale, dev->mirror.nr_regions));
+}
@@ -25,9 +25,22 @@
 
 #include <linux/types.h>
 #include <linux/genhd.h>
+#include <linux/bio.h>
+#include <linux/mempool.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/rbtree.h>
 #include "ntfs/inode.h"
 #include "ntfs/runlist.h"
 
+struct seq_file;
+struct np_cache;
+struct np_overlay;
+struct np_cbt;
+struct np_rmap;
+struct np_member;
+struct mapping_dev;
+
 /*
  * Set to non-zero for some serious log spewage for troubleshooting
  */
@@ -41,21 +54,293 @@ int proc_add_node(int index);
 void dump_unlocked_device(int device_num);
 
 int add_device(char *filename);
+int validate(struct file *img_fp);
 
-struct mapping_dev {
+int dm_target_init(void);
+void dm_target_exit(void);
+
+/*
+ * State shared by every device on the same underlying disk (see disk.c)
+ */
+struct np_disk {
+	struct list_head list;
+	struct block_device *bdev;
+	int refs;
+	spinlock_t lock;
+	int flushing;
+	struct bio_list flush_running;	/* waiting on flush_bio */
+	struct bio_list flush_next;	/* waiting on the one after */
+	struct bio flush_bio;
+	struct work_struct flush_work;
+	u64 flushes_requested;
+	u64 flushes_issued;
+	spinlock_t rmap_lock;
+	struct rb_root rmap;	/* attached runs, by physical sector */
+	struct np_rmap *meta;	/* the volume's $MFT and $MFTMirr */
+	int nr_meta;
+};
+
+extern struct workqueue_struct *np_wq;
+
+int np_disk_init(void);
+void np_disk_exit(void);
+struct np_disk *np_disk_get(struct block_device *bdev, ntfs_volume *vol);
+void np_disk_put(struct np_disk *disk);
+void np_disk_flush(struct np_disk *disk, struct bio *bio);
+void np_disk_show(struct seq_file *m, struct np_disk *disk);
+int np_rmap_alloc(struct mapping_dev *dev, struct np_member *m);
+int np_disk_rmap_add(struct np_disk *disk, struct np_member *m);
+void np_disk_rmap_del(struct np_disk *disk, struct np_member *m);
+int np_disk_lookup(dev_t devt, sector_t sector, char *buf, size_t len);
+
+/*
+ * Readahead of the next runlist element for sequential streams
+ * (see prefetch.c), all offsets and lengths in sectors
+ */
+struct np_prefetch {
+	spinlock_t lock;
+	int enabled;
+	int state;
+	int stale;		/* window no longer wanted once it lands */
+	struct page **pages;
+	sector_t start;		/* device sector the window covers */
+	unsigned int len;
+	unsigned int consumed;
+	unsigned int depth;
+	sector_t next;		/* where a sequential stream continues */
+	unsigned int seq;
+	unsigned long rate;	/* sectors per second */
+	unsigned long rate_start;
+	unsigned long rate_sectors;
+	u64 issued;		/* stats, in bytes */
+	u64 hits;
+	u64 wasted;
+	u64 late;		/* reads that beat their window */
+	int writes;		/* in flight, no window is read meanwhile */
+	mempool_t *write_pool;
+	wait_queue_head_t wait;	/* for the window and writes to land */
+};
+
+/*
+ * Token bucket limits (see qos.c)
+ */
+enum {
+	NP_QOS_RBPS,
+	NP_QOS_WBPS,
+	NP_QOS_RIOPS,
+	NP_QOS_WIOPS,
+	NP_QOS_NR
+};
+
+struct np_qos {
+	spinlock_t lock;
+	struct mapping_dev *dev;
+	int enabled;
+	u64 limit[NP_QOS_NR];	/* per second, 0 for unlimited */
+	s64 tokens[NP_QOS_NR];
+	u32 frac[NP_QOS_NR];	/* of a token, in 1/HZ units */
+	unsigned int burst_ms;
+	unsigned long last;	/* jiffies at the last refill */
+	struct bio_list queued;
+	unsigned int nr_queued;
+	struct delayed_work work;
+	unsigned long wait_start;
+	u64 throttled;		/* stats */
+	u64 throttled_bytes;
+	u64 wait_ms;
+};
+
+/*
+ * One backing file of a device (see member.c)
+ */
+struct np_member {
 	char filename[PATH_MAX+1];
 	struct file *img_fp;
+	ntfs_inode *ni;
+	struct block_device *block_dev;
+	struct np_disk *disk;
+	runlist_element *rl;
+	int nr_runs;
+	s64 size;  /* in bytes */
+	u32 cluster_size;  /* in bytes */
+	u8 cluster_shift;  /* log2 of 512 byte sectors per cluster */
+	u32 sector_size;  /* logical block size it needs, in bytes */
+	int misaligned_runs;
+	atomic_t inflight;  /* mirror reads outstanding */
+	sector_t head;  /* where its last mirror read ended */
+	unsigned long *stale;  /* mirror regions needing a resync */
+	u64 reads;
+	u64 bitmap_check_us;  /* how long the $Bitmap check took */
+	struct np_rmap *rmap;  /* its runs in the disk's reverse map */
+	int nr_rmap;
+};
+
+#define NP_MAX_MEMBERS	16
+
+enum {
+	NP_LAYOUT_LINEAR,
+	NP_LAYOUT_STRIPE,
+	NP_LAYOUT_MIRROR,
+};
+
+/*
+ * Copies of a mirrored device and their resync (see mirror.c)
+ */
+struct np_mirror {
+	spinlock_t lock;
+	struct mapping_dev *dev;
+	mempool_t *io_pool;
+	unsigned int region_shift;  /* log2 of sectors per region */
+	unsigned long nr_regions;
+	sector_t barrier_start;  /* region being resynced, empty if none */
+	sector_t barrier_end;
+	struct list_head writing;  /* writes in flight */
+	wait_queue_head_t wait;
+	struct bio_list held;  /* writes waiting out the barrier */
+	int resyncing;
+	int resync_stop;
+	unsigned long resync_pos;  /* region */
+	struct page **pages;  /* one region, while resyncing */
+	struct work_struct resync_work;
+	u64 read_errors;  /* stats */
+	u64 write_errors;
+	u64 resynced;  /* bytes */
+};
+
+struct mapping_dev {
+	char filename[PATH_MAX+1];  /* as it was added */
 	short users;
 	struct gendisk *gd;
 	struct request_queue *queue;
 	s64 size;  /* in bytes */
-	u32 cluster_size;  /* in bytes */
-	struct block_device *block_dev;
-	ntfs_inode *ni;
+	u32 sector_size;  /* logical block size, in bytes */
 	spinlock_t lock;
-	runlist_element *rl;
+	int layout;
+	sector_t chunk_sectors;  /* stripe chunk */
+	int nr_members;
+	struct np_member *members;
+	u32 phys_block_size;  /* of the disks, in bytes */
+	int misaligned_runs;
+	u64 misaligned_bytes;
+	struct bio_set *bs;  /* for split clones */
+	mempool_t *split_pool;
+	mempool_t *remap_pool;  /* for bios that aren't split */
+	atomic64_t splits;
+	atomic64_t hole_bytes;  /* read as zeroes without the disk */
+	int zero_detect;  /* turn all-zero writes into WRITE SAME/discard */
+	atomic64_t zero_writes;
+	atomic64_t zero_bytes;  /* never sent to the disk */
+	int mft_check_open;  /* re-check the runlist on disk on every open */
+	u64 mft_checks;
+	u64 mft_stale;
+	u64 mft_check_us;  /* how long the last check took */
+	struct np_prefetch pf;
+	struct np_qos qos;
+	struct np_mirror mirror;
+	struct np_cache *cache;  /* optional, see cache.c */
+	struct np_overlay *overlay;  /* optional, see overlay.c */
+	struct np_cbt *cbt;  /* optional, see cbt.c */
+	u32 cbt_granularity;  /* in bytes, 0 for the default */
 };
 
+void ntfspunch_dispatch(struct mapping_dev *dev, struct bio *bio);
+void ntfspunch_remap_origin(struct mapping_dev *dev, struct bio *bio);
+void ntfspunch_remap_member(struct mapping_dev *dev, struct np_member *m,
+			    struct bio *bio);
+void np_zero_fill_bio(struct bio *bio);
+int ntfspunch_has_hole(struct mapping_dev *dev, sector_t sector, sector_t nr);
+int ntfspunch_zero_ctl(struct mapping_dev *dev, char *key, char *value);
+
+/*
+ * bi_sector and friends are always in 512 byte units whatever the logical
+ * block size of the device, so remap arithmetic goes through these
+ */
+#define NP_SECTOR_SHIFT	9
+
+static inline sector_t
+np_clusters_to_sectors(struct np_member *m, s64 clusters)
+{
+	return (sector_t)clusters << m->cluster_shift;
+}
+
+static inline sector_t
+np_bytes_to_sectors(u64 bytes)
+{
+	return bytes >> NP_SECTOR_SHIFT;
+}
+
+static inline u64
+np_sectors_to_bytes(sector_t sectors)
+{
+	return (u64)sectors << NP_SECTOR_SHIFT;
+}
+
+/*
+ * Where holes (sparse runs, and anything past the initialized size) map
+ * to: nowhere, they read as zeroes
+ */
+#define NP_PHYS_HOLE	((sector_t)-1)
+
+int np_members_setup(struct mapping_dev *dev, char *spec);
+void np_members_free(struct mapping_dev *dev);
+int np_member_open(struct mapping_dev *dev, struct np_member *m,
+		   const char *filename);
+void np_member_close(struct np_member *m);
+struct np_member *np_map_sector(struct mapping_dev *dev, sector_t sector,
+				sector_t *msector, sector_t *max);
+runlist_element *np_copy_runlist(ntfs_inode *ni);
+runlist_element *find_run(struct np_member *m, sector_t sector);
+int np_members_rmap_add(struct mapping_dev *dev);
+void np_members_rmap_del(struct mapping_dev *dev);
+sector_t np_member_to_dev(struct mapping_dev *dev, struct np_member *m,
+			 sector_t msector);
+
+int prefetch_init(struct mapping_dev *dev);
+void prefetch_free(struct mapping_dev *dev);
+int prefetch_read(struct mapping_dev *dev, struct bio *bio);
+void prefetch_write(struct mapping_dev *dev, struct bio *bio);
+int prefetch_ctl(struct mapping_dev *dev, char *key, char *value);
+void prefetch_show(struct seq_file *m, struct mapping_dev *dev);
+
+void np_qos_init(struct mapping_dev *dev);
+void np_qos_free(struct mapping_dev *dev);
+int np_qos_throttle(struct mapping_dev *dev, struct bio *bio);
+int np_qos_ctl(struct mapping_dev *dev, char *key, char *value);
+void np_qos_show(struct seq_file *m, struct mapping_dev *dev);
+
+int np_mirror_init(struct mapping_dev *dev);
+void np_mirror_free(struct mapping_dev *dev);
+void np_mirror_submit(struct mapping_dev *dev, struct bio *bio);
+int np_mirror_ctl(struct mapping_dev *dev, char *key, char *value);
+void np_mirror_show(struct seq_file *m, struct mapping_dev *dev);
+void np_mirror_show_member(struct seq_file *m, struct mapping_dev *dev,
+			   struct np_member *mb);
+
+int np_cache_map(struct mapping_dev *dev, struct bio *bio);
+struct block_device *np_cache_flush_bdev(struct mapping_dev *dev);
+void np_cache_detach(struct mapping_dev *dev);
+int np_cache_ctl(struct mapping_dev *dev, char *key, char *value);
+void np_cache_show(struct seq_file *m, struct mapping_dev *dev);
+
+void np_overlay_map(struct mapping_dev *dev, struct bio *bio);
+struct block_device *np_overlay_flush_bdev(struct mapping_dev *dev);
+void np_overlay_detach(struct mapping_dev *dev);
+int np_overlay_ctl(struct mapping_dev *dev, char *key, char *value);
+void np_overlay_show(struct seq_file *m, struct mapping_dev *dev);
+
+void np_cbt_mark(struct mapping_dev *dev, struct bio *bio);
+void np_cbt_stop(struct mapping_dev *dev);
+int np_cbt_get(struct mapping_dev *dev, void __user *argp);
+int np_cbt_ctl(struct mapping_dev *dev, char *key, char *value);
+void np_cbt_show(struct seq_file *m, struct mapping_dev *dev);
+
+int np_bitmap_check(struct np_member *m);
+
+int np_mft_check_member(struct np_member *m);
+int np_mft_check(struct mapping_dev *dev);
+int np_mft_ctl(struct mapping_dev *dev, char *key, char *value);
+void np_mft_show(struct seq_file *m, struct mapping_dev *dev);
+
 extern struct mapping_dev **dev_list;
 extern spinlock_t dev_list_lock;
 extern int num_devices;
@@ -0,0 +1,61 @@
+/*
+ * ntfspunch_ioctl.h - ioctl interface of the NTFS Punch block devices
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Shared by the driver and the tools, so only uapi types in here
+ */
+
+#ifndef _NTFSPUNCH_IOCTL_H_
+#define _NTFSPUNCH_IOCTL_H_
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define NTFSPUNCH_IOC_MAGIC	0xb7
+
+/*
+ * A run of changed bytes on the device
+ */
+struct np_cbt_range {
+	__u64 offset;
+	__u64 length;
+};
+
+/*
+ * NTFSPUNCH_CBT_GET fills ranges with the changed regions from start on,
+ * in order and merged where they touch, and says where to carry on from.
+ * With NP_CBT_RESET the regions handed back are marked unchanged in the
+ * same step, so a write that comes in meanwhile is never lost.
+ */
+struct np_cbt_get {
+	__u64 start;		/* in: byte offset */
+	__u64 next;		/* out: start of the next call, size when done */
+	__u64 ranges;		/* in: user pointer to struct np_cbt_range[] */
+	__u32 nr_ranges;	/* in: room in ranges, out: how many filled */
+	__u32 flags;
+	__u64 granularity;	/* out: in bytes */
+};
+
+#define NP_CBT_RESET	0x1
+
+#define NTFSPUNCH_CBT_GET	_IOWR(NTFSPUNCH_IOC_MAGIC, 1, struct np_cbt_get)
+
+#endif
@@ -0,0 +1,557 @@
+/*
+ * overlay.c - Copy-on-write overlays of NTFS Punch devices
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * An overlay freezes a device's image and sends every write to a delta
+ * device instead, so the changes can be thrown away later:
+ *
+ *   echo "overlay_attach /dev/loop3" > /proc/ntfspunch/a
+ *   echo "overlay_discard now" > /proc/ntfspunch/a
+ *
+ * The delta is mapped one to one with the device (grain N of the device
+ * is grain N of the delta), so a sparse file behind a loop device only
+ * takes up what has been written.  All that needs tracking is a bitmap
+ * of which grains (clusters) are in the delta, which makes taking an
+ * overlay and discarding one just a matter of clearing it.
+ *
+ * Reads are served a piece at a time from the delta or the image.
+ * Writes covering whole grains go straight to the delta, and mark them
+ * present once they complete.  A write covering only part of a grain
+ * that isn't in the delta yet needs the rest copied up from the image
+ * first.  That is done by a worker, and later writes queue behind it so
+ * the copy can't land on top of them.  Writes already on their way to the
+ * delta are tracked until they complete, and the worker waits out any
+ * that touch the grain it's about to copy.
+ *
+ * The bitmap is in memory only, so an overlay doesn't survive the device
+ * going away.
+ */
+
+#include "ntfspunch.h"
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include <linux/fs.h>
+#include <linux/bitops.h>
+#include <linux/seq_file.h>
+#include <linux/blkdev.h>
+#include <linux/completion.h>
+#include <linux/wait.h>
+
+struct np_overlay {
+	struct mapping_dev *dev;
+	spinlock_t lock;
+	struct block_device *bdev;
+	char path[256];
+	unsigned int grain_shift;	/* log2 of sectors per grain */
+	unsigned long nr_grains;
+	unsigned long *present;
+	atomic64_t nr_present;
+	struct bio_list deferred;	/* waiting on the worker */
+	int nr_deferred;
+	struct list_head writing;	/* writes in flight to the delta */
+	wait_queue_head_t wait;		/* for those to complete */
+	struct work_struct work;
+	struct page **buf;		/* one grain, for copy-ups */
+	unsigned int buf_pages;
+	mempool_t *io_pool;
+	u64 delta_reads;		/* stats */
+	u64 origin_reads;
+	u64 copy_ups;
+};
+
+struct np_overlay_io {
+	struct np_overlay *ov;
+	struct bio *parent;
+	unsigned long first;	/* grains to mark present */
+	unsigned long last;
+	int write;
+	atomic_t remaining;
+	int error;
+	struct list_head list;	/* on writing, for writes */
+};
+
+static void
+overlay_io_put(struct np_overlay_io *io)
+{
+	struct np_overlay *ov = io->ov;
+	unsigned long flags;
+	unsigned long g;
+
+	if (!atomic_dec_and_test(&io->remaining))
+		return;
+	if (io->write) {
+		if (io->error == 0)
+			for (g = io->first; g <= io->last; g++)
+				if (!test_and_set_bit(g, ov->present))
+					atomic64_inc(&ov->nr_present);
+		spin_lock_irqsave(&ov->lock, flags);
+		list_del(&io->list);
+		wake_up(&ov->wait);
+		spin_unlock_irqrestore(&ov->lock, flags);
+	}
+	bio_endio(io->parent, io->error);
+	mempool_free(io, ov->io_pool);
+}
+
+static void
+overlay_end_io(struct bio *clone, int err)
+{
+	struct np_overlay_io *io = clone->bi_private;
+
+	if (err)
+		io->error = err;
+	bio_put(clone);
+	overlay_io_put(io);
+}
+
+static struct np_overlay_io *
+overlay_io_alloc(struct np_overlay *ov, struct bio *bio)
+{
+	struct np_overlay_io *io = mempool_alloc(ov->io_pool, GFP_NOIO);
+
+	io->ov = ov;
+	io->parent = bio;
+	io->first = 1;
+	io->last = 0;
+	io->write = bio_data_dir(bio) == WRITE;
+	io->error = 0;
+	atomic_set(&io->remaining, 1);
+	return io;
+}
+
+static struct bio *
+overlay_clone(struct np_overlay *ov, struct np_overlay_io *io, struct bio *bio)
+{
+	struct bio *clone = bio_clone_bioset(bio, GFP_NOIO, ov->dev->bs);
+
+	clone->bi_end_io = overlay_end_io;
+	clone->bi_private = io;
+	return clone;
+}
+
+/*
+ * Sectors from pos to the end of its run of grains that are (or aren't)
+ * in the delta, capped at end
+ */
+static sector_t
+overlay_run(struct np_overlay *ov, sector_t pos, sector_t end, int *in_delta)
+{
+	unsigned long g = pos >> ov->grain_shift;
+	unsigned long last = (end - 1) >> ov->grain_shift;
+	unsigned long next;
+
+	*in_delta = test_bit(g, ov->present);
+	if (*in_delta)
+		next = find_next_zero_bit(ov->present, last + 1, g);
+	else
+		next = find_next_bit(ov->present, last + 1, g);
+	return min_t(sector_t, end, (sector_t)next << ov->grain_shift) - pos;
+}
+
+/*
+ * The bitmap can change under a read as writes and copy-ups finish, so
+ * each piece is sent as soon as it's found, with io holding a reference
+ * of its own until they all are
+ */
+static void
+overlay_read(struct np_overlay *ov, struct bio *bio)
+{
+	sector_t start = bio->bi_sector, end = bio_end_sector(bio);
+	struct np_overlay_io *io = overlay_io_alloc(ov, bio);
+	sector_t pos, len;
+	struct bio *clone;
+	int in_delta;
+
+	for (pos = start; pos < end; pos += len) {
+		len = overlay_run(ov, pos, end, &in_delta);
+		atomic_inc(&io->remaining);
+		clone = overlay_clone(ov, io, bio);
+		if (len != end - start)
+			bio_trim(clone, pos - start, len);
+		if (in_delta) {
+			ov->delta_reads++;
+			clone->bi_bdev = ov->bdev;
+			generic_make_request(clone);
+		} else {
+			ov->origin_reads++;
+			ntfspunch_remap_origin(ov->dev, clone);
+		}
+	}
+	overlay_io_put(io);
+}
+
+/*
+ * Send a write to the delta, marking the whole grains it covers present
+ * once it's done.  io must already be on the writing list.
+ */
+static void
+overlay_write(struct np_overlay *ov, struct np_overlay_io *io)
+{
+	struct bio *bio = io->parent;
+	sector_t mask = (1 << ov->grain_shift) - 1;
+	unsigned long first = (bio->bi_sector + mask) >> ov->grain_shift;
+	unsigned long end = bio_end_sector(bio) >> ov->grain_shift;
+	struct bio *clone;
+
+	/* Otherwise it covers no whole grain, and io has nothing to mark */
+	if (end > first) {
+		io->first = first;
+		io->last = end - 1;
+	}
+	clone = overlay_clone(ov, io, bio);
+	clone->bi_bdev = ov->bdev;
+	generic_make_request(clone);
+}
+
+/*
+ * Whether a write only partly covers a grain that isn't in the delta
+ */
+static int
+overlay_needs_copy(struct np_overlay *ov, sector_t sector)
+{
+	sector_t mask = (1 << ov->grain_shift) - 1;
+
+	return (sector & mask) && !test_bit(sector >> ov->grain_shift,
+					    ov->present);
+}
+
+struct overlay_sync {
+	struct completion done;
+	int error;
+};
+
+static void
+overlay_sync_end_io(struct bio *bio, int err)
+{
+	struct overlay_sync *sync = bio->bi_private;
+
+	sync->error = err;
+	complete(&sync->done);
+}
+
+static int
+overlay_sync_io(struct np_overlay *ov, struct block_device *bdev, int rw,
+		sector_t sector)
+{
+	struct overlay_sync sync;
+	struct bio *bio;
+	unsigned int bytes = np_sectors_to_bytes(1 << ov->grain_shift);
+	unsigned int i, seg;
+
+	init_completion(&sync.done);
+	bio = bio_alloc(GFP_NOIO, ov->buf_pages);
+	bio->bi_sector = sector;
+	bio->bi_end_io = overlay_sync_end_io;
+	bio->bi_private = &sync;
+	for (i = 0; bytes; i++, bytes -= seg) {
+		seg = min_t(unsigned int, bytes, PAGE_SIZE);
+		bio_add_page(bio, ov->buf[i], seg, 0);
+	}
+	if (bdev) {
+		bio->bi_bdev = bdev;
+		submit_bio(rw, bio);
+	} else {
+		bio->bi_rw = rw;
+		ntfspunch_remap_origin(ov->dev, bio);
+	}
+	wait_for_completion(&sync.done);
+	bio_put(bio);
+	return sync.error;
+}
+
+/*
+ * Whether a write touching grain g is on its way to the delta
+ */
+static int
+overlay_writing(struct np_overlay *ov, unsigned long g)
+{
+	struct np_overlay_io *io;
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&ov->lock, flags);
+	list_for_each_entry(io, &ov->writing, list)
+		if (g >= io->parent->bi_sector >> ov->grain_shift &&
+		    g <= (bio_end_sector(io->parent) - 1) >> ov->grain_shift) {
+			ret = 1;
+			break;
+		}
+	spin_unlock_irqrestore(&ov->lock, flags);
+	return ret;
+}
+
+/*
+ * Copy a grain up from the image to the delta as it is.  New writes are
+ * held back while the worker runs, so once those in flight to the grain
+ * are done, nothing can land there under the copy.
+ */
+static int
+overlay_copy_up(struct np_overlay *ov, unsigned long g)
+{
+	sector_t sector = (sector_t)g << ov->grain_shift;
+	int ret;
+
+	wait_event(ov->wait, !overlay_writing(ov, g));
+	if (test_bit(g, ov->present))
+		return 0;
+	ret = overlay_sync_io(ov, NULL, READ, sector);
+	/* Written whole since, and the image's copy is out of date */
+	if (ret == 0 && test_bit(g, ov->present))
+		return 0;
+	if (ret == 0)
+		ret = overlay_sync_io(ov, ov->bdev, WRITE, sector);
+	if (ret == 0) {
+		set_bit(g, ov->present);
+		atomic64_inc(&ov->nr_present);
+		ov->copy_ups++;
+	}
+	return ret;
+}
+
+static void
+overlay_work(struct work_struct *work)
+{
+	struct np_overlay *ov = container_of(work, struct np_overlay, work);
+	struct np_overlay_io *io;
+	unsigned long flags;
+	struct bio *bio;
+	int ret;
+
+	for (;;) {
+		spin_lock_irqsave(&ov->lock, flags);
+		bio = bio_list_pop(&ov->deferred);
+		if (bio == NULL)
+			ov->nr_deferred = 0;
+		spin_unlock_irqrestore(&ov->lock, flags);
+		if (bio == NULL)
+			break;
+
+		ret = 0;
+		if (overlay_needs_copy(ov, bio->bi_sector))
+			ret = overlay_copy_up(ov, bio->bi_sector >>
+					      ov->grain_shift);
+		if (ret == 0 && overlay_needs_copy(ov, bio_end_sector(bio)))
+			ret = overlay_copy_up(ov, bio_end_sector(bio) >>
+					      ov->grain_shift);
+		if (ret) {
+			bio_endio(bio, ret);
+			continue;
+		}
+		io = overlay_io_alloc(ov, bio);
+		spin_lock_irqsave(&ov->lock, flags);
+		list_add_tail(&io->list, &ov->writing);
+		spin_unlock_irqrestore(&ov->lock, flags);
+		overlay_write(ov, io);
+	}
+}
+
+void
+np_overlay_map(struct mapping_dev *dev, struct bio *bio)
+{
+	struct np_overlay *ov = dev->overlay;
+	struct np_overlay_io *io;
+	unsigned long flags;
+
+	if (bio_data_dir(bio) != WRITE) {
+		overlay_read(ov, bio);
+		return;
+	}
+	/* Nothing to keep, and nothing of the image to drop */
+	if (bio->bi_rw & REQ_DISCARD) {
+		bio_endio(bio, 0);
+		return;
+	}
+
+	/* Listed under the worker's lock, so a copy-up can't miss it */
+	io = overlay_io_alloc(ov, bio);
+	spin_lock_irqsave(&ov->lock, flags);
+	if (ov->nr_deferred || overlay_needs_copy(ov, bio->bi_sector) ||
+	    overlay_needs_copy(ov, bio_end_sector(bio))) {
+		bio_list_add(&ov->deferred, bio);
+		if (ov->nr_deferred++ == 0)
+			queue_work(np_wq, &ov->work);
+		spin_unlock_irqrestore(&ov->lock, flags);
+		mempool_free(io, ov->io_pool);
+		return;
+	}
+	list_add_tail(&io->list, &ov->writing);
+	spin_unlock_irqrestore(&ov->lock, flags);
+	overlay_write(ov, io);
+}
+
+static void
+overlay_free(struct np_overlay *ov)
+{
+	unsigned int i;
+
+	if (ov->buf) {
+		for (i = 0; i < ov->buf_pages; i++)
+			if (ov->buf[i])
+				__free_page(ov->buf[i]);
+		kfree(ov->buf);
+	}
+	if (ov->io_pool)
+		mempool_destroy(ov->io_pool);
+	vfree(ov->present);
+	if (ov->bdev)
+		blkdev_put(ov->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	kfree(ov);
+}
+
+static int
+overlay_attach(struct mapping_dev *dev, const char *path)
+{
+	struct np_overlay *ov;
+	struct block_device *bdev;
+	u32 grain = dev->sector_size;
+	unsigned int i;
+	int ret;
+
+	if (dev->overlay || dev->cache)
+		return -EBUSY;
+	if (dev->users > 0)
+		return -EBUSY;
+
+	ov = kzalloc(sizeof(*ov), GFP_KERNEL);
+	if (ov == NULL)
+		return -ENOMEM;
+	ov->dev = dev;
+	spin_lock_init(&ov->lock);
+	strncpy(ov->path, path, sizeof(ov->path) - 1);
+	bio_list_init(&ov->deferred);
+	INIT_LIST_HEAD(&ov->writing);
+	init_waitqueue_head(&ov->wait);
+	INIT_WORK(&ov->work, overlay_work);
+	atomic64_set(&ov->nr_present, 0);
+
+	bdev = blkdev_get_by_path(path, FMODE_READ | FMODE_WRITE | FMODE_EXCL,
+				  ov);
+	if (IS_ERR(bdev)) {
+		printk(KERN_WARNING "ntfspunch: Failed to open overlay %s\n",
+		       path);
+		kfree(ov);
+		return PTR_ERR(bdev);
+	}
+	ov->bdev = bdev;
+	if (i_size_read(bdev->bd_inode) < dev->size ||
+	    bdev_logical_block_size(bdev) > dev->sector_size) {
+		printk(KERN_WARNING "ntfspunch: overlay %s must be at least %lld bytes with blocks of at most %u\n",
+		       path, dev->size, dev->sector_size);
+		ret = -EINVAL;
+		goto fail;
+	}
+
+	/* A grain is a cluster (the largest, for multi-file devices) */
+	for (i = 0; i < dev->nr_members; i++)
+		grain = max(grain, dev->members[i].cluster_size);
+	ov->grain_shift = ilog2(grain) - NP_SECTOR_SHIFT;
+	ov->nr_grains = DIV_ROUND_UP_ULL(np_bytes_to_sectors(dev->size),
+					 1 << ov->grain_shift);
+
+	ret = -ENOMEM;
+	ov->present = vzalloc(BITS_TO_LONGS(ov->nr_grains) * sizeof(long));
+	ov->buf_pages = DIV_ROUND_UP(grain, PAGE_SIZE);
+	ov->buf = kcalloc(ov->buf_pages, sizeof(*ov->buf), GFP_KERNEL);
+	ov->io_pool = mempool_create_kmalloc_pool(BIO_POOL_SIZE,
+						  sizeof(struct np_overlay_io));
+	if (ov->present == NULL || ov->buf == NULL || ov->io_pool == NULL)
+		goto fail;
+	for (i = 0; i < ov->buf_pages; i++)
+		if ((ov->buf[i] = alloc_page(GFP_KERNEL)) == NULL)
+			goto fail;
+
+	prefetch_ctl(dev, "", "off");
+	dev->overlay = ov;
+	return 0;
+
+fail:
+	overlay_free(ov);
+	return ret;
+}
+
+void
+np_overlay_detach(struct mapping_dev *dev)
+{
+	struct np_overlay *ov = dev->overlay;
+
+	if (ov == NULL)
+		return;
+	flush_work(&ov->work);
+	dev->overlay = NULL;
+	overlay_free(ov);
+}
+
+struct block_device *
+np_overlay_flush_bdev(struct mapping_dev *dev)
+{
+	return dev->overlay ? dev->overlay->bdev : NULL;
+}
+
+int
+np_overlay_ctl(struct mapping_dev *dev, char *key, char *value)
+{
+	struct np_overlay *ov = dev->overlay;
+
+	if (strcmp(key, "attach") == 0)
+		return overlay_attach(dev, value);
+	if (ov == NULL)
+		return -ENODEV;
+	if (strcmp(value, "now") != 0)
+		return -EINVAL;
+	/* Whoever has it open would see the data change underneath them */
+	if (dev->users > 0)
+		return -EBUSY;
+	if (strcmp(key, "discard") == 0) {
+		flush_work(&ov->work);
+		bitmap_zero(ov->present, ov->nr_grains);
+		atomic64_set(&ov->nr_present, 0);
+		return 0;
+	}
+	if (strcmp(key, "detach") == 0) {
+		np_overlay_detach(dev);
+		return 0;
+	}
+	return -EINVAL;
+}
+
+void
+np_overlay_show(struct seq_file *m, struct mapping_dev *dev)
+{
+	struct np_overlay *ov = dev->overlay;
+	u64 present;
+
+	if (ov == NULL) {
+		seq_printf(m, "overlay: none\n");
+		return;
+	}
+	present = atomic64_read(&ov->nr_present);
+	seq_printf(m, "overlay: %s\n", ov->path);
+	seq_printf(m, "overlay_grain_size: %llu\n",
+		   np_sectors_to_bytes(1 << ov->grain_shift));
+	seq_printf(m, "overlay_grains: %llu/%lu\n", present, ov->nr_grains);
+	seq_printf(m, "overlay_bytes: %llu\n",
+		   present * np_sectors_to_bytes(1 << ov->grain_shift));
+	seq_printf(m, "overlay_delta_reads: %llu\n", ov->delta_reads);
+	seq_printf(m, "overlay_origin_reads: %llu\n", ov->origin_reads);
+	seq_printf(m, "overlay_copy_ups: %llu\n", ov->copy_ups);
+}
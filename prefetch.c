@@ -0,0 +1,467 @@
+/*
+ * prefetch.c - Cross-extent sequential prefetch for the NTFS Punch Driver
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * A sequential stream on the punched device turns into a jump to an
+ * unrelated LCN every time it crosses into the next runlist element.  The
+ * underlying disk's own readahead has been pulling in whatever follows the
+ * old run, so the stream stalls on a cold seek.
+ *
+ * We watch for a sequential stream per device and, when it gets within
+ * "depth" of the end of its current run, read the start of the next run
+ * into a small private window.  Reads that land in the window are
+ * completed from memory.  The depth follows the measured stream rate, so
+ * the window covers roughly one seek's worth of the stream, and nothing is
+ * issued until a stream has been seen, so random workloads never pay for
+ * it.
+ *
+ * A window only ever covers the start of a run.  Writes there are tracked
+ * until they complete, and no window is read while any are in flight, so
+ * a window can never pick up data a write is about to replace.  Writes
+ * anywhere else, or with prefetch off, go through untouched.
+ */
+
+#include "ntfspunch.h"
+#include <linux/kernel.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/blkdev.h>
+#include <linux/jiffies.h>
+
+/* Sequential bios needed before we believe it's a stream */
+#define NP_PF_SEQ_THRESHOLD	8
+/* How far ahead of the stream we want the next run, roughly a cold seek */
+#define NP_PF_LOOKAHEAD_MS	20
+#define NP_PF_MIN_PAGES		16
+#define NP_PF_MAX_PAGES		256
+#define NP_PF_MAX_SECTORS	(NP_PF_MAX_PAGES << (PAGE_SHIFT - NP_SECTOR_SHIFT))
+/* How often the stream rate is sampled */
+#define NP_PF_RATE_INTERVAL	(HZ / 10)
+
+enum {
+	NP_PF_IDLE,
+	NP_PF_PENDING,
+	NP_PF_READY,
+};
+
+/*
+ * Where a tracked write was going to complete before we took it over
+ */
+struct np_pf_write {
+	struct mapping_dev *dev;
+	bio_end_io_t *end_io;
+	void *private;
+};
+
+int
+prefetch_init(struct mapping_dev *dev)
+{
+	struct np_prefetch *pf = &dev->pf;
+	int i;
+
+	memset(pf, 0, sizeof(*pf));
+	spin_lock_init(&pf->lock);
+	init_waitqueue_head(&pf->wait);
+	pf->pages = kcalloc(NP_PF_MAX_PAGES, sizeof(*pf->pages), GFP_KERNEL);
+	if (pf->pages == NULL)
+		return -ENOMEM;
+	for (i = 0; i < NP_PF_MAX_PAGES; i++) {
+		pf->pages[i] = alloc_page(GFP_KERNEL);
+		if (pf->pages[i] == NULL) {
+			prefetch_free(dev);
+			return -ENOMEM;
+		}
+	}
+	pf->write_pool = mempool_create_kmalloc_pool(BIO_POOL_SIZE,
+						     sizeof(struct np_pf_write));
+	if (pf->write_pool == NULL) {
+		prefetch_free(dev);
+		return -ENOMEM;
+	}
+	pf->depth = NP_PF_MIN_PAGES << (PAGE_SHIFT - NP_SECTOR_SHIFT);
+	pf->enabled = dev->nr_members == 1;
+	return 0;
+}
+
+/*
+ * Whether nothing in flight still needs the window or the write pool
+ *
+ * Checked under the lock, so whoever woke us has finished with pf.
+ */
+static int
+prefetch_idle(struct np_prefetch *pf)
+{
+	unsigned long flags;
+	int idle;
+
+	spin_lock_irqsave(&pf->lock, flags);
+	idle = pf->state != NP_PF_PENDING && pf->writes == 0;
+	spin_unlock_irqrestore(&pf->lock, flags);
+	return idle;
+}
+
+void
+prefetch_free(struct mapping_dev *dev)
+{
+	struct np_prefetch *pf = &dev->pf;
+	int i;
+
+	if (pf->pages == NULL)
+		return;
+	wait_event(pf->wait, prefetch_idle(pf));
+	if (pf->write_pool)
+		mempool_destroy(pf->write_pool);
+	for (i = 0; i < NP_PF_MAX_PAGES; i++)
+		if (pf->pages[i])
+			__free_page(pf->pages[i]);
+	kfree(pf->pages);
+	pf->pages = NULL;
+}
+
+/*
+ * Drop the current window, counting whatever wasn't read as waste
+ *
+ * pf lock must be held
+ */
+static void
+prefetch_retire(struct np_prefetch *pf)
+{
+	if (pf->state == NP_PF_READY) {
+		pf->wasted += np_sectors_to_bytes(pf->len - pf->consumed);
+		pf->state = NP_PF_IDLE;
+	} else if (pf->state == NP_PF_PENDING) {
+		pf->stale = 1;
+	}
+}
+
+static void
+prefetch_end_io(struct bio *bio, int err)
+{
+	struct mapping_dev *dev = bio->bi_private;
+	struct np_prefetch *pf = &dev->pf;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pf->lock, flags);
+	if (err || pf->stale) {
+		if (!err)
+			pf->wasted += np_sectors_to_bytes(pf->len);
+		pf->state = NP_PF_IDLE;
+	} else {
+		pf->state = NP_PF_READY;
+	}
+	pf->stale = 0;
+	wake_up(&pf->wait);
+	spin_unlock_irqrestore(&pf->lock, flags);
+	bio_put(bio);
+}
+
+/*
+ * Copy the part of the window covering the bio into its pages
+ *
+ * pf lock must be held
+ */
+static void
+prefetch_copy(struct np_prefetch *pf, struct bio *bio)
+{
+	struct bio_vec *bvec;
+	size_t off = np_sectors_to_bytes(bio->bi_sector - pf->start);
+	size_t done, n;
+	char *dst;
+	int i;
+
+	bio_for_each_segment(bvec, bio, i) {
+		dst = kmap_atomic(bvec->bv_page);
+		for (done = 0; done < bvec->bv_len; done += n, off += n) {
+			n = min_t(size_t, bvec->bv_len - done,
+				  PAGE_SIZE - (off & ~PAGE_MASK));
+			memcpy(dst + bvec->bv_offset + done,
+			       page_address(pf->pages[off >> PAGE_SHIFT]) +
+			       (off & ~PAGE_MASK), n);
+		}
+		kunmap_atomic(dst);
+	}
+}
+
+/*
+ * Sample the stream rate and size the window to cover
+ * NP_PF_LOOKAHEAD_MS of it
+ *
+ * pf lock must be held
+ */
+static void
+prefetch_update_rate(struct np_prefetch *pf, unsigned int sectors)
+{
+	unsigned long elapsed = jiffies - pf->rate_start;
+	unsigned long rate, depth;
+
+	pf->rate_sectors += sectors;
+	if (elapsed < NP_PF_RATE_INTERVAL)
+		return;
+
+	/* sectors per second, smoothed */
+	rate = pf->rate_sectors * HZ / elapsed;
+	pf->rate = pf->rate ? (pf->rate * 3 + rate) / 4 : rate;
+	pf->rate_start = jiffies;
+	pf->rate_sectors = 0;
+
+	depth = pf->rate * NP_PF_LOOKAHEAD_MS / 1000;
+	pf->depth = clamp_t(unsigned long, depth,
+			    NP_PF_MIN_PAGES << (PAGE_SHIFT - NP_SECTOR_SHIFT),
+			    NP_PF_MAX_SECTORS);
+}
+
+/*
+ * Build the readahead bio for the start of the run after the one
+ * the stream is in
+ *
+ * pf lock must be held, returns NULL if there's nothing worth reading
+ */
+static struct bio *
+prefetch_prepare(struct mapping_dev *dev, sector_t end)
+{
+	struct np_prefetch *pf = &dev->pf;
+	struct np_member *m = &dev->members[0];
+	runlist_element *rl = find_run(m, end - 1);
+	sector_t run_end, next_start;
+	unsigned int sectors, i;
+	struct bio *bio;
+
+	/* Holes read as zeroes already */
+	if (rl == NULL || rl[1].length == 0 || rl[1].lcn < 0)
+		return NULL;
+	run_end = np_clusters_to_sectors(m, rl->vcn + rl->length);
+	if (run_end - end > pf->depth)
+		return NULL;
+
+	/* It could read the disk before a write in flight lands */
+	if (pf->writes)
+		return NULL;
+
+	next_start = np_clusters_to_sectors(m, rl[1].vcn);
+	if (pf->state != NP_PF_IDLE) {
+		if (pf->start == next_start)
+			return NULL;	/* already have it */
+		prefetch_retire(pf);
+		if (pf->state == NP_PF_PENDING)
+			return NULL;
+	}
+
+	sectors = min_t(u64, pf->depth,
+			np_clusters_to_sectors(m, rl[1].length));
+	sectors = round_down(sectors, np_bytes_to_sectors(PAGE_SIZE));
+	if (sectors == 0)
+		return NULL;
+	bio = bio_alloc(GFP_NOWAIT | __GFP_NOWARN, sectors >> (PAGE_SHIFT - NP_SECTOR_SHIFT));
+	if (bio == NULL)
+		return NULL;
+	bio->bi_bdev = m->block_dev;
+	bio->bi_rw = READA;
+	bio->bi_sector = np_clusters_to_sectors(m, rl[1].lcn);
+	bio->bi_end_io = prefetch_end_io;
+	bio->bi_private = dev;
+	for (i = 0; i < sectors >> (PAGE_SHIFT - NP_SECTOR_SHIFT); i++)
+		bio_add_page(bio, pf->pages[i], PAGE_SIZE, 0);
+
+	pf->state = NP_PF_PENDING;
+	pf->stale = 0;
+	pf->start = next_start;
+	pf->len = bio_sectors(bio);
+	pf->consumed = 0;
+	pf->issued += np_sectors_to_bytes(pf->len);
+	return bio;
+}
+
+/*
+ * Feed a read through the stream detector
+ *
+ * Returns 1 if the read was completed out of the prefetch window,
+ * otherwise the caller remaps it as usual.
+ */
+int
+prefetch_read(struct mapping_dev *dev, struct bio *bio)
+{
+	struct np_prefetch *pf = &dev->pf;
+	sector_t start = bio->bi_sector, end = bio_end_sector(bio);
+	struct bio *ra = NULL;
+	unsigned long flags;
+	int hit = 0;
+
+	/*
+	 * Runs are only sequential on disk within a single file, and with
+	 * a cache or overlay the image may be behind it
+	 */
+	if (!pf->enabled || pf->pages == NULL || bio_sectors(bio) == 0 ||
+	    dev->nr_members != 1 || dev->cache || dev->overlay)
+		return 0;
+
+	spin_lock_irqsave(&pf->lock, flags);
+
+	if (pf->state == NP_PF_READY &&
+	    start >= pf->start && end <= pf->start + pf->len) {
+		prefetch_copy(pf, bio);
+		pf->consumed += bio_sectors(bio);
+		pf->hits += bio->bi_size;
+		hit = 1;
+		if (pf->consumed >= pf->len)
+			pf->state = NP_PF_IDLE;
+	} else if (pf->state == NP_PF_PENDING &&
+		   start < pf->start + pf->len && end > pf->start) {
+		pf->late++;
+	}
+
+	if (start == pf->next) {
+		if (pf->seq++ == 0) {
+			pf->rate_start = jiffies;
+			pf->rate_sectors = 0;
+		}
+		prefetch_update_rate(pf, bio_sectors(bio));
+	} else {
+		/* Stream broke (or never was) - give up on the window */
+		if (pf->seq >= NP_PF_SEQ_THRESHOLD && pf->state != NP_PF_IDLE &&
+		    !(start >= pf->start && start < pf->start + pf->len))
+			prefetch_retire(pf);
+		pf->seq = 0;
+	}
+	pf->next = end;
+
+	if (pf->state == NP_PF_READY && start >= pf->start + pf->len)
+		prefetch_retire(pf);	/* stream went past the window */
+
+	if (pf->seq >= NP_PF_SEQ_THRESHOLD)
+		ra = prefetch_prepare(dev, end);
+	spin_unlock_irqrestore(&pf->lock, flags);
+
+	if (ra)
+		generic_make_request(ra);
+	if (hit)
+		bio_endio(bio, 0);
+	return hit;
+}
+
+static void
+prefetch_write_end_io(struct bio *bio, int err)
+{
+	struct np_pf_write *w = bio->bi_private;
+	struct np_prefetch *pf = &w->dev->pf;
+	unsigned long flags;
+
+	bio->bi_end_io = w->end_io;
+	bio->bi_private = w->private;
+	mempool_free(w, pf->write_pool);
+	spin_lock_irqsave(&pf->lock, flags);
+	if (--pf->writes == 0)
+		wake_up(&pf->wait);
+	spin_unlock_irqrestore(&pf->lock, flags);
+	bio_endio(bio, err);
+}
+
+/*
+ * Whether a write could land in a window, now or later: the first
+ * NP_PF_MAX_SECTORS of the run it starts in, or the start of the next
+ */
+static int
+prefetch_write_overlaps(struct mapping_dev *dev, struct bio *bio)
+{
+	struct np_member *m = &dev->members[0];
+	runlist_element *rl = find_run(m, bio->bi_sector);
+
+	if (rl == NULL)
+		return 0;
+	return bio->bi_sector < np_clusters_to_sectors(m, rl->vcn) +
+		NP_PF_MAX_SECTORS ||
+		bio_end_sector(bio) > np_clusters_to_sectors(m, rl->vcn +
+							     rl->length);
+}
+
+/*
+ * Writes that could land in a window drop the one they overlap, and
+ * hold off new windows until they complete
+ */
+void
+prefetch_write(struct mapping_dev *dev, struct bio *bio)
+{
+	struct np_prefetch *pf = &dev->pf;
+	struct np_pf_write *w;
+	unsigned long flags;
+
+	/* Only single file devices with prefetch on ever have a window */
+	if (pf->pages == NULL || dev->nr_members != 1 || !pf->enabled ||
+	    !prefetch_write_overlaps(dev, bio))
+		return;
+	w = mempool_alloc(pf->write_pool, GFP_NOIO);
+	w->dev = dev;
+	w->end_io = bio->bi_end_io;
+	w->private = bio->bi_private;
+	bio->bi_end_io = prefetch_write_end_io;
+	bio->bi_private = w;
+
+	spin_lock_irqsave(&pf->lock, flags);
+	pf->writes++;
+	if (bio->bi_sector < pf->start + pf->len &&
+	    bio_end_sector(bio) > pf->start)
+		prefetch_retire(pf);
+	spin_unlock_irqrestore(&pf->lock, flags);
+}
+
+int
+prefetch_ctl(struct mapping_dev *dev, char *key, char *value)
+{
+	struct np_prefetch *pf = &dev->pf;
+	unsigned long flags;
+
+	if (dev->nr_members != 1 && strcmp(value, "on") == 0)
+		return -EOPNOTSUPP;
+	spin_lock_irqsave(&pf->lock, flags);
+	if (strcmp(value, "on") == 0) {
+		/*
+		 * Writes already in flight weren't tracked, but a stream
+		 * takes NP_PF_SEQ_THRESHOLD reads to be seen, by when
+		 * they've landed
+		 */
+		pf->enabled = 1;
+	} else if (strcmp(value, "off") == 0) {
+		pf->enabled = 0;
+		prefetch_retire(pf);
+	} else {
+		spin_unlock_irqrestore(&pf->lock, flags);
+		return -EINVAL;
+	}
+	spin_unlock_irqrestore(&pf->lock, flags);
+	return 0;
+}
+
+void
+prefetch_show(struct seq_file *m, struct mapping_dev *dev)
+{
+	struct np_prefetch *pf = &dev->pf;
+
+	seq_printf(m, "prefetch: %s\n", pf->enabled ? "on" : "off");
+	seq_printf(m, "prefetch_depth: %llu\n",
+		   np_sectors_to_bytes(pf->depth));
+	seq_printf(m, "prefetch_rate: %llu\n",
+		   np_sectors_to_bytes(pf->rate));
+	seq_printf(m, "prefetch_issued: %llu\n", pf->issued);
+	seq_printf(m, "prefetch_hits: %llu\n", pf->hits);
+	seq_printf(m, "prefetch_wasted: %llu\n", pf->wasted);
+	seq_printf(m, "prefetch_late: %llu\n", pf->late);
+}
@@ -25,6 +25,8 @@
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/math64.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/string.h>
@@ -34,6 +36,7 @@ MODULE_LICENSE("GPL v2");
 
 static struct proc_dir_entry *proc_dir = NULL;
 static struct proc_dir_entry *proc_add = NULL;
+static struct proc_dir_entry *proc_lookup = NULL;
 
 static ssize_t
 add_write(struct file *fp, const char *userBuf, size_t len, loff_t *off)
@@ -74,7 +77,11 @@ static int
 dump_node(struct seq_file *m, void *v, int index)
 {
 	struct mapping_dev *dev;
+	struct np_member *mb;
 	runlist_element *rl;
+	int i, nr_runs;
+	u64 frac;
+	u32 rem;
 	spin_lock(&dev_list_lock);
 	if (index < 0 || index >= num_devices) {
 		printk(KERN_WARNING "ntfspunch: index out of bounds\n");
@@ -95,15 +102,63 @@ dump_node(struct seq_file *m, void *v, int index)
 	seq_printf(m, "minor_number: %d\n", dev->gd->first_minor);
 	seq_printf(m, "use_count: %d\n", dev->users);
 	seq_printf(m, "size: %lld\n", dev->size);
-	seq_printf(m, "cluster_size: %u\n", dev->cluster_size);
-	seq_printf(m, "\nfile_offset:disk_offset:length\n");
-
-	/* XXX This could pop if the runlist is long... */
-	for (rl = dev->rl; rl->length; rl++) {
-		seq_printf(m, "%lld:%lld:%lld\n",
-			   rl->vcn * dev->cluster_size,
-			   rl->lcn * dev->cluster_size,
-			   rl->length * dev->cluster_size);
+	seq_printf(m, "sector_size: %u\n", dev->sector_size);
+	if (dev->layout == NP_LAYOUT_STRIPE) {
+		seq_printf(m, "layout: stripe\n");
+		seq_printf(m, "chunk_size: %llu\n",
+			   np_sectors_to_bytes(dev->chunk_sectors));
+	} else if (dev->layout == NP_LAYOUT_MIRROR) {
+		seq_printf(m, "layout: mirror\n");
+	}
+	for (i = 0, nr_runs = 0; i < dev->nr_members; i++)
+		nr_runs += dev->members[i].nr_runs;
+	seq_printf(m, "phys_block_size: %u\n", dev->phys_block_size);
+	seq_printf(m, "alignment_offset: %u\n",
+		   dev->queue->limits.alignment_offset);
+	seq_printf(m, "misaligned_runs: %d/%d\n", dev->misaligned_runs,
+		   nr_runs);
+	/* in hundredths of a percent */
+	frac = div64_u64(dev->misaligned_bytes * 10000, dev->size);
+	rem = do_div(frac, 100);
+	seq_printf(m, "misaligned_fraction: %llu.%02u%%\n", frac, rem);
+	seq_printf(m, "splits: %lld\n", (long long)atomic64_read(&dev->splits));
+	seq_printf(m, "hole_read_bytes: %lld\n",
+		   (long long)atomic64_read(&dev->hole_bytes));
+	seq_printf(m, "zero_detect: %s\n", dev->zero_detect ? "on" : "off");
+	seq_printf(m, "zero_writes: %lld\n",
+		   (long long)atomic64_read(&dev->zero_writes));
+	seq_printf(m, "zero_write_bytes: %lld\n",
+		   (long long)atomic64_read(&dev->zero_bytes));
+	prefetch_show(m, dev);
+	np_qos_show(m, dev);
+	np_mirror_show(m, dev);
+	np_cache_show(m, dev);
+	np_overlay_show(m, dev);
+	np_cbt_show(m, dev);
+	np_mft_show(m, dev);
+
+	for (i = 0; i < dev->nr_members; i++) {
+		mb = &dev->members[i];
+		if (dev->nr_members > 1) {
+			seq_printf(m, "\nmember: %d\n", i);
+			seq_printf(m, "filename: %s\n", mb->filename);
+		}
+		seq_printf(m, "cluster_size: %u\n", mb->cluster_size);
+		seq_printf(m, "bitmap_check_us: %llu\n", mb->bitmap_check_us);
+		seq_printf(m, "disk: %u:%u\n", MAJOR(mb->block_dev->bd_dev),
+			   MINOR(mb->block_dev->bd_dev));
+		np_disk_show(m, mb->disk);
+		np_mirror_show_member(m, dev, mb);
+		seq_printf(m, "\nfile_offset:disk_offset:length\n");
+
+		/* XXX This could pop if the runlist is long... */
+		for (rl = mb->rl; rl->length; rl++) {
+			/* Holes have a disk_offset of -1 */
+			seq_printf(m, "%lld:%lld:%lld\n",
+				   rl->vcn * mb->cluster_size,
+				   rl->lcn < 0 ? -1LL : rl->lcn * mb->cluster_size,
+				   rl->length * mb->cluster_size);
+		}
 	}
 	spin_unlock(&dev->lock);
 	return 0;
@@ -144,10 +199,73 @@ dump_open(struct inode *inode, struct file *file)
 	return ret;
 }
 
+/*
+ * Per device tunables, written as "<key> <value>" to the dump node
+ *
+ * Keys are matched on prefix, the handler gets the rest of the key.
+ */
+static struct {
+	const char *key;
+	int (*handler)(struct mapping_dev *dev, char *key, char *value);
+} dump_ctls[] = {
+	{ "prefetch", prefetch_ctl },
+	{ "qos_", np_qos_ctl },
+	{ "mirror_", np_mirror_ctl },
+	{ "cache_", np_cache_ctl },
+	{ "overlay_", np_overlay_ctl },
+	{ "cbt_", np_cbt_ctl },
+	{ "zero_detect", ntfspunch_zero_ctl },
+	{ "mft_", np_mft_ctl },
+};
+
+static ssize_t
+dump_write(struct file *fp, const char *userBuf, size_t len, loff_t *off)
+{
+	struct seq_file *m = fp->private_data;
+	int index = (int)(unsigned long long)m->private;
+	struct mapping_dev *dev;
+	char buf[256], *value, *key;
+	int i, klen, ret = -EINVAL;
+
+	if (len >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, userBuf, len))
+		return -EFAULT;
+	buf[len] = '\0';
+	value = strim(buf);
+	key = strsep(&value, " \t");
+	if (value == NULL)
+		return -EINVAL;
+	value = strim(value);
+
+	spin_lock(&dev_list_lock);
+	if (index < 0 || index >= num_devices) {
+		spin_unlock(&dev_list_lock);
+		return -ENODEV;
+	}
+	dev = dev_list[index];
+	spin_unlock(&dev_list_lock);
+
+	for (i = 0; i < ARRAY_SIZE(dump_ctls); i++) {
+		klen = strlen(dump_ctls[i].key);
+		if (strncmp(key, dump_ctls[i].key, klen) == 0) {
+			ret = dump_ctls[i].handler(dev, key + klen, value);
+			break;
+		}
+	}
+	if (ret) {
+		printk(KERN_WARNING "ntfspunch: bad setting \"%s %s\"\n",
+		       key, value);
+		return ret;
+	}
+	return len;
+}
+
 static struct file_operations dump_fops = {
 	.owner = THIS_MODULE,
 	.open = dump_open,
 	.read = seq_read,
+	.write = dump_write,
 	.llseek = seq_lseek,
 	.release = single_release,
 };
@@ -179,13 +297,84 @@ static struct file_operations add_fops = {
 	.release = single_release,
 };
 
+/*
+ * Operations for the lookup node (global)
+ *
+ * Write "<major>:<minor> <sector>" for a sector of the disk, or of the
+ * partition the volume is on, then read back which device and file it
+ * belongs to.  Each open file keeps its own answer.
+ */
+
+#define NP_LOOKUP_SIZE	(PATH_MAX + 128)
+
+static int
+lookup_show(struct seq_file *m, void *v)
+{
+	seq_puts(m, m->private);
+	return 0;
+}
+
+static int
+lookup_open(struct inode *inode, struct file *file)
+{
+	char *buf;
+	int ret;
+
+	buf = kzalloc(NP_LOOKUP_SIZE, GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+	ret = single_open(file, lookup_show, buf);
+	if (ret)
+		kfree(buf);
+	return ret;
+}
+
+static ssize_t
+lookup_write(struct file *fp, const char *userBuf, size_t len, loff_t *off)
+{
+	struct seq_file *m = fp->private_data;
+	unsigned int major, minor;
+	unsigned long long sector;
+	char buf[64];
+
+	if (len >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, userBuf, len))
+		return -EFAULT;
+	buf[len] = '\0';
+	if (sscanf(buf, "%u:%u %llu", &major, &minor, &sector) != 3)
+		return -EINVAL;
+	if (np_disk_lookup(MKDEV(major, minor), sector, m->private,
+			   NP_LOOKUP_SIZE))
+		snprintf(m->private, NP_LOOKUP_SIZE, "none\n");
+	/* So the answer can be read back on the same file */
+	*off = 0;
+	return len;
+}
+
+static int
+lookup_release(struct inode *inode, struct file *file)
+{
+	kfree(((struct seq_file *)file->private_data)->private);
+	return single_release(inode, file);
+}
+
+static struct file_operations lookup_fops = {
+	.owner = THIS_MODULE,
+	.open = lookup_open,
+	.read = seq_read,
+	.write = lookup_write,
+	.llseek = seq_lseek,
+	.release = lookup_release,
+};
+
 int
 proc_add_node(int index)
 {
 	char name[2];
 	name[0] = index + 'a';
 	name[1] = '\0';
-	return PTR_ERR(proc_create(name, 0, proc_dir, &dump_fops));
+	return PTR_ERR(proc_create(name, 0644, proc_dir, &dump_fops));
 }
 
 int
@@ -211,6 +400,11 @@ proc_init(void)
 		printk(KERN_WARNING "ntfspunch: failed alloc ntfspunch add node\n");
 		return -ENOMEM;
 	}
+	proc_lookup = proc_create("lookup", 0644, proc_dir, &lookup_fops);
+	if (proc_lookup == NULL) {
+		printk(KERN_WARNING "ntfspunch: failed alloc ntfspunch lookup node\n");
+		return -ENOMEM;
+	}
 	return 0;
 }
 
@@ -219,6 +413,8 @@ proc_exit(void)
 {
 	if (proc_add != NULL)
 		remove_proc_entry("add", proc_dir);
+	if (proc_lookup != NULL)
+		remove_proc_entry("lookup", proc_dir);
 	if (proc_dir != NULL)
 		remove_proc_entry("ntfspunch", NULL);
 }
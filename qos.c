@@ -0,0 +1,296 @@
+/*
+ * qos.c - Per device bandwidth and IOPS limits for the NTFS Punch Driver
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Token buckets for read/write bytes and IOPS.  Each bucket refills at
+ * its limit per second and holds up to "burst" milliseconds worth.  A bio
+ * is admitted when every bucket it draws on is positive, and is then
+ * charged in full, so a big bio can put a bucket into debt rather than
+ * never fitting.
+ *
+ * Bios that aren't admitted wait, in order, on a per-device list and are
+ * released from a delayed work item once the buckets have refilled.  The
+ * submitter never spins or sleeps.
+ */
+
+#include "ntfspunch.h"
+#include <linux/kernel.h>
+#include <linux/jiffies.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+#include <linux/blkdev.h>
+#include <linux/math64.h>
+
+#define NP_QOS_DEFAULT_BURST_MS	100
+
+static const char *np_qos_names[NP_QOS_NR] = {
+	[NP_QOS_RBPS] = "rbps",
+	[NP_QOS_WBPS] = "wbps",
+	[NP_QOS_RIOPS] = "riops",
+	[NP_QOS_WIOPS] = "wiops",
+};
+
+static void np_qos_dispatch(struct work_struct *work);
+
+void
+np_qos_init(struct mapping_dev *dev)
+{
+	struct np_qos *qos = &dev->qos;
+
+	memset(qos, 0, sizeof(*qos));
+	spin_lock_init(&qos->lock);
+	bio_list_init(&qos->queued);
+	INIT_DELAYED_WORK(&qos->work, np_qos_dispatch);
+	qos->dev = dev;
+	qos->burst_ms = NP_QOS_DEFAULT_BURST_MS;
+	qos->last = jiffies;
+}
+
+/*
+ * Fail anything still waiting, the device is going away
+ */
+void
+np_qos_free(struct mapping_dev *dev)
+{
+	struct np_qos *qos = &dev->qos;
+	struct bio *bio;
+
+	cancel_delayed_work_sync(&qos->work);
+	while ((bio = bio_list_pop(&qos->queued)))
+		bio_io_error(bio);
+}
+
+/*
+ * At least one token, or a limit below 1000/burst_ms never admits
+ * anything
+ */
+static s64
+np_qos_capacity(struct np_qos *qos, int i)
+{
+	return max_t(u64, div_u64((u64)qos->limit[i] * qos->burst_ms, 1000),
+		     1);
+}
+
+/*
+ * qos lock must be held
+ */
+static void
+np_qos_refill(struct np_qos *qos)
+{
+	unsigned long now = jiffies;
+	unsigned long elapsed = now - qos->last;
+	int i;
+
+	if (elapsed == 0)
+		return;
+	qos->last = now;
+	for (i = 0; i < NP_QOS_NR; i++) {
+		if (qos->limit[i] == 0)
+			continue;
+		/*
+		 * Carry the part of a token that hasn't accrued yet, or a
+		 * low limit refilled every jiffy would never get one
+		 */
+		qos->tokens[i] += div_u64_rem((u64)qos->limit[i] * elapsed +
+					      qos->frac[i], HZ, &qos->frac[i]);
+		if (qos->tokens[i] >= np_qos_capacity(qos, i)) {
+			qos->tokens[i] = np_qos_capacity(qos, i);
+			qos->frac[i] = 0;
+		}
+	}
+}
+
+/*
+ * Which buckets a bio draws on, and how much from each
+ */
+static void
+np_qos_cost(struct bio *bio, int *bytes_bucket, int *iops_bucket)
+{
+	if (bio_data_dir(bio) == WRITE) {
+		*bytes_bucket = NP_QOS_WBPS;
+		*iops_bucket = NP_QOS_WIOPS;
+	} else {
+		*bytes_bucket = NP_QOS_RBPS;
+		*iops_bucket = NP_QOS_RIOPS;
+	}
+}
+
+/*
+ * Charge the bio if its buckets allow it now, otherwise return how many
+ * jiffies until they will
+ *
+ * qos lock must be held
+ */
+static unsigned long
+np_qos_charge(struct np_qos *qos, struct bio *bio)
+{
+	unsigned long wait = 0, w;
+	int b, n, i;
+
+	np_qos_cost(bio, &b, &n);
+	for (i = 0; i < NP_QOS_NR; i++) {
+		if ((i != b && i != n) || qos->limit[i] == 0 ||
+		    qos->tokens[i] > 0)
+			continue;
+		/* Time to climb back above zero */
+		w = msecs_to_jiffies(div64_u64((u64)(1 - qos->tokens[i]) * 1000,
+					       qos->limit[i]));
+		wait = max(wait, max(w, 1UL));
+	}
+	if (wait)
+		return wait;
+
+	if (qos->limit[b])
+		qos->tokens[b] -= bio->bi_size;
+	if (qos->limit[n])
+		qos->tokens[n] -= 1;
+	return 0;
+}
+
+/*
+ * Returns 0 if the bio may go now, or 1 if it's been queued
+ */
+int
+np_qos_throttle(struct mapping_dev *dev, struct bio *bio)
+{
+	struct np_qos *qos = &dev->qos;
+	unsigned long flags, wait;
+	int ret = 0;
+
+	/* Flushes and discards aren't what anyone's trying to limit */
+	if (!qos->enabled || bio->bi_size == 0 || (bio->bi_rw & REQ_DISCARD))
+		return 0;
+
+	spin_lock_irqsave(&qos->lock, flags);
+	np_qos_refill(qos);
+	/* Nobody jumps the queue */
+	wait = bio_list_empty(&qos->queued) ? np_qos_charge(qos, bio) : 1;
+	if (wait) {
+		bio->bi_next = NULL;
+		bio_list_add(&qos->queued, bio);
+		qos->nr_queued++;
+		qos->throttled++;
+		qos->throttled_bytes += bio->bi_size;
+		if (qos->nr_queued == 1) {
+			qos->wait_start = jiffies;
+			queue_delayed_work(np_wq, &qos->work, wait);
+		}
+		ret = 1;
+	}
+	spin_unlock_irqrestore(&qos->lock, flags);
+	return ret;
+}
+
+static void
+np_qos_dispatch(struct work_struct *work)
+{
+	struct np_qos *qos = container_of(to_delayed_work(work),
+					  struct np_qos, work);
+	struct bio_list go;
+	struct bio *bio;
+	unsigned long flags, wait = 0;
+
+	bio_list_init(&go);
+	spin_lock_irqsave(&qos->lock, flags);
+	np_qos_refill(qos);
+	while ((bio = bio_list_peek(&qos->queued))) {
+		/* Limits may have been lifted while it waited */
+		if (qos->enabled) {
+			wait = np_qos_charge(qos, bio);
+			if (wait)
+				break;
+		}
+		bio_list_pop(&qos->queued);
+		bio_list_add(&go, bio);
+		qos->nr_queued--;
+	}
+	qos->wait_ms += jiffies_to_msecs(jiffies - qos->wait_start);
+	qos->wait_start = jiffies;
+	if (wait)
+		queue_delayed_work(np_wq, &qos->work, wait);
+	spin_unlock_irqrestore(&qos->lock, flags);
+
+	while ((bio = bio_list_pop(&go)))
+		ntfspunch_dispatch(qos->dev, bio);
+}
+
+/*
+ * "<rbps|wbps|riops|wiops> <limit>", 0 for unlimited, or "burst <ms>"
+ */
+int
+np_qos_ctl(struct mapping_dev *dev, char *key, char *value)
+{
+	struct np_qos *qos = &dev->qos;
+	unsigned long flags;
+	unsigned long long val;
+	int i, ret;
+
+	ret = kstrtoull(value, 0, &val);
+	if (ret)
+		return ret;
+
+	spin_lock_irqsave(&qos->lock, flags);
+	if (strcmp(key, "burst") == 0) {
+		if (val == 0 || val > 60000) {
+			spin_unlock_irqrestore(&qos->lock, flags);
+			return -EINVAL;
+		}
+		qos->burst_ms = val;
+	} else {
+		for (i = 0; i < NP_QOS_NR; i++)
+			if (strcmp(key, np_qos_names[i]) == 0)
+				break;
+		if (i == NP_QOS_NR) {
+			spin_unlock_irqrestore(&qos->lock, flags);
+			return -EINVAL;
+		}
+		qos->limit[i] = val;
+	}
+	/* Start every bucket full under the new settings */
+	qos->enabled = 0;
+	for (i = 0; i < NP_QOS_NR; i++) {
+		qos->tokens[i] = np_qos_capacity(qos, i);
+		qos->frac[i] = 0;
+		if (qos->limit[i])
+			qos->enabled = 1;
+	}
+	qos->last = jiffies;
+	if (!bio_list_empty(&qos->queued))
+		mod_delayed_work(np_wq, &qos->work, 0);
+	spin_unlock_irqrestore(&qos->lock, flags);
+	return 0;
+}
+
+void
+np_qos_show(struct seq_file *m, struct mapping_dev *dev)
+{
+	struct np_qos *qos = &dev->qos;
+	int i;
+
+	for (i = 0; i < NP_QOS_NR; i++)
+		seq_printf(m, "qos_%s: %llu\n", np_qos_names[i],
+			   qos->limit[i]);
+	seq_printf(m, "qos_burst: %u\n", qos->burst_ms);
+	seq_printf(m, "qos_throttled: %llu\n", qos->throttled);
+	seq_printf(m, "qos_throttled_bytes: %llu\n", qos->throttled_bytes);
+	seq_printf(m, "qos_queued: %u\n", qos->nr_queued);
+	seq_printf(m, "qos_wait_ms: %llu\n", qos->wait_ms);
+}
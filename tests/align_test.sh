@@ -0,0 +1,29 @@
+#!/bin/bash
+
+# Check the driver's alignment analysis agrees with the userspace report
+
+source settings.env
+
+(cd ${SOURCE}/tools && make ntfspunch-align > /dev/null) || exit 1
+ALIGN=${SOURCE}/tools/ntfspunch-align
+
+load_driver
+mount_ro
+
+punch_good ${NTFS_RO_MOUNT}/${PATTERN_FILE}
+
+${ALIGN} -v /proc/ntfspunch/a
+${ALIGN} ${NTFS_RO_MOUNT}/${PATTERN_FILE}
+
+DRIVER=`grep "^misaligned_runs:" /proc/ntfspunch/a | awk '{print $2}' | cut -d/ -f1`
+TOOL=`${ALIGN} /proc/ntfspunch/a | sed 's/.*: \([0-9]*\)\/.*/\1/'`
+
+unload_driver
+umount_ro
+
+if [ "${DRIVER}" != "${TOOL}" ] ; then
+    echo "ERROR: driver says ${DRIVER} misaligned runs, tool says ${TOOL}"
+    exit 1
+fi
+echo "PASS"
+exit 0
@@ -0,0 +1,39 @@
+#!/bin/bash
+
+# Attach each of the test files and check the $Bitmap check passed and
+# reported how long it took.
+
+source settings.env
+
+load_driver
+mount_ro
+
+RET=0
+for FILE in ${GOOD_FILE} ${PATTERN_FILE} ${HOLEY_FILE} ; do
+    if [ ! -f ${NTFS_RO_MOUNT}/${FILE} ] ; then
+        continue
+    fi
+    od -x -N 10 ${NTFS_RO_MOUNT}/${FILE} > /dev/null
+    if ! echo "${NTFS_RO_MOUNT}/${FILE}" > /proc/ntfspunch/add ; then
+        echo "ERROR: ${FILE} failed to attach"
+        dmesg | grep "ntfspunch: .*Bitmap" | tail -1
+        RET=1
+        continue
+    fi
+    NODE=`ls /proc/ntfspunch/? | tail -1`
+    US=`awk '/^bitmap_check_us:/ {print $2}' ${NODE}`
+    if [ -z "${US}" ] ; then
+        echo "ERROR: no bitmap_check_us for ${FILE}"
+        RET=1
+    fi
+    echo "${FILE}: \$Bitmap checked in ${US} us"
+done
+
+unload_driver
+umount_ro
+
+if [ ${RET} -ne 0 ] ; then
+    exit 1
+fi
+echo "PASS"
+exit 0
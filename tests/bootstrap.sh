@@ -42,6 +42,14 @@ echo ""
 echo "Generating Sparse file"
 ${NICE} dd if=/dev/zero of=${NTFS_RW_MOUNT}/${SPARSE_FILE} bs=1M count=0 seek=${FILLER_SIZE}
 
+echo ""
+echo "Generating sparse file with some data in it"
+${NICE} dd if=/dev/zero of=${NTFS_RW_MOUNT}/${HOLEY_FILE} bs=1M count=0 seek=200
+for MB in 0 100 ; do
+    ${NICE} dd if=/dev/urandom of=${NTFS_RW_MOUNT}/${HOLEY_FILE} bs=1M count=4 \
+        seek=${MB} conv=notrunc
+done
+
 echo ""
 echo "Generating file with pattern"
 python ./make_file.py ${NTFS_RW_MOUNT}/${PATTERN_FILE} ${PATTERN_FILE_SIZE}
@@ -0,0 +1,83 @@
+#!/bin/bash
+
+# Put a cache on a tmpfs backed loop device in front of the real file.
+# Check repeated random reads end up served from it, that write-back
+# writes reach the file once the cache is detached, and that a cleanly
+# detached cache is picked up again.  Overwrites the test file's contents.
+
+source settings.env
+
+# In MB
+CACHE_SIZE=256
+CACHE_MNT=${TEST_HOME}/cache_tmpfs
+
+cache_stat()
+{
+    grep "^cache_${1}:" /proc/ntfspunch/a | awk '{print $2}'
+}
+
+# 64 scattered 4k reads, the same ones every time
+read_pass()
+{
+    for i in `seq 0 63` ; do
+        dd if=/dev/ntfspuncha of=/dev/null bs=4k count=1 iflag=direct \
+            skip=$((i * 4099)) 2> /dev/null
+    done
+}
+
+mkdir -p ${CACHE_MNT}
+mount -t tmpfs -o size=$((CACHE_SIZE + 16))M tmpfs ${CACHE_MNT} || exit 1
+dd if=/dev/zero of=${CACHE_MNT}/cache.img bs=1M count=${CACHE_SIZE} 2> /dev/null
+CACHE_DEV=`losetup -f --show ${CACHE_MNT}/cache.img`
+
+load_driver
+mount_ro
+punch_good ${NTFS_RO_MOUNT}/${GOOD_FILE} > /dev/null
+
+RET=0
+echo "cache_attach ${CACHE_DEV}" > /proc/ntfspunch/a || exit 1
+read_pass
+read_pass
+sleep 1
+HITS=`cache_stat read_hits`
+read_pass
+grep "^cache" /proc/ntfspunch/a
+if [ `cache_stat read_hits` -lt $((HITS + 64)) ] ; then
+    echo "ERROR: repeated reads weren't served from the cache"
+    RET=1
+fi
+
+# Write-back: write into cached blocks, they should stay dirty for now
+echo "cache_mode writeback" > /proc/ntfspunch/a || exit 1
+dd if=/dev/urandom of=${TEST_HOME}/scratch bs=4k count=1 2> /dev/null
+dd if=${TEST_HOME}/scratch of=/dev/ntfspuncha bs=4k seek=4099 \
+    oflag=direct 2> /dev/null
+if [ "`cache_stat dirty`" = "0" ] ; then
+    echo "ERROR: write-back write didn't dirty the cache"
+    RET=1
+fi
+echo "cache_detach now" > /proc/ntfspunch/a || exit 1
+dd if=/dev/ntfspuncha of=${TEST_HOME}/scratch.after bs=4k count=1 \
+    skip=4099 iflag=direct 2> /dev/null
+if ! cmp ${TEST_HOME}/scratch ${TEST_HOME}/scratch.after ; then
+    echo "ERROR: write-back data didn't reach the file"
+    RET=1
+fi
+
+# Cleanly detached, so attaching again should find the blocks
+echo "cache_attach ${CACHE_DEV}" > /proc/ntfspunch/a || exit 1
+if grep -q "^cache_blocks: 0/" /proc/ntfspunch/a ; then
+    echo "ERROR: cache contents weren't kept across detach"
+    RET=1
+fi
+
+unload_driver
+umount_ro
+losetup -d ${CACHE_DEV}
+umount ${CACHE_MNT}
+
+if [ ${RET} -ne 0 ] ; then
+    exit 1
+fi
+echo "PASS"
+exit 0
@@ -0,0 +1,83 @@
+#!/bin/bash
+
+# Track changed blocks on the real file, rewrite a few spots in place (so
+# the file's contents don't change) and check ntfspunch-cbt reports just
+# those regions, resets them, and that a clean state file carries them
+# over a driver reload.
+
+source settings.env
+
+CBT=${SOURCE}/tools/ntfspunch-cbt
+STATE=${TEST_HOME}/cbt.state
+GRAN=65536
+
+(cd ${SOURCE}; make tools || exit 1)
+
+# Read some 4k blocks and write them straight back
+rewrite()
+{
+    dd if=/dev/ntfspuncha of=${TEST_HOME}/cbt.data bs=4k count=$2 skip=$1 \
+        iflag=direct 2> /dev/null
+    dd if=${TEST_HOME}/cbt.data of=/dev/ntfspuncha bs=4k seek=$1 \
+        oflag=direct 2> /dev/null
+}
+
+start_cbt()
+{
+    load_driver
+    mount_ro
+    punch_good ${NTFS_RO_MOUNT}/${GOOD_FILE} > /dev/null
+    echo "cbt_granularity ${GRAN}" > /proc/ntfspunch/a || exit 1
+    echo "cbt_start ${STATE}" > /proc/ntfspunch/a || exit 1
+}
+
+check()
+{
+    GOT=`${CBT} -r /dev/ntfspuncha | tr '\n' ' '`
+    if [ "${GOT}" != "$1" ] ; then
+        echo "ERROR: $2: expected '$1' got '${GOT}'"
+        RET=1
+    fi
+}
+
+rm -f ${STATE}
+RET=0
+start_cbt
+SIZE=`blockdev --getsize64 /dev/ntfspuncha`
+
+# Nothing to go on the first time, so all of it has changed
+check "0:${SIZE} " "first start"
+check "" "after reset"
+
+# One block, two blocks straddling a region boundary, one far away
+rewrite 1000 1
+rewrite 2047 2
+rewrite 5000 1
+grep "^cbt" /proc/ntfspunch/a
+check "$((1000 * 4096 / GRAN * GRAN)):${GRAN} \
+$((2047 * 4096 / GRAN * GRAN)):$((2 * GRAN)) \
+$((5000 * 4096 / GRAN * GRAN)):${GRAN} " "rewrites"
+check "" "after reset"
+
+# A clean stop and start keeps what changed in between
+rewrite 3000 1
+echo "cbt_stop now" > /proc/ntfspunch/a || exit 1
+echo "cbt_start ${STATE}" > /proc/ntfspunch/a || exit 1
+check "$((3000 * 4096 / GRAN * GRAN)):${GRAN} " "restart"
+
+# So does unloading the driver
+rewrite 4000 1
+unload_driver
+umount_ro
+start_cbt
+check "$((4000 * 4096 / GRAN * GRAN)):${GRAN} " "reload"
+
+unload_driver
+umount_ro
+rm -f ${TEST_HOME}/cbt.data ${STATE}
+
+if [ ${RET} -ne 0 ] ; then
+    exit 1
+fi
+echo "PASS"
+exit 0
@@ -0,0 +1,64 @@
+#!/bin/bash
+
+# Clone the pattern file with ntfspunch-clone and check the copy matches
+# the device, then spoil two blocks of the copy, rewrite one of them in
+# place on the device, and check an incremental clone repairs that one
+# and leaves the unchanged one alone.
+
+source settings.env
+
+CLONE=${SOURCE}/tools/ntfspunch-clone
+COPY=${TEST_HOME}/clone.img
+# In 4k blocks
+CHANGED=100
+UNCHANGED=1500
+
+(cd ${SOURCE}; make tools || exit 1)
+
+block()
+{
+    dd if=$1 of=$2 bs=4k count=1 skip=$3 2> /dev/null
+}
+
+load_driver
+mount_ro
+punch_good ${NTFS_RO_MOUNT}/${PATTERN_FILE} > /dev/null
+
+RET=0
+echo "cbt_start ${TEST_HOME}/clone.cbt" > /proc/ntfspunch/a || exit 1
+${CLONE} -r /proc/ntfspunch/a ${COPY} || exit 1
+if ! cmp /dev/ntfspuncha ${COPY} ; then
+    echo "ERROR: the clone doesn't match the device"
+    RET=1
+fi
+
+dd if=/dev/urandom of=${COPY} bs=4k count=1 seek=${CHANGED} conv=notrunc \
+    2> /dev/null
+dd if=/dev/urandom of=${COPY} bs=4k count=1 seek=${UNCHANGED} \
+    conv=notrunc 2> /dev/null
+block /dev/ntfspuncha ${TEST_HOME}/clone.block ${CHANGED}
+dd if=${TEST_HOME}/clone.block of=/dev/ntfspuncha bs=4k seek=${CHANGED} \
+    oflag=direct 2> /dev/null
+
+${CLONE} -i /proc/ntfspunch/a ${COPY} || exit 1
+block ${COPY} ${TEST_HOME}/clone.copy ${CHANGED}
+if ! cmp ${TEST_HOME}/clone.block ${TEST_HOME}/clone.copy ; then
+    echo "ERROR: the incremental clone missed a changed block"
+    RET=1
+fi
+block /dev/ntfspuncha ${TEST_HOME}/clone.block ${UNCHANGED}
+block ${COPY} ${TEST_HOME}/clone.copy ${UNCHANGED}
+if cmp -s ${TEST_HOME}/clone.block ${TEST_HOME}/clone.copy ; then
+    echo "ERROR: the incremental clone copied an unchanged block"
+    RET=1
+fi
+
+unload_driver
+umount_ro
+rm -f ${COPY} ${TEST_HOME}/clone.*
+
+if [ ${RET} -ne 0 ] ; then
+    exit 1
+fi
+echo "PASS"
+exit 0
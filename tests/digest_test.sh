@@ -0,0 +1,76 @@
+#!/bin/bash
+
+# Take a digest of the pattern file with ntfspunch-digest and check it
+# verifies, then change one block through the device and check exactly
+# that chunk is reported, both from the proc node and through the file on
+# the NTFS mount, and by comparing manifests.
+
+source settings.env
+
+DIGEST=${SOURCE}/tools/ntfspunch-digest
+MANIFEST=${TEST_HOME}/digest.npd
+# In 4k blocks, with 64k chunks
+CHANGED=100
+CHUNK="$(( CHANGED / 16 * 65536 )):65536"
+
+(cd ${SOURCE}; make tools || exit 1)
+
+load_driver
+mount_ro
+punch_good ${NTFS_RO_MOUNT}/${PATTERN_FILE} > /dev/null
+
+RET=0
+${DIGEST} -b 64 -o ${MANIFEST} /proc/ntfspunch/a || exit 1
+if ! ${DIGEST} -v ${MANIFEST} /proc/ntfspunch/a > /dev/null ; then
+    echo "ERROR: the untouched image doesn't verify"
+    RET=1
+fi
+
+dd if=/dev/ntfspuncha of=${TEST_HOME}/digest.block bs=4k count=1 \
+    skip=${CHANGED} iflag=direct 2> /dev/null
+dd if=/dev/urandom of=/dev/ntfspuncha bs=4k count=1 seek=${CHANGED} \
+    oflag=direct 2> /dev/null
+
+${DIGEST} -v ${MANIFEST} /proc/ntfspunch/a > ${TEST_HOME}/digest.out
+if [ $? -eq 0 ] ; then
+    echo "ERROR: the changed image still verifies"
+    RET=1
+fi
+if [ "$(grep -v ntfspunch-digest ${TEST_HOME}/digest.out)" != "${CHUNK}" ] ; then
+    echo "ERROR: expected only chunk ${CHUNK} to differ"
+    cat ${TEST_HOME}/digest.out
+    RET=1
+fi
+
+# Through FIBMAP, as before an attach
+${DIGEST} -v ${MANIFEST} ${NTFS_RO_MOUNT}/${PATTERN_FILE} \
+    > ${TEST_HOME}/digest.out
+if [ "$(grep -v ntfspunch-digest ${TEST_HOME}/digest.out)" != "${CHUNK}" ] ; then
+    echo "ERROR: verifying through the file didn't find chunk ${CHUNK}"
+    cat ${TEST_HOME}/digest.out
+    RET=1
+fi
+
+${DIGEST} -b 64 -o ${MANIFEST}.new /proc/ntfspunch/a || exit 1
+if [ "$(${DIGEST} -c ${MANIFEST} ${MANIFEST}.new | grep -v ntfspunch-digest)" \
+     != "${CHUNK}" ] ; then
+    echo "ERROR: comparing manifests didn't find chunk ${CHUNK}"
+    RET=1
+fi
+
+dd if=${TEST_HOME}/digest.block of=/dev/ntfspuncha bs=4k seek=${CHANGED} \
+    oflag=direct 2> /dev/null
+if ! ${DIGEST} -v ${MANIFEST} /proc/ntfspunch/a > /dev/null ; then
+    echo "ERROR: the restored image doesn't verify"
+    RET=1
+fi
+
+unload_driver
+umount_ro
+rm -f ${MANIFEST} ${MANIFEST}.new ${TEST_HOME}/digest.*
+
+if [ ${RET} -ne 0 ] ; then
+    exit 1
+fi
+echo "PASS"
+exit 0
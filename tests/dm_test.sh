@@ -0,0 +1,74 @@
+#!/bin/bash
+
+# Map the pattern file through the "ntfspunch" device-mapper target and
+# check it reads back the same as through the NTFS driver.  Also exercises
+# a suspend/resume runlist refresh and dm-stats.
+
+source settings.env
+
+DM_NAME=ntfspunch_dm
+
+load_driver
+mount_ro
+
+if ! dmsetup targets | grep -q ntfspunch ; then
+    echo "ERROR: ntfspunch dm target not registered"
+    exit 1
+fi
+
+# Temprary hack until initial read is suported
+od -x ${NTFS_RO_MOUNT}/${PATTERN_FILE} > ${TEST_HOME}/expected
+
+SECTORS=$((`stat -c %s ${NTFS_RO_MOUNT}/${PATTERN_FILE}` / 512))
+echo "0 ${SECTORS} ntfspunch file ${NTFS_RO_MOUNT}/${PATTERN_FILE}" | \
+    dmsetup create ${DM_NAME} || exit 1
+dmsetup table ${DM_NAME}
+dmsetup status ${DM_NAME}
+
+# The file's runs are claimed, so a second table (or device) can't map it
+if echo "0 ${SECTORS} ntfspunch file ${NTFS_RO_MOUNT}/${PATTERN_FILE}" | \
+        dmsetup create ${DM_NAME}_2 2> /dev/null ; then
+    echo "ERROR: the same file was mapped twice"
+    dmsetup remove ${DM_NAME}_2
+    dmsetup remove ${DM_NAME}
+    exit 1
+fi
+
+dmsetup stats create --bounds 1ms,5ms,10ms ${DM_NAME} > /dev/null
+
+od -x /dev/mapper/${DM_NAME} > ${TEST_HOME}/punched
+if ! diff ${TEST_HOME}/expected ${TEST_HOME}/punched ; then
+    echo "ERROR: mismatched results"
+    dmsetup remove ${DM_NAME}
+    exit 1
+fi
+
+# Bios are only split at run edges, and one pass crosses each at most once
+set -- `dmsetup status ${DM_NAME}`
+SPLITS=$5
+dd if=/dev/mapper/${DM_NAME} of=/dev/null bs=1M iflag=direct 2> /dev/null
+set -- `dmsetup status ${DM_NAME}`
+if [ $(($5 - SPLITS)) -ge $4 ] ; then
+    echo "ERROR: $(($5 - SPLITS)) bios split over $4 runs"
+    dmsetup remove ${DM_NAME}
+    exit 1
+fi
+
+dmsetup stats report ${DM_NAME}
+
+# Suspend/resume re-reads the runlist
+dmsetup suspend ${DM_NAME} && dmsetup resume ${DM_NAME} || exit 1
+od -x /dev/mapper/${DM_NAME} > ${TEST_HOME}/punched
+if ! diff ${TEST_HOME}/expected ${TEST_HOME}/punched ; then
+    echo "ERROR: mismatched results after resume"
+    dmsetup remove ${DM_NAME}
+    exit 1
+fi
+
+dmsetup stats delete --allregions ${DM_NAME}
+dmsetup remove ${DM_NAME}
+unload_driver
+umount_ro
+
+echo "PASS"
+exit 0
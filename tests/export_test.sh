@@ -0,0 +1,40 @@
+#!/bin/bash
+
+# Export the pattern device as a dm-linear table, build the dm device and
+# check it's byte-identical to /dev/ntfspuncha
+
+source settings.env
+
+EXPORT=${SOURCE}/tools/ntfspunch-export
+DM_NAME=ntfspunch_export
+
+(cd ${SOURCE}; make tools || exit 1)
+
+load_driver
+mount_ro
+
+punch_good ${NTFS_RO_MOUNT}/${PATTERN_FILE}
+
+${EXPORT} -f dm /proc/ntfspunch/a > ${TEST_HOME}/export.table || exit 1
+cat ${TEST_HOME}/export.table
+dmsetup create ${DM_NAME} ${TEST_HOME}/export.table || exit 1
+
+if ! ${EXPORT} -V /dev/mapper/${DM_NAME} /proc/ntfspunch/a ; then
+    echo "ERROR: dm-linear mapping differs from /dev/ntfspuncha"
+    dmsetup remove ${DM_NAME}
+    exit 1
+fi
+dmsetup remove ${DM_NAME}
+
+# The VMDK descriptor has to describe the same extents
+${EXPORT} -f vmdk /proc/ntfspunch/a > ${TEST_HOME}/export.vmdk || exit 1
+if [ `grep -c FLAT ${TEST_HOME}/export.vmdk` != `wc -l < ${TEST_HOME}/export.table` ] ; then
+    echo "ERROR: VMDK extent count doesn't match the dm table"
+    exit 1
+fi
+
+unload_driver
+umount_ro
+
+echo "PASS"
+exit 0
@@ -0,0 +1,39 @@
+#!/bin/bash
+
+# Several writers doing a flush after every write should end up sharing
+# disk flushes rather than each sending their own.
+
+source settings.env
+
+if ! which fio > /dev/null ; then
+    echo "fio is required for this test"
+    exit 1
+fi
+
+load_driver
+mount_ro
+
+punch_good ${NTFS_RO_MOUNT}/${GOOD_FILE}
+
+if ! grep -q "write back" /sys/block/ntfspuncha/queue/write_cache 2> /dev/null ; then
+    echo "WARNING: disk has no volatile cache, flushes are dropped early"
+fi
+
+fio --name=fsync --filename=/dev/ntfspuncha --rw=randwrite --bs=4k \
+    --direct=1 --ioengine=psync --fsync=1 --numjobs=8 --size=64M \
+    --offset_increment=64M --runtime=10 --time_based --group_reporting | \
+    grep -E 'IOPS|sync.*avg'
+
+grep "^disk_flushes" /proc/ntfspunch/a
+REQUESTED=`grep "^disk_flushes_requested:" /proc/ntfspunch/a | awk '{print $2}'`
+ISSUED=`grep "^disk_flushes_issued:" /proc/ntfspunch/a | awk '{print $2}'`
+
+unload_driver
+umount_ro
+
+if [ "${REQUESTED}" -gt 0 -a "${ISSUED}" -ge "${REQUESTED}" ] ; then
+    echo "ERROR: no flushes were merged"
+    exit 1
+fi
+echo "PASS"
+exit 0
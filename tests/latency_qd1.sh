@@ -0,0 +1,52 @@
+#!/bin/bash
+
+# Queue depth 1 latency of the punched device against the same region of
+# the raw disk, which is the cost of the lockless run lookup in
+# make_request.
+
+source settings.env
+
+if ! which fio > /dev/null ; then
+    echo "fio is required for this test"
+    exit 1
+fi
+
+load_driver
+mount_ro
+
+punch_good ${NTFS_RO_MOUNT}/${PATTERN_FILE}
+
+# The first run, so both sides read exactly the same blocks
+RUN=`grep -m1 "^[0-9]*:[0-9]*:[0-9]*$" /proc/ntfspunch/a`
+DISK_OFFSET=`echo ${RUN} | cut -d: -f2`
+LENGTH=`echo ${RUN} | cut -d: -f3`
+echo "Comparing ${LENGTH} bytes at disk offset ${DISK_OFFSET}"
+
+run_fio()
+{
+    fio --name=qd1 --rw=randread --bs=4k --direct=1 --iodepth=1 \
+        --runtime=10 --time_based --size=${LENGTH} "$@" | \
+        grep -E 'IOPS|clat \(|50.00th|99.00th'
+    return ${PIPESTATUS[0]}
+}
+
+RET=0
+for mode in "psync" "io_uring" ; do
+    echo "== ${mode}"
+    echo "raw ${NTFS_DEV}:"
+    run_fio --filename=${NTFS_DEV} --offset=${DISK_OFFSET} \
+        --ioengine=${mode} || RET=1
+    echo "punched /dev/ntfspuncha:"
+    run_fio --filename=/dev/ntfspuncha --offset=0 \
+        --ioengine=${mode} || RET=1
+done
+
+unload_driver
+umount_ro
+
+if [ ${RET} -ne 0 ] ; then
+    echo "ERROR: fio failed"
+    exit 1
+fi
+echo "PASS"
+exit 0
@@ -0,0 +1,62 @@
+#!/bin/bash
+
+# Check the MFT record is re-checked on every open and on demand, and
+# that an unmoved file passes, both for the test file and the holey one
+# (whose runlist ends in holes past the initialized size).
+
+source settings.env
+
+stat_of()
+{
+    awk "/^$2:/ {print \$2}" /proc/ntfspunch/$1
+}
+
+load_driver
+mount_ro
+
+RET=0
+punch_good ${NTFS_RO_MOUNT}/${GOOD_FILE} > /dev/null
+if [ -f ${NTFS_RO_MOUNT}/${HOLEY_FILE} ] ; then
+    od -x -N 10 ${NTFS_RO_MOUNT}/${HOLEY_FILE} > /dev/null
+    echo "${NTFS_RO_MOUNT}/${HOLEY_FILE}" > /proc/ntfspunch/add
+fi
+
+for D in `ls /proc/ntfspunch/? | xargs -n1 basename` ; do
+    BEFORE=`stat_of ${D} mft_checks`
+    if ! dd if=/dev/ntfspunch${D} of=/dev/null bs=4k count=1 2> /dev/null ; then
+        echo "ERROR: opening ntfspunch${D} failed"
+        RET=1
+    fi
+    if ! echo "mft_check now" > /proc/ntfspunch/${D} ; then
+        echo "ERROR: ntfspunch${D} failed the on demand check"
+        RET=1
+    fi
+    AFTER=`stat_of ${D} mft_checks`
+    echo "ntfspunch${D}: ${BEFORE} -> ${AFTER} checks, last took `stat_of ${D} mft_check_us` us"
+    if [ $((AFTER - BEFORE)) -lt 2 ] ; then
+        echo "ERROR: ntfspunch${D} wasn't checked on open and on demand"
+        RET=1
+    fi
+    if [ `stat_of ${D} mft_stale` -ne 0 ] ; then
+        echo "ERROR: ntfspunch${D} was reported as moved"
+        RET=1
+    fi
+done
+
+# With the open check off, opens don't read the record
+echo "mft_check off" > /proc/ntfspunch/a
+BEFORE=`stat_of a mft_checks`
+dd if=/dev/ntfspuncha of=/dev/null bs=4k count=1 2> /dev/null
+if [ `stat_of a mft_checks` -ne ${BEFORE} ] ; then
+    echo "ERROR: the open check ran while off"
+    RET=1
+fi
+
+unload_driver
+umount_ro
+
+if [ ${RET} -ne 0 ] ; then
+    exit 1
+fi
+echo "PASS"
+exit 0
@@ -0,0 +1,114 @@
+#!/bin/bash
+
+# Mirror two of the random filler files, resync one from the other, then
+# check reads spread over both copies and writes land on both.  The
+# filler files are put back afterwards from saved copies.
+
+source settings.env
+
+FILE_A=${NTFS_RO_MOUNT}/random-1.data
+FILE_B=${NTFS_RO_MOUNT}/random-3.data
+# In MB
+WRITE_SIZE=10
+
+member_stat()
+{
+    awk -v want="member: ${1}" -v key="${2}:" \
+        '$0 == want {found=1} found && $1 == key {print $2; exit}' \
+        /proc/ntfspunch/a
+}
+
+wait_resync()
+{
+    while ! grep -q "^mirror_resync: idle" /proc/ntfspunch/a ; do
+        sleep 1
+    done
+}
+
+mount_ro
+echo "Saving the filler files..."
+cp ${FILE_B} ${TEST_HOME}/mirror.b.orig
+dd if=${FILE_A} of=${TEST_HOME}/mirror.a.orig bs=1M count=${WRITE_SIZE} 2> /dev/null
+umount_ro
+
+load_driver
+mount_ro
+od -x -N 10 ${FILE_A} > /dev/null
+od -x -N 10 ${FILE_B} > /dev/null
+echo "mirror ${FILE_A} ${FILE_B}" > /proc/ntfspunch/add
+if [ ! -f /proc/ntfspunch/a ] ; then
+    echo "Failed to add mirrored device"
+    exit 1
+fi
+
+RET=0
+# The copies start out different, so bring the second up to date
+echo "mirror_stale 1" > /proc/ntfspunch/a || exit 1
+echo "mirror_resync start" > /proc/ntfspunch/a || exit 1
+wait_resync
+grep "^mirror" /proc/ntfspunch/a
+if ! grep -q "^mirror_dirty_regions: 0/" /proc/ntfspunch/a ; then
+    echo "ERROR: resync left dirty regions"
+    RET=1
+fi
+if ! cmp /dev/ntfspuncha ${FILE_A} ; then
+    echo "ERROR: mirror doesn't read back as the first file"
+    RET=1
+fi
+
+# Parallel random readers should end up on both copies
+R0=`member_stat 0 reads`
+R1=`member_stat 1 reads`
+for i in 1 2 3 4 ; do
+    dd if=/dev/ntfspuncha of=/dev/null bs=4k count=2000 iflag=direct \
+        skip=$((RANDOM * 7)) 2> /dev/null &
+done
+wait
+echo "Reads per copy: $((`member_stat 0 reads` - R0)) $((`member_stat 1 reads` - R1))"
+if [ `member_stat 0 reads` -eq ${R0} -o `member_stat 1 reads` -eq ${R1} ] ; then
+    echo "ERROR: random reads weren't spread over the copies"
+    RET=1
+fi
+
+# Write while the second copy is resynced again, so the writes run into
+# the region being copied, held back until it's done, and pass it
+# elsewhere
+dd if=/dev/urandom of=${TEST_HOME}/scratch bs=1M count=${WRITE_SIZE} 2> /dev/null
+echo "mirror_stale 1" > /proc/ntfspunch/a || exit 1
+echo "mirror_resync start" > /proc/ntfspunch/a || exit 1
+dd if=${TEST_HOME}/scratch of=/dev/ntfspuncha bs=1M oflag=direct 2> /dev/null
+wait_resync
+unload_driver
+umount_ro
+
+# Both copies should have the write
+mount_ro
+for f in ${FILE_A} ${FILE_B} ; do
+    dd if=${f} of=${TEST_HOME}/scratch.after bs=1M count=${WRITE_SIZE} 2> /dev/null
+    if ! cmp ${TEST_HOME}/scratch ${TEST_HOME}/scratch.after ; then
+        echo "ERROR: ${f} doesn't have the write"
+        RET=1
+    fi
+done
+
+echo "Restoring the filler files..."
+load_driver
+punch_good ${FILE_A} > /dev/null
+dd if=${TEST_HOME}/mirror.a.orig of=/dev/ntfspuncha bs=1M 2> /dev/null
+unload_driver
+load_driver
+punch_good ${FILE_B} > /dev/null
+dd if=${TEST_HOME}/mirror.b.orig of=/dev/ntfspuncha bs=1M 2> /dev/null
+unload_driver
+umount_ro
+rm -f ${TEST_HOME}/mirror.a.orig ${TEST_HOME}/mirror.b.orig
+
+mount_ro
+check_for_corruption
+umount_ro
+
+if [ ${RET} -ne 0 ] ; then
+    exit 1
+fi
+echo "PASS"
+exit 0
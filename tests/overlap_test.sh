@@ -0,0 +1,45 @@
+#!/bin/bash
+
+# Check a file can't be attached twice, either as two devices or twice
+# within one striped device, and that the device already attached keeps
+# working after a refused attach.
+
+source settings.env
+
+load_driver
+mount_ro
+
+RET=0
+punch_good ${NTFS_RO_MOUNT}/${GOOD_FILE} > /dev/null
+
+if echo "${NTFS_RO_MOUNT}/${GOOD_FILE}" > /proc/ntfspunch/add 2> /dev/null ||
+   [ -f /proc/ntfspunch/b ] ; then
+    echo "ERROR: the same file was attached twice"
+    RET=1
+fi
+if echo "stripe 64K ${NTFS_RO_MOUNT}/${PATTERN_FILE} ${NTFS_RO_MOUNT}/${PATTERN_FILE}" \
+    > /proc/ntfspunch/add 2> /dev/null || [ -f /proc/ntfspunch/b ] ; then
+    echo "ERROR: a stripe over one file twice was attached"
+    RET=1
+fi
+dmesg | grep "ntfspunch: .* overlaps " | tail -2
+
+# A different file is fine, and the refusals left device a alone
+echo "${NTFS_RO_MOUNT}/${PATTERN_FILE}" > /proc/ntfspunch/add
+if [ ! -f /proc/ntfspunch/b ] ; then
+    echo "ERROR: a file that overlaps nothing was refused"
+    RET=1
+fi
+if ! cmp -n 1048576 /dev/ntfspuncha ${NTFS_RO_MOUNT}/${GOOD_FILE} ; then
+    echo "ERROR: the attached device broke after a refused attach"
+    RET=1
+fi
+
+unload_driver
+umount_ro
+
+if [ ${RET} -ne 0 ] ; then
+    exit 1
+fi
+echo "PASS"
+exit 0
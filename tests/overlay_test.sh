@@ -0,0 +1,121 @@
+#!/bin/bash
+
+# Put an overlay (a sparse file on tmpfs behind a loop device) over the
+# real file, write through it, and check the writes are visible on the
+# device but never reach the file, then that discarding brings the
+# original contents back.
+
+source settings.env
+
+OVERLAY_MNT=${TEST_HOME}/overlay_tmpfs
+# In 4k blocks
+OFFSET=1000
+
+load_driver
+mount_ro
+punch_good ${NTFS_RO_MOUNT}/${GOOD_FILE} > /dev/null
+
+SIZE=`blockdev --getsize64 /dev/ntfspuncha`
+mkdir -p ${OVERLAY_MNT}
+mount -t tmpfs tmpfs ${OVERLAY_MNT} || exit 1
+truncate -s ${SIZE} ${OVERLAY_MNT}/delta.img
+OVERLAY_DEV=`losetup -f --show ${OVERLAY_MNT}/delta.img`
+
+dd if=/dev/ntfspuncha of=${TEST_HOME}/overlay.orig bs=4k count=16 \
+    skip=${OFFSET} iflag=direct 2> /dev/null
+
+RET=0
+echo "overlay_attach ${OVERLAY_DEV}" > /proc/ntfspunch/a || exit 1
+
+# Whole clusters, then a lone sector in the middle of an untouched one
+dd if=/dev/urandom of=${TEST_HOME}/scratch bs=4k count=8 2> /dev/null
+dd if=${TEST_HOME}/scratch of=/dev/ntfspuncha bs=4k seek=${OFFSET} \
+    oflag=direct 2> /dev/null
+dd if=/dev/urandom of=${TEST_HOME}/scratch.sector bs=512 count=1 2> /dev/null
+dd if=${TEST_HOME}/scratch.sector of=/dev/ntfspuncha bs=512 \
+    seek=$(((OFFSET + 12) * 8 + 3)) oflag=direct 2> /dev/null
+
+cp ${TEST_HOME}/overlay.orig ${TEST_HOME}/overlay.expected
+dd if=${TEST_HOME}/scratch of=${TEST_HOME}/overlay.expected bs=4k \
+    conv=notrunc 2> /dev/null
+dd if=${TEST_HOME}/scratch.sector of=${TEST_HOME}/overlay.expected bs=512 \
+    seek=$((12 * 8 + 3)) conv=notrunc 2> /dev/null
+dd if=/dev/ntfspuncha of=${TEST_HOME}/overlay.now bs=4k count=16 \
+    skip=${OFFSET} iflag=direct 2> /dev/null
+grep "^overlay" /proc/ntfspunch/a
+if ! cmp ${TEST_HOME}/overlay.expected ${TEST_HOME}/overlay.now ; then
+    echo "ERROR: device doesn't show the overlay's writes"
+    RET=1
+fi
+
+# The file underneath must not have changed
+dd if=${NTFS_RO_MOUNT}/${GOOD_FILE} of=${TEST_HOME}/overlay.file bs=4k \
+    count=16 skip=${OFFSET} iflag=direct 2> /dev/null
+if ! cmp ${TEST_HOME}/overlay.orig ${TEST_HOME}/overlay.file ; then
+    echo "ERROR: the file was written through the overlay"
+    RET=1
+fi
+
+# Read clusters while writes to them are still completing, so the read
+# is split against a bitmap that changes underneath it.  Each read has to
+# finish, with the cluster as it was or as written.
+for i in `seq 16 31` ; do
+    dd if=/dev/ntfspuncha of=${TEST_HOME}/overlay.before bs=4k count=1 \
+        skip=$((OFFSET + i)) iflag=direct 2> /dev/null
+    dd if=/dev/urandom of=${TEST_HOME}/scratch bs=4k count=1 2> /dev/null
+    dd if=${TEST_HOME}/scratch of=/dev/ntfspuncha bs=4k \
+        seek=$((OFFSET + i)) oflag=direct 2> /dev/null &
+    if ! timeout 30 dd if=/dev/ntfspuncha of=${TEST_HOME}/overlay.racing \
+            bs=2k count=3 skip=$(((OFFSET + i) * 2 - 1)) iflag=direct \
+            2> /dev/null ; then
+        echo "ERROR: read racing a write to cluster $((OFFSET + i)) hung"
+        RET=1
+    fi
+    wait
+    dd if=${TEST_HOME}/overlay.racing of=${TEST_HOME}/overlay.got bs=2k \
+        skip=1 count=2 2> /dev/null
+    if ! cmp -s ${TEST_HOME}/overlay.before ${TEST_HOME}/overlay.got && \
+       ! cmp -s ${TEST_HOME}/scratch ${TEST_HOME}/overlay.got ; then
+        echo "ERROR: read racing a write to cluster $((OFFSET + i)) is torn"
+        RET=1
+    fi
+done
+
+# A lone sector and the whole of a cluster not in the overlay yet,
+# written together.  Whichever lands last, the copy-up for the sector
+# mustn't put the file's data back over the rest of the whole write.
+for i in `seq 32 47` ; do
+    dd if=/dev/urandom of=${TEST_HOME}/scratch bs=4k count=1 2> /dev/null
+    dd if=${TEST_HOME}/scratch of=/dev/ntfspuncha bs=4k \
+        seek=$((OFFSET + i)) oflag=direct 2> /dev/null &
+    dd if=${TEST_HOME}/scratch.sector of=/dev/ntfspuncha bs=512 \
+        seek=$(((OFFSET + i) * 8 + 3)) oflag=direct 2> /dev/null &
+    wait
+    dd if=/dev/ntfspuncha of=${TEST_HOME}/overlay.got bs=4k count=1 \
+        skip=$((OFFSET + i)) iflag=direct 2> /dev/null
+    if ! cmp -s -n 1536 ${TEST_HOME}/scratch ${TEST_HOME}/overlay.got || \
+       ! cmp -s -i 2048 ${TEST_HOME}/scratch ${TEST_HOME}/overlay.got ; then
+        echo "ERROR: copy-up overwrote a write to cluster $((OFFSET + i))"
+        RET=1
+    fi
+done
+
+echo "overlay_discard now" > /proc/ntfspunch/a || exit 1
+dd if=/dev/ntfspuncha of=${TEST_HOME}/overlay.now bs=4k count=16 \
+    skip=${OFFSET} iflag=direct 2> /dev/null
+if ! cmp ${TEST_HOME}/overlay.orig ${TEST_HOME}/overlay.now ; then
+    echo "ERROR: discarding the overlay didn't bring the original back"
+    RET=1
+fi
+
+rm -f ${TEST_HOME}/overlay.*
+unload_driver
+umount_ro
+losetup -d ${OVERLAY_DEV}
+umount ${OVERLAY_MNT}
+
+if [ ${RET} -ne 0 ] ; then
+    exit 1
+fi
+echo "PASS"
+exit 0
@@ -0,0 +1,57 @@
+#!/bin/bash
+
+# Stream through the pattern file sequentially and make sure the cross-run
+# prefetch gets hits without changing what's read, then make sure random
+# reads don't set it off.
+
+source settings.env
+
+stat_of()
+{
+    grep "^${1}:" /proc/ntfspunch/a | awk '{print $2}'
+}
+
+load_driver
+mount_ro
+
+od -x ${NTFS_RO_MOUNT}/${PATTERN_FILE} > ${TEST_HOME}/expected
+
+punch_good ${NTFS_RO_MOUNT}/${PATTERN_FILE}
+
+if [ `grep -c "^[0-9]*:[0-9]*:[0-9]*$" /proc/ntfspunch/a` -lt 2 ] ; then
+    echo "WARNING: pattern file isn't fragmented, nothing to prefetch"
+fi
+
+echo 3 > /proc/sys/vm/drop_caches
+dd if=/dev/ntfspuncha bs=64k iflag=direct 2> /dev/null | od -x > ${TEST_HOME}/punched
+if ! diff ${TEST_HOME}/expected ${TEST_HOME}/punched ; then
+    echo "ERROR: mismatched results"
+    exit 1
+fi
+grep "^prefetch" /proc/ntfspunch/a
+HITS=`stat_of prefetch_hits`
+
+# Random 4k reads shouldn't issue anything
+ISSUED=`stat_of prefetch_issued`
+BLOCKS=$((PATTERN_FILE_SIZE * 256))
+for i in `seq 200` ; do
+    dd if=/dev/ntfspuncha of=/dev/null bs=4k count=1 iflag=direct \
+        skip=$((RANDOM % BLOCKS)) 2> /dev/null
+done
+if [ "`stat_of prefetch_issued`" != "${ISSUED}" ] ; then
+    echo "ERROR: random reads triggered prefetch"
+    exit 1
+fi
+
+echo "prefetch off" > /proc/ntfspunch/a || exit 1
+grep -q "^prefetch: off" /proc/ntfspunch/a || exit 1
+
+unload_driver
+umount_ro
+
+if [ "${HITS}" = "0" ] ; then
+    echo "WARNING: no prefetch hits"
+fi
+
+echo "PASS"
+exit 0
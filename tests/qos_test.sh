@@ -0,0 +1,54 @@
+#!/bin/bash
+
+# Cap a device's read bandwidth and check reads actually slow down to it,
+# then lift the cap again.
+
+source settings.env
+
+# In MB/s, the pattern file should then take about 2 seconds
+LIMIT=$((PATTERN_FILE_SIZE / 2))
+
+stat_of()
+{
+    grep "^${1}:" /proc/ntfspunch/a | awk '{print $2}'
+}
+
+load_driver
+mount_ro
+
+punch_good ${NTFS_RO_MOUNT}/${PATTERN_FILE}
+
+echo "qos_rbps $((LIMIT * 1024 * 1024))" > /proc/ntfspunch/a || exit 1
+START=`date +%s.%N`
+dd if=/dev/ntfspuncha of=/dev/null bs=64k iflag=direct 2> /dev/null
+END=`date +%s.%N`
+grep "^qos" /proc/ntfspunch/a
+ELAPSED=`echo "${END} - ${START}" | bc`
+echo "Read ${PATTERN_FILE_SIZE}M at ${LIMIT}M/s in ${ELAPSED}s"
+
+RET=0
+if [ `echo "${ELAPSED} < 1.5" | bc` -eq 1 ] ; then
+    echo "ERROR: limit not enforced"
+    RET=1
+fi
+if [ "`stat_of qos_throttled`" = "0" ] ; then
+    echo "ERROR: nothing was throttled"
+    RET=1
+fi
+
+echo "qos_rbps 0" > /proc/ntfspunch/a || exit 1
+THROTTLED=`stat_of qos_throttled`
+dd if=/dev/ntfspuncha of=/dev/null bs=64k iflag=direct 2> /dev/null
+if [ "`stat_of qos_throttled`" != "${THROTTLED}" ] ; then
+    echo "ERROR: still throttling with no limits"
+    RET=1
+fi
+
+unload_driver
+umount_ro
+
+if [ ${RET} -ne 0 ] ; then
+    exit 1
+fi
+echo "PASS"
+exit 0
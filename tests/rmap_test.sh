@@ -0,0 +1,50 @@
+#!/bin/bash
+
+# Map a sector in the middle of each of a few runs of the test file back
+# through /proc/ntfspunch/lookup, and check it names the right device and
+# offsets, and that a sector outside any image (the boot sector) isn't
+# claimed.
+
+source settings.env
+
+lookup()
+{
+    exec 3<> /proc/ntfspunch/lookup
+    echo "$1 $2" >&3
+    cat <&3
+    exec 3>&-
+}
+
+load_driver
+mount_ro
+
+RET=0
+punch_good ${NTFS_RO_MOUNT}/${GOOD_FILE} > /dev/null
+DISK=`awk '/^disk:/ {print $2; exit}' /proc/ntfspunch/a`
+
+for RUN in `grep -E "^[0-9]+:[0-9]+:[0-9]+$" /proc/ntfspunch/a | head -5` ; do
+    IFS=: read FOFF DOFF LEN <<< "${RUN}"
+    MID=$(( (LEN / 2) & ~511 ))
+    OUT=`lookup ${DISK} $(( (DOFF + MID) / 512 ))`
+    if ! echo "${OUT}" | grep -q "^device: /dev/ntfspuncha$" ||
+       ! echo "${OUT}" | grep -q "^offset: $(( FOFF + MID ))$" ||
+       ! echo "${OUT}" | grep -q "^file_offset: $(( FOFF + MID ))$" ; then
+        echo "ERROR: disk offset $(( DOFF + MID )) mapped to:"
+        echo "${OUT}"
+        RET=1
+    fi
+done
+
+if [ "`lookup ${DISK} 0`" != "none" ] ; then
+    echo "ERROR: the boot sector was claimed by an image"
+    RET=1
+fi
+
+unload_driver
+umount_ro
+
+if [ ${RET} -ne 0 ] ; then
+    exit 1
+fi
+echo "PASS"
+exit 0
@@ -0,0 +1,68 @@
+#!/bin/bash
+
+# Punch the sparse files, check they read the same through the device as
+# through the NTFS (holes as zeroes, including bios that straddle data and
+# a hole), that hole reads never reach the disk, and that writing into a
+# hole is refused.
+
+source settings.env
+
+load_driver
+mount_ro
+if [ ! -f ${NTFS_RO_MOUNT}/${HOLEY_FILE} ] ; then
+    echo "ERROR: no ${HOLEY_FILE}, re-run bootstrap.sh"
+    umount_ro
+    exit 1
+fi
+
+RET=0
+for FILE in ${HOLEY_FILE} ${SPARSE_FILE} ; do
+    punch_good ${NTFS_RO_MOUNT}/${FILE} > /dev/null
+done
+
+# Holes are part of the runlist dump, with a disk offset of -1
+grep -c ":-1:" /proc/ntfspunch/a
+
+SIZE=`stat -c %s ${NTFS_RO_MOUNT}/${HOLEY_FILE}`
+if ! cmp -n ${SIZE} /dev/ntfspuncha ${NTFS_RO_MOUNT}/${HOLEY_FILE} ; then
+    echo "ERROR: the holey file reads differently through the device"
+    RET=1
+fi
+# Straddles the end of the second lot of data and the hole after it
+dd if=/dev/ntfspuncha of=${TEST_HOME}/sparse.dev bs=1M count=2 skip=103 \
+    iflag=direct 2> /dev/null
+dd if=${NTFS_RO_MOUNT}/${HOLEY_FILE} of=${TEST_HOME}/sparse.file bs=1M \
+    count=2 skip=103 2> /dev/null
+if ! cmp ${TEST_HOME}/sparse.dev ${TEST_HOME}/sparse.file ; then
+    echo "ERROR: a read across data and a hole came back wrong"
+    RET=1
+fi
+
+# All hole, so all of it should come back as zeroes without the disk
+SIZE=`stat -c %s ${NTFS_RO_MOUNT}/${SPARSE_FILE}`
+if ! cmp -n ${SIZE} /dev/ntfspunchb /dev/zero ; then
+    echo "ERROR: the sparse file doesn't read as zeroes"
+    RET=1
+fi
+grep "^hole_read_bytes" /proc/ntfspunch/b
+if [ `awk '/^hole_read_bytes/ {print $2}' /proc/ntfspunch/b` -lt ${SIZE} ]
+then
+    echo "ERROR: hole reads weren't served by the driver"
+    RET=1
+fi
+
+if dd if=/dev/zero of=/dev/ntfspunchb bs=4k count=1 seek=10 oflag=direct \
+    2> /dev/null ; then
+    echo "ERROR: a write into a hole wasn't refused"
+    RET=1
+fi
+
+rm -f ${TEST_HOME}/sparse.*
+unload_driver
+umount_ro
+
+if [ ${RET} -ne 0 ] ; then
+    exit 1
+fi
+echo "PASS"
+exit 0
@@ -0,0 +1,61 @@
+#!/bin/bash
+
+# Stripe the pattern file with the real file and check the striped device
+# reads back as the two files interleaved a chunk at a time, then compare
+# sequential read throughput with the pattern file on its own.
+
+source settings.env
+
+# In KB
+CHUNK=64
+
+load_driver
+mount_ro
+
+punch_good ${NTFS_RO_MOUNT}/${PATTERN_FILE}
+echo "Single file:"
+dd if=/dev/ntfspuncha of=/dev/null bs=1M iflag=direct 2>&1 | tail -1
+
+# A file can only be attached once, so start again for the stripe
+load_driver
+echo "stripe ${CHUNK}K ${NTFS_RO_MOUNT}/${PATTERN_FILE} ${NTFS_RO_MOUNT}/${GOOD_FILE}" > /proc/ntfspunch/add
+if [ ! -f /proc/ntfspunch/a ] ; then
+    echo "Failed to add striped device"
+    exit 1
+fi
+cat /proc/ntfspunch/a | grep -v "^[0-9]"
+
+SIZE=`blockdev --getsize64 /dev/ntfspuncha`
+CHUNKS=$((SIZE / (CHUNK * 1024)))
+echo "Striped device is ${SIZE} bytes, ${CHUNKS} chunks"
+
+# Build what the device should hold from the files themselves
+rm -f ${TEST_HOME}/stripe.expected
+for i in `seq 0 $((CHUNKS - 1))` ; do
+    if [ $((i % 2)) -eq 0 ] ; then
+        FILE=${NTFS_RO_MOUNT}/${PATTERN_FILE}
+    else
+        FILE=${NTFS_RO_MOUNT}/${GOOD_FILE}
+    fi
+    dd if=${FILE} bs=${CHUNK}k skip=$((i / 2)) count=1 2> /dev/null >> \
+        ${TEST_HOME}/stripe.expected
+done
+
+RET=0
+if ! cmp /dev/ntfspuncha ${TEST_HOME}/stripe.expected ; then
+    echo "ERROR: striped device doesn't match its members"
+    RET=1
+fi
+
+echo "Striped:"
+dd if=/dev/ntfspuncha of=/dev/null bs=1M iflag=direct 2>&1 | tail -1
+
+rm -f ${TEST_HOME}/stripe.expected
+unload_driver
+umount_ro
+
+if [ ${RET} -ne 0 ] ; then
+    exit 1
+fi
+echo "PASS"
+exit 0
@@ -0,0 +1,65 @@
+#!/bin/bash
+
+# Swap heavily onto the (fragmented) test file through the driver and
+# make sure everything keeps moving.  A memory hog in a small cgroup is
+# pushed out to swap and has to get its data back intact within the time
+# limit.  Overwrites the test file's contents.
+
+source settings.env
+
+CGROUP=/sys/fs/cgroup/ntfspunch_swap
+# In MB
+HOG_SIZE=512
+HOG_LIMIT=64
+TIMEOUT=600
+
+if [ ! -f /sys/fs/cgroup/cgroup.controllers ] ; then
+    echo "cgroup v2 is required for this test"
+    exit 1
+fi
+
+load_driver
+mount_ro
+
+punch_good ${NTFS_RO_MOUNT}/${GOOD_FILE}
+
+mkswap /dev/ntfspuncha || exit 1
+swapon -p 32767 /dev/ntfspuncha || exit 1
+
+mkdir -p ${CGROUP}
+echo "+memory" > /sys/fs/cgroup/cgroup.subtree_control
+echo $((HOG_LIMIT * 1024 * 1024)) > ${CGROUP}/memory.max
+
+# Fill memory with a known pattern, then read it all back twice over so
+# pages go out to swap and come back in
+RET=0
+timeout ${TIMEOUT} sh -c "echo \$\$ > ${CGROUP}/cgroup.procs && exec python3 -c '
+import sys
+pages = ${HOG_SIZE} * 256
+mem = bytearray(pages * 4096)
+for p in range(pages):
+    mem[p * 4096:p * 4096 + 8] = p.to_bytes(8, \"little\")
+for rnd in range(2):
+    for p in range(pages):
+        if int.from_bytes(mem[p * 4096:p * 4096 + 8], \"little\") != p:
+            print(\"page %d corrupt\" % p)
+            sys.exit(1)
+'" || RET=$?
+
+grep -E "^splits:" /proc/ntfspunch/a
+grep ntfspuncha /proc/swaps
+
+swapoff /dev/ntfspuncha || RET=1
+rmdir ${CGROUP}
+unload_driver
+umount_ro
+
+if [ ${RET} -eq 124 ] ; then
+    echo "ERROR: no forward progress within ${TIMEOUT}s"
+    exit 1
+elif [ ${RET} -ne 0 ] ; then
+    echo "ERROR: swapped data corrupt"
+    exit 1
+fi
+echo "PASS"
+exit 0
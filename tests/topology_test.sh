@@ -0,0 +1,52 @@
+#!/bin/bash
+
+# Check the punched device advertises the same queue topology as the disk
+# underneath, so schedulers, readahead and mkfs treat it the same way.
+
+source settings.env
+
+load_driver
+mount_ro
+
+punch_good ${NTFS_RO_MOUNT}/${PATTERN_FILE}
+
+DISK=`basename \`readlink -f ${NTFS_DEV}\``
+# Partitions keep their queue settings on the whole disk
+if [ ! -d /sys/block/${DISK} ] ; then
+    DISK_PATH=`readlink -f /sys/class/block/${DISK}`
+    DISK=`dirname ${DISK_PATH}`
+    DISK=`basename ${DISK}`
+fi
+
+RET=0
+for attr in rotational logical_block_size physical_block_size \
+            max_segments max_segment_size ; do
+    want=`cat /sys/block/${DISK}/queue/${attr}`
+    got=`cat /sys/block/ntfspuncha/queue/${attr}`
+    echo "${attr}: ${DISK}=${want} ntfspuncha=${got}"
+    if [ "${attr}" = "logical_block_size" -o \
+         "${attr}" = "physical_block_size" ] ; then
+        # May be larger if the NTFS sector size is
+        if [ ${got} -lt ${want} ] ; then
+            RET=1
+        fi
+    elif [ "${want}" != "${got}" ] ; then
+        RET=1
+    fi
+done
+
+if grep -q "write back" /sys/block/${DISK}/queue/write_cache 2> /dev/null ; then
+    grep -q "write back" /sys/block/ntfspuncha/queue/write_cache || RET=1
+fi
+echo "optimal_io_size: `cat /sys/block/ntfspuncha/queue/optimal_io_size`"
+echo "read_ahead_kb: `cat /sys/block/ntfspuncha/queue/read_ahead_kb`"
+
+unload_driver
+umount_ro
+
+if [ ${RET} -ne 0 ] ; then
+    echo "ERROR: topology doesn't match the underlying disk"
+    exit 1
+fi
+echo "PASS"
+exit 0
@@ -0,0 +1,64 @@
+#!/bin/bash
+
+# Serve the pattern file through the userspace ublk server, check it reads
+# back the same as through the kernel driver, then compare throughput
+
+source settings.env
+
+UBLK=${SOURCE}/tools/ntfspunch-ublk
+
+(cd ${SOURCE}; make tools || exit 1)
+modprobe ublk_drv || exit 1
+
+load_driver
+mount_ro
+
+od -x ${NTFS_RO_MOUNT}/${PATTERN_FILE} > ${TEST_HOME}/expected
+
+punch_good ${NTFS_RO_MOUNT}/${PATTERN_FILE}
+
+${UBLK} -q 2 -d 64 /proc/ntfspunch/a > ${TEST_HOME}/ublk.log &
+UBLK_PID=$!
+for i in $(seq 50); do
+    grep -q serving ${TEST_HOME}/ublk.log && break
+    sleep 0.1
+done
+UBLK_DEV=`sed -n 's/.* on \(\/dev\/ublkb[0-9]*\).*/\1/p' ${TEST_HOME}/ublk.log`
+if [ -z "${UBLK_DEV}" ] ; then
+    echo "ERROR: ublk server failed to start"
+    kill ${UBLK_PID}
+    exit 1
+fi
+
+od -x ${UBLK_DEV} > ${TEST_HOME}/punched
+if ! diff ${TEST_HOME}/expected ${TEST_HOME}/punched ; then
+    echo "ERROR: mismatched results through ${UBLK_DEV}"
+    kill ${UBLK_PID}
+    exit 1
+fi
+
+if which fio > /dev/null ; then
+    for dev in /dev/ntfspuncha ${UBLK_DEV}; do
+        echo "Random 4k reads on ${dev}"
+        fio --name=randread --filename=${dev} --rw=randread --bs=4k \
+            --direct=1 --ioengine=io_uring --iodepth=32 --runtime=10 \
+            --time_based --group_reporting | grep -E 'IOPS|lat.*avg'
+        echo "Sequential 1M reads on ${dev}"
+        fio --name=seqread --filename=${dev} --rw=read --bs=1M \
+            --direct=1 --ioengine=io_uring --iodepth=8 --runtime=10 \
+            --time_based --group_reporting | grep -E 'BW='
+    done
+fi
+
+kill ${UBLK_PID}
+wait ${UBLK_PID}
+
+unload_driver
+umount_ro
+
+mount_ro
+check_for_corruption
+umount_ro
+
+echo "PASS"
+exit 0
@@ -0,0 +1,60 @@
+#!/bin/bash
+
+# Boot a throw-away QEMU guest whose only disk is the pattern file served by
+# the vhost-user-blk backend (tools/ntfspunch-vhost), and check the guest
+# sees the same bytes the NTFS driver does.
+#
+# Needs qemu-system-x86_64, a static busybox, and a guest kernel with
+# virtio-pci and virtio-blk built in (set VM_KERNEL in settings.env)
+
+source settings.env
+
+VHOST=${SOURCE}/tools/ntfspunch-vhost
+SOCK=${TEST_HOME}/vhost.sock
+INITRD=${TEST_HOME}/vhost-initrd.cpio.gz
+
+(cd ${SOURCE}; make tools || exit 1)
+
+mount_ro
+
+md5sum < ${NTFS_RO_MOUNT}/${PATTERN_FILE} | awk '{print $1}' > ${TEST_HOME}/expected
+
+# Minimal initramfs that checksums the virtio disk and powers off
+rm -rf ${TEST_HOME}/initrd
+mkdir -p ${TEST_HOME}/initrd/bin
+cp `which busybox` ${TEST_HOME}/initrd/bin/
+cat > ${TEST_HOME}/initrd/init <<'INIT'
+#!/bin/busybox sh
+/bin/busybox --install -s /bin
+mount -t proc proc /proc
+mount -t sysfs sys /sys
+mount -t devtmpfs dev /dev
+echo "NP_SUM=`md5sum < /dev/vda | cut -d' ' -f1`"
+poweroff -f
+INIT
+chmod +x ${TEST_HOME}/initrd/init
+mkdir -p ${TEST_HOME}/initrd/{proc,sys,dev}
+(cd ${TEST_HOME}/initrd && find . | cpio -o -H newc | gzip) > ${INITRD}
+
+${VHOST} -s ${SOCK} -q 2 ${NTFS_RO_MOUNT}/${PATTERN_FILE} &
+VHOST_PID=$!
+sleep 1
+
+qemu-system-x86_64 -enable-kvm -m 512 -nographic -no-reboot \
+    -kernel ${VM_KERNEL} -initrd ${INITRD} -append "console=ttyS0 quiet" \
+    -object memory-backend-memfd,id=mem,size=512M,share=on \
+    -numa node,memdev=mem \
+    -chardev socket,id=np0,path=${SOCK} \
+    -device vhost-user-blk-pci,chardev=np0,num-queues=2 \
+    | tee ${TEST_HOME}/vhost.log
+
+kill ${VHOST_PID}
+umount_ro
+
+if ! grep -q "NP_SUM=`cat ${TEST_HOME}/expected`" ${TEST_HOME}/vhost.log ; then
+    echo "ERROR: guest saw different data"
+    exit 1
+fi
+
+echo "PASS"
+exit 0
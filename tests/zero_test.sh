@@ -0,0 +1,58 @@
+#!/bin/bash
+
+# Turn on zero detection, overwrite some random data on the real file
+# with zeroes, and check they read back as zeroes both through the device
+# and the file, and that ordinary writes still get through.  Overwrites
+# part of the test file.
+
+source settings.env
+
+# In 4k blocks
+OFFSET=3000
+COUNT=64
+
+load_driver
+mount_ro
+punch_good ${NTFS_RO_MOUNT}/${GOOD_FILE} > /dev/null
+
+RET=0
+echo "zero_detect on" > /proc/ntfspunch/a || exit 1
+
+dd if=/dev/urandom of=${TEST_HOME}/zero.random bs=4k count=${COUNT} \
+    2> /dev/null
+dd if=${TEST_HOME}/zero.random of=/dev/ntfspuncha bs=4k seek=${OFFSET} \
+    oflag=direct 2> /dev/null
+dd if=/dev/ntfspuncha of=${TEST_HOME}/zero.now bs=4k count=${COUNT} \
+    skip=${OFFSET} iflag=direct 2> /dev/null
+if ! cmp ${TEST_HOME}/zero.random ${TEST_HOME}/zero.now ; then
+    echo "ERROR: a non-zero write didn't get through"
+    RET=1
+fi
+
+dd if=/dev/zero of=/dev/ntfspuncha bs=64k count=$((COUNT / 16)) \
+    seek=$((OFFSET / 16)) oflag=direct 2> /dev/null
+grep "^zero_" /proc/ntfspunch/a
+if ! dd if=/dev/ntfspuncha bs=4k count=${COUNT} skip=${OFFSET} \
+    iflag=direct 2> /dev/null | cmp -n $((COUNT * 4096)) - /dev/zero ; then
+    echo "ERROR: the zeroes didn't read back through the device"
+    RET=1
+fi
+
+unload_driver
+# Need to unmount to flush out any stale cache content
+umount_ro
+mount_ro
+if ! dd if=${NTFS_RO_MOUNT}/${GOOD_FILE} bs=4k count=${COUNT} \
+    skip=${OFFSET} 2> /dev/null | cmp -n $((COUNT * 4096)) - /dev/zero ; then
+    echo "ERROR: the zeroes didn't reach the file"
+    RET=1
+fi
+
+rm -f ${TEST_HOME}/zero.*
+umount_ro
+
+if [ ${RET} -ne 0 ] ; then
+    exit 1
+fi
+echo "PASS"
+exit 0
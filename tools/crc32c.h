@@ -0,0 +1,40 @@
+/*
+ * crc32c.h - CRC32C (Castagnoli) used for image digests
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NP_CRC32C_H_
+#define _NP_CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Uses the SSE4.2 crc32 instruction when the CPU has it, and a
+ * slicing-by-8 table otherwise.  Start with crc = 0.
+ */
+uint32_t np_crc32c(uint32_t crc, const void *buf, size_t len);
+
+/*
+ * The crc32c of A followed by B, from crc32c(A), crc32c(B) and B's
+ * length, so pieces can be hashed in any order (zlib's method)
+ */
+uint32_t np_crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+#endif
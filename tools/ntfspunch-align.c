@@ -0,0 +1,147 @@
+/*
+ * ntfspunch-align.c - Physical alignment report for NTFS Punch images
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Checks every run of one or more images against the physical block size
+ * and alignment offset of the disk they live on, the same way the driver
+ * does when a device is added, and says which images are worth
+ * re-creating (defragmenting or copying to a fresh file) on the Windows
+ * side to get rid of read-modify-write on 512e disks.
+ */
+
+#include "punchmap.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+static int verbose;
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: ntfspunch-align [-v] [-b phys_block_size] <source>...\n"
+		"  source is a /proc/ntfspunch/? node or a file on a"
+		" mounted NTFS\n"
+		"  -v lists every misaligned run\n"
+		"  -b overrides the physical block size reported by the disk\n");
+	exit(1);
+}
+
+/*
+ * Returns 1 if the image has misaligned runs, 0 if not, -1 on error
+ */
+static int
+report(const char *source, unsigned int force_pbs)
+{
+	struct np_map map;
+	unsigned int pbs = force_pbs;
+	int align = 0, fd, ret;
+	uint64_t off, bad_bytes = 0;
+	size_t i, bad_runs = 0;
+
+	ret = np_map_load(&map, source);
+	if (ret) {
+		fprintf(stderr, "ntfspunch-align: unable to load runlist from"
+			" %s: %s\n", source, strerror(-ret));
+		return -1;
+	}
+
+	/* With -b we can get by without the disk, assuming it's aligned */
+	fd = open(map.disk, O_RDONLY);
+	if (fd < 0 && pbs == 0) {
+		perror(map.disk);
+		np_map_free(&map);
+		return -1;
+	}
+	if (fd >= 0) {
+		if (pbs == 0 && ioctl(fd, BLKPBSZGET, &pbs) < 0)
+			pbs = 512;
+		if (ioctl(fd, BLKALIGNOFF, &align) < 0 || align < 0)
+			align = 0;
+		close(fd);
+	}
+
+	for (i = 0; i < map.nr_runs; i++) {
+		const struct np_run *run = &map.runs[i];
+
+		/* Unsigned wrap is fine, pbs is a power of two */
+		off = (run->disk_offset - run->file_offset - align) & (pbs - 1);
+		if (off == 0)
+			continue;
+		bad_runs++;
+		bad_bytes += run->length;
+		if (verbose)
+			printf("  run %zu: file offset %" PRIu64 " disk offset %"
+			       PRIu64 " length %" PRIu64 " off by %" PRIu64
+			       "\n", i, run->file_offset, run->disk_offset,
+			       run->length, off);
+	}
+
+	printf("%s: %s pbs %u alignment_offset %d: %zu/%zu runs"
+	       " misaligned (%.2f%% of %" PRIu64 " bytes)%s\n",
+	       map.filename, map.disk, pbs, align, bad_runs, map.nr_runs,
+	       map.size ? 100.0 * bad_bytes / map.size : 0.0, map.size,
+	       bad_runs ? " - re-create" : "");
+	np_map_free(&map);
+	return bad_runs != 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned int pbs = 0;
+	int opt, i, ret, status = 0;
+
+	while ((opt = getopt(argc, argv, "vb:")) != -1) {
+		switch (opt) {
+		case 'v':
+			verbose = 1;
+			break;
+		case 'b':
+			pbs = strtoul(optarg, NULL, 0);
+			if (pbs < 512 || (pbs & (pbs - 1)))
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind == argc)
+		usage();
+
+	/* Exit status: 0 all aligned, 1 something to re-create, 2 errors */
+	for (i = optind; i < argc; i++) {
+		ret = report(argv[i], pbs);
+		if (ret < 0)
+			status = 2;
+		else if (ret > 0 && status == 0)
+			status = 1;
+	}
+	return status;
+}
@@ -0,0 +1,109 @@
+/*
+ * ntfspunch-cbt.c - Changed block report for NTFS Punch devices
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Prints the changed ranges of an NTFS Punch device (see cbt.c) as
+ * offset:length lines, in bytes, for backup scripts.  With -r they are
+ * reset as they are read, so the next run only shows what changed since.
+ */
+
+#include "../ntfspunch_ioctl.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#define NR_RANGES	1024
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: ntfspunch-cbt [-r] [-s start] <device>\n"
+		"  -r resets the ranges reported\n"
+		"  -s starts at a byte offset other than 0\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct np_cbt_range ranges[NR_RANGES];
+	struct np_cbt_get req;
+	uint64_t start = 0, size;
+	int opt, fd, reset = 0;
+	uint32_t i;
+
+	while ((opt = getopt(argc, argv, "rs:")) != -1) {
+		switch (opt) {
+		case 'r':
+			reset = 1;
+			break;
+		case 's':
+			start = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (ioctl(fd, BLKGETSIZE64, &size) < 0) {
+		perror(argv[optind]);
+		close(fd);
+		return 1;
+	}
+	while (start < size) {
+		memset(&req, 0, sizeof(req));
+		req.start = start;
+		req.ranges = (uintptr_t)ranges;
+		req.nr_ranges = NR_RANGES;
+		req.flags = reset ? NP_CBT_RESET : 0;
+		if (ioctl(fd, NTFSPUNCH_CBT_GET, &req) < 0) {
+			fprintf(stderr, "ntfspunch-cbt: %s: %s\n", argv[optind],
+				errno == ENODEV ? "changed block tracking isn't"
+				" started" : strerror(errno));
+			close(fd);
+			return 1;
+		}
+		for (i = 0; i < req.nr_ranges; i++)
+			printf("%" PRIu64 ":%" PRIu64 "\n",
+			       (uint64_t)ranges[i].offset,
+			       (uint64_t)ranges[i].length);
+		if (req.next <= start)
+			break;
+		start = req.next;
+	}
+	close(fd);
+	return 0;
+}
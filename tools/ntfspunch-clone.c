@@ -0,0 +1,522 @@
+/*
+ * ntfspunch-clone.c - Parallel extent-aware copy of NTFS Punch images
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Copying an image through /dev/ntfspunchX reads it in file order, which
+ * on a fragmented image means a seek every run.  This reads the runs
+ * straight off the underlying disk in LBA order instead, with several
+ * io_uring queues pulling chunks off the same sorted list so the disk
+ * sees one mostly sequential stream, and writes each chunk at its file
+ * offset in the destination.
+ *
+ * Chunks that read back as all zeroes aren't written when the
+ * destination is a fresh file (they're left as holes) and are punched
+ * out of an existing one.  With -i only what changed block tracking (see
+ * cbt.c) reports as changed since the last fetch is copied, into a
+ * destination holding the previous copy.  -r starts a new chain with a
+ * full copy, throwing away what changed block tracking had so far.
+ *
+ * Changed block data is reset when it's fetched, before the copy, so
+ * writes during the copy show up next time.  If the copy then fails the
+ * changes are gone, and the next copy has to be a full one.
+ */
+
+#define _GNU_SOURCE
+#include "punchmap.h"
+#include "uring.h"
+#include "../ntfspunch_ioctl.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+
+#define DEF_QUEUES	4
+#define DEF_DEPTH	8
+#define DEF_CHUNK	(1024 * 1024)
+#define MAX_CHUNK	(64 * 1024 * 1024)
+#define NR_CBT_RANGES	1024
+
+/* Registered file slots */
+#define FILE_DISK	0
+#define FILE_DEST	1
+
+/* What to do with a chunk of zeroes */
+enum {
+	ZERO_SKIP,	/* the destination already reads as zeroes */
+	ZERO_PUNCH,
+	ZERO_WRITE,
+};
+
+struct chunk {
+	uint64_t disk_offset;
+	uint64_t file_offset;
+	uint32_t length;
+};
+
+struct slot {
+	struct chunk *c;
+	void *buf;
+	int writing;
+};
+
+struct queue {
+	pthread_t thread;
+	struct np_ring ring;
+	struct slot *slots;
+	int error;
+};
+
+static struct np_map map;
+static struct chunk *chunks;
+static size_t nr_chunks, next_chunk;
+static int disk_fd = -1, dest_fd = -1;
+static int zero_mode;
+static int failed;
+static unsigned int depth = DEF_DEPTH, chunk_size = DEF_CHUNK;
+static unsigned int disk_bs = 512;
+static uint64_t bytes_read, bytes_written, bytes_zero;
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: ntfspunch-clone [-q queues] [-d depth] [-b chunk_kb]"
+		" [-i | -r] <source> <dest>\n"
+		"  source is a /proc/ntfspunch/? node or a file on a"
+		" mounted NTFS\n"
+		"  dest is a file or block device\n"
+		"  -i copies only what changed block tracking reports\n"
+		"  -r resets changed block tracking and copies everything\n");
+	exit(1);
+}
+
+static int
+add_chunk(size_t *alloced, uint64_t disk_offset, uint64_t file_offset,
+	  uint32_t length)
+{
+	struct chunk *tmp;
+
+	if (nr_chunks == *alloced) {
+		*alloced = *alloced ? *alloced * 2 : 1024;
+		tmp = realloc(chunks, *alloced * sizeof(*tmp));
+		if (tmp == NULL)
+			return -ENOMEM;
+		chunks = tmp;
+	}
+	chunks[nr_chunks].disk_offset = disk_offset;
+	chunks[nr_chunks].file_offset = file_offset;
+	chunks[nr_chunks].length = length;
+	nr_chunks++;
+	return 0;
+}
+
+/*
+ * Cut [offset, offset + len) of the image into chunks, split where the
+ * runs are
+ */
+static int
+add_range(size_t *alloced, uint64_t offset, uint64_t len)
+{
+	uint64_t disk, n;
+	int ret;
+
+	if (offset >= map.size)
+		return 0;
+	if (len > map.size - offset)
+		len = map.size - offset;
+	while (len) {
+		n = np_map_lookup(&map, offset, len, &disk);
+		if (n == 0) {
+			fprintf(stderr, "ntfspunch-clone: offset %" PRIu64
+				" isn't mapped\n", offset);
+			return -EINVAL;
+		}
+		if (n > chunk_size)
+			n = chunk_size;
+		ret = add_chunk(alloced, disk, offset, n);
+		if (ret)
+			return ret;
+		offset += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+by_disk_offset(const void *a, const void *b)
+{
+	const struct chunk *x = a, *y = b;
+
+	if (x->disk_offset != y->disk_offset)
+		return x->disk_offset < y->disk_offset ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Fetch (and reset) every changed range from the device, and queue them
+ * up for copying if copy is set
+ */
+static int
+cbt_fetch(size_t *alloced, int copy)
+{
+	struct np_cbt_range r[NR_CBT_RANGES];
+	struct np_cbt_get req;
+	uint64_t start = 0;
+	uint32_t i;
+	int fd, ret = 0;
+
+	if (map.device[0] == '\0') {
+		fprintf(stderr, "ntfspunch-clone: changed block tracking needs"
+			" a /proc/ntfspunch/? source\n");
+		return -EINVAL;
+	}
+	fd = open(map.device, O_RDONLY);
+	if (fd < 0) {
+		perror(map.device);
+		return -errno;
+	}
+	while (start < map.size) {
+		memset(&req, 0, sizeof(req));
+		req.start = start;
+		req.ranges = (uintptr_t)r;
+		req.nr_ranges = NR_CBT_RANGES;
+		req.flags = NP_CBT_RESET;
+		if (ioctl(fd, NTFSPUNCH_CBT_GET, &req) < 0) {
+			ret = -errno;
+			fprintf(stderr, "ntfspunch-clone: %s: %s\n", map.device,
+				errno == ENODEV ? "changed block tracking"
+				" isn't started" : strerror(errno));
+			break;
+		}
+		for (i = 0; copy && i < req.nr_ranges && ret == 0; i++)
+			ret = add_range(alloced, r[i].offset, r[i].length);
+		if (ret || req.next <= start)
+			break;
+		start = req.next;
+	}
+	close(fd);
+	return ret;
+}
+
+static int
+is_zero(const char *buf, size_t len)
+{
+	return buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0;
+}
+
+/*
+ * Start reading the next chunk into a slot, returns 0 if there are none
+ * left
+ */
+static int
+queue_read(struct queue *q, unsigned int tag)
+{
+	struct io_uring_sqe *sqe;
+	struct slot *s = &q->slots[tag];
+	size_t idx;
+	uint32_t len;
+
+	if (__atomic_load_n(&failed, __ATOMIC_RELAXED))
+		return 0;
+	idx = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED);
+	if (idx >= nr_chunks)
+		return 0;
+	s->c = &chunks[idx];
+	s->writing = 0;
+	/* O_DIRECT wants whole disk blocks, the tail is just not written */
+	len = (s->c->length + disk_bs - 1) & ~(disk_bs - 1);
+	sqe = np_ring_get_sqe(&q->ring);
+	np_prep_rw_fixed(sqe, IORING_OP_READ_FIXED, FILE_DISK, s->buf, len,
+			 s->c->disk_offset, tag, tag);
+	return 1;
+}
+
+static void
+queue_write(struct queue *q, unsigned int tag)
+{
+	struct io_uring_sqe *sqe;
+	struct slot *s = &q->slots[tag];
+
+	s->writing = 1;
+	sqe = np_ring_get_sqe(&q->ring);
+	np_prep_rw_fixed(sqe, IORING_OP_WRITE_FIXED, FILE_DEST, s->buf,
+			 s->c->length, s->c->file_offset, tag, tag);
+}
+
+/*
+ * Returns 1 if the slot is free again
+ */
+static int
+queue_complete(struct queue *q, unsigned int tag, int res)
+{
+	struct slot *s = &q->slots[tag];
+
+	if (res < 0 || (uint32_t)res < s->c->length) {
+		fprintf(stderr, "ntfspunch-clone: %s at %s offset %" PRIu64
+			": %s\n", s->writing ? "write" : "read",
+			s->writing ? "destination" : map.disk,
+			s->writing ? s->c->file_offset : s->c->disk_offset,
+			res < 0 ? strerror(-res) : "short transfer");
+		q->error = res < 0 ? res : -EIO;
+		__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+	if (s->writing) {
+		__atomic_fetch_add(&bytes_written, s->c->length,
+				   __ATOMIC_RELAXED);
+		return 1;
+	}
+	__atomic_fetch_add(&bytes_read, s->c->length, __ATOMIC_RELAXED);
+	if (zero_mode != ZERO_WRITE && is_zero(s->buf, s->c->length)) {
+		if (zero_mode == ZERO_PUNCH &&
+		    fallocate(dest_fd, FALLOC_FL_PUNCH_HOLE |
+			      FALLOC_FL_KEEP_SIZE, s->c->file_offset,
+			      s->c->length) < 0) {
+			/* Not every filesystem can, fall back to writing */
+			queue_write(q, tag);
+			return 0;
+		}
+		__atomic_fetch_add(&bytes_zero, s->c->length,
+				   __ATOMIC_RELAXED);
+		return 1;
+	}
+	queue_write(q, tag);
+	return 0;
+}
+
+static int
+queue_init(struct queue *q)
+{
+	int fds[2] = { disk_fd, dest_fd };
+	struct iovec *iov;
+	unsigned int i;
+	int ret;
+
+	q->slots = calloc(depth, sizeof(*q->slots));
+	iov = calloc(depth, sizeof(*iov));
+	if (q->slots == NULL || iov == NULL) {
+		free(iov);
+		return -ENOMEM;
+	}
+	for (i = 0; i < depth; i++) {
+		if (posix_memalign(&q->slots[i].buf, 4096, chunk_size)) {
+			free(iov);
+			return -ENOMEM;
+		}
+		iov[i].iov_base = q->slots[i].buf;
+		iov[i].iov_len = chunk_size;
+	}
+	ret = np_ring_init(&q->ring, depth, 0);
+	if (ret == 0)
+		ret = np_ring_register_files(&q->ring, fds, 2);
+	if (ret == 0)
+		ret = np_ring_register_buffers(&q->ring, iov, depth);
+	free(iov);
+	return ret;
+}
+
+static void *
+queue_thread(void *arg)
+{
+	struct queue *q = arg;
+	struct io_uring_cqe *cqe;
+	unsigned int tag, inflight = 0;
+	int ret, res;
+
+	for (tag = 0; tag < depth; tag++)
+		inflight += queue_read(q, tag);
+	while (inflight) {
+		ret = np_ring_submit(&q->ring, 1);
+		if (ret < 0) {
+			fprintf(stderr, "ntfspunch-clone: io_uring_enter: %s\n",
+				strerror(-ret));
+			q->error = ret;
+			__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		while ((cqe = np_ring_peek_cqe(&q->ring)) != NULL) {
+			tag = cqe->user_data;
+			res = cqe->res;
+			np_ring_cqe_seen(&q->ring);
+			if (!queue_complete(q, tag, res))
+				continue;
+			inflight--;
+			inflight += queue_read(q, tag);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Open the destination and work out what zeroes in it look like
+ */
+static int
+open_dest(const char *path, int incremental)
+{
+	struct stat st;
+	uint64_t size;
+
+	dest_fd = open(path, O_WRONLY | O_CREAT, 0644);
+	if (dest_fd < 0 || fstat(dest_fd, &st) < 0) {
+		perror(path);
+		return -1;
+	}
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(dest_fd, BLKGETSIZE64, &size) < 0 ||
+		    size < map.size) {
+			fprintf(stderr, "ntfspunch-clone: %s is smaller than"
+				" the image\n", path);
+			return -1;
+		}
+		zero_mode = ZERO_WRITE;
+		return 0;
+	}
+	if (incremental) {
+		/* Has to be the previous copy */
+		if ((uint64_t)st.st_size != map.size) {
+			fprintf(stderr, "ntfspunch-clone: %s isn't the size of"
+				" the image, copy it in full first\n", path);
+			return -1;
+		}
+		zero_mode = ZERO_PUNCH;
+		return 0;
+	}
+	/* Start from all holes */
+	if (ftruncate(dest_fd, 0) < 0 || ftruncate(dest_fd, map.size) < 0) {
+		perror(path);
+		return -1;
+	}
+	zero_mode = ZERO_SKIP;
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct queue *queues;
+	struct timespec t0, t1;
+	size_t alloced = 0, i;
+	uint64_t planned = 0;
+	int opt, ret, incremental = 0, reset = 0, nr_queues = DEF_QUEUES;
+	double secs;
+
+	while ((opt = getopt(argc, argv, "q:d:b:ir")) != -1) {
+		switch (opt) {
+		case 'q':
+			nr_queues = atoi(optarg);
+			break;
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 'b':
+			chunk_size = atoi(optarg) * 1024;
+			break;
+		case 'i':
+			incremental = 1;
+			break;
+		case 'r':
+			reset = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 2 || nr_queues < 1 || depth < 1 ||
+	    depth > 4096 || chunk_size < 4096 || chunk_size > MAX_CHUNK ||
+	    (chunk_size & 4095) || (incremental && reset))
+		usage();
+
+	ret = np_map_load(&map, argv[optind]);
+	if (ret) {
+		fprintf(stderr, "ntfspunch-clone: unable to load runlist from"
+			" %s: %s\n", argv[optind], strerror(-ret));
+		return 1;
+	}
+	np_map_coalesce(&map);
+	disk_fd = open(map.disk, O_RDONLY | O_DIRECT);
+	if (disk_fd < 0) {
+		perror(map.disk);
+		return 1;
+	}
+	if (ioctl(disk_fd, BLKSSZGET, &disk_bs) < 0)
+		disk_bs = 512;
+	if (open_dest(argv[optind + 1], incremental))
+		return 1;
+
+	if (incremental || reset)
+		ret = cbt_fetch(&alloced, incremental);
+	for (i = 0; !incremental && ret == 0 && i < map.nr_runs; i++)
+		ret = add_range(&alloced, map.runs[i].file_offset,
+				map.runs[i].length);
+	if (ret)
+		return 1;
+	qsort(chunks, nr_chunks, sizeof(*chunks), by_disk_offset);
+	for (i = 0; i < nr_chunks; i++)
+		planned += chunks[i].length;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	queues = calloc(nr_queues, sizeof(*queues));
+	for (i = 0; i < (size_t)nr_queues; i++) {
+		ret = queue_init(&queues[i]);
+		if (ret) {
+			fprintf(stderr, "ntfspunch-clone: queue %zu setup: %s\n",
+				i, strerror(-ret));
+			return 1;
+		}
+	}
+	for (i = 0; i < (size_t)nr_queues; i++)
+		pthread_create(&queues[i].thread, NULL, queue_thread,
+			       &queues[i]);
+	for (i = 0; i < (size_t)nr_queues; i++) {
+		pthread_join(queues[i].thread, NULL);
+		if (queues[i].error)
+			ret = queues[i].error;
+	}
+	if (ret == 0 && fdatasync(dest_fd) < 0) {
+		perror(argv[optind + 1]);
+		ret = -errno;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("ntfspunch-clone: %s: %zu chunks, %" PRIu64 " bytes read, %"
+	       PRIu64 " written, %" PRIu64 " zero, %" PRIu64 " unchanged,"
+	       " %.1f MB/s\n", map.filename, nr_chunks, bytes_read,
+	       bytes_written, bytes_zero,
+	       map.size - planned,
+	       secs > 0 ? bytes_read / secs / (1024 * 1024) : 0.0);
+	for (i = 0; i < (size_t)nr_queues; i++)
+		np_ring_exit(&queues[i].ring);
+	close(dest_fd);
+	close(disk_fd);
+	np_map_free(&map);
+	return ret ? 1 : 0;
+}
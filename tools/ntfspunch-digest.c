@@ -0,0 +1,606 @@
+/*
+ * ntfspunch-digest.c - Parallel content digests of NTFS Punch images
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * To tell whether Windows changed an image while it was booted, take a
+ * digest of the image before handing the disk back, and verify it
+ * before attaching the image again:
+ *
+ *   ntfspunch-digest -o /var/lib/ntfspunch/disk.npd /proc/ntfspunch/a
+ *   ntfspunch-digest -v /var/lib/ntfspunch/disk.npd /mnt/ntfs/disk.img
+ *
+ * The image is cut into fixed-size chunks by file offset, and each
+ * chunk's leaf is its crc32c (SSE4.2 where there is one).  Like
+ * ntfspunch-clone, the runs are read straight off the disk in LBA order
+ * by several io_uring queues.  Each queue hashes its own pieces, and a
+ * chunk split over runs is pieced back together with
+ * np_crc32c_combine(), so the read order doesn't matter.
+ *
+ * The manifest is a Merkle tree over the leaves, with each node the
+ * crc32c of up to FANOUT children.  Verifying compares the roots and only
+ * descends into subtrees that differ, printing the chunks that changed
+ * as offset:length.  -c does the same between two manifests without
+ * reading any image.
+ *
+ * crc32c is for catching changes, not tampering.
+ */
+
+#define _GNU_SOURCE
+#include "punchmap.h"
+#include "uring.h"
+#include "crc32c.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#define DEF_QUEUES	4
+#define DEF_DEPTH	16
+#define DEF_CHUNK	(1024 * 1024)
+#define MAX_CHUNK	(64 * 1024 * 1024)
+#define FANOUT		64
+
+#define MANIFEST_MAGIC		"NPDIGEST"
+#define MANIFEST_VERSION	1
+
+/* Little endian on disk, followed by the levels from the leaves up */
+struct manifest_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t chunk_size;
+	uint64_t size;		/* of the image, in bytes */
+	uint64_t nr_chunks;
+	uint32_t fanout;
+	uint32_t root;
+};
+
+struct manifest {
+	uint64_t size;
+	uint32_t chunk_size;
+	int nr_levels;
+	size_t count[64];	/* nodes per level, 0 is the leaves */
+	uint32_t *level[64];
+};
+
+/* A piece of a chunk that's contiguous on the disk */
+struct piece {
+	uint64_t disk_offset;
+	uint64_t file_offset;
+	uint32_t length;
+	uint32_t crc;
+};
+
+struct queue {
+	pthread_t thread;
+	struct np_ring ring;
+	struct piece **slots;
+	void **bufs;
+	int error;
+};
+
+static struct np_map map;
+static struct piece *pieces, **order;
+static size_t nr_pieces, next_piece;
+static int disk_fd = -1;
+static int failed;
+static unsigned int depth = DEF_DEPTH, chunk_size = DEF_CHUNK;
+static unsigned int disk_bs = 512;
+static uint64_t bytes_read;
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: ntfspunch-digest [-q queues] [-d depth] [-b chunk_kb]"
+		" -o <manifest> <source>\n"
+		"       ntfspunch-digest [-q queues] [-d depth]"
+		" -v <manifest> <source>\n"
+		"       ntfspunch-digest -c <old manifest> <new manifest>\n"
+		"  source is a /proc/ntfspunch/? node or a file on a"
+		" mounted NTFS\n"
+		"  -o writes a manifest of the image\n"
+		"  -v prints the chunks that changed since the manifest\n"
+		"  -c prints the chunks that differ between manifests\n");
+	exit(1);
+}
+
+/*
+ * Cut the runs into pieces that never cross a chunk boundary, in file
+ * order
+ */
+static int
+build_pieces(void)
+{
+	uint64_t off, end, n;
+	size_t alloced = 0, i;
+	struct np_run *run;
+	struct piece *tmp;
+
+	for (i = 0; i < map.nr_runs; i++) {
+		run = &map.runs[i];
+		off = run->file_offset;
+		end = run->file_offset + run->length;
+		if (end > map.size)
+			end = map.size;
+		for (; off < end; off += n) {
+			n = chunk_size - off % chunk_size;
+			if (n > end - off)
+				n = end - off;
+			if (nr_pieces == alloced) {
+				alloced = alloced ? alloced * 2 : 1024;
+				tmp = realloc(pieces, alloced * sizeof(*tmp));
+				if (tmp == NULL)
+					return -ENOMEM;
+				pieces = tmp;
+			}
+			pieces[nr_pieces].disk_offset = run->disk_offset +
+				(off - run->file_offset);
+			pieces[nr_pieces].file_offset = off;
+			pieces[nr_pieces].length = n;
+			nr_pieces++;
+		}
+	}
+	return 0;
+}
+
+static int
+by_disk_offset(const void *a, const void *b)
+{
+	const struct piece *x = *(struct piece **)a, *y = *(struct piece **)b;
+
+	if (x->disk_offset != y->disk_offset)
+		return x->disk_offset < y->disk_offset ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Start reading the next piece into a slot, returns 0 if there are none
+ * left
+ */
+static int
+queue_read(struct queue *q, unsigned int tag)
+{
+	struct io_uring_sqe *sqe;
+	struct piece *p;
+	size_t idx;
+	uint32_t len;
+
+	if (__atomic_load_n(&failed, __ATOMIC_RELAXED))
+		return 0;
+	idx = __atomic_fetch_add(&next_piece, 1, __ATOMIC_RELAXED);
+	if (idx >= nr_pieces)
+		return 0;
+	p = q->slots[tag] = order[idx];
+	/* O_DIRECT wants whole disk blocks, the tail isn't hashed */
+	len = (p->length + disk_bs - 1) & ~(disk_bs - 1);
+	sqe = np_ring_get_sqe(&q->ring);
+	np_prep_rw_fixed(sqe, IORING_OP_READ_FIXED, 0, q->bufs[tag], len,
+			 p->disk_offset, tag, tag);
+	return 1;
+}
+
+static void
+queue_complete(struct queue *q, unsigned int tag, int res)
+{
+	struct piece *p = q->slots[tag];
+
+	if (res < 0 || (uint32_t)res < p->length) {
+		fprintf(stderr, "ntfspunch-digest: read at %s offset %" PRIu64
+			": %s\n", map.disk, p->disk_offset,
+			res < 0 ? strerror(-res) : "short transfer");
+		q->error = res < 0 ? res : -EIO;
+		__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	p->crc = np_crc32c(0, q->bufs[tag], p->length);
+	__atomic_fetch_add(&bytes_read, p->length, __ATOMIC_RELAXED);
+}
+
+static int
+queue_init(struct queue *q)
+{
+	struct iovec *iov;
+	unsigned int i;
+	int ret;
+
+	q->slots = calloc(depth, sizeof(*q->slots));
+	q->bufs = calloc(depth, sizeof(*q->bufs));
+	iov = calloc(depth, sizeof(*iov));
+	if (q->slots == NULL || q->bufs == NULL || iov == NULL) {
+		free(iov);
+		return -ENOMEM;
+	}
+	for (i = 0; i < depth; i++) {
+		if (posix_memalign(&q->bufs[i], 4096, chunk_size)) {
+			free(iov);
+			return -ENOMEM;
+		}
+		iov[i].iov_base = q->bufs[i];
+		iov[i].iov_len = chunk_size;
+	}
+	ret = np_ring_init(&q->ring, depth, 0);
+	if (ret == 0)
+		ret = np_ring_register_files(&q->ring, &disk_fd, 1);
+	if (ret == 0)
+		ret = np_ring_register_buffers(&q->ring, iov, depth);
+	free(iov);
+	return ret;
+}
+
+static void *
+queue_thread(void *arg)
+{
+	struct queue *q = arg;
+	struct io_uring_cqe *cqe;
+	unsigned int tag, inflight = 0;
+	int ret, res;
+
+	for (tag = 0; tag < depth; tag++)
+		inflight += queue_read(q, tag);
+	while (inflight) {
+		ret = np_ring_submit(&q->ring, 1);
+		if (ret < 0) {
+			fprintf(stderr, "ntfspunch-digest: io_uring_enter: %s\n",
+				strerror(-ret));
+			q->error = ret;
+			__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		while ((cqe = np_ring_peek_cqe(&q->ring)) != NULL) {
+			tag = cqe->user_data;
+			res = cqe->res;
+			np_ring_cqe_seen(&q->ring);
+			queue_complete(q, tag, res);
+			inflight--;
+			inflight += queue_read(q, tag);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Build the levels above the leaves, each node the crc32c of its
+ * children (as stored, little endian)
+ */
+static int
+build_tree(struct manifest *mf)
+{
+	size_t i, n;
+	int l;
+
+	for (l = 0; mf->count[l] > 1; l++) {
+		if (l + 1 == 64)
+			return -EINVAL;
+		n = (mf->count[l] + FANOUT - 1) / FANOUT;
+		mf->level[l + 1] = malloc(n * sizeof(uint32_t));
+		if (mf->level[l + 1] == NULL)
+			return -ENOMEM;
+		for (i = 0; i < n; i++) {
+			size_t first = i * FANOUT;
+			size_t nr = mf->count[l] - first < FANOUT ?
+				mf->count[l] - first : FANOUT;
+			mf->level[l + 1][i] = htole32(np_crc32c(0,
+				&mf->level[l][first], nr * sizeof(uint32_t)));
+		}
+		mf->count[l + 1] = n;
+	}
+	mf->nr_levels = l + 1;
+	return 0;
+}
+
+static uint32_t
+root_of(const struct manifest *mf)
+{
+	return le32toh(mf->level[mf->nr_levels - 1][0]);
+}
+
+/*
+ * Read every piece and work out the leaves and the tree
+ */
+static int
+digest_image(struct manifest *mf, int nr_queues)
+{
+	struct queue *queues;
+	struct timespec t0, t1;
+	uint64_t chunk;
+	uint32_t leaf;
+	size_t i;
+	int ret = 0;
+	double secs;
+
+	if (build_pieces())
+		return -ENOMEM;
+	order = malloc(nr_pieces * sizeof(*order));
+	if (order == NULL)
+		return -ENOMEM;
+	for (i = 0; i < nr_pieces; i++)
+		order[i] = &pieces[i];
+	qsort(order, nr_pieces, sizeof(*order), by_disk_offset);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	queues = calloc(nr_queues, sizeof(*queues));
+	if (queues == NULL)
+		return -ENOMEM;
+	for (i = 0; i < (size_t)nr_queues; i++) {
+		ret = queue_init(&queues[i]);
+		if (ret) {
+			fprintf(stderr, "ntfspunch-digest: queue %zu setup: %s\n",
+				i, strerror(-ret));
+			return ret;
+		}
+	}
+	for (i = 0; i < (size_t)nr_queues; i++)
+		pthread_create(&queues[i].thread, NULL, queue_thread,
+			       &queues[i]);
+	for (i = 0; i < (size_t)nr_queues; i++) {
+		pthread_join(queues[i].thread, NULL);
+		if (queues[i].error)
+			ret = queues[i].error;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (i = 0; i < (size_t)nr_queues; i++)
+		np_ring_exit(&queues[i].ring);
+	if (ret)
+		return ret;
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	fprintf(stderr, "ntfspunch-digest: %s: %zu pieces, %" PRIu64
+		" bytes, %.1f MB/s\n", map.filename, nr_pieces, bytes_read,
+		secs > 0 ? bytes_read / secs / (1024 * 1024) : 0.0);
+
+	/* Pieces are in file order, so each chunk's are together */
+	mf->size = map.size;
+	mf->chunk_size = chunk_size;
+	mf->count[0] = (map.size + chunk_size - 1) / chunk_size;
+	mf->level[0] = calloc(mf->count[0] ? mf->count[0] : 1,
+			      sizeof(uint32_t));
+	if (mf->level[0] == NULL)
+		return -ENOMEM;
+	for (i = 0; i < nr_pieces; i++) {
+		chunk = pieces[i].file_offset / chunk_size;
+		leaf = le32toh(mf->level[0][chunk]);
+		if (pieces[i].file_offset % chunk_size == 0)
+			leaf = pieces[i].crc;
+		else
+			leaf = np_crc32c_combine(leaf, pieces[i].crc,
+						 pieces[i].length);
+		mf->level[0][chunk] = htole32(leaf);
+	}
+	if (mf->count[0] == 0)
+		mf->count[0] = 1;
+	return build_tree(mf);
+}
+
+static int
+write_manifest(const struct manifest *mf, const char *path)
+{
+	struct manifest_header h;
+	FILE *fp;
+	int l, ret = 0;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MANIFEST_MAGIC, sizeof(h.magic));
+	h.version = htole32(MANIFEST_VERSION);
+	h.chunk_size = htole32(mf->chunk_size);
+	h.size = htole64(mf->size);
+	h.nr_chunks = htole64(mf->count[0]);
+	h.fanout = htole32(FANOUT);
+	h.root = htole32(root_of(mf));
+
+	fp = fopen(path, "w");
+	if (fp == NULL)
+		return -errno;
+	if (fwrite(&h, sizeof(h), 1, fp) != 1)
+		ret = -EIO;
+	for (l = 0; ret == 0 && l < mf->nr_levels; l++)
+		if (fwrite(mf->level[l], sizeof(uint32_t), mf->count[l],
+			   fp) != mf->count[l])
+			ret = -EIO;
+	if (fclose(fp) && ret == 0)
+		ret = -errno;
+	return ret;
+}
+
+/*
+ * Load a manifest, rebuilding (and so checking) the tree from its leaves
+ */
+static int
+read_manifest(struct manifest *mf, const char *path)
+{
+	struct manifest_header h;
+	FILE *fp;
+	int ret = 0;
+
+	memset(mf, 0, sizeof(*mf));
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -errno;
+	if (fread(&h, sizeof(h), 1, fp) != 1 ||
+	    memcmp(h.magic, MANIFEST_MAGIC, sizeof(h.magic)) != 0 ||
+	    le32toh(h.version) != MANIFEST_VERSION ||
+	    le32toh(h.fanout) != FANOUT || le64toh(h.nr_chunks) == 0) {
+		fclose(fp);
+		return -EINVAL;
+	}
+	mf->size = le64toh(h.size);
+	mf->chunk_size = le32toh(h.chunk_size);
+	mf->count[0] = le64toh(h.nr_chunks);
+	mf->level[0] = malloc(mf->count[0] * sizeof(uint32_t));
+	if (mf->level[0] == NULL ||
+	    fread(mf->level[0], sizeof(uint32_t), mf->count[0], fp) !=
+	    mf->count[0])
+		ret = -EINVAL;
+	fclose(fp);
+	if (ret == 0)
+		ret = build_tree(mf);
+	if (ret == 0 && root_of(mf) != le32toh(h.root))
+		ret = -EINVAL;
+	return ret;
+}
+
+/*
+ * Walk down both trees from node i of level l, only into the children
+ * that differ, and print the leaves that do
+ */
+static size_t
+diff_tree(const struct manifest *a, const struct manifest *b, int l,
+	  size_t i)
+{
+	size_t c, end, n = 0;
+	uint64_t off, len;
+
+	if (a->level[l][i] == b->level[l][i])
+		return 0;
+	if (l == 0) {
+		off = (uint64_t)i * a->chunk_size;
+		len = a->size - off < a->chunk_size ? a->size - off :
+			a->chunk_size;
+		printf("%" PRIu64 ":%" PRIu64 "\n", off, len);
+		return 1;
+	}
+	end = (i + 1) * FANOUT;
+	if (end > a->count[l - 1])
+		end = a->count[l - 1];
+	for (c = i * FANOUT; c < end; c++)
+		n += diff_tree(a, b, l - 1, c);
+	return n;
+}
+
+static int
+compare(const struct manifest *old, const struct manifest *new,
+	const char *name)
+{
+	size_t n;
+
+	if (old->size != new->size || old->chunk_size != new->chunk_size) {
+		printf("ntfspunch-digest: %s: size or chunk size differs\n",
+		       name);
+		return 1;
+	}
+	n = diff_tree(old, new, old->nr_levels - 1, 0);
+	printf("ntfspunch-digest: %s: %zu of %zu chunks differ\n", name, n,
+	       old->count[0]);
+	return n ? 1 : 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct manifest mf, old;
+	const char *out = NULL, *in = NULL;
+	int opt, ret, cmp = 0, nr_queues = DEF_QUEUES;
+
+	while ((opt = getopt(argc, argv, "q:d:b:o:v:c")) != -1) {
+		switch (opt) {
+		case 'q':
+			nr_queues = atoi(optarg);
+			break;
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 'b':
+			chunk_size = atoi(optarg) * 1024;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'v':
+			in = optarg;
+			break;
+		case 'c':
+			cmp = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (cmp) {
+		if (out || in || optind != argc - 2)
+			usage();
+		if ((ret = read_manifest(&old, argv[optind])) ||
+		    (ret = read_manifest(&mf, argv[optind + 1]))) {
+			fprintf(stderr, "ntfspunch-digest: bad manifest: %s\n",
+				strerror(-ret));
+			return 1;
+		}
+		return compare(&old, &mf, argv[optind + 1]);
+	}
+	if (optind != argc - 1 || !out == !in || nr_queues < 1 ||
+	    depth < 1 || depth > 4096)
+		usage();
+	if (in) {
+		ret = read_manifest(&old, in);
+		if (ret) {
+			fprintf(stderr, "ntfspunch-digest: %s: bad manifest: %s\n",
+				in, strerror(-ret));
+			return 1;
+		}
+		chunk_size = old.chunk_size;
+	}
+	if (chunk_size < 4096 || chunk_size > MAX_CHUNK || (chunk_size & 4095))
+		usage();
+
+	ret = np_map_load(&map, argv[optind]);
+	if (ret) {
+		fprintf(stderr, "ntfspunch-digest: unable to load runlist from"
+			" %s: %s\n", argv[optind], strerror(-ret));
+		return 1;
+	}
+	np_map_coalesce(&map);
+	disk_fd = open(map.disk, O_RDONLY | O_DIRECT);
+	if (disk_fd < 0) {
+		perror(map.disk);
+		return 1;
+	}
+	if (ioctl(disk_fd, BLKSSZGET, &disk_bs) < 0)
+		disk_bs = 512;
+
+	memset(&mf, 0, sizeof(mf));
+	ret = digest_image(&mf, nr_queues);
+	close(disk_fd);
+	if (ret) {
+		fprintf(stderr, "ntfspunch-digest: %s: %s\n", map.filename,
+			strerror(-ret));
+		return 1;
+	}
+	if (in) {
+		ret = compare(&old, &mf, map.filename);
+	} else {
+		ret = write_manifest(&mf, out);
+		if (ret)
+			fprintf(stderr, "ntfspunch-digest: %s: %s\n", out,
+				strerror(-ret));
+		else
+			printf("ntfspunch-digest: %s: %zu chunks, root %08x\n",
+			       map.filename, mf.count[0], root_of(&mf));
+		ret = ret ? 1 : 0;
+	}
+	np_map_free(&map);
+	return ret;
+}
@@ -0,0 +1,270 @@
+/*
+ * ntfspunch-export.c - Export a runlist for dm-linear, VMDK or QEMU
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Turns a device's runlist into mappings that existing kernel/hypervisor
+ * features understand, for hosts where we'd rather not run the driver:
+ *
+ *   dm    - a dmsetup table of linear targets
+ *   vmdk  - a monolithicFlat VMDK descriptor, one FLAT extent per run
+ *   qemu  - raw offset/size pairs (JSON) for -blockdev raw,offset=,size=
+ *
+ * -V reads the exported path and the reference device side by side and
+ * compares CRC32C digests chunk by chunk, so a mapping can be proven
+ * byte-identical to /dev/ntfspunchX before it's trusted.
+ */
+
+#define _GNU_SOURCE
+#include "crc32c.h"
+#include "punchmap.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define VERIFY_CHUNK	(1024 * 1024)
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: ntfspunch-export [-f dm|vmdk|qemu] <source>\n"
+		"       ntfspunch-export -V <exported path> [-R reference]"
+		" <source>\n"
+		"  source is a /proc/ntfspunch/? node or a file on a"
+		" mounted NTFS\n"
+		"  the reference defaults to the /dev/ntfspunch? of the source,"
+		" or \"map\"\n"
+		"  to read the runlist directly from the underlying disk\n");
+	exit(1);
+}
+
+static void
+export_dm(const struct np_map *map, const char *disk)
+{
+	size_t i;
+
+	for (i = 0; i < map->nr_runs; i++)
+		printf("%" PRIu64 " %" PRIu64 " linear %s %" PRIu64 "\n",
+		       map->runs[i].file_offset >> 9,
+		       map->runs[i].length >> 9, disk,
+		       map->runs[i].disk_offset >> 9);
+}
+
+static void
+export_vmdk(const struct np_map *map, const char *disk)
+{
+	uint64_t sectors = map->size >> 9;
+	size_t i;
+
+	printf("# Disk DescriptorFile\n"
+	       "version=1\n"
+	       "CID=fffffffe\n"
+	       "parentCID=ffffffff\n"
+	       "createType=\"monolithicFlat\"\n"
+	       "\n"
+	       "# Extent description\n");
+	for (i = 0; i < map->nr_runs; i++)
+		printf("RW %" PRIu64 " FLAT \"%s\" %" PRIu64 "\n",
+		       map->runs[i].length >> 9, disk,
+		       map->runs[i].disk_offset >> 9);
+	printf("\n"
+	       "# The Disk Data Base\n"
+	       "#DDB\n"
+	       "\n"
+	       "ddb.virtualHWVersion = \"4\"\n"
+	       "ddb.adapterType = \"lsilogic\"\n"
+	       "ddb.geometry.cylinders = \"%" PRIu64 "\"\n"
+	       "ddb.geometry.heads = \"255\"\n"
+	       "ddb.geometry.sectors = \"63\"\n",
+	       sectors / (255 * 63));
+}
+
+static void
+export_qemu(const struct np_map *map, const char *disk)
+{
+	size_t i;
+
+	printf("{\n  \"disk\": \"%s\",\n  \"size\": %" PRIu64 ",\n"
+	       "  \"extents\": [\n", disk, map->size);
+	for (i = 0; i < map->nr_runs; i++)
+		printf("    { \"logical\": %" PRIu64 ", \"offset\": %" PRIu64
+		       ", \"size\": %" PRIu64 " }%s\n",
+		       map->runs[i].file_offset, map->runs[i].disk_offset,
+		       map->runs[i].length,
+		       i + 1 < map->nr_runs ? "," : "");
+	printf("  ]");
+	/* A single run can be handed to QEMU's raw driver as-is */
+	if (map->nr_runs == 1)
+		printf(",\n  \"blockdev\": \"driver=raw,offset=%" PRIu64
+		       ",size=%" PRIu64 ",file.driver=host_device"
+		       ",file.filename=%s\"", map->runs[0].disk_offset,
+		       map->runs[0].length, disk);
+	printf("\n}\n");
+}
+
+/*
+ * Read len bytes at offset of the image, either from a device/file or,
+ * with disk_fd >= 0, through the runlist straight from the disk
+ */
+static int
+read_image(const struct np_map *map, int fd, int disk_fd, char *buf,
+	   uint64_t offset, uint64_t len)
+{
+	uint64_t done = 0, n, disk_off;
+
+	if (disk_fd < 0)
+		return pread(fd, buf, len, offset) == (ssize_t)len ? 0 : -EIO;
+	while (done < len) {
+		n = np_map_lookup(map, offset + done, len - done, &disk_off);
+		if (n == 0 ||
+		    pread(disk_fd, buf + done, n, disk_off) != (ssize_t)n)
+			return -EIO;
+		done += n;
+	}
+	return 0;
+}
+
+static int
+open_side(const struct np_map *map, const char *path, int *fd, int *disk_fd)
+{
+	*fd = -1;
+	*disk_fd = -1;
+	if (strcmp(path, "map") == 0) {
+		*disk_fd = open(map->disk, O_RDONLY | O_DIRECT);
+		return *disk_fd < 0 ? -errno : 0;
+	}
+	*fd = open(path, O_RDONLY | O_DIRECT);
+	return *fd < 0 ? -errno : 0;
+}
+
+static int
+verify(const struct np_map *map, const char *exported, const char *reference)
+{
+	int efd, edisk, rfd, rdisk, mismatches = 0;
+	uint32_t ecrc = 0, rcrc = 0, a, b;
+	uint64_t off, len;
+	char *ebuf, *rbuf;
+
+	if (open_side(map, exported, &efd, &edisk) < 0) {
+		perror(exported);
+		return 1;
+	}
+	if (open_side(map, reference, &rfd, &rdisk) < 0) {
+		perror(reference);
+		return 1;
+	}
+	if (posix_memalign((void **)&ebuf, 4096, VERIFY_CHUNK) ||
+	    posix_memalign((void **)&rbuf, 4096, VERIFY_CHUNK))
+		return 1;
+
+	for (off = 0; off < map->size; off += len) {
+		len = map->size - off < VERIFY_CHUNK ?
+			map->size - off : VERIFY_CHUNK;
+		if (read_image(map, efd, edisk, ebuf, off, len) ||
+		    read_image(map, rfd, rdisk, rbuf, off, len)) {
+			fprintf(stderr, "read error at %" PRIu64 "\n", off);
+			return 1;
+		}
+		a = np_crc32c(0, ebuf, len);
+		b = np_crc32c(0, rbuf, len);
+		if (a != b) {
+			printf("mismatch at %" PRIu64 " (%" PRIu64
+			       " bytes): %08x != %08x\n", off, len, a, b);
+			mismatches++;
+		}
+		ecrc = np_crc32c(ecrc, ebuf, len);
+		rcrc = np_crc32c(rcrc, rbuf, len);
+	}
+	printf("%s: crc32c %08x\n%s: crc32c %08x\n", exported, ecrc,
+	       reference, rcrc);
+	if (mismatches || ecrc != rcrc) {
+		printf("FAIL: %d mismatched chunks\n", mismatches);
+		return 1;
+	}
+	printf("OK: %" PRIu64 " bytes identical\n", map->size);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *format = "dm", *exported = NULL, *reference = NULL;
+	char *disk;
+	struct np_map map;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "f:V:R:")) != -1) {
+		switch (opt) {
+		case 'f':
+			format = optarg;
+			break;
+		case 'V':
+			exported = optarg;
+			break;
+		case 'R':
+			reference = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+
+	ret = np_map_load(&map, argv[optind]);
+	if (ret) {
+		fprintf(stderr, "ntfspunch-export: unable to load runlist from"
+			" %s: %s\n", argv[optind], strerror(-ret));
+		return 1;
+	}
+	np_map_coalesce(&map);
+
+	if (exported) {
+		if (reference == NULL)
+			reference = map.device[0] ? map.device : "map";
+		ret = verify(&map, exported, reference);
+		np_map_free(&map);
+		return ret;
+	}
+
+	/* Hand out the stable node name rather than /dev/block/M:m */
+	disk = realpath(map.disk, NULL);
+	if (disk == NULL) {
+		perror(map.disk);
+		return 1;
+	}
+	if (strcmp(format, "dm") == 0)
+		export_dm(&map, disk);
+	else if (strcmp(format, "vmdk") == 0)
+		export_vmdk(&map, disk);
+	else if (strcmp(format, "qemu") == 0)
+		export_qemu(&map, disk);
+	else
+		usage();
+	free(disk);
+	np_map_free(&map);
+	return 0;
+}
@@ -0,0 +1,493 @@
+/*
+ * ntfspunch-ublk.c - Serve an NTFS Punch image through ublk
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * For hosts that can't load the kernel module.  The image's runlist is
+ * remapped in userspace exactly like split_or_get_offset() does, and the
+ * resulting extents are read/written against the underlying NTFS block
+ * device with io_uring, one ring and thread per ublk queue.
+ */
+
+#define _GNU_SOURCE
+#include "punchmap.h"
+#include "uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/fs.h>
+#include <linux/ublk_cmd.h>
+
+#define DEF_QUEUES	1
+#define DEF_DEPTH	64
+#define DEF_MAX_IO	(512 * 1024)
+
+/* Registered file slots */
+#define FILE_CDEV	0
+#define FILE_DISK	1
+
+/* user_data layout: tag | kind << 16 | piece length << 32 */
+#define UD_CMD		0
+#define UD_DISK		1
+#define UD_TAG(ud)	((ud) & 0xffff)
+#define UD_KIND(ud)	(((ud) >> 16) & 0xff)
+#define UD_LEN(ud)	((ud) >> 32)
+#define UD(tag, kind, len) \
+	((uint64_t)(tag) | (uint64_t)(kind) << 16 | (uint64_t)(len) << 32)
+
+#ifdef UBLK_U_CMD_ADD_DEV
+#define CMD_ADD_DEV		UBLK_U_CMD_ADD_DEV
+#define CMD_SET_PARAMS		UBLK_U_CMD_SET_PARAMS
+#define CMD_START_DEV		UBLK_U_CMD_START_DEV
+#define CMD_STOP_DEV		UBLK_U_CMD_STOP_DEV
+#define CMD_DEL_DEV		UBLK_U_CMD_DEL_DEV
+#define IO_FETCH_REQ		UBLK_U_IO_FETCH_REQ
+#define IO_COMMIT_AND_FETCH_REQ	UBLK_U_IO_COMMIT_AND_FETCH_REQ
+#else
+#define CMD_ADD_DEV		UBLK_CMD_ADD_DEV
+#define CMD_SET_PARAMS		UBLK_CMD_SET_PARAMS
+#define CMD_START_DEV		UBLK_CMD_START_DEV
+#define CMD_STOP_DEV		UBLK_CMD_STOP_DEV
+#define CMD_DEL_DEV		UBLK_CMD_DEL_DEV
+#define IO_FETCH_REQ		UBLK_IO_FETCH_REQ
+#define IO_COMMIT_AND_FETCH_REQ	UBLK_IO_COMMIT_AND_FETCH_REQ
+#endif
+
+struct tag_state {
+	void *buf;
+	int pending;		/* disk I/Os still in flight */
+	int result;		/* bytes transferred or -errno */
+	int aborted;
+};
+
+struct queue {
+	int q_id;
+	pthread_t thread;
+	struct np_ring ring;
+	struct ublksrv_io_desc *descs;
+	size_t descs_size;
+	struct tag_state *tags;
+	int nr_aborted;
+};
+
+static struct np_map map;
+static struct ublksrv_ctrl_dev_info info;
+static struct queue *queues;
+static int cdev_fd = -1;
+static int disk_fd = -1;
+static volatile sig_atomic_t stopping;
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: ntfspunch-ublk [-q queues] [-d depth] [-m max_io_kb]"
+		" <source>\n"
+		"  source is a /proc/ntfspunch/? node or a file on a"
+		" mounted NTFS\n");
+	exit(1);
+}
+
+static void
+on_signal(int sig)
+{
+	stopping = 1;
+}
+
+static int
+ctrl_cmd(struct np_ring *ring, int ctrl_fd, unsigned int op,
+	 struct ublksrv_ctrl_cmd *cmd)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	sqe = np_ring_get_sqe(ring);
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->fd = ctrl_fd;
+	sqe->cmd_op = op;
+	memcpy(sqe->cmd, cmd, sizeof(*cmd));
+	ret = np_ring_submit(ring, 1);
+	if (ret < 0)
+		return ret;
+	cqe = np_ring_peek_cqe(ring);
+	ret = cqe->res;
+	np_ring_cqe_seen(ring);
+	return ret;
+}
+
+static struct io_uring_sqe *
+get_sqe(struct np_ring *ring)
+{
+	struct io_uring_sqe *sqe;
+
+	/* A full SQ ring drains synchronously on enter without SQPOLL */
+	while ((sqe = np_ring_get_sqe(ring)) == NULL)
+		np_ring_submit(ring, 0);
+	return sqe;
+}
+
+static void
+queue_io_cmd(struct queue *q, int tag, unsigned int op, int result)
+{
+	struct io_uring_sqe *sqe = get_sqe(&q->ring);
+	struct ublksrv_io_cmd *cmd = (struct ublksrv_io_cmd *)sqe->cmd;
+
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = FILE_CDEV;
+	sqe->cmd_op = op;
+	sqe->user_data = UD(tag, UD_CMD, 0);
+	cmd->q_id = q->q_id;
+	cmd->tag = tag;
+	cmd->result = result;
+	cmd->addr = (unsigned long)q->tags[tag].buf;
+}
+
+/*
+ * Turn one ublk request into disk I/Os, splitting wherever the image
+ * crosses into a different runlist element
+ */
+static void
+handle_request(struct queue *q, int tag)
+{
+	const struct ublksrv_io_desc *iod = &q->descs[tag];
+	struct tag_state *ts = &q->tags[tag];
+	uint64_t off = iod->start_sector << 9;
+	uint64_t len = (uint64_t)iod->nr_sectors << 9;
+	uint64_t done = 0, disk_off, n;
+	struct io_uring_sqe *sqe;
+	int op;
+
+	ts->result = len;
+	ts->pending = 0;
+
+	switch (ublksrv_get_op(iod)) {
+	case UBLK_IO_OP_READ:
+		op = IORING_OP_READ_FIXED;
+		break;
+	case UBLK_IO_OP_WRITE:
+		op = IORING_OP_WRITE_FIXED;
+		break;
+	case UBLK_IO_OP_FLUSH:
+		sqe = get_sqe(&q->ring);
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->fd = FILE_DISK;
+		sqe->user_data = UD(tag, UD_DISK, 0);
+		ts->result = 0;
+		ts->pending = 1;
+		return;
+	default:
+		queue_io_cmd(q, tag, IO_COMMIT_AND_FETCH_REQ, -EOPNOTSUPP);
+		return;
+	}
+
+	while (done < len) {
+		n = np_map_lookup(&map, off + done, len - done, &disk_off);
+		if (n == 0) {
+			fprintf(stderr, "ntfspunch-ublk: Couldn't map I/O at"
+				" %llu (%llu bytes)\n",
+				(unsigned long long)(off + done),
+				(unsigned long long)(len - done));
+			ts->result = -EIO;
+			break;
+		}
+		sqe = get_sqe(&q->ring);
+		np_prep_rw_fixed(sqe, op, FILE_DISK, (char *)ts->buf + done,
+				 n, disk_off, tag, UD(tag, UD_DISK, n));
+		if (op == IORING_OP_WRITE_FIXED &&
+		    (iod->op_flags & UBLK_IO_F_FUA))
+			sqe->rw_flags = RWF_DSYNC;
+		ts->pending++;
+		done += n;
+	}
+	if (ts->pending == 0)
+		queue_io_cmd(q, tag, IO_COMMIT_AND_FETCH_REQ, ts->result);
+}
+
+static void
+handle_cqe(struct queue *q, struct io_uring_cqe *cqe)
+{
+	int tag = UD_TAG(cqe->user_data);
+	struct tag_state *ts = &q->tags[tag];
+
+	if (UD_KIND(cqe->user_data) == UD_CMD) {
+		if (cqe->res == UBLK_IO_RES_OK) {
+			handle_request(q, tag);
+			return;
+		}
+		if (cqe->res != UBLK_IO_RES_ABORT)
+			fprintf(stderr, "ntfspunch-ublk: q%d tag %d: %s\n",
+				q->q_id, tag, strerror(-cqe->res));
+		ts->aborted = 1;
+		q->nr_aborted++;
+		return;
+	}
+
+	if (cqe->res < 0)
+		ts->result = cqe->res;
+	else if ((uint64_t)cqe->res != UD_LEN(cqe->user_data) &&
+		 ts->result >= 0)
+		ts->result = -EIO;
+	if (--ts->pending == 0)
+		queue_io_cmd(q, tag, IO_COMMIT_AND_FETCH_REQ, ts->result);
+}
+
+static void *
+queue_thread(void *arg)
+{
+	struct queue *q = arg;
+	struct io_uring_cqe *cqe;
+	int tag;
+
+	for (tag = 0; tag < info.queue_depth; tag++)
+		queue_io_cmd(q, tag, IO_FETCH_REQ, 0);
+
+	while (q->nr_aborted < info.queue_depth) {
+		if (np_ring_submit(&q->ring, 1) < 0)
+			break;
+		while ((cqe = np_ring_peek_cqe(&q->ring)) != NULL) {
+			handle_cqe(q, cqe);
+			np_ring_cqe_seen(&q->ring);
+		}
+	}
+	return NULL;
+}
+
+static int
+queue_init(struct queue *q, int q_id)
+{
+	long pagesz = sysconf(_SC_PAGESIZE);
+	size_t stride = UBLK_MAX_QUEUE_DEPTH * sizeof(struct ublksrv_io_desc);
+	struct iovec *iov;
+	int fds[2] = { cdev_fd, disk_fd };
+	int tag, ret;
+
+	q->q_id = q_id;
+	stride = (stride + pagesz - 1) & ~(pagesz - 1);
+	q->descs_size = info.queue_depth * sizeof(struct ublksrv_io_desc);
+	q->descs_size = (q->descs_size + pagesz - 1) & ~(pagesz - 1);
+	q->descs = mmap(NULL, q->descs_size, PROT_READ, MAP_SHARED | MAP_POPULATE,
+			cdev_fd, UBLKSRV_CMD_BUF_OFFSET + q_id * stride);
+	if (q->descs == MAP_FAILED)
+		return -errno;
+
+	/* Room for every tag's command plus a few split pieces each */
+	ret = np_ring_init(&q->ring, info.queue_depth * 4, 0);
+	if (ret)
+		return ret;
+	ret = np_ring_register_files(&q->ring, fds, 2);
+	if (ret)
+		return ret;
+
+	q->tags = calloc(info.queue_depth, sizeof(*q->tags));
+	iov = calloc(info.queue_depth, sizeof(*iov));
+	if (q->tags == NULL || iov == NULL)
+		return -ENOMEM;
+	for (tag = 0; tag < info.queue_depth; tag++) {
+		if (posix_memalign(&q->tags[tag].buf, pagesz,
+				   info.max_io_buf_bytes))
+			return -ENOMEM;
+		iov[tag].iov_base = q->tags[tag].buf;
+		iov[tag].iov_len = info.max_io_buf_bytes;
+	}
+	ret = np_ring_register_buffers(&q->ring, iov, info.queue_depth);
+	free(iov);
+	return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct ublksrv_ctrl_cmd cmd;
+	struct ublk_params params;
+	struct np_ring ctrl_ring;
+	char cdev_path[64];
+	int opt, ctrl_fd, ret, i;
+	int nr_queues = DEF_QUEUES, depth = DEF_DEPTH, max_io = DEF_MAX_IO;
+	unsigned int pbs;
+	int lbs;
+
+	while ((opt = getopt(argc, argv, "q:d:m:")) != -1) {
+		switch (opt) {
+		case 'q':
+			nr_queues = atoi(optarg);
+			break;
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 'm':
+			max_io = atoi(optarg) * 1024;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1 || nr_queues < 1 || depth < 1 ||
+	    depth > UBLK_MAX_QUEUE_DEPTH || max_io < 4096)
+		usage();
+
+	ret = np_map_load(&map, argv[optind]);
+	if (ret) {
+		fprintf(stderr, "ntfspunch-ublk: unable to load runlist from"
+			" %s: %s\n", argv[optind], strerror(-ret));
+		return 1;
+	}
+	disk_fd = open(map.disk, O_RDWR | O_DIRECT);
+	if (disk_fd < 0) {
+		perror(map.disk);
+		return 1;
+	}
+	/* O_DIRECT wants whole logical blocks, so offer the disk's own */
+	if (ioctl(disk_fd, BLKSSZGET, &lbs) < 0 ||
+	    ioctl(disk_fd, BLKPBSZGET, &pbs) < 0) {
+		perror(map.disk);
+		return 1;
+	}
+	if (pbs < (unsigned int)lbs)
+		pbs = lbs;
+	if (map.size % lbs) {
+		fprintf(stderr, "ntfspunch-ublk: %s isn't a multiple of the"
+			" %d byte blocks of %s\n", map.filename, lbs, map.disk);
+		return 1;
+	}
+
+	ctrl_fd = open("/dev/ublk-control", O_RDWR);
+	if (ctrl_fd < 0) {
+		perror("/dev/ublk-control");
+		return 1;
+	}
+	ret = np_ring_init(&ctrl_ring, 4, IORING_SETUP_SQE128);
+	if (ret) {
+		fprintf(stderr, "ntfspunch-ublk: io_uring setup: %s\n",
+			strerror(-ret));
+		return 1;
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.nr_hw_queues = nr_queues;
+	info.queue_depth = depth;
+	info.max_io_buf_bytes = max_io;
+	info.dev_id = -1;
+	info.ublksrv_pid = getpid();
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.dev_id = -1;
+	cmd.queue_id = -1;
+	cmd.addr = (unsigned long)&info;
+	cmd.len = sizeof(info);
+	ret = ctrl_cmd(&ctrl_ring, ctrl_fd, CMD_ADD_DEV, &cmd);
+	if (ret < 0) {
+		fprintf(stderr, "ntfspunch-ublk: ADD_DEV: %s\n",
+			strerror(-ret));
+		return 1;
+	}
+
+	memset(&params, 0, sizeof(params));
+	params.len = sizeof(params);
+	params.types = UBLK_PARAM_TYPE_BASIC;
+	params.basic.attrs = UBLK_ATTR_VOLATILE_CACHE | UBLK_ATTR_FUA;
+	params.basic.logical_bs_shift = __builtin_ctz(lbs);
+	params.basic.physical_bs_shift = __builtin_ctz(pbs);
+	params.basic.io_min_shift = __builtin_ctz(lbs);
+	params.basic.io_opt_shift = __builtin_ctz(pbs);
+	params.basic.max_sectors = info.max_io_buf_bytes >> 9;
+	params.basic.dev_sectors = map.size >> 9;
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.dev_id = info.dev_id;
+	cmd.queue_id = -1;
+	cmd.addr = (unsigned long)&params;
+	cmd.len = sizeof(params);
+	ret = ctrl_cmd(&ctrl_ring, ctrl_fd, CMD_SET_PARAMS, &cmd);
+	if (ret < 0) {
+		fprintf(stderr, "ntfspunch-ublk: SET_PARAMS: %s\n",
+			strerror(-ret));
+		goto del;
+	}
+
+	snprintf(cdev_path, sizeof(cdev_path), "/dev/ublkc%u", info.dev_id);
+	for (i = 0; i < 100 && cdev_fd < 0; i++) {
+		cdev_fd = open(cdev_path, O_RDWR);
+		if (cdev_fd < 0)
+			usleep(10000);	/* wait for udev */
+	}
+	if (cdev_fd < 0) {
+		perror(cdev_path);
+		goto del;
+	}
+
+	queues = calloc(nr_queues, sizeof(*queues));
+	for (i = 0; i < nr_queues; i++) {
+		ret = queue_init(&queues[i], i);
+		if (ret) {
+			fprintf(stderr, "ntfspunch-ublk: queue %d setup: %s\n",
+				i, strerror(-ret));
+			goto del;
+		}
+	}
+	for (i = 0; i < nr_queues; i++)
+		pthread_create(&queues[i].thread, NULL, queue_thread,
+			       &queues[i]);
+
+	/* START_DEV blocks until every queue has fetched all its tags */
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.dev_id = info.dev_id;
+	cmd.queue_id = -1;
+	cmd.data[0] = getpid();
+	ret = ctrl_cmd(&ctrl_ring, ctrl_fd, CMD_START_DEV, &cmd);
+	if (ret < 0) {
+		fprintf(stderr, "ntfspunch-ublk: START_DEV: %s\n",
+			strerror(-ret));
+		goto stop;
+	}
+	printf("ntfspunch-ublk: serving %s on /dev/ublkb%u (%d queues,"
+	       " depth %d, %zu runs)\n", map.filename, info.dev_id,
+	       nr_queues, depth, map.nr_runs);
+	fflush(stdout);
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	while (!stopping)
+		pause();
+
+stop:
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.dev_id = info.dev_id;
+	cmd.queue_id = -1;
+	ctrl_cmd(&ctrl_ring, ctrl_fd, CMD_STOP_DEV, &cmd);
+	for (i = 0; i < nr_queues; i++)
+		pthread_join(queues[i].thread, NULL);
+del:
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.dev_id = info.dev_id;
+	cmd.queue_id = -1;
+	ctrl_cmd(&ctrl_ring, ctrl_fd, CMD_DEL_DEV, &cmd);
+	np_ring_exit(&ctrl_ring);
+	np_map_free(&map);
+	return ret < 0 ? 1 : 0;
+}
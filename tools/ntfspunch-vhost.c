@@ -0,0 +1,851 @@
+/*
+ * ntfspunch-vhost.c - vhost-user-blk backend for NTFS Punch images
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Lets QEMU hand guest virtio-blk requests straight to us, so a VM disk
+ * backed by a punched image skips both the QEMU block layer and the
+ * /dev/ntfspunchX hop.  Each virtqueue gets its own polling thread
+ * (optionally pinned to a CPU) and io_uring, and requests are remapped
+ * through the runlist onto the underlying NTFS block device.
+ */
+
+#define _GNU_SOURCE
+#include "punchmap.h"
+#include "uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/virtio_blk.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_ring.h>
+
+#define MAX_QUEUES		16
+#define MAX_REGIONS		8
+#define MAX_IOV			256
+#define DEF_POLL_US		50
+
+/* vhost-user message types we understand */
+enum {
+	VHOST_USER_GET_FEATURES = 1,
+	VHOST_USER_SET_FEATURES = 2,
+	VHOST_USER_SET_OWNER = 3,
+	VHOST_USER_RESET_OWNER = 4,
+	VHOST_USER_SET_MEM_TABLE = 5,
+	VHOST_USER_SET_VRING_NUM = 8,
+	VHOST_USER_SET_VRING_ADDR = 9,
+	VHOST_USER_SET_VRING_BASE = 10,
+	VHOST_USER_GET_VRING_BASE = 11,
+	VHOST_USER_SET_VRING_KICK = 12,
+	VHOST_USER_SET_VRING_CALL = 13,
+	VHOST_USER_SET_VRING_ERR = 14,
+	VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+	VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+	VHOST_USER_GET_QUEUE_NUM = 17,
+	VHOST_USER_SET_VRING_ENABLE = 18,
+	VHOST_USER_GET_CONFIG = 24,
+	VHOST_USER_SET_CONFIG = 25,
+};
+
+#define VHOST_USER_VERSION		0x1
+#define VHOST_USER_REPLY		0x4
+#define VHOST_USER_NEED_REPLY		0x8
+#define VHOST_USER_VRING_NOFD		0x100
+#define VHOST_USER_F_PROTOCOL_FEATURES	30
+
+#define PROTOCOL_F_MQ			0
+#define PROTOCOL_F_REPLY_ACK		3
+#define PROTOCOL_F_CONFIG		9
+
+struct vu_region {
+	uint64_t guest_addr;
+	uint64_t size;
+	uint64_t user_addr;
+	uint64_t mmap_offset;
+};
+
+struct vu_msg {
+	uint32_t request;
+	uint32_t flags;
+	uint32_t size;
+	union {
+		uint64_t u64;
+		struct {
+			uint32_t index;
+			uint32_t num;
+		} state;
+		struct {
+			uint32_t index;
+			uint32_t flags;
+			uint64_t desc;
+			uint64_t used;
+			uint64_t avail;
+			uint64_t log;
+		} addr;
+		struct {
+			uint32_t nregions;
+			uint32_t padding;
+			struct vu_region regions[MAX_REGIONS];
+		} mem;
+		struct {
+			uint32_t offset;
+			uint32_t size;
+			uint32_t flags;
+			uint8_t region[256];
+		} config;
+	} payload;
+} __attribute__((packed));
+
+#define VU_HDR_SIZE	offsetof(struct vu_msg, payload)
+
+struct mem_map {
+	struct vu_region r;
+	void *mmap_addr;
+	size_t mmap_size;
+};
+
+/*
+ * Per-request bookkeeping, indexed by the head descriptor
+ */
+struct req {
+	uint8_t *status;
+	uint32_t in_len;	/* bytes handed back to the guest */
+	int pending;
+	int error;
+	int unsupported;
+};
+
+struct vq {
+	int index;
+	unsigned int num;
+	struct vring_desc *desc;
+	struct vring_avail *avail;
+	struct vring_used *used;
+	uint16_t last_avail;
+	uint16_t used_idx;
+	int kick_fd;
+	int call_fd;
+	int enabled;
+	int cpu;
+	volatile int stop;
+	int running;
+	pthread_t thread;
+	struct np_ring ring;
+	struct req *reqs;
+	int inflight;
+};
+
+static struct np_map map;
+static int disk_fd = -1;
+static int poll_us = DEF_POLL_US;
+static int nr_queues = 1;
+static int cpus[MAX_QUEUES];
+static int nr_cpus;
+static struct mem_map mem[MAX_REGIONS];
+static int nr_mem;
+static struct vq vqs[MAX_QUEUES];
+static uint64_t features;
+static uint64_t protocol_features;
+
+static const uint64_t supported_features =
+	(1ULL << VIRTIO_BLK_F_SEG_MAX) |
+	(1ULL << VIRTIO_BLK_F_BLK_SIZE) |
+	(1ULL << VIRTIO_BLK_F_FLUSH) |
+	(1ULL << VIRTIO_BLK_F_MQ) |
+	(1ULL << VIRTIO_F_VERSION_1) |
+	(1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+
+static const uint64_t supported_protocol_features =
+	(1ULL << PROTOCOL_F_MQ) |
+	(1ULL << PROTOCOL_F_REPLY_ACK) |
+	(1ULL << PROTOCOL_F_CONFIG);
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: ntfspunch-vhost -s socket [-q queues] [-c cpu,cpu,...]"
+		" [-p poll_us] <source>\n"
+		"  source is a /proc/ntfspunch/? node or a file on a"
+		" mounted NTFS\n");
+	exit(1);
+}
+
+/*
+ * Guest physical -> our virtual
+ */
+static void *
+gpa_to_va(uint64_t gpa, uint64_t len)
+{
+	int i;
+
+	for (i = 0; i < nr_mem; i++) {
+		struct vu_region *r = &mem[i].r;
+		if (gpa >= r->guest_addr &&
+		    gpa + len <= r->guest_addr + r->size)
+			return (char *)mem[i].mmap_addr + r->mmap_offset +
+				(gpa - r->guest_addr);
+	}
+	return NULL;
+}
+
+/*
+ * QEMU virtual -> our virtual, used for the ring addresses
+ */
+static void *
+qva_to_va(uint64_t qva)
+{
+	int i;
+
+	for (i = 0; i < nr_mem; i++) {
+		struct vu_region *r = &mem[i].r;
+		if (qva >= r->user_addr && qva < r->user_addr + r->size)
+			return (char *)mem[i].mmap_addr + r->mmap_offset +
+				(qva - r->user_addr);
+	}
+	return NULL;
+}
+
+static void
+vq_notify(struct vq *vq)
+{
+	uint64_t one = 1;
+
+	if (vq->call_fd >= 0 &&
+	    !(__atomic_load_n(&vq->avail->flags, __ATOMIC_ACQUIRE) &
+	      VRING_AVAIL_F_NO_INTERRUPT))
+		if (write(vq->call_fd, &one, sizeof(one)) < 0)
+			perror("ntfspunch-vhost: call");
+}
+
+static void
+vq_complete(struct vq *vq, uint16_t head)
+{
+	struct req *r = &vq->reqs[head];
+	struct vring_used_elem *e;
+
+	if (r->unsupported)
+		*r->status = VIRTIO_BLK_S_UNSUPP;
+	else
+		*r->status = r->error ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+	e = &vq->used->ring[vq->used_idx % vq->num];
+	e->id = head;
+	e->len = r->in_len + 1;
+	vq->used_idx++;
+	__atomic_store_n(&vq->used->idx, vq->used_idx, __ATOMIC_RELEASE);
+	vq->inflight--;
+	vq_notify(vq);
+}
+
+/*
+ * Issue the data part of a request, splitting wherever the logical range
+ * crosses into another runlist element
+ */
+static void
+vq_submit_rw(struct vq *vq, uint16_t head, int write, uint64_t offset,
+	     struct iovec *iov, int niov, uint64_t len)
+{
+	struct req *r = &vq->reqs[head];
+	struct iovec slice[MAX_IOV];
+	struct io_uring_sqe *sqe;
+	uint64_t done = 0, disk_off, n, want;
+	int i, ns, skip;
+
+	i = 0;
+	skip = 0;
+	while (done < len) {
+		n = np_map_lookup(&map, offset + done, len - done, &disk_off);
+		if (n == 0) {
+			fprintf(stderr, "ntfspunch-vhost: Couldn't map I/O at"
+				" %llu\n", (unsigned long long)(offset + done));
+			r->error = 1;
+			break;
+		}
+		/* Carve n bytes of guest iovecs out for this extent */
+		for (ns = 0, want = n; want && ns < MAX_IOV; ns++) {
+			uint64_t chunk = iov[i].iov_len - skip;
+			if (chunk > want)
+				chunk = want;
+			slice[ns].iov_base = (char *)iov[i].iov_base + skip;
+			slice[ns].iov_len = chunk;
+			want -= chunk;
+			skip += chunk;
+			if (skip == iov[i].iov_len) {
+				i++;
+				skip = 0;
+			}
+		}
+		while ((sqe = np_ring_get_sqe(&vq->ring)) == NULL)
+			np_ring_submit(&vq->ring, 0);
+		sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->fd = 0;
+		sqe->addr = (unsigned long)slice;
+		sqe->len = ns;
+		sqe->off = disk_off;
+		sqe->user_data = head | (n - want) << 16;
+		/* Submit now so slice[] can be reused for the next extent */
+		np_ring_submit(&vq->ring, 0);
+		r->pending++;
+		done += n - want;
+	}
+}
+
+static void
+vq_handle(struct vq *vq, uint16_t head)
+{
+	struct req *r = &vq->reqs[head];
+	struct iovec iov[MAX_IOV + 2];
+	struct virtio_blk_outhdr *hdr;
+	struct io_uring_sqe *sqe;
+	struct vring_desc *d;
+	uint16_t idx = head;
+	uint64_t len = 0;
+	int niov = 0, i;
+
+	memset(r, 0, sizeof(*r));
+	vq->inflight++;
+	do {
+		d = &vq->desc[idx];
+		if (niov == MAX_IOV + 2 ||
+		    (iov[niov].iov_base = gpa_to_va(d->addr, d->len)) == NULL) {
+			fprintf(stderr, "ntfspunch-vhost: bad descriptor\n");
+			vq->inflight--;
+			return;
+		}
+		iov[niov++].iov_len = d->len;
+		idx = d->next;
+	} while (d->flags & VRING_DESC_F_NEXT);
+
+	/* Header is the first 16 bytes, status the last byte */
+	if (niov < 2 || iov[0].iov_len < sizeof(*hdr) ||
+	    iov[niov - 1].iov_len < 1) {
+		fprintf(stderr, "ntfspunch-vhost: malformed request\n");
+		vq->inflight--;
+		return;
+	}
+	hdr = iov[0].iov_base;
+	r->status = (uint8_t *)iov[niov - 1].iov_base +
+		iov[niov - 1].iov_len - 1;
+	iov[niov - 1].iov_len--;
+	for (i = 1; i < niov; i++)
+		len += iov[i].iov_len;
+
+	switch (hdr->type & ~VIRTIO_BLK_T_BARRIER) {
+	case VIRTIO_BLK_T_IN:
+		r->in_len = len;
+		vq_submit_rw(vq, head, 0, hdr->sector << 9, iov + 1,
+			     niov - 1, len);
+		break;
+	case VIRTIO_BLK_T_OUT:
+		vq_submit_rw(vq, head, 1, hdr->sector << 9, iov + 1,
+			     niov - 1, len);
+		break;
+	case VIRTIO_BLK_T_FLUSH:
+		while ((sqe = np_ring_get_sqe(&vq->ring)) == NULL)
+			np_ring_submit(&vq->ring, 0);
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->fd = 0;
+		sqe->user_data = head;
+		r->pending++;
+		break;
+	case VIRTIO_BLK_T_GET_ID:
+		if (len) {
+			snprintf(iov[1].iov_base, iov[1].iov_len, "%s",
+				 "ntfspunch");
+			r->in_len = len;
+		}
+		break;
+	default:
+		r->unsupported = 1;
+		break;
+	}
+	if (r->pending == 0)
+		vq_complete(vq, head);
+}
+
+static int
+vq_poll_once(struct vq *vq)
+{
+	struct io_uring_cqe *cqe;
+	uint16_t avail_idx;
+	int work = 0;
+
+	avail_idx = __atomic_load_n(&vq->avail->idx, __ATOMIC_ACQUIRE);
+	while (vq->last_avail != avail_idx) {
+		vq_handle(vq, vq->avail->ring[vq->last_avail % vq->num]);
+		vq->last_avail++;
+		work++;
+	}
+	if (work)
+		np_ring_submit(&vq->ring, 0);
+
+	while ((cqe = np_ring_peek_cqe(&vq->ring)) != NULL) {
+		uint16_t head = cqe->user_data & 0xffff;
+		struct req *r = &vq->reqs[head];
+		if (cqe->res < 0 ||
+		    (uint64_t)cqe->res != cqe->user_data >> 16)
+			r->error = 1;
+		np_ring_cqe_seen(&vq->ring);
+		if (--r->pending == 0)
+			vq_complete(vq, head);
+		work++;
+	}
+	return work;
+}
+
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Busy-poll the avail ring and the io_uring while there's work, and only
+ * fall back to sleeping on the kick eventfd after poll_us of idleness
+ */
+static void *
+vq_thread(void *arg)
+{
+	struct vq *vq = arg;
+	struct pollfd pfd;
+	uint64_t idle_since = now_us(), kicks;
+	cpu_set_t set;
+
+	if (vq->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(vq->cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+	vq->used->flags = VRING_USED_F_NO_NOTIFY;
+
+	while (!vq->stop) {
+		if (vq_poll_once(vq)) {
+			idle_since = now_us();
+			continue;
+		}
+		if (vq->inflight) {
+			np_ring_submit(&vq->ring, 1);
+			continue;
+		}
+		if (now_us() - idle_since < (uint64_t)poll_us)
+			continue;
+
+		/* Ask for kicks again, then re-check to close the race */
+		__atomic_store_n(&vq->used->flags, 0, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&vq->avail->idx, __ATOMIC_SEQ_CST) ==
+		    vq->last_avail) {
+			pfd.fd = vq->kick_fd;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, 100) > 0 &&
+			    read(vq->kick_fd, &kicks, sizeof(kicks)) < 0)
+				perror("ntfspunch-vhost: kick");
+		}
+		vq->used->flags = VRING_USED_F_NO_NOTIFY;
+		idle_since = now_us();
+	}
+	while (vq->inflight) {
+		np_ring_submit(&vq->ring, 1);
+		vq_poll_once(vq);
+	}
+	return NULL;
+}
+
+static int
+vq_start(struct vq *vq)
+{
+	int ret;
+
+	if (vq->running || vq->desc == NULL || vq->kick_fd < 0)
+		return 0;
+	ret = np_ring_init(&vq->ring, vq->num * 2, 0);
+	if (ret == 0)
+		ret = np_ring_register_files(&vq->ring, &disk_fd, 1);
+	if (ret)
+		return ret;
+	vq->reqs = calloc(vq->num, sizeof(*vq->reqs));
+	if (vq->reqs == NULL)
+		return -ENOMEM;
+	vq->stop = 0;
+	vq->inflight = 0;
+	vq->running = 1;
+	pthread_create(&vq->thread, NULL, vq_thread, vq);
+	return 0;
+}
+
+static void
+vq_stop(struct vq *vq)
+{
+	if (!vq->running)
+		return;
+	vq->stop = 1;
+	pthread_join(vq->thread, NULL);
+	np_ring_exit(&vq->ring);
+	free(vq->reqs);
+	vq->reqs = NULL;
+	vq->running = 0;
+}
+
+static void
+vq_reset(struct vq *vq, int index)
+{
+	if (vq->kick_fd >= 0)
+		close(vq->kick_fd);
+	if (vq->call_fd >= 0)
+		close(vq->call_fd);
+	memset(vq, 0, sizeof(*vq));
+	vq->index = index;
+	vq->kick_fd = -1;
+	vq->call_fd = -1;
+	vq->cpu = nr_cpus ? cpus[index % nr_cpus] : -1;
+}
+
+static void
+mem_unmap(void)
+{
+	int i;
+
+	for (i = 0; i < nr_mem; i++)
+		munmap(mem[i].mmap_addr, mem[i].mmap_size);
+	nr_mem = 0;
+}
+
+static int
+set_mem_table(struct vu_msg *msg, int *fds, int nfds)
+{
+	unsigned int i;
+
+	mem_unmap();
+	if (msg->payload.mem.nregions > MAX_REGIONS ||
+	    (int)msg->payload.mem.nregions != nfds)
+		return -EINVAL;
+	for (i = 0; i < msg->payload.mem.nregions; i++) {
+		mem[i].r = msg->payload.mem.regions[i];
+		mem[i].mmap_size = mem[i].r.size + mem[i].r.mmap_offset;
+		mem[i].mmap_addr = mmap(NULL, mem[i].mmap_size,
+					PROT_READ | PROT_WRITE, MAP_SHARED,
+					fds[i], 0);
+		close(fds[i]);
+		if (mem[i].mmap_addr == MAP_FAILED)
+			return -errno;
+		nr_mem = i + 1;
+	}
+	return 0;
+}
+
+static int
+recv_msg(int sock, struct vu_msg *msg, int *fds, int *nfds)
+{
+	char control[CMSG_SPACE(MAX_REGIONS * sizeof(int))];
+	struct iovec iov = { msg, VU_HDR_SIZE };
+	struct msghdr mh = { 0 };
+	struct cmsghdr *cmsg;
+	ssize_t n;
+
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control;
+	mh.msg_controllen = sizeof(control);
+	n = recvmsg(sock, &mh, 0);
+	if (n != VU_HDR_SIZE)
+		return -1;
+
+	*nfds = 0;
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS) {
+			*nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+		}
+	}
+	if (msg->size > sizeof(msg->payload))
+		return -1;
+	if (msg->size &&
+	    recv(sock, &msg->payload, msg->size, MSG_WAITALL) != msg->size)
+		return -1;
+	return 0;
+}
+
+static void
+send_reply(int sock, struct vu_msg *msg, uint32_t size)
+{
+	msg->flags = VHOST_USER_VERSION | VHOST_USER_REPLY;
+	msg->size = size;
+	if (send(sock, msg, VU_HDR_SIZE + size, 0) < 0)
+		perror("ntfspunch-vhost: reply");
+}
+
+static void
+fill_config(struct virtio_blk_config *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->capacity = map.size >> 9;
+	cfg->seg_max = MAX_IOV;
+	cfg->blk_size = 512;
+	cfg->num_queues = nr_queues;
+}
+
+/*
+ * Returns 1 if a reply was already sent, 0 if not, < 0 on error
+ */
+static int
+handle_msg(int sock, struct vu_msg *msg, int *fds, int nfds)
+{
+	struct virtio_blk_config cfg;
+	struct vq *vq;
+	int ret = 0;
+
+	switch (msg->request) {
+	case VHOST_USER_GET_FEATURES:
+		msg->payload.u64 = supported_features;
+		send_reply(sock, msg, sizeof(msg->payload.u64));
+		return 1;
+	case VHOST_USER_SET_FEATURES:
+		features = msg->payload.u64 & supported_features;
+		break;
+	case VHOST_USER_GET_PROTOCOL_FEATURES:
+		msg->payload.u64 = supported_protocol_features;
+		send_reply(sock, msg, sizeof(msg->payload.u64));
+		return 1;
+	case VHOST_USER_SET_PROTOCOL_FEATURES:
+		protocol_features = msg->payload.u64 &
+			supported_protocol_features;
+		break;
+	case VHOST_USER_GET_QUEUE_NUM:
+		msg->payload.u64 = nr_queues;
+		send_reply(sock, msg, sizeof(msg->payload.u64));
+		return 1;
+	case VHOST_USER_SET_OWNER:
+	case VHOST_USER_RESET_OWNER:
+		break;
+	case VHOST_USER_SET_MEM_TABLE:
+		ret = set_mem_table(msg, fds, nfds);
+		break;
+	case VHOST_USER_SET_VRING_NUM:
+		if (msg->payload.state.index >= (uint32_t)nr_queues)
+			return -EINVAL;
+		vqs[msg->payload.state.index].num = msg->payload.state.num;
+		break;
+	case VHOST_USER_SET_VRING_ADDR:
+		if (msg->payload.addr.index >= (uint32_t)nr_queues)
+			return -EINVAL;
+		vq = &vqs[msg->payload.addr.index];
+		vq->desc = qva_to_va(msg->payload.addr.desc);
+		vq->avail = qva_to_va(msg->payload.addr.avail);
+		vq->used = qva_to_va(msg->payload.addr.used);
+		if (!vq->desc || !vq->avail || !vq->used)
+			return -EINVAL;
+		vq->used_idx = vq->used->idx;
+		break;
+	case VHOST_USER_SET_VRING_BASE:
+		if (msg->payload.state.index >= (uint32_t)nr_queues)
+			return -EINVAL;
+		vqs[msg->payload.state.index].last_avail =
+			msg->payload.state.num;
+		break;
+	case VHOST_USER_GET_VRING_BASE:
+		if (msg->payload.state.index >= (uint32_t)nr_queues)
+			return -EINVAL;
+		vq = &vqs[msg->payload.state.index];
+		vq_stop(vq);
+		msg->payload.state.num = vq->last_avail;
+		send_reply(sock, msg, sizeof(msg->payload.state));
+		vq_reset(vq, vq->index);
+		return 1;
+	case VHOST_USER_SET_VRING_KICK:
+	case VHOST_USER_SET_VRING_CALL:
+	case VHOST_USER_SET_VRING_ERR:
+		if ((msg->payload.u64 & 0xff) >= (uint64_t)nr_queues)
+			return -EINVAL;
+		vq = &vqs[msg->payload.u64 & 0xff];
+		if (msg->payload.u64 & VHOST_USER_VRING_NOFD || nfds < 1)
+			fds[0] = -1;
+		if (msg->request == VHOST_USER_SET_VRING_KICK) {
+			vq->kick_fd = fds[0];
+			/* Without protocol features rings start on kick */
+			if (!(features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)))
+				vq->enabled = 1;
+			if (vq->enabled)
+				ret = vq_start(vq);
+		} else if (msg->request == VHOST_USER_SET_VRING_CALL) {
+			if (vq->call_fd >= 0)
+				close(vq->call_fd);
+			vq->call_fd = fds[0];
+		} else if (fds[0] >= 0) {
+			close(fds[0]);
+		}
+		break;
+	case VHOST_USER_SET_VRING_ENABLE:
+		if (msg->payload.state.index >= (uint32_t)nr_queues)
+			return -EINVAL;
+		vq = &vqs[msg->payload.state.index];
+		vq->enabled = msg->payload.state.num;
+		if (vq->enabled)
+			ret = vq_start(vq);
+		else
+			vq_stop(vq);
+		break;
+	case VHOST_USER_GET_CONFIG:
+		fill_config(&cfg);
+		if (msg->payload.config.offset + msg->payload.config.size >
+		    sizeof(cfg) ||
+		    msg->payload.config.size > sizeof(msg->payload.config.region))
+			return -EINVAL;
+		memcpy(msg->payload.config.region,
+		       (char *)&cfg + msg->payload.config.offset,
+		       msg->payload.config.size);
+		send_reply(sock, msg, msg->size);
+		return 1;
+	case VHOST_USER_SET_CONFIG:
+		/* Nothing in our config is writable */
+		break;
+	default:
+		fprintf(stderr, "ntfspunch-vhost: unhandled request %u\n",
+			msg->request);
+		ret = -EOPNOTSUPP;
+		break;
+	}
+	return ret;
+}
+
+static void
+serve(int sock)
+{
+	struct vu_msg msg;
+	int fds[MAX_REGIONS], nfds, ret, i;
+
+	for (i = 0; i < MAX_QUEUES; i++)
+		vq_reset(&vqs[i], i);
+	features = 0;
+	protocol_features = 0;
+
+	while (recv_msg(sock, &msg, fds, &nfds) == 0) {
+		ret = handle_msg(sock, &msg, fds, nfds);
+		if (ret < 0)
+			fprintf(stderr, "ntfspunch-vhost: request %u: %s\n",
+				msg.request, strerror(-ret));
+		if (ret != 1 && (msg.flags & VHOST_USER_NEED_REPLY) &&
+		    (protocol_features & (1ULL << PROTOCOL_F_REPLY_ACK))) {
+			msg.payload.u64 = ret < 0 ? 1 : 0;
+			send_reply(sock, &msg, sizeof(msg.payload.u64));
+		}
+	}
+
+	for (i = 0; i < MAX_QUEUES; i++) {
+		vq_stop(&vqs[i]);
+		vq_reset(&vqs[i], i);
+	}
+	mem_unmap();
+}
+
+static void
+parse_cpus(char *list)
+{
+	char *tok;
+
+	for (tok = strtok(list, ","); tok && nr_cpus < MAX_QUEUES;
+	     tok = strtok(NULL, ","))
+		cpus[nr_cpus++] = atoi(tok);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	char *sock_path = NULL;
+	int opt, lsock, sock, ret, i;
+
+	while ((opt = getopt(argc, argv, "s:q:c:p:")) != -1) {
+		switch (opt) {
+		case 's':
+			sock_path = optarg;
+			break;
+		case 'q':
+			nr_queues = atoi(optarg);
+			break;
+		case 'c':
+			parse_cpus(optarg);
+			break;
+		case 'p':
+			poll_us = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1 || sock_path == NULL ||
+	    nr_queues < 1 || nr_queues > MAX_QUEUES ||
+	    strlen(sock_path) >= sizeof(sun.sun_path))
+		usage();
+
+	ret = np_map_load(&map, argv[optind]);
+	if (ret) {
+		fprintf(stderr, "ntfspunch-vhost: unable to load runlist from"
+			" %s: %s\n", argv[optind], strerror(-ret));
+		return 1;
+	}
+	disk_fd = open(map.disk, O_RDWR | O_DIRECT);
+	if (disk_fd < 0) {
+		perror(map.disk);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	lsock = socket(AF_UNIX, SOCK_STREAM, 0);
+	strcpy(sun.sun_path, sock_path);
+	unlink(sock_path);
+	if (lsock < 0 || bind(lsock, (struct sockaddr *)&sun, sizeof(sun)) ||
+	    listen(lsock, 1)) {
+		perror(sock_path);
+		return 1;
+	}
+	printf("ntfspunch-vhost: serving %s on %s (%d queues, %zu runs)\n",
+	       map.filename, sock_path, nr_queues, map.nr_runs);
+	fflush(stdout);
+
+	for (i = 0; i < MAX_QUEUES; i++)
+		vqs[i].kick_fd = vqs[i].call_fd = -1;
+
+	/* One front-end at a time; wait for the next after it disconnects */
+	while ((sock = accept(lsock, NULL, NULL)) >= 0) {
+		serve(sock);
+		close(sock);
+	}
+	perror("ntfspunch-vhost: accept");
+	np_map_free(&map);
+	return 1;
+}
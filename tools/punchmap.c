@@ -0,0 +1,261 @@
+/*
+ * punchmap.c - Userspace view of an NTFS Punch runlist
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "punchmap.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <linux/magic.h>
+
+static int
+add_run(struct np_map *map, size_t *alloced, uint64_t file_offset,
+	uint64_t disk_offset, uint64_t length)
+{
+	struct np_run *tmp;
+
+	if (map->nr_runs == *alloced) {
+		*alloced = *alloced ? *alloced * 2 : 64;
+		tmp = realloc(map->runs, *alloced * sizeof(*tmp));
+		if (tmp == NULL)
+			return -ENOMEM;
+		map->runs = tmp;
+	}
+	map->runs[map->nr_runs].file_offset = file_offset;
+	map->runs[map->nr_runs].disk_offset = disk_offset;
+	map->runs[map->nr_runs].length = length;
+	map->nr_runs++;
+	return 0;
+}
+
+/*
+ * Find the device node for major:minor, preferring the kernel's name from
+ * sysfs over the udev /dev/block symlinks, which not every host has
+ */
+static void
+disk_node(char *buf, size_t len, unsigned int major, unsigned int minor)
+{
+	char path[64], line[256];
+	FILE *fp;
+
+	snprintf(buf, len, "/dev/block/%u:%u", major, minor);
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/uevent",
+		 major, minor);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strncmp(line, "DEVNAME=", 8) == 0) {
+			line[strcspn(line, "\n")] = '\0';
+			snprintf(buf, len, "/dev/%s", line + 8);
+			break;
+		}
+	}
+	fclose(fp);
+}
+
+/*
+ * Parse the output of dump_node() in proc.c
+ */
+static int
+load_proc(struct np_map *map, const char *path)
+{
+	char line[PATH_MAX + 64];
+	unsigned long long f, d, l;
+	unsigned int major, minor;
+	size_t alloced = 0;
+	int index;
+	int ret = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -errno;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		if (strstr(line, ":-1:") != NULL) {
+			/* A hole, which isn't anywhere on the disk to read */
+			ret = -EOPNOTSUPP;
+			break;
+		} else if (sscanf(line, "%llu:%llu:%llu", &f, &d, &l) == 3) {
+			ret = add_run(map, &alloced, f, d, l);
+			if (ret)
+				break;
+		} else if (strncmp(line, "layout: ", 8) == 0 &&
+			   strcmp(line + 8, "linear") != 0) {
+			/* Runs are per member, there's no single map */
+			ret = -EOPNOTSUPP;
+			break;
+		} else if (strncmp(line, "filename: ", 10) == 0) {
+			snprintf(map->filename, sizeof(map->filename), "%.*s",
+				 PATH_MAX, line + 10);
+		} else if (sscanf(line, "minor_number: %d", &index) == 1) {
+			snprintf(map->device, sizeof(map->device),
+				 "/dev/ntfspunch%c", index + 'a');
+		} else if (sscanf(line, "size: %llu", &l) == 1) {
+			map->size = l;
+		} else if (sscanf(line, "cluster_size: %llu", &l) == 1) {
+			map->cluster_size = l;
+		} else if (sscanf(line, "disk: %u:%u", &major, &minor) == 2) {
+			disk_node(map->disk, sizeof(map->disk), major, minor);
+		}
+	}
+	fclose(fp);
+	if (ret == 0 && (map->nr_runs == 0 || map->disk[0] == '\0'))
+		ret = -EINVAL;
+	return ret;
+}
+
+/*
+ * Walk the file one filesystem block at a time with FIBMAP and coalesce
+ * the result into runs.  The kernel ntfs driver implements ->bmap for
+ * plain non-resident files, which is all we can punch anyway.
+ */
+static int
+load_fibmap(struct np_map *map, const char *path)
+{
+	struct stat st;
+	size_t alloced = 0;
+	uint64_t nblocks, i;
+	int fd, bsz, blk, ret = 0;
+	struct np_run *last;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) < 0 || ioctl(fd, FIGETBSZ, &bsz) < 0) {
+		ret = -errno;
+		goto out;
+	}
+	snprintf(map->filename, sizeof(map->filename), "%s", path);
+	disk_node(map->disk, sizeof(map->disk), major(st.st_dev),
+		  minor(st.st_dev));
+	map->cluster_size = bsz;
+	nblocks = (st.st_size + bsz - 1) / bsz;
+	map->size = nblocks * bsz;
+
+	for (i = 0; i < nblocks; i++) {
+		blk = i;
+		if (ioctl(fd, FIBMAP, &blk) < 0) {
+			ret = -errno;
+			goto out;
+		}
+		if (blk == 0) {
+			fprintf(stderr, "%s: block %llu is not allocated\n",
+				path, (unsigned long long)i);
+			ret = -EINVAL;
+			goto out;
+		}
+		last = map->nr_runs ? &map->runs[map->nr_runs - 1] : NULL;
+		if (last && last->disk_offset + last->length ==
+		    (uint64_t)blk * bsz) {
+			last->length += bsz;
+			continue;
+		}
+		ret = add_run(map, &alloced, i * bsz, (uint64_t)blk * bsz, bsz);
+		if (ret)
+			goto out;
+	}
+out:
+	close(fd);
+	return ret;
+}
+
+int
+np_map_load(struct np_map *map, const char *source)
+{
+	struct statfs sfs;
+	int ret;
+
+	memset(map, 0, sizeof(*map));
+	if (statfs(source, &sfs) < 0)
+		return -errno;
+	if (sfs.f_type == PROC_SUPER_MAGIC)
+		ret = load_proc(map, source);
+	else
+		ret = load_fibmap(map, source);
+	if (ret)
+		np_map_free(map);
+	return ret;
+}
+
+void
+np_map_free(struct np_map *map)
+{
+	free(map->runs);
+	map->runs = NULL;
+	map->nr_runs = 0;
+}
+
+size_t
+np_map_coalesce(struct np_map *map)
+{
+	struct np_run *out, *in;
+	size_t i;
+
+	if (map->nr_runs == 0)
+		return 0;
+	out = map->runs;
+	for (i = 1; i < map->nr_runs; i++) {
+		in = &map->runs[i];
+		if (out->file_offset + out->length == in->file_offset &&
+		    out->disk_offset + out->length == in->disk_offset) {
+			out->length += in->length;
+			continue;
+		}
+		*++out = *in;
+	}
+	map->nr_runs = out - map->runs + 1;
+	return map->nr_runs;
+}
+
+uint64_t
+np_map_lookup(const struct np_map *map, uint64_t offset, uint64_t len,
+	      uint64_t *disk_offset)
+{
+	size_t lo = 0, hi = map->nr_runs;
+	const struct np_run *run;
+	uint64_t avail;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		run = &map->runs[mid];
+		if (offset < run->file_offset)
+			hi = mid;
+		else if (offset >= run->file_offset + run->length)
+			lo = mid + 1;
+		else {
+			*disk_offset = run->disk_offset +
+				(offset - run->file_offset);
+			avail = run->file_offset + run->length - offset;
+			return len < avail ? len : avail;
+		}
+	}
+	return 0;
+}
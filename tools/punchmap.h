@@ -0,0 +1,72 @@
+/*
+ * punchmap.h - Userspace view of an NTFS Punch runlist
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _PUNCHMAP_H_
+#define _PUNCHMAP_H_
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * One runlist element, in bytes rather than clusters
+ */
+struct np_run {
+	uint64_t file_offset;
+	uint64_t disk_offset;
+	uint64_t length;
+};
+
+struct np_map {
+	char filename[PATH_MAX + 1];
+	char disk[PATH_MAX + 1];	/* underlying block device node */
+	char device[32];		/* /dev/ntfspunch? if attached */
+	uint64_t size;			/* in bytes */
+	uint32_t cluster_size;		/* in bytes */
+	size_t nr_runs;
+	struct np_run *runs;		/* sorted by file_offset */
+};
+
+/*
+ * Load a map from either a /proc/ntfspunch/? dump node, or directly from
+ * a pre-allocated file on a mounted NTFS (via FIBMAP, so the kernel
+ * module doesn't need to be loaded)
+ */
+int np_map_load(struct np_map *map, const char *source);
+void np_map_free(struct np_map *map);
+
+/*
+ * Merge neighbouring runs that are contiguous both in the file and on the
+ * disk.  Returns the number of runs left.
+ */
+size_t np_map_coalesce(struct np_map *map);
+
+/*
+ * Userspace equivalent of split_or_get_offset() in main.c
+ *
+ * Returns how many of the len bytes starting at offset are physically
+ * contiguous and stores where they start on the disk, or 0 if the offset
+ * isn't mapped.  Callers split the I/O on the returned length.
+ */
+uint64_t np_map_lookup(const struct np_map *map, uint64_t offset,
+		       uint64_t len, uint64_t *disk_offset);
+
+#endif
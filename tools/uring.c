@@ -0,0 +1,184 @@
+/*
+ * uring.c - Minimal io_uring wrapper shared by the NTFS Punch tools
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define np_load_acquire(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define np_store_release(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+int
+np_ring_init(struct np_ring *ring, unsigned int entries, unsigned int flags)
+{
+	struct io_uring_params p;
+	void *sq, *cq;
+	int fd;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	p.flags = flags;
+	fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0)
+		return -errno;
+
+	ring->fd = fd;
+	ring->flags = flags;
+	ring->sqe_size = (flags & IORING_SETUP_SQE128) ? 128 : 64;
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	sq = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+	ring->sq_ring = sq;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq = sq;
+	} else {
+		cq = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto fail;
+	}
+	ring->cq_ring = cq;
+
+	ring->sqes_size = p.sq_entries * ring->sqe_size;
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto fail;
+	}
+
+	ring->sq_head = sq + p.sq_off.head;
+	ring->sq_tail = sq + p.sq_off.tail;
+	ring->sq_mask = sq + p.sq_off.ring_mask;
+	ring->sq_array = sq + p.sq_off.array;
+	ring->sq_entries = p.sq_entries;
+	ring->sqe_tail = *ring->sq_tail;
+
+	ring->cq_head = cq + p.cq_off.head;
+	ring->cq_tail = cq + p.cq_off.tail;
+	ring->cq_mask = cq + p.cq_off.ring_mask;
+	ring->cqes = cq + p.cq_off.cqes;
+	return 0;
+
+fail:
+	np_ring_exit(ring);
+	return -ENOMEM;
+}
+
+void
+np_ring_exit(struct np_ring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->fd > 0)
+		close(ring->fd);
+	memset(ring, 0, sizeof(*ring));
+}
+
+/*
+ * Returns a zeroed sqe, or NULL if the submission ring is full
+ */
+struct io_uring_sqe *
+np_ring_get_sqe(struct np_ring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head = np_load_acquire(ring->sq_head);
+	unsigned int idx;
+
+	if (ring->sqe_tail - head >= ring->sq_entries)
+		return NULL;
+	idx = ring->sqe_tail & *ring->sq_mask;
+	sqe = (void *)((char *)ring->sqes + idx * ring->sqe_size);
+	memset(sqe, 0, ring->sqe_size);
+	ring->sq_array[idx] = idx;
+	ring->sqe_tail++;
+	return sqe;
+}
+
+/*
+ * Publish every prepared sqe and optionally wait for wait_nr completions
+ */
+int
+np_ring_submit(struct np_ring *ring, unsigned int wait_nr)
+{
+	unsigned int submitted = ring->sqe_tail - *ring->sq_tail;
+	unsigned int flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+	int ret;
+
+	np_store_release(ring->sq_tail, ring->sqe_tail);
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, submitted,
+			      wait_nr, flags, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	return ret < 0 ? -errno : ret;
+}
+
+struct io_uring_cqe *
+np_ring_peek_cqe(struct np_ring *ring)
+{
+	unsigned int head = *ring->cq_head;
+
+	if (head == np_load_acquire(ring->cq_tail))
+		return NULL;
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+void
+np_ring_cqe_seen(struct np_ring *ring)
+{
+	np_store_release(ring->cq_head, *ring->cq_head + 1);
+}
+
+int
+np_ring_register_files(struct np_ring *ring, const int *fds, unsigned int nr)
+{
+	int ret = syscall(__NR_io_uring_register, ring->fd,
+			  IORING_REGISTER_FILES, fds, nr);
+	return ret < 0 ? -errno : 0;
+}
+
+int
+np_ring_register_buffers(struct np_ring *ring, const struct iovec *iov,
+			 unsigned int nr)
+{
+	int ret = syscall(__NR_io_uring_register, ring->fd,
+			  IORING_REGISTER_BUFFERS, iov, nr);
+	return ret < 0 ? -errno : 0;
+}
@@ -0,0 +1,93 @@
+/*
+ * uring.h - Minimal io_uring wrapper shared by the NTFS Punch tools
+ *
+ * Copyright (c) 2014 Daniel Hiltgen @ Netkine Inc.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NP_URING_H_
+#define _NP_URING_H_
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/*
+ * We talk to the kernel directly rather than pulling in liburing so the
+ * tools build anywhere the UAPI headers are installed.  Only the handful
+ * of operations the tools need are wrapped here.
+ */
+struct np_ring {
+	int fd;
+	unsigned int flags;
+	unsigned int sqe_size;
+
+	/* Submission ring */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int sq_entries;
+	unsigned int sqe_tail;
+
+	/* Completion ring */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+int np_ring_init(struct np_ring *ring, unsigned int entries,
+		 unsigned int flags);
+void np_ring_exit(struct np_ring *ring);
+
+struct io_uring_sqe *np_ring_get_sqe(struct np_ring *ring);
+int np_ring_submit(struct np_ring *ring, unsigned int wait_nr);
+struct io_uring_cqe *np_ring_peek_cqe(struct np_ring *ring);
+void np_ring_cqe_seen(struct np_ring *ring);
+
+int np_ring_register_files(struct np_ring *ring, const int *fds,
+			   unsigned int nr);
+int np_ring_register_buffers(struct np_ring *ring, const struct iovec *iov,
+			     unsigned int nr);
+
+/*
+ * Fill in a fixed-buffer read or write against a registered file
+ */
+static inline void
+np_prep_rw_fixed(struct io_uring_sqe *sqe, int op, int file_index,
+		 void *buf, unsigned int len, uint64_t off, int buf_index,
+		 uint64_t user_data)
+{
+	sqe->opcode = op;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = file_index;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->buf_index = buf_index;
+	sqe->user_data = user_data;
+}
+
+#endif